@@ -0,0 +1,303 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/fiemap.h>
+
+#include "filemap.h"
+
+/* Checking extents against the geometry of the storage underneath the volume (see --stripe-unit, --erase-block
+ * and --alignment)
+ *
+ * A RAID array with parity has to read, modify and write back a whole stripe (the stripe unit times the number
+ * of data disks) for any write that does not cover all of it; and an SSD has to do the same with an erase block.
+ * An extent is aligned to a geometry if it begins on a boundary of it, and ends on one too (unless it is the last
+ * extent of its file, which can end anywhere). Every other extent is misaligned, and is classified further by
+ * how many boundaries it crosses: one that crosses none is within a single stripe unit, stripe or erase block.
+ *
+ * Offsets are within the volume, so this assumes that the volume itself begins on a boundary (e.g. that its
+ * partition is aligned).
+ */
+
+#define FM_ALIGN_BUCKETS                16U
+#define FM_ALIGN_GEOMETRIES             3U
+
+struct fm_align_geometry
+{
+	const char *                name;       // What the boundaries are between
+	uint64_t                    size;       // The distance between boundaries (in bytes)
+	uint64_t                    aligned;    // Number of aligned extents
+	uint64_t                    alignedbytes;
+	uint64_t                    buckets[FM_ALIGN_BUCKETS];      // Misaligned extents by boundaries crossed
+	uint64_t                    bucketbytes[FM_ALIGN_BUCKETS];  // Bytes in them
+};
+
+struct fm_align_file
+{
+	const struct fm_inode *     inode;      // The file
+	uint64_t                    extents;    // Number of extents that are in the volume
+	uint64_t                    misaligned[FM_ALIGN_GEOMETRIES];    // Number of them misaligned, per geometry
+	uint64_t                    total;      // Sum of the above
+};
+
+static uint64_t
+fm_align_stripe_bytes(void)
+{
+	return (fm_stripe_unit * fm_stripe_width * UINT64_C(1024));
+}
+
+static bool FM_NONNULL(1)
+fm_align_aligned(const struct fm_extent *const restrict extent, const uint64_t size)
+{
+	if ((extent->off % size) != 0U)
+		return false;
+
+	return (((extent->off + extent->len) % size) == 0U || (extent->flags & FIEMAP_EXTENT_LAST));
+}
+
+static uint64_t FM_NONNULL(1)
+fm_align_crossings(const struct fm_extent *const restrict extent, const uint64_t size)
+{
+	if (! extent->len)
+		return 0U;
+
+	return (((extent->off + extent->len - 1U) / size) - (extent->off / size));
+}
+
+uint32_t FM_NONNULL(1) FM_WARN_UNUSED
+fm_align_flags(const struct fm_extent *const restrict extent)
+{
+	uint32_t flags = FM_IFLAGS_NONE;
+
+	if (! fm_extent_in_volume(extent))
+		return flags;
+
+	if (fm_stripe_unit && ! fm_align_aligned(extent, fm_align_stripe_bytes()))
+		flags |= FM_IFLAGS_STRIPE_UNALIGNED;
+
+	if (fm_erase_block && ! fm_align_aligned(extent, (fm_erase_block * UINT64_C(1024))))
+		flags |= FM_IFLAGS_ERASE_UNALIGNED;
+
+	return flags;
+}
+
+static int FM_NONNULL(1, 2)
+fm_align_sortby_misaligned_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_align_file *const file1 = ptr1;
+	const struct fm_align_file *const file2 = ptr2;
+
+	if (file1->total > file2->total)
+		return -1;
+
+	if (file1->total < file2->total)
+		return 1;
+
+	if (file1->inode->inum < file2->inode->inum)
+		return -1;
+
+	if (file1->inode->inum > file2->inode->inum)
+		return 1;
+
+	return 0;
+}
+
+static void FM_NONNULL(1)
+fm_align_print_geometry(const struct fm_align_geometry *const restrict geom)
+{
+	uint64_t extents = geom->aligned;
+	uint64_t bytes = geom->alignedbytes;
+
+	for (unsigned int i = 0U; i < FM_ALIGN_BUCKETS; i++)
+	{
+		extents += geom->buckets[i];
+		bytes += geom->bucketbytes[i];
+	}
+
+	(void) printf("\n");
+	(void) printf("%s (%" PRIu64 " bytes):\n", geom->name, geom->size);
+	(void) printf("\n");
+	(void) printf("%-28s %12s %20s %8s\n", "Class", "Extents", "Bytes", "Share");
+	(void) printf("---------------------------- ------------ -------------------- --------\n\n");
+
+	for (unsigned int i = 0U; i <= FM_ALIGN_BUCKETS; i++)
+	{
+		const uint64_t count = ((i) ? geom->buckets[i - 1U] : geom->aligned);
+		const uint64_t size = ((i) ? geom->bucketbytes[i - 1U] : geom->alignedbytes);
+		const long double share = ((extents) ? (100.0L * ((long double) count / (long double) extents)) : 0.0L);
+		char class[128U];
+		char pcnt[128U];
+
+		if (i && ! count)
+			continue;
+
+		(void) memset(class, 0x00, sizeof class);
+
+		if (! i)
+			(void) snprintf(class, sizeof class, "aligned");
+		else if (i == 1U)
+			(void) snprintf(class, sizeof class, "misaligned, within one");
+		else if (i == 2U)
+			(void) snprintf(class, sizeof class, "misaligned, crossing 1");
+		else if (i == FM_ALIGN_BUCKETS)
+			(void) snprintf(class, sizeof class, "misaligned, crossing %" PRIu64 "+",
+			                (UINT64_C(1) << (i - 2U)));
+		else
+			(void) snprintf(class, sizeof class, "misaligned, crossing %" PRIu64 "-%" PRIu64,
+			                (UINT64_C(1) << (i - 2U)), ((UINT64_C(1) << (i - 1U)) - 1U));
+
+		(void) memset(pcnt, 0x00, sizeof pcnt);
+		(void) snprintf(pcnt, sizeof pcnt, "%.2Lf%%", share);
+
+		(void) printf("%-28s %12" PRIu64 " %20s %8s\n", class, count, fm_readable_size(FM_READABLE_SIZE, size), pcnt);
+	}
+
+	(void) printf("\n");
+	(void) printf("%-28s %12" PRIu64 " %20s\n", "total", extents, fm_readable_size(FM_READABLE_SIZE, bytes));
+}
+
+bool FM_WARN_UNUSED
+fm_align_report(void)
+{
+	const uint64_t inodes = HASH_COUNT(fm_inodes);
+	struct fm_align_geometry geoms[FM_ALIGN_GEOMETRIES];
+	struct fm_align_file *files;
+	struct fm_inode *fi;
+	struct fm_inode *itmp;
+	unsigned int geomcount = 0U;
+	uint64_t count = 0U;
+	uint64_t top;
+
+	(void) memset(geoms, 0x00, sizeof geoms);
+
+	if (fm_stripe_unit)
+	{
+		geoms[geomcount].name = "Stripe unit";
+		geoms[geomcount].size = (fm_stripe_unit * UINT64_C(1024));
+		geomcount++;
+	}
+	if (fm_stripe_unit && fm_stripe_width > 1U)
+	{
+		geoms[geomcount].name = "Full stripe";
+		geoms[geomcount].size = fm_align_stripe_bytes();
+		geomcount++;
+	}
+	if (fm_erase_block)
+	{
+		geoms[geomcount].name = "Erase block";
+		geoms[geomcount].size = (fm_erase_block * UINT64_C(1024));
+		geomcount++;
+	}
+	if ((files = calloc(inodes + 1U, sizeof *files)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	HASH_ITER(hh, fm_inodes, fi, itmp)
+	{
+		struct fm_align_file *const file = &files[count];
+		const struct fm_extent *fe;
+
+		file->inode = fi;
+
+		DL_FOREACH(fi->extents, fe)
+		{
+			if (! fm_extent_in_volume(fe))
+				continue;
+
+			file->extents++;
+
+			for (unsigned int g = 0U; g < geomcount; g++)
+			{
+				struct fm_align_geometry *const geom = &geoms[g];
+				uint64_t crossings;
+				unsigned int bucket = 0U;
+
+				if (fm_align_aligned(fe, geom->size))
+				{
+					geom->aligned++;
+					geom->alignedbytes += fe->len;
+					continue;
+				}
+
+				// Within one, crossing 1, crossing 2-3, crossing 4-7, ...
+				for (crossings = fm_align_crossings(fe, geom->size); crossings && bucket < (FM_ALIGN_BUCKETS - 1U);
+				     crossings >>= 1U)
+					bucket++;
+
+				geom->buckets[bucket]++;
+				geom->bucketbytes[bucket] += fe->len;
+
+				file->misaligned[g]++;
+				file->total++;
+			}
+		}
+
+		if (file->total)
+			// Only the files with misaligned extents are kept
+			count++;
+		else
+			(void) memset(file, 0x00, sizeof *file);
+	}
+
+	qsort(files, count, sizeof *files, &fm_align_sortby_misaligned_cb);
+
+	top = ((fm_alignment_top < count) ? fm_alignment_top : count);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble)
+	{
+		(void) printf("Files with misaligned extents : %" PRIu64 "\n", count);
+		(void) printf("Files listed ................ : %" PRIu64 " (most misaligned extents first)\n", top);
+	}
+
+	for (unsigned int g = 0U; g < geomcount; g++)
+		(void) fm_align_print_geometry(&geoms[g]);
+
+	(void) printf("\n");
+	(void) printf("%12s", "Extents");
+
+	for (unsigned int g = 0U; g < geomcount; g++)
+		(void) printf(" %12s", geoms[g].name);
+
+	(void) printf("    %s\n", "File Name");
+	(void) printf("------------");
+
+	for (unsigned int g = 0U; g < geomcount; g++)
+		(void) printf(" ------------");
+
+	(void) printf("    ---------\n\n");
+
+	for (uint64_t i = 0U; i < top; i++)
+	{
+		const struct fm_align_file *const file = &files[i];
+
+		(void) printf("%12" PRIu64, file->extents);
+
+		for (unsigned int g = 0U; g < geomcount; g++)
+			(void) printf(" %12" PRIu64, file->misaligned[g]);
+
+		(void) printf("    %s\n", ((file->inode->names != NULL) ? file->inode->names->name : "(unnamed)"));
+	}
+
+	(void) fflush(stdout);
+
+	free(files);
+
+	return true;
+}
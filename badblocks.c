@@ -0,0 +1,321 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filemap.h"
+
+/* Finding the files damaged by bad blocks (see --badblocks)
+ *
+ * The list (as written by badblocks(8), one block number per line, in blocks of the filesystem's block size)
+ * is read and sorted, and then merged against the extents sorted by physical offset (see lookup.c) in one
+ * pass; the extent that each block is in can only be at or after the one that the block before it was in.
+ */
+
+struct fm_badblocks_file
+{
+	UT_hash_handle              hh;         // For entry into fm_badblocks_files below
+	const struct fm_inode *     inode;      // The damaged file (hash key)
+	uint64_t                    count;      // Number of bad blocks in it
+};
+
+static struct fm_badblocks_file *fm_badblocks_files = NULL;
+
+static int FM_NONNULL(1, 2)
+fm_badblocks_sort_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const uint64_t block1 = *(const uint64_t *) ptr1;
+	const uint64_t block2 = *(const uint64_t *) ptr2;
+
+	if (block1 < block2)
+		return -1;
+
+	if (block1 > block2)
+		return 1;
+
+	return 0;
+}
+
+static int FM_NONNULL(1, 2)
+fm_badblocks_sortby_count_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_badblocks_file *const file1 = ptr1;
+	const struct fm_badblocks_file *const file2 = ptr2;
+
+	if (file1->count > file2->count)
+		return -1;
+
+	if (file1->count < file2->count)
+		return 1;
+
+	return 0;
+}
+
+static uint64_t * FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_badblocks_read(const char *const restrict path, uint64_t *const restrict count)
+{
+	uint64_t *blocks = NULL;
+	uint64_t alloc = 0U;
+	uint64_t lineno = 0U;
+	char line[BUFSIZ];
+	FILE *fp;
+
+	*count = 0U;
+
+	if ((fp = fopen(path, "r")) == NULL)
+	{
+		(void) fm_print_message("%s: while reading bad blocks from '%s': fopen(3): %s\n",
+		                        argvzero, path, strerror(errno));
+		return NULL;
+	}
+	while (fgets(line, sizeof line, fp) != NULL)
+	{
+		const char *ptr = line;
+		char *end = NULL;
+
+		lineno++;
+
+		while (isspace((unsigned char) *ptr))
+			ptr++;
+
+		if (! *ptr || *ptr == '#')
+			// Blank line or comment
+			continue;
+
+		errno = 0;
+
+		const unsigned long long value = strtoull(ptr, &end, 10);
+
+		while (end != NULL && isspace((unsigned char) *end))
+			end++;
+
+		if (errno != 0 || end == ptr || ! isdigit((unsigned char) *ptr) || *end != 0x00 ||
+		    value > (UINT64_MAX / fm_blksz))
+		{
+			(void) fm_print_message("%s: while reading bad blocks from '%s': line %" PRIu64 ": invalid block "
+			                        "number\n", argvzero, path, lineno);
+			goto fail;
+		}
+		if (*count == alloc)
+		{
+			const uint64_t newalloc = ((alloc) ? (alloc * 2U) : 4096U);
+			uint64_t *const newblocks = realloc(blocks, newalloc * sizeof *blocks);
+
+			if (newblocks == NULL)
+			{
+				(void) fm_print_message("%s: while reading bad blocks from '%s': realloc(3): %s\n",
+				                        argvzero, path, strerror(errno));
+				goto fail;
+			}
+
+			blocks = newblocks;
+			alloc = newalloc;
+		}
+
+		blocks[(*count)++] = (uint64_t) value;
+	}
+	if (ferror(fp))
+	{
+		(void) fm_print_message("%s: while reading bad blocks from '%s': fgets(3): %s\n",
+		                        argvzero, path, strerror(errno));
+		goto fail;
+	}
+
+	(void) fclose(fp);
+
+	if (blocks == NULL && (blocks = calloc(1U, sizeof *blocks)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return NULL;
+	}
+
+	return blocks;
+
+fail:
+
+	(void) fclose(fp);
+	free(blocks);
+	return NULL;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_badblocks_count(const struct fm_inode *const inode)
+{
+	struct fm_badblocks_file *file = NULL;
+
+	HASH_FIND(hh, fm_badblocks_files, &inode, sizeof inode, file);
+
+	if (file == NULL)
+	{
+		if ((file = calloc(1U, sizeof *file)) == NULL)
+		{
+			(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+
+		file->inode = inode;
+
+		HASH_ADD(hh, fm_badblocks_files, inode, sizeof file->inode, file);
+	}
+
+	file->count++;
+
+	return true;
+}
+
+static const struct fm_extent * FM_NONNULL(1, 3)
+fm_badblocks_owner(struct fm_extent *const *const restrict index, const uint64_t extcount,
+                   uint64_t *const restrict first, const uint64_t off)
+{
+	// The blocks are sorted, so the extents before the one that was found last can never hold any of the rest
+	while (*first < extcount && (index[*first]->off + index[*first]->len) <= off)
+		(*first)++;
+
+	if (*first == extcount || index[*first]->off >= (off + fm_blksz))
+		return NULL;
+
+	return index[*first];
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_badblocks_report(const char *const restrict path)
+{
+	struct fm_badblocks_file *file;
+	struct fm_badblocks_file *ftmp;
+	struct fm_extent **index = NULL;
+	uint64_t *blocks = NULL;
+	uint64_t extcount = 0U;
+	uint64_t count = 0U;
+	uint64_t unique = 0U;
+	uint64_t unowned = 0U;
+	uint64_t first = 0U;
+	bool result = false;
+
+	if ((blocks = fm_badblocks_read(path, &count)) == NULL || (index = fm_lookup_index(&extcount)) == NULL)
+		// These functions print messages on error
+		goto done;
+
+	qsort(blocks, count, sizeof *blocks, &fm_badblocks_sort_cb);
+
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		if (i && blocks[i] == blocks[unique - 1U])
+			// Listed more than once (badblocks(8) can be run more than once over the same list)
+			continue;
+
+		blocks[unique++] = blocks[i];
+	}
+
+	// Counted before anything is printed, so that the totals can come first, like every other report
+	for (uint64_t i = 0U; i < unique; i++)
+	{
+		const struct fm_extent *const extent = fm_badblocks_owner(index, extcount, &first, (blocks[i] * fm_blksz));
+
+		if (extent == NULL)
+			unowned++;
+		else if (! fm_badblocks_count(extent->inode))
+			// This function prints messages on error
+			goto done;
+	}
+
+	HASH_SORT(fm_badblocks_files, fm_badblocks_sortby_count_cb);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble && ! fm_names_only)
+	{
+		(void) printf("Bad blocks .................. : %" PRIu64 " (%" PRIu64 " in free space or metadata)\n",
+		              unique, unowned);
+		(void) printf("Damaged files ............... : %u\n", HASH_COUNT(fm_badblocks_files));
+		(void) printf("\n");
+	}
+
+	if (! fm_names_only)
+	{
+		(void) printf("%20s %12s %20s    %s\n", "Bad Block", "Inode Number", "File Offset", "File Name(s)");
+		(void) printf("-------------------- ------------ --------------------    ------------\n\n");
+	}
+
+	first = 0U;
+
+	for (uint64_t i = 0U; i < unique && ! fm_names_only; i++)
+	{
+		const uint64_t off = (blocks[i] * fm_blksz);
+		const struct fm_extent *const extent = fm_badblocks_owner(index, extcount, &first, off);
+		const struct fm_name *fname;
+
+		if (extent == NULL)
+		{
+			(void) printf("%20" PRIu64 " %12s %20s    %s\n", blocks[i], "-", "-",
+			              "(free space or filesystem metadata)");
+			continue;
+		}
+
+		(void) printf("%20" PRIu64 " %12s %20s   ", blocks[i],
+		              fm_inode_number(extent->inode->inum, extent->inode->host),
+		              fm_readable_size(FM_READABLE_SIZE, (extent->loff + ((off > extent->off) ?
+		                                                  (off - extent->off) : 0U))));
+
+		DL_FOREACH(extent->inode->names, fname)
+			(void) printf(" %s", fname->name);
+
+		(void) printf("\n");
+	}
+
+	if (! fm_names_only)
+	{
+		(void) printf("\n");
+		(void) printf("%12s    %s\n", "Bad Blocks", "File Name(s)");
+		(void) printf("------------    ------------\n\n");
+	}
+
+	HASH_ITER(hh, fm_badblocks_files, file, ftmp)
+	{
+		const struct fm_name *fname;
+
+		DL_FOREACH(file->inode->names, fname)
+		{
+			if (fm_names_only)
+			{
+				(void) printf("%s", fname->name);
+
+				if (fm_names_zero)
+					(void) putchar('\0');
+				else
+					(void) putchar('\n');
+			}
+			else if (fname == file->inode->names)
+				(void) printf("%12" PRIu64 "    %s\n", file->count, fname->name);
+			else
+				(void) printf("%12s    %s\n", " ", fname->name);
+		}
+	}
+
+	result = true;
+
+done:
+
+	HASH_ITER(hh, fm_badblocks_files, file, ftmp)
+	{
+		HASH_DEL(fm_badblocks_files, file);
+		free(file);
+	}
+
+	free(blocks);
+	free(index);
+
+	return result;
+}
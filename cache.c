@@ -0,0 +1,142 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/fiemap.h>
+
+#include "filemap.h"
+
+/* The scan cache is simply a map saved by a previous run; see mapfile.c
+ * Entries are looked up by inode number and are only used if the inode has not changed since
+ */
+static struct fm_cache_entry *fm_cache = NULL;
+static uint64_t fm_cache_hits = 0U;
+
+static void
+fm_cache_clear(void)
+{
+	struct fm_cache_entry *ce;
+	struct fm_cache_entry *ctmp;
+
+	HASH_ITER(hh, fm_cache, ce, ctmp)
+	{
+		HASH_DEL(fm_cache, ce);
+		free(ce->extents);
+		free(ce);
+	}
+}
+
+static bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_cache_load_cb(const struct fm_map_record *const restrict rec, const struct fm_map_extent *const restrict mexts,
+                 const char *const restrict names, void *const restrict cbarg)
+{
+	struct fm_cache_entry *ce;
+
+	(void) names;
+	(void) cbarg;
+
+	if (rec->host)
+		// A file in a filesystem image (see --nested); not something that fm_cache_find() is asked about
+		return true;
+
+	for (uint64_t i = 0U; i < rec->extcount; i++)
+	{
+		/* Extents that had not yet been allocated when the cache was written will have been allocated
+		 * somewhere by now, even if the inode's timestamps have not changed since; don't cache those
+		 */
+		if (mexts[i].flags & (FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_UNKNOWN))
+			return true;
+	}
+	if ((ce = calloc(1U, sizeof *ce)) == NULL)
+	{
+		(void) fm_print_message("%s: while loading cache: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+	if (rec->extcount && (ce->extents = calloc(rec->extcount, sizeof *ce->extents)) == NULL)
+	{
+		(void) fm_print_message("%s: while loading cache: calloc(3): %s\n", argvzero, strerror(errno));
+		free(ce);
+		return false;
+	}
+	if (rec->extcount)
+		(void) memcpy(ce->extents, mexts, rec->extcount * sizeof *ce->extents);
+
+	(void) memcpy(&ce->sb, &rec->sb, sizeof ce->sb);
+
+	ce->inum = rec->inum;
+	ce->extcount = rec->extcount;
+
+	HASH_ADD(hh, fm_cache, inum, sizeof ce->inum, ce);
+
+	return true;
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_cache_load(const char *const restrict path)
+{
+	struct fm_map_header hdr;
+
+	if (access(path, F_OK) < 0 && errno == ENOENT)
+		// No cache yet; everything will be mapped and the cache will be written after scanning
+		return true;
+
+	if (! fm_load_map(path, &hdr, &fm_cache_load_cb, NULL))
+		// This function prints messages on error
+		return false;
+
+	if (hdr.blksz != fm_blksz)
+	{
+		// Not the same filesystem as last time (or it was recreated); ignore the cache
+		(void) fm_cache_clear();
+	}
+
+	return true;
+}
+
+const struct fm_cache_entry * FM_NONNULL(1) FM_WARN_UNUSED
+fm_cache_find(const struct stat *const restrict sb)
+{
+	const uint64_t inum = (uint64_t) sb->st_ino;
+	struct fm_cache_entry *ce = NULL;
+
+	if (fm_cache_path == NULL)
+		return NULL;
+
+	HASH_FIND(hh, fm_cache, &inum, sizeof inum, ce);
+
+	if (ce == NULL || ce->sb.st_dev != sb->st_dev || ce->sb.st_size != sb->st_size ||
+	    (ce->sb.st_mode & S_IFMT) != (sb->st_mode & S_IFMT) ||
+	    ce->sb.st_mtim.tv_sec != sb->st_mtim.tv_sec || ce->sb.st_mtim.tv_nsec != sb->st_mtim.tv_nsec ||
+	    ce->sb.st_ctim.tv_sec != sb->st_ctim.tv_sec || ce->sb.st_ctim.tv_nsec != sb->st_ctim.tv_nsec)
+		return NULL;
+
+	fm_cache_hits++;
+	return ce;
+}
+
+void
+fm_cache_free(void)
+{
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: scan cache: reused the extents of %" PRIu64 " of %" PRIu64 " inodes\n",
+		                        argvzero, fm_cache_hits, fm_inode_count);
+
+	(void) fm_cache_clear();
+
+	fm_cache_hits = 0U;
+}
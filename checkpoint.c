@@ -0,0 +1,163 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filemap.h"
+
+static struct fm_checkpoint fm_checkpoint;
+
+static bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_checkpoint_load_cb(const struct fm_map_record *const restrict rec, const struct fm_map_extent *const restrict mexts,
+                      const char *const restrict names, void *const restrict cbarg)
+{
+	(void) cbarg;
+
+	return fm_restore_inode(rec, mexts, names);
+}
+
+bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_checkpoint_add_dir(struct fm_checkpoint *const restrict ckpt, const char *const restrict path)
+{
+	const size_t len = strlen(path);
+	struct fm_checkpoint_dir *cdir = NULL;
+
+	HASH_FIND(hh, ckpt->dirs, path, len, cdir);
+
+	if (cdir != NULL)
+		return true;
+
+	if ((cdir = calloc(1U, sizeof *cdir + len + 1U)) == NULL)
+	{
+		(void) fm_print_message("%s: while checkpointing '%s': calloc(3): %s\n", argvzero, path, strerror(errno));
+		return false;
+	}
+
+	(void) memcpy(cdir->path, path, len);
+
+	HASH_ADD_KEYPTR(hh, ckpt->dirs, cdir->path, len, cdir);
+
+	return true;
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_checkpoint_begin(const char *const restrict rootpath)
+{
+	struct fm_map_header hdr;
+
+	(void) memset(&fm_checkpoint, 0x00, sizeof fm_checkpoint);
+	(void) snprintf(fm_checkpoint.rootpath, sizeof fm_checkpoint.rootpath, "%s", rootpath);
+
+	fm_checkpoint.saved = time(NULL);
+
+	if (! fm_resume_scan)
+		return true;
+
+	if (! fm_load_checkpoint(fm_checkpoint_path, &hdr, &fm_checkpoint_load_cb, NULL, &fm_checkpoint))
+		// This function prints messages on error
+		return false;
+
+	if (strcmp(fm_checkpoint.rootpath, rootpath) != 0)
+	{
+		(void) fm_print_message("%s: checkpoint '%s' is of a scan of '%s', not '%s'\n",
+		                        argvzero, fm_checkpoint_path, fm_checkpoint.rootpath, rootpath);
+		return false;
+	}
+	if (hdr.blksz != fm_blksz || (bool) (hdr.flags & FM_MAPFILE_FLAGS_DIRECTORIES) != fm_scan_directories)
+	{
+		(void) fm_print_message("%s: checkpoint '%s' was made with different options or on a different "
+		                        "filesystem\n", argvzero, fm_checkpoint_path);
+		return false;
+	}
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: resuming with %" PRIu64 " inodes in %u completed directories\n",
+		                        argvzero, fm_inode_count, HASH_COUNT(fm_checkpoint.dirs));
+
+	return true;
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_checkpoint_skip_dir(const char *const restrict path)
+{
+	struct fm_checkpoint_dir *cdir = NULL;
+
+	if (fm_checkpoint_path == NULL)
+		return false;
+
+	HASH_FIND(hh, fm_checkpoint.dirs, path, strlen(path), cdir);
+
+	return (cdir != NULL);
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_checkpoint_done_dir(const char *const restrict path)
+{
+	if (fm_checkpoint_path == NULL)
+		return true;
+
+	if (! fm_checkpoint_add_dir(&fm_checkpoint, path))
+		// This function prints messages on error
+		return false;
+
+	if (time(NULL) < (fm_checkpoint.saved + (time_t) fm_checkpoint_interval))
+		return true;
+
+	if (! fm_checkpoint_save())
+	{
+		// The scan is worth more than the checkpoint; carry on, and try again at the next interval
+		(void) fm_print_message("%s: warning: could not save checkpoint '%s'; trying again in %" PRIu64
+		                        " seconds\n", argvzero, fm_checkpoint_path, fm_checkpoint_interval);
+
+		fm_checkpoint.saved = time(NULL);
+	}
+
+	return true;
+}
+
+bool
+fm_checkpoint_save(void)
+{
+	if (fm_checkpoint_path == NULL)
+		return true;
+
+	if (! fm_save_checkpoint(fm_checkpoint_path, &fm_checkpoint))
+		// This function prints messages on error
+		return false;
+
+	fm_checkpoint.saved = time(NULL);
+
+	return true;
+}
+
+void
+fm_checkpoint_finish(void)
+{
+	struct fm_checkpoint_dir *cdir;
+	struct fm_checkpoint_dir *ctmp;
+
+	if (fm_checkpoint_path == NULL)
+		return;
+
+	// The scan completed; there is nothing left to resume
+	(void) unlink(fm_checkpoint_path);
+
+	HASH_ITER(hh, fm_checkpoint.dirs, cdir, ctmp)
+	{
+		HASH_DEL(fm_checkpoint.dirs, cdir);
+		free(cdir);
+	}
+}
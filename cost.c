@@ -0,0 +1,300 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <linux/fiemap.h>
+
+#include "filemap.h"
+
+/* Estimating how long it takes to read each file from start to finish (see --read-cost and --order-cost)
+ *
+ * The extents of an inode are followed in logical order. Before the first, and wherever an extent does not
+ * carry on from where the previous one ended in the volume, the device has to seek; the rest of the time is
+ * spent transferring the data at the device's sequential rate.
+ *
+ * On a hard disk, a seek costs the time for the head to move to the new track and the time for the platter
+ * to turn to the data (half a revolution on average). The former grows with the square root of the distance
+ * moved, from a track-to-track seek for the shortest up to a full-stroke seek for moving across the whole of
+ * what was mapped. On a solid-state drive, every seek costs the same (the device's access latency). As the
+ * head could be anywhere before a file is read, its first seek is taken to be an average one (a third of the
+ * way across the volume).
+ *
+ * The ideal time for a file is the time to read it with a single seek, so its efficiency is the share of its
+ * estimated time that is spent transferring data rather than seeking more than that.
+ */
+
+#define FM_COST_HDD_SEEK_US             16000U      // Full-stroke seek time of a typical 7200 RPM hard disk
+#define FM_COST_HDD_ROTATION_US         4167U       // Half a revolution at 7200 RPM
+#define FM_COST_HDD_RATE                150U        // Sequential transfer rate of the same, in MiB/s
+#define FM_COST_SSD_SEEK_US             100U        // Access latency of a typical SATA solid-state drive
+#define FM_COST_SSD_RATE                500U        // Sequential transfer rate of the same, in MiB/s
+
+struct fm_cost_file
+{
+	const struct fm_inode *     inode;      // The file
+	uint64_t                    seeks;      // How many times reading it has to seek
+	uint64_t                    bytes;      // How much of its data is read from the volume
+	long double                 ideal;      // How long reading it would take with one seek (in seconds)
+};
+
+static uint64_t fm_cost_span = 0U;
+
+static long double
+fm_cost_seek_secs(void)
+{
+	const uint64_t us = ((fm_cost_seek) ? fm_cost_seek :
+	                     ((fm_cost_model == FM_COST_MODEL_SSD) ? FM_COST_SSD_SEEK_US : FM_COST_HDD_SEEK_US));
+
+	return ((long double) us / 1.0E6L);
+}
+
+static uint64_t
+fm_cost_rate_mibs(void)
+{
+	if (fm_cost_rate)
+		return fm_cost_rate;
+
+	return ((fm_cost_model == FM_COST_MODEL_SSD) ? FM_COST_SSD_RATE : FM_COST_HDD_RATE);
+}
+
+static long double
+fm_cost_seek_time(const uint64_t distance)
+{
+	const long double fullstroke = fm_cost_seek_secs();
+	const long double tracktotrack = (fullstroke / 16.0L);
+	long double fraction;
+
+	if (fm_cost_model == FM_COST_MODEL_SSD)
+		return fullstroke;
+
+	fraction = ((fm_cost_span) ? ((long double) distance / (long double) fm_cost_span) : 1.0L);
+
+	if (fraction > 1.0L)
+		fraction = 1.0L;
+
+	return (tracktotrack + ((fullstroke - tracktotrack) * sqrtl(fraction)) + (FM_COST_HDD_ROTATION_US / 1.0E6L));
+}
+
+static long double
+fm_cost_transfer_time(const uint64_t bytes)
+{
+	return ((long double) bytes / ((long double) fm_cost_rate_mibs() * (long double) (UINT64_C(1) << 20)));
+}
+
+static bool FM_NONNULL(1)
+fm_cost_readable(const struct fm_extent *const restrict extent)
+{
+	// Reading these does not read anything from where the extent says it is in the volume
+	return (fm_extent_in_volume(extent) && ! (extent->flags & FIEMAP_EXTENT_UNWRITTEN));
+}
+
+static long double FM_NONNULL(1, 2, 3)
+fm_cost_estimate(const struct fm_inode *const restrict fi, uint64_t *const restrict seeks,
+                 uint64_t *const restrict bytes)
+{
+	const struct fm_extent *prev = NULL;
+	const struct fm_extent *fe;
+	long double secs = 0.0L;
+
+	*seeks = 0U;
+	*bytes = 0U;
+
+	// The list is in logical order (fe->pos ascending)
+	DL_FOREACH(fi->extents, fe)
+	{
+		if (! fm_cost_readable(fe))
+			continue;
+
+		if (prev == NULL)
+		{
+			secs += fm_cost_seek_time(fm_cost_span / 3U);
+			*seeks += 1U;
+		}
+		else if (fe->off != (prev->off + prev->len))
+		{
+			const uint64_t end = (prev->off + prev->len);
+
+			secs += fm_cost_seek_time((fe->off > end) ? (fe->off - end) : (end - fe->off));
+			*seeks += 1U;
+		}
+
+		*bytes += fe->len;
+		prev = fe;
+	}
+
+	return (secs + fm_cost_transfer_time(*bytes));
+}
+
+static long double
+fm_cost_ideal(const uint64_t bytes)
+{
+	if (! bytes)
+		return 0.0L;
+
+	return (fm_cost_seek_time(fm_cost_span / 3U) + fm_cost_transfer_time(bytes));
+}
+
+static void
+fm_cost_measure_span(void)
+{
+	const struct fm_extent *fe;
+	const struct fm_extent *etmp;
+
+	fm_cost_span = 0U;
+
+	// Seek distances are relative to the span of the volume that was mapped
+	HASH_ITER(hh, fm_extents, fe, etmp)
+		if ((fe->off + fe->len) > fm_cost_span)
+			fm_cost_span = (fe->off + fe->len);
+}
+
+void
+fm_cost_prepare(void)
+{
+	struct fm_inode *fi;
+	struct fm_inode *itmp;
+
+	(void) fm_cost_measure_span();
+
+	HASH_ITER(hh, fm_inodes, fi, itmp)
+	{
+		uint64_t seeks;
+		uint64_t bytes;
+
+		fi->readtime = fm_cost_estimate(fi, &seeks, &bytes);
+	}
+}
+
+static int FM_NONNULL(1, 2)
+fm_cost_sortby_lost_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_cost_file *const file1 = ptr1;
+	const struct fm_cost_file *const file2 = ptr2;
+	const long double lost1 = (file1->inode->readtime - file1->ideal);
+	const long double lost2 = (file2->inode->readtime - file2->ideal);
+
+	if (lost1 > lost2)
+		return -1;
+
+	if (lost1 < lost2)
+		return 1;
+
+	if (file1->inode->inum < file2->inode->inum)
+		return -1;
+
+	if (file1->inode->inum > file2->inode->inum)
+		return 1;
+
+	return 0;
+}
+
+bool FM_WARN_UNUSED
+fm_cost_report(void)
+{
+	const uint64_t inodes = HASH_COUNT(fm_inodes);
+	struct fm_cost_file *files;
+	struct fm_inode *fi;
+	struct fm_inode *itmp;
+	long double estimated = 0.0L;
+	long double ideal = 0.0L;
+	uint64_t count = 0U;
+	uint64_t seeks = 0U;
+	uint64_t bytes = 0U;
+	uint64_t top;
+
+	if ((files = calloc(inodes + 1U, sizeof *files)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	(void) fm_cost_measure_span();
+
+	HASH_ITER(hh, fm_inodes, fi, itmp)
+	{
+		struct fm_cost_file *const file = &files[count];
+
+		if ((fi->sb.st_mode & S_IFMT) != S_IFREG || fi->names == NULL)
+			// Directories are not read from start to finish
+			continue;
+
+		file->inode = fi;
+		fi->readtime = fm_cost_estimate(fi, &file->seeks, &file->bytes);
+		file->ideal = fm_cost_ideal(file->bytes);
+
+		estimated += fi->readtime;
+		ideal += file->ideal;
+		seeks += file->seeks;
+		bytes += file->bytes;
+		count++;
+	}
+
+	qsort(files, count, sizeof *files, &fm_cost_sortby_lost_cb);
+
+	top = ((fm_cost_top < count) ? fm_cost_top : count);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble)
+	{
+		const long double efficiency = ((estimated > 0.0L) ? (100.0L * (ideal / estimated)) : 100.0L);
+
+		if (fm_cost_model == FM_COST_MODEL_SSD)
+			(void) printf("Cost model .................. : ssd (%.3Lf ms per seek, %" PRIu64 " MiB/s)\n",
+			              (fm_cost_seek_secs() * 1.0E3L), fm_cost_rate_mibs());
+		else
+			(void) printf("Cost model .................. : hdd (%.3Lf ms full-stroke seek, %.3Lf ms rotational "
+			              "latency, %" PRIu64 " MiB/s)\n", (fm_cost_seek_secs() * 1.0E3L),
+			              (FM_COST_HDD_ROTATION_US / 1.0E3L), fm_cost_rate_mibs());
+
+		(void) printf("Volume span ................. : %s\n", fm_readable_size(FM_READABLE_SIZE, fm_cost_span));
+		(void) printf("Files estimated ............. : %" PRIu64 " (%" PRIu64 " seeks)\n", count, seeks);
+		(void) printf("Data to read ................ : %s\n", fm_readable_size(FM_READABLE_SIZE, bytes));
+		(void) printf("Estimated read time ......... : %.3Lf seconds (ideally %.3Lf seconds; %.2Lf%% efficient)\n",
+		              estimated, ideal, efficiency);
+		(void) printf("Files listed ................ : %" PRIu64 " (most time lost to seeking first)\n", top);
+		(void) printf("\n");
+	}
+
+	(void) printf("%12s %12s %20s %14s %14s %10s    %s\n", "Extents", "Seeks", "Allocated", "Estimated ms",
+	              "Ideal ms", "Efficiency", "File Name");
+	(void) printf("------------ ------------ -------------------- -------------- -------------- ---------- "
+	              "   ---------\n\n");
+
+	for (uint64_t i = 0U; i < top; i++)
+	{
+		const struct fm_cost_file *const file = &files[i];
+		const long double readtime = file->inode->readtime;
+		const long double efficiency = ((readtime > 0.0L) ? (100.0L * (file->ideal / readtime)) : 100.0L);
+		char pcnt[128U];
+
+		(void) memset(pcnt, 0x00, sizeof pcnt);
+		(void) snprintf(pcnt, sizeof pcnt, "%.2Lf%%", efficiency);
+
+		(void) printf("%12" PRIu64 " %12" PRIu64 " %20s %14.3Lf %14.3Lf %10s    %s\n", file->inode->extcount,
+		              file->seeks, fm_readable_size(FM_READABLE_SIZE, file->bytes), (readtime * 1.0E3L),
+		              (file->ideal * 1.0E3L), pcnt, file->inode->names->name);
+	}
+
+	(void) fflush(stdout);
+
+	free(files);
+
+	return true;
+}
@@ -0,0 +1,541 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+
+#include "filemap.h"
+
+/* Defragmenting the most fragmented files (see --defrag)
+ *
+ * For each file, a donor file is created next to it (so that it is on the same filesystem) and as much space as
+ * the file needs is allocated to it in one go, which gives the filesystem the chance to find it in as few pieces
+ * as it can. If the donor is in fewer pieces than the file, the file's data is moved into the donor's space:
+ *
+ *   - On ext4, EXT4_IOC_MOVE_EXT copies the data and swaps the extents of the two files, a piece at a time, while
+ *     the file stays where it is (same inode, names, owner, permissions, extended attributes). The donor ends up
+ *     with the file's old extents, and is removed.
+ *
+ *   - Elsewhere, the data is copied into the donor, the donor is given the file's owner, permissions and times,
+ *     and is renamed over the file. That would break hardlinks and lose extended attributes (ACLs, capabilities,
+ *     security labels), so files with either are left alone.
+ *
+ * Afterwards the file is mapped again (see fm_rescan_extents()) to see what it really has now. With --defrag-rate,
+ * the copying pauses whenever it is ahead of that rate. With --defrag-dry-run, nothing is changed at all.
+ */
+
+#define FM_DEFRAG_CHUNK_SIZE            (UINT64_C(8) << 20)
+#define FM_DEFRAG_BUSY_RETRIES          50U
+#define FM_DEFRAG_DONOR_NAME            ".filemap-defrag.XXXXXX"
+
+#ifndef EXT4_IOC_MOVE_EXT
+// From the kernel's fs/ext4/ext4.h; not exported to userspace headers
+struct move_extent
+{
+	uint32_t            reserved;       // Should be zero
+	uint32_t            donor_fd;       // Donor file descriptor
+	uint64_t            orig_start;     // Logical start offset in blocks for the original file
+	uint64_t            donor_start;    // Logical start offset in blocks for the donor file
+	uint64_t            len;            // Block length to be moved
+	uint64_t            moved_len;      // Moved block length
+};
+#define EXT4_IOC_MOVE_EXT               _IOWR('f', 15, struct move_extent)
+#endif
+
+enum fm_defrag_method
+{
+	FM_DEFRAG_METHOD_NONE           = 0,
+	FM_DEFRAG_METHOD_MOVED          = 1,
+	FM_DEFRAG_METHOD_COPIED         = 2,
+};
+
+struct fm_defrag_state
+{
+	struct timespec             started;    // When the first file was started on
+	uint64_t                    bytes;      // Bytes copied or moved so far
+	unsigned char *             buf;        // For copying (when the data cannot be moved)
+	bool                        canmove;    // EXT4_IOC_MOVE_EXT has not been refused yet
+};
+
+static int FM_NONNULL(1, 2)
+fm_defrag_sortby_extcount_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_inode *const inode1 = *(const struct fm_inode *const *) ptr1;
+	const struct fm_inode *const inode2 = *(const struct fm_inode *const *) ptr2;
+
+	if (inode1->extcount > inode2->extcount)
+		return -1;
+
+	if (inode1->extcount < inode2->extcount)
+		return 1;
+
+	if (inode1->inum < inode2->inum)
+		return -1;
+
+	if (inode1->inum > inode2->inum)
+		return 1;
+
+	return 0;
+}
+
+static void FM_NONNULL(1)
+fm_defrag_throttle(struct fm_defrag_state *const restrict state, const uint64_t len)
+{
+	state->bytes += len;
+
+	(void) fm_throttle(&state->started, state->bytes, fm_defrag_rate);
+}
+
+static bool FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_defrag_count_extents(const int fd, const char *const restrict path, uint64_t *const restrict count)
+{
+	struct fiemap fmh = {
+		.fm_start          = 0U,
+		.fm_length         = FIEMAP_MAX_OFFSET,
+		.fm_flags          = FIEMAP_FLAG_SYNC,
+		.fm_mapped_extents = 0U,
+		.fm_extent_count   = 0U,
+	};
+
+	// With no room for any extents, the kernel only counts them
+	if (ioctl(fd, FS_IOC_FIEMAP, &fmh) < 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': ioctl(2) FS_IOC_FIEMAP: %s\n",
+		                        argvzero, path, strerror(errno));
+		return false;
+	}
+
+	*count = fmh.fm_mapped_extents;
+	return true;
+}
+
+static bool FM_NONNULL(1, 3, 4) FM_WARN_UNUSED
+fm_defrag_move(struct fm_defrag_state *const restrict state, const int fd, const struct stat *const restrict sb,
+               const char *const restrict path, const int donorfd)
+{
+	const uint64_t blocks = ((((uint64_t) sb->st_size) + fm_blksz - 1U) / fm_blksz);
+	const uint64_t chunk = (FM_DEFRAG_CHUNK_SIZE / fm_blksz);
+	const struct timespec pause = { .tv_sec = 0, .tv_nsec = 10000000L };
+	unsigned int busy = 0U;
+	uint64_t done = 0U;
+
+	while (done < blocks)
+	{
+		struct move_extent mext;
+
+		(void) memset(&mext, 0x00, sizeof mext);
+
+		mext.donor_fd = (uint32_t) donorfd;
+		mext.orig_start = done;
+		mext.donor_start = done;
+		mext.len = (((blocks - done) < chunk) ? (blocks - done) : chunk);
+
+		if (ioctl(fd, EXT4_IOC_MOVE_EXT, &mext) < 0)
+		{
+			if (errno == EBUSY && busy++ < FM_DEFRAG_BUSY_RETRIES)
+			{
+				// Pages of the file are still being written back; give that a moment, and drop them
+				(void) fdatasync(fd);
+				(void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+				(void) nanosleep(&pause, NULL);
+				continue;
+			}
+			if (! done && (errno == ENOTTY || errno == EOPNOTSUPP || errno == EINVAL))
+			{
+				// Not ext4 (or not a kind of file that it can do this for); copy it instead
+				state->canmove = false;
+				return false;
+			}
+
+			(void) fm_print_message("%s: while defragmenting '%s': ioctl(2) EXT4_IOC_MOVE_EXT: %s\n",
+			                        argvzero, path, strerror(errno));
+			return false;
+		}
+		if (! mext.moved_len)
+		{
+			(void) fm_print_message("%s: while defragmenting '%s': ioctl(2) EXT4_IOC_MOVE_EXT: %s\n",
+			                        argvzero, path, "no progress");
+			return false;
+		}
+
+		done += mext.moved_len;
+
+		(void) fm_defrag_throttle(state, (mext.moved_len * fm_blksz));
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_defrag_unchanged(const struct stat *const restrict before, const struct stat *const restrict after)
+{
+	return (before->st_ino == after->st_ino && before->st_size == after->st_size &&
+	        before->st_mtim.tv_sec == after->st_mtim.tv_sec && before->st_mtim.tv_nsec == after->st_mtim.tv_nsec &&
+	        before->st_ctim.tv_sec == after->st_ctim.tv_sec && before->st_ctim.tv_nsec == after->st_ctim.tv_nsec);
+}
+
+static bool FM_NONNULL(1)
+fm_defrag_sync_dir(const char *const restrict path)
+{
+	const char *const slash = strrchr(path, '/');
+	char dirpath[PATH_MAX];
+	int dirfd;
+
+	(void) memset(dirpath, 0x00, sizeof dirpath);
+
+	if (slash == NULL)
+		(void) snprintf(dirpath, sizeof dirpath, ".");
+	else if (slash == path)
+		(void) snprintf(dirpath, sizeof dirpath, "/");
+	else
+		(void) snprintf(dirpath, sizeof dirpath, "%.*s", (int) (slash - path), path);
+
+	if ((dirfd = open(dirpath, O_NOCTTY | O_RDONLY | O_DIRECTORY, 0)) < 0 || fsync(dirfd) < 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': %s '%s': %s\n", argvzero, path,
+		                        ((dirfd < 0) ? "open(2)" : "fsync(2)"), dirpath, strerror(errno));
+
+		if (dirfd >= 0)
+			(void) close(dirfd);
+
+		return false;
+	}
+
+	(void) close(dirfd);
+	return true;
+}
+
+static bool FM_NONNULL(1, 3, 4, 6) FM_WARN_UNUSED
+fm_defrag_copy(struct fm_defrag_state *const restrict state, const int fd, const struct stat *const restrict sb,
+               const char *const restrict path, const int donorfd, const char *const restrict donorpath)
+{
+	const struct timespec times[2] = { sb->st_atim, sb->st_mtim };
+	struct stat now;
+	uint64_t done = 0U;
+
+	(void) memset(&now, 0x00, sizeof now);
+
+	while (done < (uint64_t) sb->st_size)
+	{
+		const uint64_t left = (((uint64_t) sb->st_size) - done);
+		const size_t want = (size_t) ((left < FM_DEFRAG_CHUNK_SIZE) ? left : FM_DEFRAG_CHUNK_SIZE);
+		const ssize_t got = pread(fd, state->buf, want, (off_t) done);
+		size_t written = 0U;
+
+		if (got < 0 && errno == EINTR)
+			continue;
+
+		if (got <= 0)
+		{
+			(void) fm_print_message("%s: while defragmenting '%s': pread(2): %s\n", argvzero, path,
+			                        ((got < 0) ? strerror(errno) : "file was truncated"));
+			return false;
+		}
+		while (written < (size_t) got)
+		{
+			const ssize_t ret = pwrite(donorfd, state->buf + written, ((size_t) got - written),
+			                           (off_t) (done + written));
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			if (ret < 0)
+			{
+				(void) fm_print_message("%s: while defragmenting '%s': pwrite(2): %s\n",
+				                        argvzero, donorpath, strerror(errno));
+				return false;
+			}
+
+			written += (size_t) ret;
+		}
+
+		done += (uint64_t) got;
+
+		(void) fm_defrag_throttle(state, (uint64_t) got);
+	}
+
+	if (fchown(donorfd, sb->st_uid, sb->st_gid) < 0 || fchmod(donorfd, (sb->st_mode & 07777)) < 0 ||
+	    futimens(donorfd, times) < 0 || fsync(donorfd) < 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': %s\n", argvzero, donorpath, strerror(errno));
+		return false;
+	}
+	if (fstat(fd, &now) < 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': fstat(2): %s\n", argvzero, path, strerror(errno));
+		return false;
+	}
+	if (! fm_defrag_unchanged(sb, &now))
+	{
+		// Written to (or truncated, or had its metadata changed) while it was being copied; keep it as it is
+		(void) fm_print_message("%s: while defragmenting '%s': it changed while it was being copied\n",
+		                        argvzero, path);
+		return false;
+	}
+	if (rename(donorpath, path) < 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': rename(2): %s\n", argvzero, path, strerror(errno));
+		return false;
+	}
+
+	// The copy is in place either way; this only makes the rename durable
+	(void) fm_defrag_sync_dir(path);
+
+	return true;
+}
+
+static bool FM_NONNULL(2, 3)
+fm_defrag_copyable(const int fd, const struct stat *const restrict sb, const char *const restrict path)
+{
+	if (sb->st_nlink > 1U)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': it has hardlinks, which copying would break\n",
+		                        argvzero, path);
+		return false;
+	}
+
+	if (flistxattr(fd, NULL, 0U) > 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': it has extended attributes, which copying would "
+		                        "lose\n", argvzero, path);
+		return false;
+	}
+
+	return true;
+}
+
+static enum fm_defrag_method FM_NONNULL(1, 2, 3)
+fm_defrag_file(struct fm_defrag_state *const restrict state, const struct fm_inode *const restrict fi,
+               const char *const restrict path)
+{
+	enum fm_defrag_method method = FM_DEFRAG_METHOD_NONE;
+	const char *const slash = strrchr(path, '/');
+	char donorpath[PATH_MAX];
+	uint64_t donorexts = 0U;
+	struct stat sb;
+	int donorfd = -1;
+	int fd;
+
+	(void) memset(&sb, 0x00, sizeof sb);
+	(void) memset(donorpath, 0x00, sizeof donorpath);
+
+	if ((fd = open(path, O_NOCTTY | O_RDWR | O_NOFOLLOW, 0)) < 0 || fstat(fd, &sb) < 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': %s: %s\n", argvzero, path,
+		                        ((fd < 0) ? "open(2)" : "fstat(2)"), strerror(errno));
+		goto done;
+	}
+	if ((uint64_t) sb.st_ino != fi->inum || sb.st_size != fi->sb.st_size ||
+	    sb.st_mtim.tv_sec != fi->sb.st_mtim.tv_sec || sb.st_mtim.tv_nsec != fi->sb.st_mtim.tv_nsec)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': it has changed since it was mapped\n",
+		                        argvzero, path);
+		goto done;
+	}
+	if (fdatasync(fd) < 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': fdatasync(2): %s\n", argvzero, path, strerror(errno));
+		goto done;
+	}
+
+	// Next to the file, so that it is on the same filesystem
+	(void) snprintf(donorpath, sizeof donorpath, "%.*s%s", ((slash != NULL) ? (int) (slash - path + 1) : 0), path,
+	                FM_DEFRAG_DONOR_NAME);
+
+	if ((donorfd = mkstemp(donorpath)) < 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': mkstemp(3): %s\n", argvzero, path, strerror(errno));
+		donorpath[0] = 0x00;
+		goto done;
+	}
+	if ((errno = posix_fallocate(donorfd, 0, sb.st_size)) != 0)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': posix_fallocate(3): %s\n",
+		                        argvzero, donorpath, strerror(errno));
+		goto done;
+	}
+	if (! fm_defrag_count_extents(donorfd, donorpath, &donorexts))
+		// This function prints messages on error
+		goto done;
+
+	if (donorexts >= fi->extcount)
+	{
+		(void) fm_print_message("%s: while defragmenting '%s': no room for it in fewer than %" PRIu64 " extents\n",
+		                        argvzero, path, fi->extcount);
+		goto done;
+	}
+
+	if (state->canmove && fm_defrag_move(state, fd, &sb, path, donorfd))
+		method = FM_DEFRAG_METHOD_MOVED;
+	else if (! state->canmove && fm_defrag_copyable(fd, &sb, path) &&
+	         fm_defrag_copy(state, fd, &sb, path, donorfd, donorpath))
+	{
+		// The donor is now the file
+		donorpath[0] = 0x00;
+		method = FM_DEFRAG_METHOD_COPIED;
+	}
+
+done:
+
+	if (donorfd >= 0)
+		(void) close(donorfd);
+
+	if (donorpath[0])
+		// Holds the file's old extents if they were moved, or nothing of use if not
+		(void) unlink(donorpath);
+
+	if (fd >= 0)
+		(void) close(fd);
+
+	return method;
+}
+
+bool FM_WARN_UNUSED
+fm_defrag_report(void)
+{
+	struct fm_defrag_state state;
+	struct fm_inode **inodes = NULL;
+	struct fm_inode *fi;
+	struct fm_inode *itmp;
+	uint64_t extsbefore = 0U;
+	uint64_t extsafter = 0U;
+	uint64_t improved = 0U;
+	uint64_t count = 0U;
+	uint64_t top;
+	bool result = false;
+
+	(void) memset(&state, 0x00, sizeof state);
+
+	state.canmove = true;
+
+	if ((inodes = calloc(HASH_COUNT(fm_inodes) + 1U, sizeof *inodes)) == NULL ||
+	    (state.buf = malloc(FM_DEFRAG_CHUNK_SIZE)) == NULL)
+	{
+		(void) fm_print_message("%s: malloc(3): %s\n", argvzero, strerror(errno));
+		goto done;
+	}
+
+	HASH_ITER(hh, fm_inodes, fi, itmp)
+		if ((fi->flags & FM_IFLAGS_FRAGMENTED) && fi->extcount > 1U && fi->names != NULL &&
+		    (fi->sb.st_mode & S_IFMT) == S_IFREG)
+			inodes[count++] = fi;
+
+	qsort(inodes, count, sizeof *inodes, &fm_defrag_sortby_extcount_cb);
+
+	top = ((fm_defrag_count < count) ? fm_defrag_count : count);
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &state.started);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	(void) printf("%12s %12s %8s    %s\n", "Extents", "Now", "How", "File Name");
+	(void) printf("------------ ------------ --------    ---------\n\n");
+
+	for (uint64_t i = 0U; i < top; i++)
+	{
+		const uint64_t before = inodes[i]->extcount;
+		char path[PATH_MAX];
+		enum fm_defrag_method method;
+		struct stat sb;
+		uint64_t inum;
+		int fd;
+
+		(void) memset(path, 0x00, sizeof path);
+		(void) memcpy(path, inodes[i]->names->name, sizeof path);
+
+		if (fm_defrag_dry_run)
+		{
+			(void) printf("%12" PRIu64 " %12s %8s    %s\n", before, "-", "dry-run", path);
+			continue;
+		}
+
+		if (! fm_run_quietly)
+			(void) fm_print_message("%s: defragmenting %s ...", argvzero, path);
+
+		method = fm_defrag_file(&state, inodes[i], path);
+
+		if (method == FM_DEFRAG_METHOD_NONE)
+		{
+			(void) printf("%12" PRIu64 " %12" PRIu64 " %8s    %s\n", before, before, "skipped", path);
+			continue;
+		}
+
+		// See what it really has now (it is a new inode if it was copied, which takes over the name)
+		(void) memset(&sb, 0x00, sizeof sb);
+
+		if ((fd = open(path, O_NOCTTY | O_RDONLY | O_NOFOLLOW, 0)) < 0)
+		{
+			(void) fm_scan_failed(path, "open(2)", errno);
+			continue;
+		}
+		if (fstat(fd, &sb) < 0)
+		{
+			(void) fm_scan_failed(path, "fstat(2)", errno);
+			(void) close(fd);
+			continue;
+		}
+		if (! fm_rescan_extents(fd, &sb, path))
+			// This function records the failure, and closes the fd
+			continue;
+
+		inum = (uint64_t) sb.st_ino;
+
+		fi = fm_find_inode(inum, 0U);
+
+		if (fi == NULL)
+			// Could not be mapped again (with --keep-going); this has been recorded
+			continue;
+
+		(void) printf("%12" PRIu64 " %12" PRIu64 " %8s    %s\n", before, fi->extcount,
+		              ((method == FM_DEFRAG_METHOD_MOVED) ? "moved" : "copied"), path);
+
+		extsbefore += before;
+		extsafter += fi->extcount;
+
+		if (fi->extcount < before)
+			improved++;
+	}
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble && ! fm_defrag_dry_run)
+	{
+		(void) printf("\n");
+		(void) printf("Files defragmented .......... : %" PRIu64 " of %" PRIu64 " (%" PRIu64 " fragmented)\n",
+		              improved, top, count);
+		(void) printf("Extents (before / after) .... : %" PRIu64 " / %" PRIu64 "\n", extsbefore, extsafter);
+		(void) printf("Data moved or copied ........ : %s\n", fm_readable_size(FM_READABLE_SIZE, state.bytes));
+	}
+
+	result = true;
+
+done:
+
+	free(state.buf);
+	free(inodes);
+
+	return result;
+}
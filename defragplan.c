@@ -0,0 +1,537 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filemap.h"
+
+/* Planning where to rewrite fragmented files to (see --plan-defrag)
+ *
+ * Nothing is changed; the plan says which files to rewrite, in which order, and into which free ranges of the
+ * volume, and how many extents each should have afterwards.
+ *
+ * The fragmented regular files are grouped by the directory that they are in (by their first name), as the
+ * files of a directory tend to be read together. The groups with the most excess extents (beyond one per file)
+ * are planned first, so that if there is not enough free space for everything, it goes where it gains the most.
+ * Each group is placed, whole and in name order, into the smallest free range that it fits in. If there is
+ * none, each of its files is placed into the smallest free range that it fits in; and if there is none for a
+ * file either, it is split across the largest free ranges, if that still leaves it with fewer extents than it
+ * has now. Otherwise the file is left where it is.
+ *
+ * The free space is what the filesystem's reverse mapping says is free (so --fsmap is required); the gaps between
+ * the extents mapped would also hold its metadata, and everything outside of the path scanned. Each piece of free
+ * space that a file is planned into is counted as the fewest extents its length can be described in (see
+ * fm_score_ideal()), as a long enough free range still holds no more than the longest extent in each.
+ *
+ * The free ranges are kept in an array in order of their length, so that the best fit is a binary search, and
+ * the space left over after taking from a range is put back into its place in that order. The space that the
+ * files planned are using now is not reused for the files planned after them; a filesystem only frees it once
+ * each file has been rewritten, and the plan must not depend on the order that it is carried out in.
+ */
+
+struct fm_plan_file
+{
+	const struct fm_inode *     inode;      // The file
+	const char *                name;       // Its first name
+	size_t                      dirlen;     // Length of the directory part of that name (including the slash)
+	uint64_t                    bytes;      // Bytes allocated to it now (and so to be allocated to it again)
+	uint64_t                    firstpiece; // Index of its first free range taken (see fm_plan_pieces below)
+	uint64_t                    piececount; // Number of free ranges taken (0 if it is to be left where it is)
+	uint64_t                    extents;    // Number of extents it should have in them
+	uint64_t                    order;      // When it is to be rewritten (1 for first)
+};
+
+struct fm_plan_group
+{
+	uint64_t                    first;      // Index of the first file of the directory
+	uint64_t                    count;      // Number of files in the directory
+	uint64_t                    bytes;      // Bytes allocated to them
+	uint64_t                    excess;     // Number of their extents beyond the first of each
+};
+
+struct fm_plan_free
+{
+	struct fm_freespace_range * ranges;     // Free ranges (in order of length, then offset)
+	uint64_t                    count;      // Number of entries in the array above
+};
+
+static struct fm_freespace_range *fm_plan_pieces = NULL;
+static uint64_t fm_plan_piececount = 0U;
+static uint64_t fm_plan_piecealloc = 0U;
+
+static int FM_NONNULL(1, 2)
+fm_plan_sortby_len_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_freespace_range *const range1 = ptr1;
+	const struct fm_freespace_range *const range2 = ptr2;
+
+	if (range1->len < range2->len)
+		return -1;
+
+	if (range1->len > range2->len)
+		return 1;
+
+	if (range1->off < range2->off)
+		return -1;
+
+	if (range1->off > range2->off)
+		return 1;
+
+	return 0;
+}
+
+static int FM_NONNULL(1, 2)
+fm_plan_sortby_name_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_plan_file *const file1 = ptr1;
+	const struct fm_plan_file *const file2 = ptr2;
+	const size_t dirlen = ((file1->dirlen < file2->dirlen) ? file1->dirlen : file2->dirlen);
+	const int result = strncmp(file1->name, file2->name, dirlen);
+
+	// By directory first, so that the files of each directory are next to each other
+	if (result != 0)
+		return result;
+
+	if (file1->dirlen < file2->dirlen)
+		return -1;
+
+	if (file1->dirlen > file2->dirlen)
+		return 1;
+
+	return strcmp(file1->name, file2->name);
+}
+
+static int FM_NONNULL(1, 2)
+fm_plan_sortby_excess_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_plan_group *const group1 = ptr1;
+	const struct fm_plan_group *const group2 = ptr2;
+
+	if (group1->excess > group2->excess)
+		return -1;
+
+	if (group1->excess < group2->excess)
+		return 1;
+
+	if (group1->first < group2->first)
+		return -1;
+
+	if (group1->first > group2->first)
+		return 1;
+
+	return 0;
+}
+
+static uint64_t FM_NONNULL(1)
+fm_plan_search(const struct fm_plan_free *const restrict free, const uint64_t len)
+{
+	uint64_t lo = 0U;
+	uint64_t hi = free->count;
+
+	// The first (smallest) free range that is at least len long
+	while (lo < hi)
+	{
+		const uint64_t mid = (lo + ((hi - lo) / 2U));
+
+		if (free->ranges[mid].len < len)
+			lo = (mid + 1U);
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static bool FM_WARN_UNUSED
+fm_plan_record(const uint64_t off, const uint64_t len)
+{
+	if (fm_plan_piececount == fm_plan_piecealloc)
+	{
+		const uint64_t alloc = ((fm_plan_piecealloc) ? (fm_plan_piecealloc * 2U) : 4096U);
+		void *const ptr = realloc(fm_plan_pieces, alloc * sizeof *fm_plan_pieces);
+
+		if (ptr == NULL)
+		{
+			(void) fm_print_message("%s: realloc(3): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+
+		fm_plan_pieces = ptr;
+		fm_plan_piecealloc = alloc;
+	}
+
+	fm_plan_pieces[fm_plan_piececount].off = off;
+	fm_plan_pieces[fm_plan_piececount].len = len;
+	fm_plan_piececount++;
+
+	return true;
+}
+
+static uint64_t FM_WARN_UNUSED
+fm_plan_extents(const uint64_t len)
+{
+	// As fm_score_ideal(); even a single free range holds no more than the longest extent in each extent
+	if (! fm_max_extent_len || len <= fm_max_extent_len)
+		return 1U;
+
+	return ((len / fm_max_extent_len) + (((len % fm_max_extent_len) != 0U) ? 1U : 0U));
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_plan_take(struct fm_plan_free *const restrict free, const uint64_t idx, const uint64_t len)
+{
+	const struct fm_freespace_range range = free->ranges[idx];
+
+	if (! fm_plan_record(range.off, len))
+		// This function prints messages on error
+		return false;
+
+	// Take the range out of the array, and put what is left of it back where it now belongs
+	(void) memmove(&free->ranges[idx], &free->ranges[idx + 1U], (free->count - idx - 1U) * sizeof *free->ranges);
+	free->count--;
+
+	if (range.len > len)
+	{
+		const struct fm_freespace_range rest = { .off = (range.off + len), .len = (range.len - len) };
+		uint64_t at = fm_plan_search(free, rest.len);
+
+		while (at < free->count && free->ranges[at].len == rest.len && free->ranges[at].off < rest.off)
+			at++;
+
+		(void) memmove(&free->ranges[at + 1U], &free->ranges[at], (free->count - at) * sizeof *free->ranges);
+		free->ranges[at] = rest;
+		free->count++;
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_plan_place(struct fm_plan_free *const restrict free, struct fm_plan_file *const restrict file)
+{
+	uint64_t idx = fm_plan_search(free, file->bytes);
+	uint64_t extents = 0U;
+	uint64_t found = 0U;
+
+	file->firstpiece = fm_plan_piececount;
+
+	if (idx < free->count)
+	{
+		file->piececount = 1U;
+		return fm_plan_take(free, idx, file->bytes);
+	}
+
+	// It does not fit anywhere in one piece; how many of the largest free ranges would it take?
+	for (idx = free->count; idx && found < file->bytes && extents < file->inode->extcount; idx--)
+	{
+		const uint64_t len = (((file->bytes - found) < free->ranges[idx - 1U].len) ?
+		                      (file->bytes - found) : free->ranges[idx - 1U].len);
+
+		found += len;
+		extents += fm_plan_extents(len);
+	}
+
+	if (found < file->bytes || extents >= file->inode->extcount)
+		// Not enough free space, or no fewer extents than it has now
+		return true;
+
+	for (found = 0U; found < file->bytes; file->piececount++)
+	{
+		const uint64_t len = (((file->bytes - found) < free->ranges[free->count - 1U].len) ?
+		                      (file->bytes - found) : free->ranges[free->count - 1U].len);
+
+		if (! fm_plan_take(free, (free->count - 1U), len))
+			// This function prints messages on error
+			return false;
+
+		found += len;
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_plan_free_ranges(struct fm_plan_free *const restrict free)
+{
+	const struct fm_freespace_range *ranges = NULL;
+	uint64_t count = 0U;
+
+	(void) fm_freespace_collect(&ranges, &count);
+
+	if ((free->ranges = calloc(count + 1U, sizeof *free->ranges)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		// Only whole blocks can be allocated
+		const uint64_t start = (((ranges[i].off + fm_blksz - 1U) / fm_blksz) * fm_blksz);
+		const uint64_t end = (((ranges[i].off + ranges[i].len) / fm_blksz) * fm_blksz);
+
+		if (start >= end)
+			continue;
+
+		free->ranges[free->count].off = start;
+		free->ranges[free->count].len = (end - start);
+		free->count++;
+	}
+
+	(void) fm_freespace_free();
+
+	qsort(free->ranges, free->count, sizeof *free->ranges, &fm_plan_sortby_len_cb);
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_plan_write(const char *const restrict path, const struct fm_plan_file *const restrict files, const uint64_t count,
+              const uint64_t planned, const uint64_t before, const uint64_t after)
+{
+	const struct fm_plan_file **ordered = NULL;
+	char tmppath[PATH_MAX];
+	FILE *fp;
+
+	if ((ordered = calloc(planned + 1U, sizeof *ordered)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	for (uint64_t i = 0U; i < count; i++)
+		if (files[i].order)
+			ordered[files[i].order - 1U] = &files[i];
+
+	(void) memset(tmppath, 0x00, sizeof tmppath);
+
+	// Write to a temporary file and rename it into place, so that an existing plan is never left half-written
+	(void) snprintf(tmppath, sizeof tmppath, "%s.tmp", path);
+
+	if ((fp = fopen(tmppath, "w")) == NULL)
+	{
+		(void) fm_print_message("%s: while saving '%s': fopen(3): %s\n", argvzero, tmppath, strerror(errno));
+		free(ordered);
+		return false;
+	}
+
+	(void) fprintf(fp, "# filemap defragmentation plan\n");
+	(void) fprintf(fp, "# free-space\tfsmap\n");
+	(void) fprintf(fp, "# block-size\t%" PRIu64 "\n", fm_blksz);
+	(void) fprintf(fp, "# files\t%" PRIu64 "\n", planned);
+	(void) fprintf(fp, "# extents-before\t%" PRIu64 "\n", before);
+	(void) fprintf(fp, "# extents-after\t%" PRIu64 "\n", after);
+	(void) fprintf(fp, "# order\tinode\textents-before\textents-after\tbytes\tplacement\tname\n");
+
+	for (uint64_t i = 0U; i < planned; i++)
+	{
+		const struct fm_plan_file *const file = ordered[i];
+
+		(void) fprintf(fp, "%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t", file->order,
+		               file->inode->inum, file->inode->extcount, file->extents, file->bytes);
+
+		// Each free range taken, as offset+length in bytes, in the order that the file's data goes into them
+		for (uint64_t j = 0U; j < file->piececount; j++)
+			(void) fprintf(fp, "%s%" PRIu64 "+%" PRIu64, ((j) ? "," : ""),
+			               fm_plan_pieces[file->firstpiece + j].off, fm_plan_pieces[file->firstpiece + j].len);
+
+		(void) fprintf(fp, "\t%s\n", file->name);
+	}
+
+	free(ordered);
+
+	if (ferror(fp) || fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+	{
+		(void) fm_print_message("%s: while saving '%s': write: %s\n", argvzero, tmppath, strerror(errno));
+		(void) fclose(fp);
+		(void) unlink(tmppath);
+		return false;
+	}
+	if (fclose(fp) != 0)
+	{
+		(void) fm_print_message("%s: while saving '%s': fclose(3): %s\n", argvzero, tmppath, strerror(errno));
+		(void) unlink(tmppath);
+		return false;
+	}
+	if (rename(tmppath, path) < 0)
+	{
+		(void) fm_print_message("%s: while saving '%s': rename(2): %s\n", argvzero, path, strerror(errno));
+		(void) unlink(tmppath);
+		return false;
+	}
+
+	return true;
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_plan_defrag(const char *const restrict path)
+{
+	struct fm_plan_free free_ranges = { .ranges = NULL, .count = 0U };
+	struct fm_plan_group *groups = NULL;
+	struct fm_plan_file *files = NULL;
+	struct fm_inode *fi;
+	struct fm_inode *itmp;
+	uint64_t groupcount = 0U;
+	uint64_t together = 0U;
+	uint64_t planned = 0U;
+	uint64_t before = 0U;
+	uint64_t after = 0U;
+	uint64_t count = 0U;
+	bool result = false;
+
+	if (! fm_plan_free_ranges(&free_ranges))
+		// This function prints messages on error
+		goto done;
+
+	if ((files = calloc(HASH_COUNT(fm_inodes) + 1U, sizeof *files)) == NULL ||
+	    (groups = calloc(HASH_COUNT(fm_inodes) + 1U, sizeof *groups)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		goto done;
+	}
+
+	HASH_ITER(hh, fm_inodes, fi, itmp)
+	{
+		const struct fm_extent *fe;
+		const char *slash;
+
+		if (! (fi->flags & FM_IFLAGS_FRAGMENTED) || fi->extcount < 2U || fi->names == NULL ||
+		    (fi->sb.st_mode & S_IFMT) != S_IFREG)
+			// Not fragmented, or not something that can be rewritten by rewriting a file
+			continue;
+
+		files[count].inode = fi;
+		files[count].name = fi->names->name;
+
+		slash = strrchr(fi->names->name, '/');
+		files[count].dirlen = ((slash != NULL) ? (size_t) (slash - fi->names->name + 1) : 0U);
+
+		DL_FOREACH(fi->extents, fe)
+			files[count].bytes += fe->len;
+
+		count++;
+	}
+
+	qsort(files, count, sizeof *files, &fm_plan_sortby_name_cb);
+
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		if (! i || files[i].dirlen != files[i - 1U].dirlen ||
+		    strncmp(files[i].name, files[i - 1U].name, files[i].dirlen) != 0)
+		{
+			groups[groupcount].first = i;
+			groupcount++;
+		}
+
+		groups[groupcount - 1U].count++;
+		groups[groupcount - 1U].bytes += files[i].bytes;
+		groups[groupcount - 1U].excess += (files[i].inode->extcount - 1U);
+	}
+
+	qsort(groups, groupcount, sizeof *groups, &fm_plan_sortby_excess_cb);
+
+	for (uint64_t i = 0U; i < groupcount; i++)
+	{
+		const struct fm_plan_group *const group = &groups[i];
+		const uint64_t idx = fm_plan_search(&free_ranges, group->bytes);
+
+		if (group->count > 1U && idx < free_ranges.count)
+		{
+			// The whole directory fits in one free range; its files go into it one after another
+			const uint64_t off = free_ranges.ranges[idx].off;
+			uint64_t used = 0U;
+
+			if (! fm_plan_take(&free_ranges, idx, group->bytes))
+				// This function prints messages on error
+				goto done;
+
+			// Split what was taken back up between the files
+			fm_plan_piececount--;
+
+			for (uint64_t j = group->first; j < (group->first + group->count); j++)
+			{
+				files[j].firstpiece = fm_plan_piececount;
+				files[j].piececount = 1U;
+
+				if (! fm_plan_record((off + used), files[j].bytes))
+					// This function prints messages on error
+					goto done;
+
+				used += files[j].bytes;
+			}
+
+			together++;
+		}
+		else
+		{
+			for (uint64_t j = group->first; j < (group->first + group->count); j++)
+				if (! fm_plan_place(&free_ranges, &files[j]))
+					// This function prints messages on error
+					goto done;
+		}
+
+		for (uint64_t j = group->first; j < (group->first + group->count); j++)
+		{
+			if (! files[j].piececount)
+				continue;
+
+			for (uint64_t k = 0U; k < files[j].piececount; k++)
+				files[j].extents += fm_plan_extents(fm_plan_pieces[files[j].firstpiece + k].len);
+
+			files[j].order = ++planned;
+			before += files[j].inode->extcount;
+			after += files[j].extents;
+		}
+	}
+
+	if (! fm_plan_write(path, files, count, planned, before, after))
+		// This function prints messages on error
+		goto done;
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble)
+	{
+		(void) printf("Free space is from .......... : the filesystem's reverse mapping\n");
+		(void) printf("Fragmented files ............ : %" PRIu64 " in %" PRIu64 " directories\n", count,
+		              groupcount);
+		(void) printf("Files to rewrite ............ : %" PRIu64 " (%" PRIu64 " directories kept together)\n",
+		              planned, together);
+		(void) printf("Files left as they are ...... : %" PRIu64 " (no free space to make them less fragmented)\n",
+		              (count - planned));
+		(void) printf("Extents (before / after) .... : %" PRIu64 " / %" PRIu64 "\n", before, after);
+		(void) printf("Plan written to ............. : %s\n", path);
+	}
+
+	result = true;
+
+done:
+
+	free(fm_plan_pieces);
+
+	fm_plan_pieces = NULL;
+	fm_plan_piececount = 0U;
+	fm_plan_piecealloc = 0U;
+
+	free(free_ranges.ranges);
+	free(groups);
+	free(files);
+
+	return result;
+}
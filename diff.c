@@ -0,0 +1,297 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filemap.h"
+
+/* Everything we need to know about an inode in a saved map to compare it against the other map.
+ * The extents themselves are reduced to a digest of their layout, so that two very large snapshots
+ * can be held in memory at once.
+ */
+struct fm_diff_inode
+{
+	uint64_t            inum;           // Inode number (sort key, after host)
+	uint64_t            host;           // Inode number of the image file it is in; 0 if in the volume
+	uint64_t            extcount;       // Number of data extents in this inode
+	uint64_t            layout;         // FNV-1a digest of the (logical offset, physical offset, length) triples
+	uint64_t            nameoff;        // Offset of the alphabetically-first file name in names below
+	uint32_t            flags;          // Bitfield of FM_IFLAGS_*
+};
+
+struct fm_diff_snapshot
+{
+	struct fm_diff_inode *  inodes;     // Array of structs above; sorted by inode number after loading
+	uint64_t                count;      // Number of entries used in the array above
+	uint64_t                alloc;      // Number of entries allocated in the array above
+	char *                  names;      // One file name per inode, NUL-terminated, back to back
+	uint64_t                namelen;    // Number of bytes used in the buffer above
+	uint64_t                namealloc;  // Number of bytes allocated in the buffer above
+};
+
+struct fm_diff_category
+{
+	uint64_t            inodes;         // Number of inodes in this category
+	uint64_t            old_extents;    // Number of extents they had in the old map
+	uint64_t            new_extents;    // Number of extents they have in the new map
+};
+
+static uint64_t
+fm_diff_digest(uint64_t digest, const uint64_t value)
+{
+	for (unsigned int i = 0U; i < sizeof value; i++)
+	{
+		digest ^= ((value >> (i * 8U)) & 0xFFU);
+		digest *= UINT64_C(0x100000001B3);
+	}
+
+	return digest;
+}
+
+static bool FM_NONNULL(1, 3, 4) FM_WARN_UNUSED
+fm_diff_load_cb(const struct fm_map_record *const restrict rec, const struct fm_map_extent *const restrict mexts,
+                const char *const restrict names, void *const restrict cbarg)
+{
+	struct fm_diff_snapshot *const snap = cbarg;
+	const char *fname = names;
+	struct fm_diff_inode *di;
+	size_t fnamelen;
+
+	// Names are saved in alphabetical order; the first one is sufficient to identify the inode in the report
+	if (! rec->namecount)
+		fname = "";
+
+	fnamelen = (strlen(fname) + 1U);
+
+	if (snap->count == snap->alloc)
+	{
+		const uint64_t alloc = ((snap->alloc) ? (snap->alloc * 2U) : 65536U);
+		void *const ptr = realloc(snap->inodes, alloc * sizeof *snap->inodes);
+
+		if (ptr == NULL)
+		{
+			(void) fm_print_message("%s: while loading map: realloc(3): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+
+		snap->inodes = ptr;
+		snap->alloc = alloc;
+	}
+	while ((snap->namelen + fnamelen) > snap->namealloc)
+	{
+		const uint64_t alloc = ((snap->namealloc) ? (snap->namealloc * 2U) : 1048576U);
+		void *const ptr = realloc(snap->names, alloc);
+
+		if (ptr == NULL)
+		{
+			(void) fm_print_message("%s: while loading map: realloc(3): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+
+		snap->names = ptr;
+		snap->namealloc = alloc;
+	}
+
+	di = &snap->inodes[snap->count++];
+
+	(void) memset(di, 0x00, sizeof *di);
+	(void) memcpy(snap->names + snap->namelen, fname, fnamelen);
+
+	di->inum     = rec->inum;
+	di->host     = rec->host;
+	di->extcount = rec->extcount;
+	di->flags    = rec->flags;
+	di->nameoff  = snap->namelen;
+	di->layout   = UINT64_C(0xCBF29CE484222325);
+
+	for (uint64_t i = 0U; i < rec->extcount; i++)
+	{
+		di->layout = fm_diff_digest(di->layout, mexts[i].loff);
+		di->layout = fm_diff_digest(di->layout, mexts[i].off);
+		di->layout = fm_diff_digest(di->layout, mexts[i].len);
+	}
+
+	snap->namelen += fnamelen;
+
+	return true;
+}
+
+static int FM_NONNULL(1, 2)
+fm_diff_sortby_inum_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_diff_inode *const in1 = ptr1;
+	const struct fm_diff_inode *const in2 = ptr2;
+
+	if (in1->host < in2->host)
+		return -1;
+
+	if (in1->host > in2->host)
+		return 1;
+
+	if (in1->inum < in2->inum)
+		return -1;
+
+	if (in1->inum > in2->inum)
+		return 1;
+
+	return 0;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_diff_load(const char *const restrict path, struct fm_diff_snapshot *const restrict snap)
+{
+	struct fm_map_header hdr;
+
+	if (! fm_load_map(path, &hdr, &fm_diff_load_cb, snap))
+		// This function prints messages on error
+		return false;
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: sorting %s ...", argvzero, path);
+
+	qsort(snap->inodes, snap->count, sizeof *snap->inodes, &fm_diff_sortby_inum_cb);
+
+	return true;
+}
+
+static void FM_NONNULL(2, 3)
+fm_diff_print(const char which, const struct fm_diff_snapshot *const restrict snap,
+              const struct fm_diff_inode *const restrict di, const uint64_t old_extents, const uint64_t new_extents)
+{
+	(void) printf("%6c %20s %12" PRIu64 " %12" PRIu64 "    %s\n",
+	              which, fm_inode_number(di->inum, di->host), old_extents, new_extents, snap->names + di->nameoff);
+}
+
+static void FM_NONNULL(2)
+fm_diff_print_total(const char *const restrict label, const struct fm_diff_category *const restrict cat)
+{
+	(void) printf("%s : %" PRIu64 " inodes; %" PRIu64 " -> %" PRIu64 " extents\n",
+	              label, cat->inodes, cat->old_extents, cat->new_extents);
+}
+
+bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_diff_snapshots(const char *const restrict oldpath, const char *const restrict newpath)
+{
+	struct fm_diff_snapshot oldsnap;
+	struct fm_diff_snapshot newsnap;
+	struct fm_diff_category added;
+	struct fm_diff_category removed;
+	struct fm_diff_category moved;
+	struct fm_diff_category refragged;
+	uint64_t unchanged = 0U;
+	uint64_t i = 0U;
+	uint64_t j = 0U;
+	bool result = false;
+
+	(void) memset(&oldsnap, 0x00, sizeof oldsnap);
+	(void) memset(&newsnap, 0x00, sizeof newsnap);
+	(void) memset(&added, 0x00, sizeof added);
+	(void) memset(&removed, 0x00, sizeof removed);
+	(void) memset(&moved, 0x00, sizeof moved);
+	(void) memset(&refragged, 0x00, sizeof refragged);
+
+	if (! fm_diff_load(oldpath, &oldsnap) || ! fm_diff_load(newpath, &newsnap))
+		// This function prints messages on error
+		goto done;
+
+	(void) fm_print_message("");
+
+	if (! fm_skip_preamble)
+	{
+		(void) printf("%6s %20s %12s %12s    %s\n", "Change", "Inode Number", "Old Extents", "New Extents",
+		              "File Name");
+
+		(void) printf("------ -------------------- ------------ ------------    ---------\n\n");
+	}
+
+	// Both arrays are sorted by inode number; walk them together in a single pass
+	while (i < oldsnap.count || j < newsnap.count)
+	{
+		const struct fm_diff_inode *const oi = ((i < oldsnap.count) ? &oldsnap.inodes[i] : NULL);
+		const struct fm_diff_inode *const ni = ((j < newsnap.count) ? &newsnap.inodes[j] : NULL);
+
+		if (ni == NULL || (oi != NULL && fm_diff_sortby_inum_cb(oi, ni) < 0))
+		{
+			(void) fm_diff_print('-', &oldsnap, oi, oi->extcount, 0U);
+
+			removed.inodes++;
+			removed.old_extents += oi->extcount;
+			i++;
+			continue;
+		}
+		if (oi == NULL || fm_diff_sortby_inum_cb(ni, oi) < 0)
+		{
+			(void) fm_diff_print('+', &newsnap, ni, 0U, ni->extcount);
+
+			added.inodes++;
+			added.new_extents += ni->extcount;
+			j++;
+			continue;
+		}
+
+		i++;
+		j++;
+
+		if (oi->extcount == ni->extcount && oi->layout == ni->layout)
+		{
+			unchanged++;
+			continue;
+		}
+
+		const uint32_t fragflags = (FM_IFLAGS_FRAGMENTED | FM_IFLAGS_UNORDERED);
+		const uint32_t newflags = ((ni->flags & ~oi->flags) & fragflags);
+
+		if (ni->extcount > oi->extcount || newflags)
+		{
+			// Gained extents, or its extents are no longer contiguous and/or in order
+			(void) fm_diff_print('F', &newsnap, ni, oi->extcount, ni->extcount);
+
+			refragged.inodes++;
+			refragged.old_extents += oi->extcount;
+			refragged.new_extents += ni->extcount;
+		}
+		else
+		{
+			// Same or fewer extents, but they are somewhere else now
+			(void) fm_diff_print('M', &newsnap, ni, oi->extcount, ni->extcount);
+
+			moved.inodes++;
+			moved.old_extents += oi->extcount;
+			moved.new_extents += ni->extcount;
+		}
+	}
+
+	if (! fm_skip_preamble)
+	{
+		(void) printf("\n");
+		(void) fm_diff_print_total("Added (+) ...................", &added);
+		(void) fm_diff_print_total("Removed (-) .................", &removed);
+		(void) fm_diff_print_total("Moved (M) ...................", &moved);
+		(void) fm_diff_print_total("Refragmented (F) ............", &refragged);
+		(void) printf("Unchanged ................... : %" PRIu64 " inodes\n", unchanged);
+	}
+
+	(void) fflush(stdout);
+
+	result = true;
+
+done:
+
+	free(oldsnap.inodes);
+	free(oldsnap.names);
+	free(newsnap.inodes);
+	free(newsnap.names);
+
+	return result;
+}
@@ -26,20 +26,38 @@ bool FM_NONNULL(2, 3) FM_WARN_UNUSED
 fm_scan_directory(const int fd, const struct stat *const restrict sb, const char *const restrict abspath)
 {
 	DIR *dp;
+	bool walked = true;
+
+	if (fm_checkpoint_skip_dir(abspath))
+	{
+		// Completely scanned before the scan was interrupted; everything in it was restored from the checkpoint
+		(void) close(fd);
+		return true;
+	}
 
 	if (! fm_run_quietly)
 		(void) fm_print_message("%s: scanning %s ...", argvzero, abspath);
 
+	if (fm_watch_mode)
+		// Start watching before reading the directory, so that nothing changed during the scan is missed
+		(void) fm_watch_directory(abspath);
+
 	if (fm_sync_files && fsync(fd) < 0)
 	{
-		(void) fm_print_message("%s: while scanning '%s': fsync(2): %s\n",
-		                        argvzero, abspath, strerror(errno));
-		return false;
+		(void) fm_scan_failed(abspath, "fsync(2)", errno);
+		(void) close(fd);
+		return fm_keep_going;
 	}
 	if ((dp = fdopendir(fd)) == NULL)
 	{
-		(void) fm_print_message("%s: while scanning '%s': fdopendir(3): %s\n",
-		                        argvzero, abspath, strerror(errno));
+		(void) fm_scan_failed(abspath, "fdopendir(3)", errno);
+		(void) close(fd);
+		return fm_keep_going;
+	}
+	if (fm_rollup_top && ! fm_rollup_enter(abspath))
+	{
+		// This function records the failure
+		(void) closedir(dp);
 		return false;
 	}
 
@@ -61,9 +79,17 @@ fm_scan_directory(const int fd, const struct stat *const restrict sb, const char
 				// End of directory entries
 				break;
 
-			(void) fm_print_message("%s: while walking '%s': readdir(3): %s\n",
-			                        argvzero, abspath, strerror(errno));
-			return false;
+			(void) fm_scan_failed(abspath, "readdir(3)", errno);
+
+			if (! fm_keep_going)
+			{
+				(void) closedir(dp);
+				return false;
+			}
+
+			// The rest of this directory cannot be walked; keep what was found in it so far
+			walked = false;
+			break;
 		}
 
 		if (strcmp(ede->d_name, ".") == 0 || strcmp(ede->d_name, "..") == 0)
@@ -79,9 +105,15 @@ fm_scan_directory(const int fd, const struct stat *const restrict sb, const char
 
 		if (fstatat(fd, ede->d_name, &esb, AT_SYMLINK_NOFOLLOW) < 0)
 		{
-			(void) fm_print_message("%s: while scanning '%s': fstatat(2): %s\n",
-			                        argvzero, entpath, strerror(errno));
-			return false;
+			(void) fm_scan_failed(entpath, "fstatat(2)", errno);
+
+			if (! fm_keep_going)
+			{
+				(void) closedir(dp);
+				return false;
+			}
+
+			continue;
 		}
 
 		if (esb.st_dev != sb->st_dev)
@@ -92,19 +124,56 @@ fm_scan_directory(const int fd, const struct stat *const restrict sb, const char
 			// Not a file or directory
 			continue;
 
+		if ((esb.st_mode & S_IFMT) == S_IFDIR && fm_checkpoint_skip_dir(entpath))
+			// Completely scanned before the scan was interrupted; no need to even open it
+			continue;
+
+		if ((esb.st_mode & S_IFMT) == S_IFREG)
+		{
+			/* If this inode has already been mapped (hardlinks) or its extents are in the scan cache
+			 * and it has not changed since, there is no need to open it
+			 */
+			const enum fm_cache_result cres = fm_scan_cached(&esb, 0U, entpath);
+
+			if (cres == FM_CACHE_ERROR && ! fm_keep_going)
+			{
+				// This function records the failure
+				(void) closedir(dp);
+				return false;
+			}
+			if (cres == FM_CACHE_ERROR)
+				continue;
+
+			if (cres == FM_CACHE_HIT)
+				continue;
+		}
+
 		(void) memset(&esb, 0x00, sizeof esb);
 
 		if ((efd = openat(fd, ede->d_name, O_NOCTTY | O_RDONLY | O_NOFOLLOW, 0)) < 0)
 		{
-			(void) fm_print_message("%s: while scanning '%s': openat(2): %s\n",
-			                        argvzero, entpath, strerror(errno));
-			return false;
+			(void) fm_scan_failed(entpath, "openat(2)", errno);
+
+			if (! fm_keep_going)
+			{
+				(void) closedir(dp);
+				return false;
+			}
+
+			continue;
 		}
 		if (fstat(efd, &esb) < 0)
 		{
-			(void) fm_print_message("%s: while scanning '%s': fstat(2): %s\n",
-			                        argvzero, entpath, strerror(errno));
-			return false;
+			(void) fm_scan_failed(entpath, "fstat(2)", errno);
+			(void) close(efd);
+
+			if (! fm_keep_going)
+			{
+				(void) closedir(dp);
+				return false;
+			}
+
+			continue;
 		}
 		if (esb.st_dev != sb->st_dev)
 		{
@@ -115,8 +184,11 @@ fm_scan_directory(const int fd, const struct stat *const restrict sb, const char
 		if ((esb.st_mode & S_IFMT) == S_IFDIR)
 		{
 			if (! fm_scan_directory(efd, &esb, entpath))
-				// This function prints messages on error
+			{
+				// This function records the failure
+				(void) closedir(dp);
 				return false;
+			}
 
 			// The function called above will close the fd
 			continue;
@@ -124,8 +196,11 @@ fm_scan_directory(const int fd, const struct stat *const restrict sb, const char
 		if ((esb.st_mode & S_IFMT) == S_IFREG)
 		{
 			if (! fm_scan_extents(efd, &esb, entpath))
-				// This function prints messages on error
+			{
+				// This function records the failure
+				(void) closedir(dp);
 				return false;
+			}
 
 			// The function called above will close the fd
 			continue;
@@ -137,13 +212,41 @@ fm_scan_directory(const int fd, const struct stat *const restrict sb, const char
 
 	if (fm_scan_directories)
 	{
-		if (! fm_scan_extents(fd, sb, abspath))
-			// This function prints messages on error
+		// The directory itself is mapped through a duplicate of the fd, which the function called below closes
+		const int dfd = dup(fd);
+
+		if (dfd < 0)
+		{
+			(void) fm_scan_failed(abspath, "dup(2)", errno);
+
+			if (! fm_keep_going)
+			{
+				(void) closedir(dp);
+				return false;
+			}
+		}
+		else if (! fm_scan_extents(dfd, sb, abspath))
+		{
+			// This function records the failure
+			(void) closedir(dp);
 			return false;
+		}
+	}
+
+	if (fm_rollup_top && ! fm_rollup_leave())
+	{
+		// This function records the failure
+		(void) closedir(dp);
+		return false;
 	}
 
 	// This will also close the fd
 	(void) closedir(dp);
 
-	return true;
+	if (! walked)
+		// Not done; a scan resumed from a checkpoint must walk it again to find the rest of it
+		return true;
+
+	// This function prints messages on error
+	return fm_checkpoint_done_dir(abspath);
 }
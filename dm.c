@@ -0,0 +1,913 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <linux/dm-ioctl.h>
+#include <linux/fiemap.h>
+
+#include "filemap.h"
+
+/* Translating offsets in a device-mapper device to offsets on the disk underneath it (see --dm-table and
+ * --dm-live)
+ *
+ * When the volume is a device-mapper device (e.g. an LVM logical volume), FIEMAP reports offsets in that
+ * device, not on the disk that the data is actually on. The device's table is a list of segments, each of
+ * which maps a range of the device onto one or more underlying devices: a linear (or crypt) segment onto one
+ * device at an offset, and a striped segment onto several, in turns of one chunk each. The table is given as
+ * the output of 'dmsetup table', or is read from the kernel (which is the only place it can be read from; sysfs
+ * only names the device and its underlying devices).
+ *
+ * Every extent is split wherever it crosses from one segment (or stripe chunk) to the next, and each piece is
+ * moved to where it is on its underlying device. Only the pieces on one underlying device are kept, so that the
+ * offsets of everything that remains are comparable; pieces that follow each other there are joined again. For a
+ * table that maps onto more than one device (a striped segment, or segments on several physical volumes), which
+ * one must be given with --dm-device, as the rest of the data would silently go missing otherwise. If
+ * sysfs says that the device is a partition, the start of the partition is added, so that offsets are on the
+ * whole disk.
+ */
+
+#define FM_DM_SECTOR_SIZE               UINT64_C(512)
+#define FM_DM_IOCTL_BUFSZ               16384U
+#define FM_DM_CONTROL_PATH              "/dev/" DM_DIR "/" DM_CONTROL_NODE
+
+struct fm_dm_target
+{
+	dev_t                       dev;        // The underlying device
+	uint64_t                    off;        // Where the segment (or its stripe) begins on it (in bytes)
+};
+
+struct fm_dm_segment
+{
+	uint64_t                    start;      // Where the segment begins in the device-mapper device (in bytes)
+	uint64_t                    len;        // Length of the segment (in bytes)
+	uint64_t                    chunk;      // Length of a stripe chunk (in bytes; 0 for a linear segment)
+	uint64_t                    first;      // Index of its first target in fm_dm_targets below
+	uint64_t                    count;      // Number of targets (stripes); 0 for an unsupported target type
+	char                        type[DM_MAX_TYPE_NAME];     // Target type (e.g. "linear")
+};
+
+struct fm_dm_inode
+{
+	struct fm_inode *           inode;      // The inode
+	struct fm_map_extent *      extents;    // Its translated extents (in logical order)
+	uint64_t                    count;      // Number of entries in the array above
+	uint64_t                    alloc;      // Number of entries allocated
+	uint32_t                    keep;       // Inode flags that do not depend on its extents
+};
+
+static struct fm_dm_segment *fm_dm_segments = NULL;
+static uint64_t fm_dm_segcount = 0U;
+static uint64_t fm_dm_segalloc = 0U;
+static struct fm_dm_target *fm_dm_targets = NULL;
+static uint64_t fm_dm_tgtcount = 0U;
+static uint64_t fm_dm_tgtalloc = 0U;
+
+static dev_t fm_dm_selected = 0U;               // The underlying device whose extents are kept
+static uint64_t fm_dm_partstart = 0U;           // Where it begins on its disk, if it is a partition (in bytes)
+static uint64_t fm_dm_disksize = 0U;            // Size of its disk (in bytes; 0 if not known)
+static char fm_dm_description[PATH_MAX];        // What it is, for the preamble
+
+bool FM_WARN_UNUSED
+fm_dm_requested(void)
+{
+	return (fm_dm_table_path != NULL || fm_dm_live);
+}
+
+const char * FM_RETURNS_NONNULL FM_WARN_UNUSED
+fm_dm_describe(void)
+{
+	return fm_dm_description;
+}
+
+uint64_t FM_WARN_UNUSED
+fm_dm_disk_size(void)
+{
+	return fm_dm_disksize;
+}
+
+static bool FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_dm_sysfs_read(const dev_t dev, const char *const restrict attr, char *const restrict buf, const size_t bufsz)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	(void) memset(path, 0x00, sizeof path);
+	(void) memset(buf, 0x00, bufsz);
+	(void) snprintf(path, sizeof path, "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), attr);
+
+	if ((fd = open(path, O_NOCTTY | O_RDONLY, 0)) < 0)
+		return false;
+
+	len = read(fd, buf, (bufsz - 1U));
+
+	(void) close(fd);
+
+	if (len <= 0)
+		return false;
+
+	while (len && isspace((unsigned char) buf[len - 1]))
+		buf[--len] = 0x00;
+
+	return (len > 0);
+}
+
+static bool FM_NONNULL(2) FM_WARN_UNUSED
+fm_dm_sysfs_number(const dev_t dev, const char *const restrict attr, uint64_t *const restrict value)
+{
+	char buf[64U];
+	char *end = NULL;
+
+	if (! fm_dm_sysfs_read(dev, attr, buf, sizeof buf))
+		return false;
+
+	errno = 0;
+
+	const unsigned long long num = strtoull(buf, &end, 10);
+
+	if (errno != 0 || end == buf || *end != 0x00 || num > (UINT64_MAX / FM_DM_SECTOR_SIZE))
+		return false;
+
+	*value = (uint64_t) num;
+	return true;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_dm_parse_number(const char *const restrict arg, uint64_t *const restrict result)
+{
+	char *end = NULL;
+
+	if (! isdigit((unsigned char) *arg))
+		return false;
+
+	errno = 0;
+
+	const unsigned long long value = strtoull(arg, &end, 10);
+
+	if (errno != 0 || end == arg || *end != 0x00)
+		return false;
+
+	*result = (uint64_t) value;
+	return true;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_dm_parse_device(const char *const restrict arg, dev_t *const restrict dev)
+{
+	const char *const colon = strchr(arg, ':');
+	struct stat sb;
+
+	if (colon != NULL && isdigit((unsigned char) arg[0]) && isdigit((unsigned char) colon[1]))
+	{
+		char *end = NULL;
+
+		errno = 0;
+
+		const unsigned long maj = strtoul(arg, &end, 10);
+
+		if (errno != 0 || end != colon || maj > UINT_MAX)
+			return false;
+
+		const unsigned long min = strtoul(colon + 1, &end, 10);
+
+		if (errno != 0 || *end != 0x00 || min > UINT_MAX)
+			return false;
+
+		*dev = makedev((unsigned int) maj, (unsigned int) min);
+		return true;
+	}
+
+	// Tables can also name devices by path
+	if (stat(arg, &sb) < 0 || (sb.st_mode & S_IFMT) != S_IFBLK)
+		return false;
+
+	*dev = sb.st_rdev;
+	return true;
+}
+
+static bool FM_NONNULL(1, 4, 5) FM_WARN_UNUSED
+fm_dm_add_segment(const char *const restrict where, const uint64_t start, const uint64_t len,
+                  const char *const restrict type, char *const restrict params)
+{
+	const uint64_t prevend = ((fm_dm_segcount) ? (fm_dm_segments[fm_dm_segcount - 1U].start +
+	                          fm_dm_segments[fm_dm_segcount - 1U].len) : 0U);
+	struct fm_dm_segment *segment;
+	char *args[2U] = { NULL, NULL };
+	char *save = NULL;
+	char *tok;
+	uint64_t stripes = 0U;
+	uint64_t chunk = 0U;
+	uint64_t skip = 0U;
+
+	if (start > (UINT64_MAX / FM_DM_SECTOR_SIZE) || len > (UINT64_MAX / FM_DM_SECTOR_SIZE) ||
+	    (start * FM_DM_SECTOR_SIZE) != prevend || ! len)
+	{
+		(void) fm_print_message("%s: while reading the device-mapper table %s: segments are not contiguous\n",
+		                        argvzero, where);
+		return false;
+	}
+	if (fm_dm_segcount == fm_dm_segalloc)
+	{
+		const uint64_t alloc = ((fm_dm_segalloc) ? (fm_dm_segalloc * 2U) : 64U);
+		void *const ptr = realloc(fm_dm_segments, alloc * sizeof *fm_dm_segments);
+
+		if (ptr == NULL)
+		{
+			(void) fm_print_message("%s: realloc(3): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+
+		fm_dm_segments = ptr;
+		fm_dm_segalloc = alloc;
+	}
+
+	segment = &fm_dm_segments[fm_dm_segcount];
+
+	(void) memset(segment, 0x00, sizeof *segment);
+	(void) snprintf(segment->type, sizeof segment->type, "%s", type);
+
+	segment->start = (start * FM_DM_SECTOR_SIZE);
+	segment->len = (len * FM_DM_SECTOR_SIZE);
+	segment->first = fm_dm_tgtcount;
+
+	if (strcmp(type, "linear") == 0)
+		stripes = 1U;
+	else if (strcmp(type, "crypt") == 0)
+	{
+		// <cipher> <key> <iv offset> <device> <offset> [...]; the data is where it would be if it were linear
+		stripes = 1U;
+		skip = 3U;
+	}
+	else if (strcmp(type, "striped") == 0)
+	{
+		// <stripes> <chunk size> <device> <offset> [<device> <offset> ...]
+		for (uint64_t i = 0U; i < 2U && (tok = strtok_r(((i) ? NULL : params), " \t", &save)) != NULL; i++)
+			args[i] = tok;
+
+		if (args[1] == NULL || ! fm_dm_parse_number(args[0], &stripes) || ! stripes || stripes > UINT16_MAX ||
+		    ! fm_dm_parse_number(args[1], &chunk) || ! chunk || chunk > (UINT64_MAX / FM_DM_SECTOR_SIZE))
+		{
+			(void) fm_print_message("%s: while reading the device-mapper table %s: invalid striped target\n",
+			                        argvzero, where);
+			return false;
+		}
+
+		chunk *= FM_DM_SECTOR_SIZE;
+	}
+	else
+	{
+		// Kept, so that the table is complete; an extent in it is an error (see fm_dm_translate_extent())
+		fm_dm_segcount++;
+		return true;
+	}
+
+	for (uint64_t i = 0U; i < skip && (tok = strtok_r(((save == NULL) ? params : NULL), " \t", &save)) != NULL; i++)
+		continue;
+
+	for (uint64_t i = 0U; i < stripes; i++)
+	{
+		struct fm_dm_target *target;
+		uint64_t off = 0U;
+
+		args[0] = strtok_r(((save == NULL) ? params : NULL), " \t", &save);
+		args[1] = ((args[0] != NULL) ? strtok_r(NULL, " \t", &save) : NULL);
+
+		if (fm_dm_tgtcount == fm_dm_tgtalloc)
+		{
+			const uint64_t alloc = ((fm_dm_tgtalloc) ? (fm_dm_tgtalloc * 2U) : 64U);
+			void *const ptr = realloc(fm_dm_targets, alloc * sizeof *fm_dm_targets);
+
+			if (ptr == NULL)
+			{
+				(void) fm_print_message("%s: realloc(3): %s\n", argvzero, strerror(errno));
+				return false;
+			}
+
+			fm_dm_targets = ptr;
+			fm_dm_tgtalloc = alloc;
+		}
+
+		target = &fm_dm_targets[fm_dm_tgtcount];
+
+		if (args[1] == NULL || ! fm_dm_parse_device(args[0], &target->dev) || ! fm_dm_parse_number(args[1], &off) ||
+		    off > (UINT64_MAX / FM_DM_SECTOR_SIZE))
+		{
+			(void) fm_print_message("%s: while reading the device-mapper table %s: invalid %s target\n",
+			                        argvzero, where, type);
+			return false;
+		}
+
+		target->off = (off * FM_DM_SECTOR_SIZE);
+		fm_dm_tgtcount++;
+	}
+
+	segment->chunk = chunk;
+	segment->count = stripes;
+	fm_dm_segcount++;
+
+	return true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_dm_parse_line(const char *const restrict where, char *const restrict line)
+{
+	char *fields[3U] = { NULL, NULL, NULL };
+	char *save = NULL;
+	uint64_t start = 0U;
+	uint64_t len = 0U;
+
+	// <start> <length> <target type> <arguments>, in 512-byte sectors
+	for (size_t i = 0U; i < 3U; i++)
+		if ((fields[i] = strtok_r(((i) ? NULL : line), " \t", &save)) == NULL)
+			break;
+
+	if (fields[2] == NULL || ! fm_dm_parse_number(fields[0], &start) || ! fm_dm_parse_number(fields[1], &len))
+	{
+		(void) fm_print_message("%s: while reading the device-mapper table %s: invalid segment\n",
+		                        argvzero, where);
+		return false;
+	}
+
+	return fm_dm_add_segment(where, start, len, fields[2], ((save != NULL) ? save : ""));
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_dm_read_file(const char *const restrict path, const char *const dmname)
+{
+	char line[BUFSIZ];
+	char name[BUFSIZ];
+	uint64_t lineno = 0U;
+	bool found = false;
+	FILE *fp;
+
+	(void) memset(name, 0x00, sizeof name);
+
+	if ((fp = fopen(path, "r")) == NULL)
+	{
+		(void) fm_print_message("%s: while reading the device-mapper table '%s': fopen(3): %s\n",
+		                        argvzero, path, strerror(errno));
+		return false;
+	}
+	while (fgets(line, sizeof line, fp) != NULL)
+	{
+		char where[PATH_MAX + 64U];
+		size_t len = strlen(line);
+		char *ptr = line;
+		char *colon;
+
+		lineno++;
+
+		(void) memset(where, 0x00, sizeof where);
+		(void) snprintf(where, sizeof where, "'%s': line %" PRIu64, path, lineno);
+
+		if (len && line[len - 1U] != '\n' && ! feof(fp))
+		{
+			(void) fm_print_message("%s: while reading the device-mapper table %s: line too long\n",
+			                        argvzero, where);
+			goto fail;
+		}
+		while (len && isspace((unsigned char) line[len - 1U]))
+			line[--len] = 0x00;
+
+		while (isspace((unsigned char) *ptr))
+			ptr++;
+
+		if (! *ptr || *ptr == '#')
+			// Blank line or comment
+			continue;
+
+		// 'dmsetup table' prefixes each line with "<name>: " when it lists more than one device
+		if ((colon = strchr(ptr, ':')) != NULL && colon[1] != 0x00 && isspace((unsigned char) colon[1]))
+		{
+			*colon = 0x00;
+
+			if (name[0] && strcmp(name, ptr) != 0 && dmname == NULL)
+			{
+				(void) fm_print_message("%s: while reading the device-mapper table '%s': it has more than one "
+				                        "device in it, and sysfs does not say which one the volume is\n",
+				                        argvzero, path);
+				goto fail;
+			}
+
+			(void) snprintf(name, sizeof name, "%s", ptr);
+
+			for (ptr = (colon + 1); isspace((unsigned char) *ptr); ptr++)
+				continue;
+
+			if (dmname != NULL && strcmp(name, dmname) != 0)
+				// Another device's table
+				continue;
+		}
+		if (! fm_dm_parse_line(where, ptr))
+			// This function prints messages on error
+			goto fail;
+
+		found = true;
+	}
+	if (ferror(fp))
+	{
+		(void) fm_print_message("%s: while reading the device-mapper table '%s': fgets(3): %s\n",
+		                        argvzero, path, strerror(errno));
+		goto fail;
+	}
+	if (! found)
+	{
+		if (dmname != NULL)
+			(void) fm_print_message("%s: while reading the device-mapper table '%s': there is no table for "
+			                        "'%s' in it\n", argvzero, path, dmname);
+		else
+			(void) fm_print_message("%s: while reading the device-mapper table '%s': there are no segments "
+			                        "in it\n", argvzero, path);
+		goto fail;
+	}
+
+	(void) fclose(fp);
+	return true;
+
+fail:
+
+	(void) fclose(fp);
+	return false;
+}
+
+static bool FM_WARN_UNUSED
+fm_dm_read_kernel(const dev_t dev)
+{
+	struct dm_ioctl *dmi = NULL;
+	size_t bufsz = FM_DM_IOCTL_BUFSZ;
+	char where[64U];
+	bool result = false;
+	int fd;
+
+	(void) memset(where, 0x00, sizeof where);
+	(void) snprintf(where, sizeof where, "of %u:%u", major(dev), minor(dev));
+
+	if ((fd = open(FM_DM_CONTROL_PATH, O_NOCTTY | O_RDWR, 0)) < 0)
+	{
+		(void) fm_print_message("%s: while reading the device-mapper table %s: open(2) '%s': %s\n",
+		                        argvzero, where, FM_DM_CONTROL_PATH, strerror(errno));
+		return false;
+	}
+	for (;;)
+	{
+		if ((dmi = calloc(1U, bufsz)) == NULL)
+		{
+			(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+			goto done;
+		}
+
+		dmi->version[0] = DM_VERSION_MAJOR;
+		dmi->data_size = (uint32_t) bufsz;
+		dmi->data_start = (uint32_t) sizeof *dmi;
+		dmi->flags = DM_STATUS_TABLE_FLAG;
+		dmi->dev = (uint64_t) dev;
+
+		if (ioctl(fd, DM_TABLE_STATUS, dmi) < 0)
+		{
+			(void) fm_print_message("%s: while reading the device-mapper table %s: ioctl(2) DM_TABLE_STATUS: "
+			                        "%s\n", argvzero, where, strerror(errno));
+			goto done;
+		}
+		if (! (dmi->flags & DM_BUFFER_FULL_FLAG))
+			break;
+
+		// Try again with room for a larger table
+		free(dmi);
+		dmi = NULL;
+
+		if (bufsz > (UINT32_MAX / 2U))
+		{
+			(void) fm_print_message("%s: while reading the device-mapper table %s: it is too large\n",
+			                        argvzero, where);
+			goto done;
+		}
+
+		bufsz *= 2U;
+	}
+
+	char *const data = (((char *) dmi) + dmi->data_start);
+	const size_t datasz = ((dmi->data_size > dmi->data_start) ? (dmi->data_size - dmi->data_start) : 0U);
+	size_t next = 0U;
+
+	if (! dmi->target_count)
+	{
+		(void) fm_print_message("%s: while reading the device-mapper table %s: the device has no table loaded\n",
+		                        argvzero, where);
+		goto done;
+	}
+	for (uint32_t i = 0U; i < dmi->target_count; i++)
+	{
+		struct dm_target_spec spec;
+		char type[DM_MAX_TYPE_NAME + 1U];
+		char *params;
+
+		if (next > datasz || (datasz - next) <= sizeof spec)
+		{
+			(void) fm_print_message("%s: while reading the device-mapper table %s: truncated table\n",
+			                        argvzero, where);
+			goto done;
+		}
+
+		// Offsets of the targets are from the start of the first one
+		(void) memcpy(&spec, (data + next), sizeof spec);
+		(void) memset(type, 0x00, sizeof type);
+		(void) memcpy(type, spec.target_type, sizeof spec.target_type);
+
+		params = (data + next + sizeof spec);
+
+		if (memchr(params, 0x00, (datasz - next - sizeof spec)) == NULL)
+		{
+			(void) fm_print_message("%s: while reading the device-mapper table %s: truncated table\n",
+			                        argvzero, where);
+			goto done;
+		}
+		if (! fm_dm_add_segment(where, spec.sector_start, spec.length, type, params))
+			// This function prints messages on error
+			goto done;
+
+		next = spec.next;
+	}
+
+	result = true;
+
+done:
+
+	(void) close(fd);
+	free(dmi);
+
+	return result;
+}
+
+static void
+fm_dm_describe_selected(void)
+{
+	char link[PATH_MAX];
+	char path[PATH_MAX];
+	uint64_t sectors = 0U;
+	uint64_t start = 0U;
+	char *name = NULL;
+	char *disk = NULL;
+	ssize_t len;
+
+	(void) memset(link, 0x00, sizeof link);
+	(void) memset(path, 0x00, sizeof path);
+	(void) snprintf(path, sizeof path, "/sys/dev/block/%u:%u", major(fm_dm_selected), minor(fm_dm_selected));
+	(void) snprintf(fm_dm_description, sizeof fm_dm_description, "%u:%u", major(fm_dm_selected),
+	                minor(fm_dm_selected));
+
+	// e.g. "../../devices/pci0000:00/.../block/sda/sda2"
+	if ((len = readlink(path, link, (sizeof link - 1U))) <= 0)
+		// Not on this system (or no sysfs); offsets are on the device, whatever it is
+		return;
+
+	link[len] = 0x00;
+
+	if ((name = strrchr(link, '/')) == NULL)
+		return;
+
+	*name++ = 0x00;
+
+	if (fm_dm_sysfs_read(fm_dm_selected, "partition", path, sizeof path) &&
+	    fm_dm_sysfs_number(fm_dm_selected, "start", &start) && (disk = strrchr(link, '/')) != NULL)
+	{
+		fm_dm_partstart = (start * FM_DM_SECTOR_SIZE);
+
+		if (fm_dm_sysfs_number(fm_dm_selected, "../size", &sectors))
+			fm_dm_disksize = (sectors * FM_DM_SECTOR_SIZE);
+
+		(void) snprintf(fm_dm_description, sizeof fm_dm_description, "%s (%u:%u), %" PRIu64 " bytes into %s",
+		                name, major(fm_dm_selected), minor(fm_dm_selected), fm_dm_partstart, (disk + 1));
+		return;
+	}
+
+	if (fm_dm_sysfs_number(fm_dm_selected, "size", &sectors))
+		fm_dm_disksize = (sectors * FM_DM_SECTOR_SIZE);
+
+	(void) snprintf(fm_dm_description, sizeof fm_dm_description, "%s (%u:%u)", name, major(fm_dm_selected),
+	                minor(fm_dm_selected));
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_dm_load(const struct stat *const restrict sb)
+{
+	// The volume that <path> is on; or, for --ext4-image of a block device, that device itself
+	const dev_t dev = (((sb->st_mode & S_IFMT) == S_IFBLK) ? sb->st_rdev : sb->st_dev);
+	char dmname[BUFSIZ];
+	uint64_t devices = 0U;
+	bool named;
+
+	named = fm_dm_sysfs_read(dev, "dm/name", dmname, sizeof dmname);
+
+	if (fm_dm_live && ! fm_dm_read_kernel(dev))
+		// This function prints messages on error
+		return false;
+
+	if (fm_dm_table_path != NULL && ! fm_dm_read_file(fm_dm_table_path, ((named) ? dmname : NULL)))
+		// This function prints messages on error
+		return false;
+
+	for (uint64_t i = 0U; i < fm_dm_tgtcount; i++)
+	{
+		uint64_t j = 0U;
+
+		while (j < i && fm_dm_targets[j].dev != fm_dm_targets[i].dev)
+			j++;
+
+		if (j == i)
+			// Not seen before
+			devices++;
+	}
+
+	if (fm_dm_device != NULL)
+	{
+		bool found = false;
+
+		if (! fm_dm_parse_device(fm_dm_device, &fm_dm_selected))
+		{
+			(void) fm_print_message("%s: --dm-device '%s': not a block device or <major>:<minor>\n",
+			                        argvzero, fm_dm_device);
+			return false;
+		}
+		for (uint64_t i = 0U; i < fm_dm_tgtcount && ! found; i++)
+			found = (fm_dm_targets[i].dev == fm_dm_selected);
+
+		if (! found)
+		{
+			(void) fm_print_message("%s: --dm-device '%s': not in the device-mapper table\n",
+			                        argvzero, fm_dm_device);
+			return false;
+		}
+	}
+	else if (devices > 1U)
+	{
+		(void) fm_print_message("%s: the device-mapper table maps onto %" PRIu64 " devices (striped, or on "
+		                        "several physical volumes); give --dm-device to choose the one to map onto\n",
+		                        argvzero, devices);
+		return false;
+	}
+	else if (fm_dm_tgtcount)
+		// The only device in the table
+		fm_dm_selected = fm_dm_targets[0].dev;
+	else
+	{
+		(void) fm_print_message("%s: the device-mapper table has no linear, striped or crypt segments in it\n",
+		                        argvzero);
+		return false;
+	}
+
+	(void) fm_dm_describe_selected();
+
+	if (devices > 1U)
+	{
+		const size_t len = strlen(fm_dm_description);
+
+		(void) snprintf(fm_dm_description + len, sizeof fm_dm_description - len, "; only the data on it, of the "
+		                "%" PRIu64 " devices that the volume is on", devices);
+	}
+
+	return true;
+}
+
+static const struct fm_dm_segment * FM_WARN_UNUSED
+fm_dm_find_segment(const uint64_t off)
+{
+	uint64_t lo = 0U;
+	uint64_t hi = fm_dm_segcount;
+
+	// Segments are contiguous and in order (see fm_dm_add_segment())
+	while (lo < hi)
+	{
+		const uint64_t mid = (lo + ((hi - lo) / 2U));
+		const struct fm_dm_segment *const segment = &fm_dm_segments[mid];
+
+		if (off < segment->start)
+			hi = mid;
+		else if (off >= (segment->start + segment->len))
+			lo = (mid + 1U);
+		else
+			return segment;
+	}
+
+	return NULL;
+}
+
+static bool FM_NONNULL(1, 2, 3) FM_WARN_UNUSED
+fm_dm_add_piece(struct fm_dm_inode *const restrict dmi, const struct fm_extent *const restrict fe,
+                const char *const restrict abspath, const uint64_t off, const uint64_t len, const uint64_t loff)
+{
+	const uint32_t flags = (fe->flags & ~FIEMAP_EXTENT_LAST);
+
+	if (dmi->count)
+	{
+		struct fm_map_extent *const prev = &dmi->extents[dmi->count - 1U];
+
+		if ((prev->off + prev->len) == off && (prev->loff + prev->len) == loff && prev->flags == flags)
+		{
+			// Split only by the table, or by pieces on other devices that were in between in the volume
+			prev->len += len;
+			return true;
+		}
+	}
+	if (dmi->count == dmi->alloc)
+	{
+		const uint64_t alloc = ((dmi->alloc) ? (dmi->alloc * 2U) : 8U);
+		void *const ptr = realloc(dmi->extents, alloc * sizeof *dmi->extents);
+
+		if (ptr == NULL)
+		{
+			(void) fm_scan_failed(abspath, "realloc(3)", errno);
+			return false;
+		}
+
+		dmi->extents = ptr;
+		dmi->alloc = alloc;
+	}
+
+	struct fm_map_extent *const mext = &dmi->extents[dmi->count];
+
+	(void) memset(mext, 0x00, sizeof *mext);
+
+	mext->off   = off;
+	mext->len   = len;
+	mext->loff  = loff;
+	mext->pos   = (dmi->count + 1U);
+	mext->flags = flags;
+
+	dmi->count++;
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 2, 3, 4) FM_WARN_UNUSED
+fm_dm_translate_extent(struct fm_dm_inode *const restrict dmi, const struct fm_extent *const restrict fe,
+                       const char *const restrict abspath, uint64_t *const restrict elsewhere)
+{
+	const uint64_t end = (fe->off + fe->len);
+	uint64_t off = fe->off;
+
+	if (! fm_extent_in_volume(fe))
+		// These are not anywhere in the volume (yet), so there is nothing to translate
+		return fm_dm_add_piece(dmi, fe, abspath, fe->off, fe->len, fe->loff);
+
+	while (off < end)
+	{
+		const struct fm_dm_segment *const segment = fm_dm_find_segment(off);
+		const struct fm_dm_target *target;
+		uint64_t rel;
+		uint64_t len;
+		uint64_t doff;
+
+		if (segment == NULL)
+		{
+			(void) fm_print_message("%s: while translating '%s': offset %" PRIu64 " is beyond the end of the "
+			                        "device-mapper table\n", argvzero, abspath, off);
+			return false;
+		}
+		if (! segment->count)
+		{
+			(void) fm_print_message("%s: while translating '%s': offset %" PRIu64 " is in a segment of the "
+			                        "device-mapper table with unsupported target type '%s'\n", argvzero, abspath,
+			                        off, segment->type);
+			return false;
+		}
+
+		rel = (off - segment->start);
+		len = ((end < (segment->start + segment->len)) ? end : (segment->start + segment->len)) - off;
+
+		if (segment->chunk)
+		{
+			// Chunk N of the segment is chunk (N / stripes) of stripe (N % stripes)
+			const uint64_t chunkno = (rel / segment->chunk);
+			const uint64_t within = (rel % segment->chunk);
+
+			target = &fm_dm_targets[segment->first + (chunkno % segment->count)];
+			doff = (target->off + (((chunkno / segment->count) * segment->chunk) + within));
+
+			if (len > (segment->chunk - within))
+				len = (segment->chunk - within);
+		}
+		else
+		{
+			target = &fm_dm_targets[segment->first];
+			doff = (target->off + rel);
+		}
+
+		if (target->dev == fm_dm_selected)
+		{
+			if (! fm_dm_add_piece(dmi, fe, abspath, (fm_dm_partstart + doff), len, (fe->loff + (off - fe->off))))
+				// This function records the failure
+				return false;
+		}
+		else
+			*elsewhere += len;
+
+		off += len;
+	}
+
+	return true;
+}
+
+bool FM_WARN_UNUSED
+fm_dm_translate(void)
+{
+	const uint64_t inodes = HASH_COUNT(fm_inodes);
+	struct fm_dm_inode *dmis;
+	struct fm_inode *fi;
+	struct fm_inode *itmp;
+	uint64_t elsewhere = 0U;
+	uint64_t count = 0U;
+	bool result = false;
+
+	if ((dmis = calloc(inodes + 1U, sizeof *dmis)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	// Everything is translated before anything is replaced, so that old and new offsets never meet in the hash
+	HASH_ITER(hh, fm_inodes, fi, itmp)
+	{
+		const char *const abspath = ((fi->names != NULL) ? fi->names->name : "(unnamed)");
+		struct fm_dm_inode *const dmi = &dmis[count++];
+		const struct fm_extent *fe;
+		bool last = false;
+
+		dmi->inode = fi;
+		dmi->keep = (fi->flags & FM_IFLAGS_NESTED);
+
+		DL_FOREACH(fi->extents, fe)
+		{
+			if (! fm_dm_translate_extent(dmi, fe, abspath, &elsewhere))
+				// This function prints messages on error
+				goto done;
+
+			last = (fe->flags & FIEMAP_EXTENT_LAST);
+		}
+
+		if (last && dmi->count)
+			dmi->extents[dmi->count - 1U].flags |= FIEMAP_EXTENT_LAST;
+	}
+
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		struct fm_inode *const inode = dmis[i].inode;
+
+		if (! fm_replace_extents(inode, NULL, 0U, ((inode->names != NULL) ? inode->names->name : "(unnamed)")))
+			// This function records the failure
+			goto done;
+	}
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		struct fm_inode *const inode = dmis[i].inode;
+
+		if (! fm_replace_extents(inode, dmis[i].extents, dmis[i].count,
+		                         ((inode->names != NULL) ? inode->names->name : "(unnamed)")))
+			// This function records the failure
+			goto done;
+
+		inode->flags |= dmis[i].keep;
+	}
+
+	if (elsewhere)
+		(void) fm_print_message("%s: %s of the data is on other devices than %s, and has been left out (see "
+		                        "--dm-device)\n", argvzero, fm_readable_size(FM_READABLE_SIZE, elsewhere),
+		                        fm_dm_description);
+
+	result = true;
+
+done:
+
+	for (uint64_t i = 0U; i < count; i++)
+		free(dmis[i].extents);
+
+	free(dmis);
+	free(fm_dm_segments);
+	free(fm_dm_targets);
+
+	fm_dm_segments = NULL;
+	fm_dm_targets = NULL;
+	fm_dm_segcount = fm_dm_segalloc = 0U;
+	fm_dm_tgtcount = fm_dm_tgtalloc = 0U;
+
+	return result;
+}
@@ -0,0 +1,203 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filemap.h"
+
+/* An entry that could not be scanned (see --keep-going)
+ * The failures are recorded in the order they happened and are summarised after the scan
+ */
+struct fm_scan_error
+{
+	struct fm_scan_error *  prev;       // For entry into fm_scan_errors below
+	struct fm_scan_error *  next;       // For entry into fm_scan_errors below
+
+	const char *            what;       // What failed (a string literal)
+	int                     errnum;     // The errno value it failed with
+	char                    path[];     // The path of the entry that could not be scanned
+};
+
+static struct fm_scan_error *fm_scan_errors = NULL;
+static uint64_t fm_scan_error_count = 0U;
+static bool fm_scan_errors_reported = false;
+
+static bool
+fm_scan_error_transient(const int errnum)
+{
+	switch (errnum)
+	{
+		// The entry was removed, replaced, or was busy (being written to) while it was being scanned
+		case ENOENT:
+		case ESTALE:
+		case EAGAIN:
+		case EBUSY:
+		case EINTR:
+		case ETXTBSY:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+static bool FM_NONNULL(1, 2)
+fm_scan_error_retry(const char *const restrict abspath, const struct stat *const restrict rootsb)
+{
+	struct stat sb;
+	int fd;
+
+	(void) memset(&sb, 0x00, sizeof sb);
+
+	if ((fd = open(abspath, O_NOCTTY | O_RDONLY | O_NOFOLLOW, 0)) < 0)
+	{
+		if (errno == ENOENT)
+			// It is gone for good now; there is nothing left of it to map
+			return true;
+
+		(void) fm_scan_failed(abspath, "open(2)", errno);
+		return true;
+	}
+	if (fstat(fd, &sb) < 0)
+	{
+		(void) fm_scan_failed(abspath, "fstat(2)", errno);
+		(void) close(fd);
+		return true;
+	}
+	if (sb.st_dev != rootsb->st_dev)
+	{
+		// Not on the same filesystem (anymore)
+		(void) close(fd);
+		return true;
+	}
+
+	// These functions record failures and close the fd; they do not fail otherwise with --keep-going
+	if ((sb.st_mode & S_IFMT) == S_IFDIR)
+		return fm_scan_directory(fd, &sb, abspath);
+
+	if ((sb.st_mode & S_IFMT) == S_IFREG)
+		return fm_scan_extents(fd, &sb, abspath);
+
+	(void) close(fd);
+	return true;
+}
+
+void FM_NONNULL(1, 2)
+fm_scan_failed(const char *const restrict abspath, const char *const restrict what, const int errnum)
+{
+	struct fm_scan_error *se;
+	const size_t len = strlen(abspath);
+
+	(void) fm_print_message("%s: while scanning '%s': %s: %s\n", argvzero, abspath, what, strerror(errnum));
+
+	if (! fm_keep_going || fm_scan_errors_reported)
+		return;
+
+	fm_scan_error_count++;
+
+	if ((se = calloc(1U, sizeof *se + len + 1U)) == NULL)
+		// It is still counted above, so the exit status will reflect it
+		return;
+
+	(void) memcpy(se->path, abspath, len);
+
+	se->what = what;
+	se->errnum = errnum;
+
+	DL_APPEND(fm_scan_errors, se);
+}
+
+void FM_NONNULL(1)
+fm_retry_failures(const struct stat *const restrict rootsb)
+{
+	struct fm_scan_error *failed = fm_scan_errors;
+	struct fm_scan_error *se;
+	struct fm_scan_error *stmp;
+
+	if (! fm_keep_going)
+		return;
+
+	// Anything that fails again will be recorded again
+	fm_scan_errors = NULL;
+	fm_scan_error_count = 0U;
+
+	DL_FOREACH_SAFE(failed, se, stmp)
+	{
+		DL_DELETE(failed, se);
+
+		if (! fm_scan_error_transient(se->errnum))
+		{
+			DL_APPEND(fm_scan_errors, se);
+			fm_scan_error_count++;
+			continue;
+		}
+
+		if (! fm_run_quietly)
+			(void) fm_print_message("%s: retrying %s ...", argvzero, se->path);
+
+		(void) fm_scan_error_retry(se->path, rootsb);
+		free(se);
+	}
+}
+
+uint64_t
+fm_report_failures(void)
+{
+	const uint64_t count = fm_scan_error_count;
+	struct fm_scan_error *se;
+	struct fm_scan_error *stmp;
+
+	fm_scan_errors_reported = true;
+
+	if (! count)
+		return 0U;
+
+	(void) fm_print_message("");
+	(void) fprintf(stderr, "%s: %" PRIu64 " entries could not be scanned; the results are incomplete\n",
+	                       argvzero, count);
+
+	// Group the failures by their cause; each group is printed in the order its failures happened
+	while (fm_scan_errors != NULL)
+	{
+		const int errnum = fm_scan_errors->errnum;
+		uint64_t errcount = 0U;
+
+		DL_FOREACH(fm_scan_errors, se)
+			if (se->errnum == errnum)
+				errcount++;
+
+		(void) fprintf(stderr, "\n  %s (%" PRIu64 "):\n", strerror(errnum), errcount);
+
+		DL_FOREACH_SAFE(fm_scan_errors, se, stmp)
+		{
+			if (se->errnum != errnum)
+				continue;
+
+			(void) fprintf(stderr, "    %s (%s)\n", se->path, se->what);
+
+			DL_DELETE(fm_scan_errors, se);
+			free(se);
+		}
+	}
+
+	(void) fflush(stderr);
+
+	fm_scan_error_count = 0U;
+
+	return count;
+}
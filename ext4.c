@@ -0,0 +1,1306 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/fiemap.h>
+
+#include "filemap.h"
+
+/* Reading an ext4 (or ext2/ext3) filesystem image directly, without mounting it
+ *
+ * The inode tables are read from start to finish in large sequential reads, collecting the extents of every
+ * file and directory. The directory blocks are then read in the order that they appear in the image, and
+ * finally the names are put together in memory from the directory entries, starting at the root directory.
+ * Everything on disk is little-endian; checksums are not verified.
+ */
+
+#define FM_EXT4_SUPERBLOCK_OFFSET       1024U
+#define FM_EXT4_SUPERBLOCK_SIZE         1024U
+#define FM_EXT4_MAGIC                   0xEF53U
+#define FM_EXT4_ROOT_INO                2U
+#define FM_EXT4_GOOD_OLD_FIRST_INO      11U
+#define FM_EXT4_GOOD_OLD_INODE_SIZE     128U
+#define FM_EXT4_MIN_DESC_SIZE           32U
+#define FM_EXT4_MIN_DESC_SIZE_64BIT     64U
+#define FM_EXT4_READ_SIZE               (4U * 1024U * 1024U)
+
+#define FM_EXT4_INCOMPAT_COMPRESSION    0x0001U
+#define FM_EXT4_INCOMPAT_FILETYPE       0x0002U
+#define FM_EXT4_INCOMPAT_RECOVER        0x0004U
+#define FM_EXT4_INCOMPAT_JOURNAL_DEV    0x0008U
+#define FM_EXT4_INCOMPAT_META_BG        0x0010U
+#define FM_EXT4_INCOMPAT_64BIT          0x0080U
+#define FM_EXT4_INCOMPAT_DIRDATA        0x1000U
+#define FM_EXT4_INCOMPAT_UNSUPPORTED    (FM_EXT4_INCOMPAT_COMPRESSION | FM_EXT4_INCOMPAT_JOURNAL_DEV | \
+                                         FM_EXT4_INCOMPAT_DIRDATA)
+
+#define FM_EXT4_RO_COMPAT_SPARSE_SUPER  0x0001U
+#define FM_EXT4_RO_COMPAT_GDT_CSUM      0x0010U
+#define FM_EXT4_RO_COMPAT_METADATA_CSUM 0x0400U
+
+#define FM_EXT4_BG_INODE_UNINIT         0x0001U
+
+#define FM_EXT4_EXTENTS_FL              0x00080000U
+#define FM_EXT4_INLINE_DATA_FL          0x10000000U
+
+#define FM_EXT4_INODE_BLOCK_OFFSET      0x28U
+#define FM_EXT4_INODE_BLOCK_SIZE        60U
+#define FM_EXT4_NDIR_BLOCKS             12U
+
+#define FM_EXT4_EXTENT_MAGIC            0xF30AU
+#define FM_EXT4_EXTENT_MAX_DEPTH        5U
+#define FM_EXT4_EXTENT_INIT_MAX_LEN     32768U
+
+struct fm_ext4_dir
+{
+	UT_hash_handle      hh;             // For entry into fs->dirs below
+	uint64_t            inum;           // Inode number (hash key)
+
+	bool                walked;         // Whether names have been given to its entries yet
+};
+
+struct fm_ext4_run
+{
+	uint64_t            inum;           // The directory these blocks belong to
+	uint64_t            pblk;           // First block of the run in the image (sort key)
+	uint64_t            count;          // Number of blocks in the run
+};
+
+struct fm_ext4_dirent
+{
+	uint64_t            parent;         // Inode number of the directory the entry is in (sort key)
+	uint64_t            child;          // Inode number the entry refers to
+	uint64_t            nameoff;        // Offset of the entry's name in fs->names below (NUL-terminated)
+};
+
+struct fm_ext4_fs
+{
+	int                     fd;                 // The image
+	const char *            path;               // The image's path (for messages)
+	uint64_t                blksz;              // Filesystem block size
+	uint64_t                blocks;             // Number of blocks in the filesystem
+	uint64_t                first_data_block;   // Block number of the start of group 0
+	uint64_t                blocks_per_group;
+	uint64_t                inodes_per_group;
+	uint64_t                groups;             // Number of block groups
+	uint64_t                inode_size;         // Size of an inode table entry
+	uint64_t                first_ino;          // First inode number that is not reserved
+	uint64_t                desc_size;          // Size of a group descriptor
+	uint64_t                first_meta_bg;      // First group descriptor block that is in a meta_bg
+	uint32_t                incompat;           // Bitfield of FM_EXT4_INCOMPAT_*
+	uint32_t                ro_compat;          // Bitfield of FM_EXT4_RO_COMPAT_*
+
+	unsigned char *         nodebuf;            // One block per level of an extent tree or indirect block map
+
+	struct fm_map_extent *  exts;               // Extents of the inode being read
+	uint64_t                extcount;
+	uint64_t                extalloc;
+
+	struct fm_ext4_dir *    dirs;               // Hash of every directory found in the inode tables
+	struct fm_ext4_run *    runs;               // Array of the blocks of those directories
+	uint64_t                runcount;
+	uint64_t                runalloc;
+	struct fm_ext4_dirent * dirents;            // Array of the entries in those directories
+	uint64_t                direntcount;
+	uint64_t                direntalloc;
+	char *                  names;              // The names of those entries, back to back
+	uint64_t                namelen;
+	uint64_t                namealloc;
+
+	// For a filesystem in a file that is itself on the filesystem being mapped (see fm_ext4_scan_nested())
+	struct fm_map_extent *  hostexts;           // Extents of that file (in logical order)
+	uint64_t                hostcount;
+	uint64_t                host;               // Its inode number, which the inodes in it are keyed under
+	struct fm_map_extent *  texts;              // Extents of the inode being read, translated to the host
+	uint64_t                textalloc;
+	uint64_t *              added;              // Array of the inode numbers (in the image) added to the model
+	uint64_t                addedcount;
+	uint64_t                addedalloc;
+};
+
+static uint16_t FM_NONNULL(1)
+fm_ext4_le16(const unsigned char *const restrict ptr)
+{
+	return (uint16_t) (((uint16_t) ptr[0]) | (((uint16_t) ptr[1]) << 8));
+}
+
+static uint32_t FM_NONNULL(1)
+fm_ext4_le32(const unsigned char *const restrict ptr)
+{
+	return ((uint32_t) ptr[0]) | (((uint32_t) ptr[1]) << 8) | (((uint32_t) ptr[2]) << 16) |
+	       (((uint32_t) ptr[3]) << 24);
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_ext4_grow(void **const restrict ptr, uint64_t *const restrict alloc, const uint64_t needed, const size_t size)
+{
+	uint64_t newalloc = ((*alloc) ? *alloc : 1024U);
+	void *newptr;
+
+	if (needed <= *alloc)
+		return true;
+
+	while (newalloc < needed)
+		newalloc *= 2U;
+
+	if ((newptr = realloc(*ptr, newalloc * size)) == NULL)
+	{
+		(void) fm_print_message("%s: while reading image: realloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	*ptr = newptr;
+	*alloc = newalloc;
+	return true;
+}
+
+static void FM_NONNULL(1, 3)
+fm_ext4_failed(const struct fm_ext4_fs *const restrict fs, const uint64_t inum, const char *const restrict what,
+               const int errnum)
+{
+	char label[PATH_MAX];
+
+	(void) memset(label, 0x00, sizeof label);
+	(void) snprintf(label, sizeof label, "%s: inode %" PRIu64, fs->path, inum);
+	(void) fm_scan_failed(label, what, errnum);
+}
+
+static void FM_NONNULL(1, 3)
+fm_ext4_group_failed(const struct fm_ext4_fs *const restrict fs, const uint64_t group, const char *const restrict what,
+                     const int errnum)
+{
+	char label[PATH_MAX];
+
+	(void) memset(label, 0x00, sizeof label);
+	(void) snprintf(label, sizeof label, "%s: group %" PRIu64, fs->path, group);
+	(void) fm_scan_failed(label, what, errnum);
+}
+
+static bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_ext4_read(const struct fm_ext4_fs *const restrict fs, const uint64_t off, unsigned char *const restrict buf,
+             const size_t len)
+{
+	size_t done = 0U;
+
+	while (done < len)
+	{
+		const ssize_t ret = pread(fs->fd, buf + done, len - done, (off_t) (off + done));
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return false;
+
+		if (ret == 0)
+		{
+			// The image is shorter than the filesystem in it claims to be
+			errno = EUCLEAN;
+			return false;
+		}
+
+		done += (size_t) ret;
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1)
+fm_ext4_has_super(const struct fm_ext4_fs *const restrict fs, uint64_t group)
+{
+	static const uint64_t bases[] = { 3U, 5U, 7U };
+
+	if (! (fs->ro_compat & FM_EXT4_RO_COMPAT_SPARSE_SUPER) || group <= 1U)
+		return true;
+
+	// With sparse_super, only groups 0, 1 and powers of 3, 5 and 7 have backups of the superblock
+	for (size_t i = 0U; i < (sizeof bases / sizeof bases[0]); i++)
+	{
+		uint64_t power = bases[i];
+
+		while (power < group)
+			power *= bases[i];
+
+		if (power == group)
+			return true;
+	}
+
+	return false;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_ext4_read_super(struct fm_ext4_fs *const restrict fs, const struct stat *const restrict sb)
+{
+	unsigned char sbuf[FM_EXT4_SUPERBLOCK_SIZE];
+	uint32_t log_block_size;
+
+	if (! fm_ext4_read(fs, FM_EXT4_SUPERBLOCK_OFFSET, sbuf, sizeof sbuf))
+	{
+		(void) fm_print_message("%s: while reading image '%s': superblock: %s\n",
+		                        argvzero, fs->path, strerror(errno));
+		return false;
+	}
+	if (fm_ext4_le16(sbuf + 0x38) != FM_EXT4_MAGIC)
+	{
+		(void) fm_print_message("%s: while reading image '%s': not an ext2/ext3/ext4 filesystem\n",
+		                        argvzero, fs->path);
+		return false;
+	}
+
+	log_block_size          = fm_ext4_le32(sbuf + 0x18);
+	fs->blocks              = fm_ext4_le32(sbuf + 0x04);
+	fs->first_data_block    = fm_ext4_le32(sbuf + 0x14);
+	fs->blocks_per_group    = fm_ext4_le32(sbuf + 0x20);
+	fs->inodes_per_group    = fm_ext4_le32(sbuf + 0x28);
+	fs->incompat            = fm_ext4_le32(sbuf + 0x60);
+	fs->ro_compat           = fm_ext4_le32(sbuf + 0x64);
+	fs->first_meta_bg       = fm_ext4_le32(sbuf + 0x104);
+	fs->first_ino           = FM_EXT4_GOOD_OLD_FIRST_INO;
+	fs->inode_size          = FM_EXT4_GOOD_OLD_INODE_SIZE;
+	fs->desc_size           = FM_EXT4_MIN_DESC_SIZE;
+
+	if (fm_ext4_le32(sbuf + 0x4C) != 0U)
+	{
+		// Not a revision 0 (ext2) filesystem
+		fs->first_ino   = fm_ext4_le32(sbuf + 0x54);
+		fs->inode_size  = fm_ext4_le16(sbuf + 0x58);
+	}
+	if (fs->incompat & FM_EXT4_INCOMPAT_64BIT)
+	{
+		fs->blocks     |= ((uint64_t) fm_ext4_le32(sbuf + 0x150)) << 32;
+		fs->desc_size   = fm_ext4_le16(sbuf + 0xFE);
+	}
+	if (log_block_size > 6U)
+	{
+		(void) fm_print_message("%s: while reading image '%s': invalid block size\n", argvzero, fs->path);
+		return false;
+	}
+
+	fs->blksz = (1024U << log_block_size);
+
+	if (! fs->blocks_per_group || ! fs->inodes_per_group || fs->first_data_block >= fs->blocks ||
+	    fs->inode_size < FM_EXT4_GOOD_OLD_INODE_SIZE || fs->inode_size > fs->blksz ||
+	    (fs->inode_size & (fs->inode_size - 1U)) || fs->desc_size < FM_EXT4_MIN_DESC_SIZE ||
+	    fs->desc_size > fs->blksz || (fs->desc_size & (fs->desc_size - 1U)) ||
+	    ((fs->incompat & FM_EXT4_INCOMPAT_64BIT) && fs->desc_size < FM_EXT4_MIN_DESC_SIZE_64BIT))
+	{
+		(void) fm_print_message("%s: while reading image '%s': the superblock is corrupted\n",
+		                        argvzero, fs->path);
+		return false;
+	}
+	if (fs->incompat & FM_EXT4_INCOMPAT_UNSUPPORTED)
+	{
+		(void) fm_print_message("%s: while reading image '%s': unsupported filesystem features (0x%" PRIx32
+		                        ")\n", argvzero, fs->path, (fs->incompat & FM_EXT4_INCOMPAT_UNSUPPORTED));
+		return false;
+	}
+	if ((sb->st_mode & S_IFMT) == S_IFREG && (uint64_t) sb->st_size < (fs->blocks * fs->blksz))
+		(void) fm_print_message("%s: warning: image '%s' is smaller than the filesystem in it; "
+		                        "it may have been truncated\n", argvzero, fs->path);
+
+	if (fs->incompat & FM_EXT4_INCOMPAT_RECOVER)
+		(void) fm_print_message("%s: warning: the journal of image '%s' has not been replayed; "
+		                        "recently changed files may be mapped as they were before\n", argvzero, fs->path);
+
+	fs->groups = (((fs->blocks - fs->first_data_block) + fs->blocks_per_group - 1U) / fs->blocks_per_group);
+
+	return true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_ext4_add_run(struct fm_ext4_fs *const restrict fs, const uint64_t lblk, const uint64_t pblk, const uint64_t count,
+                const uint32_t flags, const bool merge)
+{
+	struct fm_map_extent *mext;
+
+	if (pblk < fs->first_data_block || pblk >= fs->blocks || count > (fs->blocks - pblk))
+	{
+		errno = EUCLEAN;
+		return false;
+	}
+	if (merge && fs->extcount)
+	{
+		// Contiguous blocks of a file that does not use extents; merge them into one, as FIEMAP would
+		mext = &fs->exts[fs->extcount - 1U];
+
+		if (mext->flags == flags && (mext->loff + mext->len) == (lblk * fs->blksz) &&
+		    (mext->off + mext->len) == (pblk * fs->blksz))
+		{
+			mext->len += (count * fs->blksz);
+			return true;
+		}
+	}
+	if (! fm_ext4_grow((void **) &fs->exts, &fs->extalloc, fs->extcount + 1U, sizeof *fs->exts))
+	{
+		// This function prints messages on error
+		errno = ENOMEM;
+		return false;
+	}
+
+	mext = &fs->exts[fs->extcount++];
+
+	(void) memset(mext, 0x00, sizeof *mext);
+
+	mext->off   = (pblk * fs->blksz);
+	mext->len   = (count * fs->blksz);
+	mext->loff  = (lblk * fs->blksz);
+	mext->flags = flags;
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_ext4_walk_extents(struct fm_ext4_fs *const restrict fs, const unsigned char *const restrict node,
+                     const size_t nodelen, const unsigned int level)
+{
+	const uint16_t entries = fm_ext4_le16(node + 2U);
+	const uint16_t depth = fm_ext4_le16(node + 6U);
+
+	if (fm_ext4_le16(node) != FM_EXT4_EXTENT_MAGIC || entries > fm_ext4_le16(node + 4U) ||
+	    (12U + (entries * 12U)) > nodelen || depth > FM_EXT4_EXTENT_MAX_DEPTH ||
+	    (level <= FM_EXT4_EXTENT_MAX_DEPTH && depth != level))
+	{
+		errno = EUCLEAN;
+		return false;
+	}
+
+	for (uint16_t i = 0U; i < entries; i++)
+	{
+		const unsigned char *const ent = (node + 12U + (i * 12U));
+
+		if (depth == 0U)
+		{
+			const uint64_t lblk = fm_ext4_le32(ent);
+			const uint64_t pblk = ((((uint64_t) fm_ext4_le16(ent + 6U)) << 32) | fm_ext4_le32(ent + 8U));
+			uint64_t count = fm_ext4_le16(ent + 4U);
+			uint32_t flags = 0U;
+
+			if (count > FM_EXT4_EXTENT_INIT_MAX_LEN)
+			{
+				// Allocated but not yet written to
+				count -= FM_EXT4_EXTENT_INIT_MAX_LEN;
+				flags |= FIEMAP_EXTENT_UNWRITTEN;
+			}
+			if (count && ! fm_ext4_add_run(fs, lblk, pblk, count, flags, false))
+				return false;
+		}
+		else
+		{
+			const uint64_t pblk = ((((uint64_t) fm_ext4_le16(ent + 8U)) << 32) | fm_ext4_le32(ent + 4U));
+			unsigned char *const child = (fs->nodebuf + ((depth - 1U) * fs->blksz));
+
+			if (pblk < fs->first_data_block || pblk >= fs->blocks)
+			{
+				errno = EUCLEAN;
+				return false;
+			}
+			if (! fm_ext4_read(fs, pblk * fs->blksz, child, fs->blksz))
+				return false;
+
+			if (! fm_ext4_walk_extents(fs, child, fs->blksz, depth - 1U))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_ext4_walk_indirect(struct fm_ext4_fs *const restrict fs, const uint64_t pblk, uint64_t *const restrict lblk,
+                      const uint64_t maxlblk, const unsigned int level)
+{
+	const uint64_t perblock = (fs->blksz / 4U);
+	unsigned char *const buf = (fs->nodebuf + ((level - 1U) * fs->blksz));
+	uint64_t span = 1U;
+
+	for (unsigned int i = 1U; i < level; i++)
+		span *= perblock;
+
+	if (pblk < fs->first_data_block || pblk >= fs->blocks)
+	{
+		errno = EUCLEAN;
+		return false;
+	}
+	if (! fm_ext4_read(fs, pblk * fs->blksz, buf, fs->blksz))
+		return false;
+
+	for (uint64_t i = 0U; i < perblock && *lblk < maxlblk; i++)
+	{
+		const uint64_t ptr = fm_ext4_le32(buf + (i * 4U));
+
+		if (! ptr)
+		{
+			// A hole
+			*lblk += span;
+			continue;
+		}
+		if (level == 1U)
+		{
+			if (! fm_ext4_add_run(fs, *lblk, ptr, 1U, FIEMAP_EXTENT_MERGED, true))
+				return false;
+
+			*lblk += 1U;
+			continue;
+		}
+		if (! fm_ext4_walk_indirect(fs, ptr, lblk, maxlblk, level - 1U))
+			return false;
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_ext4_walk_blockmap(struct fm_ext4_fs *const restrict fs, const unsigned char *const restrict iblock,
+                      const uint64_t size)
+{
+	const uint64_t maxlblk = ((size + fs->blksz - 1U) / fs->blksz);
+	uint64_t lblk = 0U;
+
+	for (unsigned int i = 0U; i < FM_EXT4_NDIR_BLOCKS && lblk < maxlblk; i++, lblk++)
+	{
+		const uint64_t ptr = fm_ext4_le32(iblock + (i * 4U));
+
+		if (ptr && ! fm_ext4_add_run(fs, lblk, ptr, 1U, FIEMAP_EXTENT_MERGED, true))
+			return false;
+	}
+
+	// Then the single, double and triple indirect blocks
+	for (unsigned int level = 1U; level <= 3U && lblk < maxlblk; level++)
+	{
+		const uint64_t ptr = fm_ext4_le32(iblock + ((FM_EXT4_NDIR_BLOCKS + level - 1U) * 4U));
+		uint64_t span = 1U;
+
+		if (ptr)
+		{
+			if (! fm_ext4_walk_indirect(fs, ptr, &lblk, maxlblk, level))
+				return false;
+
+			continue;
+		}
+
+		for (unsigned int i = 0U; i < level; i++)
+			span *= (fs->blksz / 4U);
+
+		lblk += span;
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_ext4_add_dirents(struct fm_ext4_fs *const restrict fs, const uint64_t inum, const unsigned char *const restrict buf,
+                    const size_t buflen)
+{
+	size_t pos = 0U;
+
+	while ((pos + 8U) <= buflen)
+	{
+		const unsigned char *const ent = (buf + pos);
+		const uint64_t child = fm_ext4_le32(ent);
+		size_t reclen = fm_ext4_le16(ent + 4U);
+		size_t namelen = ent[6];
+
+		if (! (fs->incompat & FM_EXT4_INCOMPAT_FILETYPE))
+			namelen = fm_ext4_le16(ent + 6U);
+
+		if ((reclen == 0U || reclen == 65535U) && buflen >= 65536U)
+			// How a record length of 64 KiB is stored
+			reclen = buflen;
+
+		if (reclen < 8U || (reclen % 4U) || (pos + reclen) > buflen || (8U + namelen) > reclen)
+		{
+			(void) fm_ext4_failed(fs, inum, "corrupted directory entry", EUCLEAN);
+			return fm_keep_going;
+		}
+
+		pos += reclen;
+
+		if (! child || ! namelen)
+			// An unused entry, the tail of a block (checksum) or a node of a hashed directory index
+			continue;
+
+		if ((namelen == 1U && ent[8] == '.') || (namelen == 2U && ent[8] == '.' && ent[9] == '.'))
+			continue;
+
+		if (! fm_ext4_grow((void **) &fs->dirents, &fs->direntalloc, fs->direntcount + 1U, sizeof *fs->dirents))
+			// This function prints messages on error
+			return false;
+
+		if (! fm_ext4_grow((void **) &fs->names, &fs->namealloc, fs->namelen + namelen + 1U, 1U))
+			// This function prints messages on error
+			return false;
+
+		fs->dirents[fs->direntcount].parent  = inum;
+		fs->dirents[fs->direntcount].child   = child;
+		fs->dirents[fs->direntcount].nameoff = fs->namelen;
+		fs->direntcount++;
+
+		(void) memcpy(fs->names + fs->namelen, ent + 8U, namelen);
+
+		fs->names[fs->namelen + namelen] = 0x00;
+		fs->namelen += (namelen + 1U);
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_ext4_add_dir(struct fm_ext4_fs *const restrict fs, const uint64_t inum, const unsigned char *const restrict raw,
+                const bool isinline)
+{
+	struct fm_ext4_dir *dir;
+
+	if ((dir = calloc(1U, sizeof *dir)) == NULL)
+	{
+		(void) fm_print_message("%s: while reading image: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	dir->inum = inum;
+
+	HASH_ADD(hh, fs->dirs, inum, sizeof dir->inum, dir);
+
+	if (isinline)
+	{
+		/* The first 4 bytes are the inode number of the parent directory, then the entries follow
+		 * Directories that outgrow the inode continue in an extended attribute, which is not read
+		 */
+		const unsigned char *const iblock = (raw + FM_EXT4_INODE_BLOCK_OFFSET);
+
+		return fm_ext4_add_dirents(fs, inum, iblock + 4U, FM_EXT4_INODE_BLOCK_SIZE - 4U);
+	}
+
+	for (uint64_t i = 0U; i < fs->extcount; i++)
+	{
+		const struct fm_map_extent *const mext = &fs->exts[i];
+
+		if (mext->flags & FIEMAP_EXTENT_UNWRITTEN)
+			// Nothing in here yet
+			continue;
+
+		if (! fm_ext4_grow((void **) &fs->runs, &fs->runalloc, fs->runcount + 1U, sizeof *fs->runs))
+			// This function prints messages on error
+			return false;
+
+		fs->runs[fs->runcount].inum  = inum;
+		fs->runs[fs->runcount].pblk  = (mext->off / fs->blksz);
+		fs->runs[fs->runcount].count = (mext->len / fs->blksz);
+		fs->runcount++;
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_ext4_translate(struct fm_ext4_fs *const restrict fs)
+{
+	uint64_t count = 0U;
+
+	for (uint64_t i = 0U; i < fs->extcount; i++)
+	{
+		const struct fm_map_extent *const gext = &fs->exts[i];
+		const uint64_t gend = (gext->off + gext->len);
+		uint64_t lo = 0U;
+		uint64_t hi = fs->hostcount;
+
+		// Find the first extent of the host file that ends after this extent (of the image) starts
+		while (lo < hi)
+		{
+			const uint64_t mid = (lo + ((hi - lo) / 2U));
+
+			if ((fs->hostexts[mid].loff + fs->hostexts[mid].len) <= gext->off)
+				lo = (mid + 1U);
+			else
+				hi = mid;
+		}
+
+		// Split it up wherever the host file's extents are discontiguous; parts in holes were never written
+		for (uint64_t j = lo; j < fs->hostcount && fs->hostexts[j].loff < gend; j++)
+		{
+			const struct fm_map_extent *const hext = &fs->hostexts[j];
+			const uint64_t start = ((hext->loff > gext->off) ? hext->loff : gext->off);
+			const uint64_t end = (((hext->loff + hext->len) < gend) ? (hext->loff + hext->len) : gend);
+			struct fm_map_extent *text;
+
+			if (! fm_ext4_grow((void **) &fs->texts, &fs->textalloc, count + 1U, sizeof *fs->texts))
+				// This function prints messages on error
+				return false;
+
+			text = &fs->texts[count++];
+
+			(void) memset(text, 0x00, sizeof *text);
+
+			text->off   = (hext->off + (start - hext->loff));
+			text->len   = (end - start);
+			text->loff  = (gext->loff + (start - gext->off));
+			text->pos   = count;
+			text->flags = (gext->flags & ~FIEMAP_EXTENT_LAST);
+		}
+	}
+
+	if (count)
+		fs->texts[count - 1U].flags |= FIEMAP_EXTENT_LAST;
+
+	fs->extcount = count;
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_ext4_map_inode(struct fm_ext4_fs *const restrict fs, const uint64_t inum, const unsigned char *const restrict raw,
+                  const uint64_t rawoff)
+{
+	const uint16_t mode = fm_ext4_le16(raw + 0x00);
+	const uint32_t iflags = fm_ext4_le32(raw + 0x20);
+	const unsigned char *const iblock = (raw + FM_EXT4_INODE_BLOCK_OFFSET);
+	const bool isdir = ((mode & S_IFMT) == S_IFDIR);
+	const bool isinline = (iflags & FM_EXT4_INLINE_DATA_FL);
+	struct fm_map_record rec;
+	char label[PATH_MAX];
+	bool mapped = true;
+
+	if (! fm_ext4_le16(raw + 0x1A))
+		// Not in use (no links)
+		return true;
+
+	if (! (isdir || (mode & S_IFMT) == S_IFREG))
+		// Not a file or directory
+		return true;
+
+	(void) memset(&rec, 0x00, sizeof rec);
+
+	rec.inum                    = inum;
+	rec.host                    = fs->host;
+	rec.sb.st_ino               = (ino_t) inum;
+	rec.sb.st_mode              = (mode_t) mode;
+	rec.sb.st_nlink             = (nlink_t) fm_ext4_le16(raw + 0x1A);
+	rec.sb.st_uid               = (uid_t) (fm_ext4_le16(raw + 0x02) | (((uint32_t) fm_ext4_le16(raw + 0x78)) << 16));
+	rec.sb.st_gid               = (gid_t) (fm_ext4_le16(raw + 0x18) | (((uint32_t) fm_ext4_le16(raw + 0x7A)) << 16));
+	rec.sb.st_size              = (off_t) (fm_ext4_le32(raw + 0x04) | (((uint64_t) fm_ext4_le32(raw + 0x6C)) << 32));
+	rec.sb.st_blksize           = (blksize_t) fs->blksz;
+	rec.sb.st_atim.tv_sec       = (time_t) (int32_t) fm_ext4_le32(raw + 0x08);
+	rec.sb.st_ctim.tv_sec       = (time_t) (int32_t) fm_ext4_le32(raw + 0x0C);
+	rec.sb.st_mtim.tv_sec       = (time_t) (int32_t) fm_ext4_le32(raw + 0x10);
+
+	fs->extcount = 0U;
+
+	if (isinline && ! isdir && rec.sb.st_size)
+	{
+		// The data is stored in the inode itself; report it as FIEMAP would
+		const uint64_t len = (((uint64_t) rec.sb.st_size < FM_EXT4_INODE_BLOCK_SIZE) ?
+		                      (uint64_t) rec.sb.st_size : FM_EXT4_INODE_BLOCK_SIZE);
+
+		if (! fm_ext4_grow((void **) &fs->exts, &fs->extalloc, 1U, sizeof *fs->exts))
+			// This function prints messages on error
+			return false;
+
+		(void) memset(fs->exts, 0x00, sizeof *fs->exts);
+
+		fs->exts[0].off   = (rawoff + FM_EXT4_INODE_BLOCK_OFFSET);
+		fs->exts[0].len   = len;
+		fs->exts[0].flags = (FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED);
+		fs->extcount      = 1U;
+	}
+	else if (! isinline && (iflags & FM_EXT4_EXTENTS_FL))
+		mapped = fm_ext4_walk_extents(fs, iblock, FM_EXT4_INODE_BLOCK_SIZE, UINT_MAX);
+	else if (! isinline)
+		mapped = fm_ext4_walk_blockmap(fs, iblock, (uint64_t) rec.sb.st_size);
+
+	if (! mapped)
+	{
+		(void) fm_ext4_failed(fs, inum, "block map", errno);
+		return fm_keep_going;
+	}
+
+	for (uint64_t i = 0U; i < fs->extcount; i++)
+		fs->exts[i].pos = (i + 1U);
+
+	if (fs->extcount)
+		fs->exts[fs->extcount - 1U].flags |= FIEMAP_EXTENT_LAST;
+
+	if (isdir && ! fm_ext4_add_dir(fs, inum, raw, isinline))
+		// This function prints messages on error
+		return false;
+
+	if (isdir && ! fm_scan_directories)
+		return true;
+
+	if (fs->hostexts != NULL && ! fm_ext4_translate(fs))
+		// This function prints messages on error
+		return false;
+
+	// It is given its names later, when the directories have been read; until then, identify it by number
+	(void) memset(label, 0x00, sizeof label);
+	(void) snprintf(label, sizeof label, "%s: inode %" PRIu64, fs->path, inum);
+
+	rec.extcount = fs->extcount;
+
+	if (! fm_restore_inode(&rec, ((fs->hostexts != NULL) ? fs->texts : fs->exts), label))
+		// This function prints messages on error
+		return fm_keep_going;
+
+	if (fs->hostexts != NULL)
+	{
+		if (! fm_ext4_grow((void **) &fs->added, &fs->addedalloc, fs->addedcount + 1U, sizeof *fs->added))
+			// This function prints messages on error
+			return false;
+
+		fs->added[fs->addedcount++] = rec.inum;
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_ext4_read_inodes(struct fm_ext4_fs *const restrict fs)
+{
+	const uint64_t descs_per_block = (fs->blksz / fs->desc_size);
+	const uint64_t desc_blocks = ((fs->groups + descs_per_block - 1U) / descs_per_block);
+	const bool csums = (fs->ro_compat & (FM_EXT4_RO_COMPAT_GDT_CSUM | FM_EXT4_RO_COMPAT_METADATA_CSUM));
+	unsigned char *descs = NULL;
+	unsigned char *buf = NULL;
+	bool result = false;
+
+	if ((descs = calloc(desc_blocks, fs->blksz)) == NULL || (buf = malloc(FM_EXT4_READ_SIZE)) == NULL)
+	{
+		(void) fm_print_message("%s: while reading image: malloc(3): %s\n", argvzero, strerror(errno));
+		goto done;
+	}
+	for (uint64_t i = 0U; i < desc_blocks; i++)
+	{
+		uint64_t pblk = (fs->first_data_block + 1U + i);
+
+		if ((fs->incompat & FM_EXT4_INCOMPAT_META_BG) && i >= fs->first_meta_bg)
+		{
+			// Each block of descriptors is in the first group that it describes
+			const uint64_t group = (i * descs_per_block);
+
+			pblk = (fs->first_data_block + (group * fs->blocks_per_group) + (fm_ext4_has_super(fs, group) ? 1U : 0U));
+		}
+		if (! fm_ext4_read(fs, pblk * fs->blksz, descs + (i * fs->blksz), fs->blksz))
+		{
+			(void) fm_scan_failed(fs->path, "group descriptors", errno);
+
+			// Nothing in it can be found without them; a nested image is mapped as an ordinary file instead
+			result = fm_keep_going;
+			goto done;
+		}
+	}
+	for (uint64_t group = 0U; group < fs->groups; group++)
+	{
+		const unsigned char *const desc = (descs + (group * fs->desc_size));
+		uint64_t itable = fm_ext4_le32(desc + 0x08);
+		uint64_t count = fs->inodes_per_group;
+		uint64_t done = 0U;
+
+		if (fs->desc_size >= FM_EXT4_MIN_DESC_SIZE_64BIT)
+			itable |= ((uint64_t) fm_ext4_le32(desc + 0x28)) << 32;
+
+		if (csums)
+		{
+			// These are only trustworthy if the descriptors are checksummed
+			uint64_t unused = fm_ext4_le16(desc + 0x1C);
+
+			if (fs->desc_size >= FM_EXT4_MIN_DESC_SIZE_64BIT)
+				unused |= ((uint64_t) fm_ext4_le16(desc + 0x32)) << 16;
+
+			if (fm_ext4_le16(desc + 0x12) & FM_EXT4_BG_INODE_UNINIT)
+				// No inode in this group has ever been used
+				continue;
+
+			if (unused <= count)
+				count -= unused;
+		}
+		if (itable < fs->first_data_block || itable >= fs->blocks)
+		{
+			(void) fm_ext4_group_failed(fs, group, "corrupted descriptor", EUCLEAN);
+
+			if (! fm_keep_going)
+				goto done;
+
+			continue;
+		}
+		if (! fm_run_quietly)
+			(void) fm_print_message("%s: reading inode table %" PRIu64 "/%" PRIu64 " of %s ...",
+			                        argvzero, group + 1U, fs->groups, fs->path);
+
+		// Read as much of the table at once as possible; the tables of neighbouring groups are often adjacent
+		while (done < count)
+		{
+			const uint64_t chunk = ((count - done) < (FM_EXT4_READ_SIZE / fs->inode_size)) ?
+			                       (count - done) : (FM_EXT4_READ_SIZE / fs->inode_size);
+			const uint64_t off = ((itable * fs->blksz) + (done * fs->inode_size));
+
+			if (! fm_ext4_read(fs, off, buf, chunk * fs->inode_size))
+			{
+				(void) fm_ext4_group_failed(fs, group, "inode table", errno);
+
+				if (! fm_keep_going)
+					goto done;
+
+				// The rest of this group's inodes cannot be found; what they occupy stays with the image file
+				break;
+			}
+			for (uint64_t i = 0U; i < chunk; i++)
+			{
+				const uint64_t inum = ((group * fs->inodes_per_group) + done + i + 1U);
+
+				if (inum < fs->first_ino && inum != FM_EXT4_ROOT_INO)
+					// Reserved (bad blocks, journal, resize, ...); these have no names
+					continue;
+
+				if (! fm_ext4_map_inode(fs, inum, buf + (i * fs->inode_size), off + (i * fs->inode_size)))
+					// This function prints messages on error
+					goto done;
+			}
+
+			done += chunk;
+		}
+	}
+
+	result = true;
+
+done:
+
+	free(descs);
+	free(buf);
+
+	return result;
+}
+
+static int FM_NONNULL(1, 2)
+fm_ext4_sortby_pblk_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_ext4_run *const run1 = ptr1;
+	const struct fm_ext4_run *const run2 = ptr2;
+
+	if (run1->pblk < run2->pblk)
+		return -1;
+
+	if (run1->pblk > run2->pblk)
+		return 1;
+
+	return 0;
+}
+
+static int FM_NONNULL(1, 2)
+fm_ext4_sortby_parent_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_ext4_dirent *const ent1 = ptr1;
+	const struct fm_ext4_dirent *const ent2 = ptr2;
+
+	if (ent1->parent < ent2->parent)
+		return -1;
+
+	if (ent1->parent > ent2->parent)
+		return 1;
+
+	return 0;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_ext4_read_dirs(struct fm_ext4_fs *const restrict fs)
+{
+	const uint64_t maxblocks = (FM_EXT4_READ_SIZE / fs->blksz);
+	unsigned char *buf;
+
+	if ((buf = malloc(FM_EXT4_READ_SIZE)) == NULL)
+	{
+		(void) fm_print_message("%s: while reading image: malloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	// Read the directories in the order that they are laid out in the image, not the order they are nested in
+	qsort(fs->runs, fs->runcount, sizeof *fs->runs, &fm_ext4_sortby_pblk_cb);
+
+	for (uint64_t i = 0U; i < fs->runcount; i++)
+	{
+		const struct fm_ext4_run *const run = &fs->runs[i];
+		uint64_t done = 0U;
+
+		if (! fm_run_quietly)
+			(void) fm_print_message("%s: reading directory blocks %" PRIu64 "/%" PRIu64 " of %s ...",
+			                        argvzero, i + 1U, fs->runcount, fs->path);
+
+		while (done < run->count)
+		{
+			const uint64_t chunk = (((run->count - done) < maxblocks) ? (run->count - done) : maxblocks);
+
+			if (! fm_ext4_read(fs, (run->pblk + done) * fs->blksz, buf, chunk * fs->blksz))
+			{
+				(void) fm_ext4_failed(fs, run->inum, "read(2)", errno);
+
+				if (! fm_keep_going)
+				{
+					free(buf);
+					return false;
+				}
+
+				break;
+			}
+			for (uint64_t j = 0U; j < chunk; j++)
+			{
+				if (! fm_ext4_add_dirents(fs, run->inum, buf + (j * fs->blksz), fs->blksz))
+				{
+					// This function prints messages on error
+					free(buf);
+					return false;
+				}
+			}
+
+			done += chunk;
+		}
+	}
+
+	free(buf);
+
+	qsort(fs->dirents, fs->direntcount, sizeof *fs->dirents, &fm_ext4_sortby_parent_cb);
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_ext4_name_dir(struct fm_ext4_fs *const restrict fs, const uint64_t inum, char *const restrict path,
+                 const size_t pathlen)
+{
+	struct fm_ext4_dir *dir = NULL;
+	struct fm_inode *fi = NULL;
+	uint64_t lo = 0U;
+	uint64_t hi = fs->direntcount;
+
+	HASH_FIND(hh, fs->dirs, &inum, sizeof inum, dir);
+
+	if (dir == NULL || dir->walked)
+		// Not a directory, or a directory that is linked more than once (a corrupted filesystem)
+		return true;
+
+	dir->walked = true;
+
+	fi = fm_find_inode(inum, fs->host);
+
+	// The root directory of a nested filesystem is named after the file it is in; see fm_add_name()
+	if (fi != NULL && fm_scan_cached(&fi->sb, fs->host, (pathlen ? path : "/")) == FM_CACHE_ERROR &&
+	    ! fm_keep_going)
+		// This function records the failure
+		return false;
+
+	// The entries are sorted by the directory they are in; find the first one in this directory
+	while (lo < hi)
+	{
+		const uint64_t mid = (lo + ((hi - lo) / 2U));
+
+		if (fs->dirents[mid].parent < inum)
+			lo = (mid + 1U);
+		else
+			hi = mid;
+	}
+	for (uint64_t i = lo; i < fs->direntcount && fs->dirents[i].parent == inum; i++)
+	{
+		const struct fm_ext4_dirent *const ent = &fs->dirents[i];
+		const char *const name = (fs->names + ent->nameoff);
+		const size_t namelen = strlen(name);
+
+		if ((pathlen + 1U + namelen) >= PATH_MAX)
+		{
+			(void) fm_scan_failed(path, "file name too long", ENAMETOOLONG);
+
+			if (! fm_keep_going)
+				return false;
+
+			continue;
+		}
+
+		path[pathlen] = '/';
+		(void) memcpy(path + pathlen + 1U, name, namelen + 1U);
+
+		if (! fm_ext4_name_dir(fs, ent->child, path, pathlen + 1U + namelen))
+			// This function records the failure
+			return false;
+
+		HASH_FIND(hh, fs->dirs, &ent->child, sizeof ent->child, dir);
+		fi = fm_find_inode(ent->child, fs->host);
+
+		if (dir == NULL && fi != NULL && fm_scan_cached(&fi->sb, fs->host, path) == FM_CACHE_ERROR && ! fm_keep_going)
+			// This function records the failure
+			return false;
+
+		path[pathlen] = 0x00;
+	}
+
+	return true;
+}
+
+static void FM_NONNULL(1)
+fm_ext4_free(struct fm_ext4_fs *const restrict fs)
+{
+	struct fm_ext4_dir *dir;
+	struct fm_ext4_dir *dtmp;
+
+	HASH_ITER(hh, fs->dirs, dir, dtmp)
+	{
+		HASH_DEL(fs->dirs, dir);
+		free(dir);
+	}
+
+	free(fs->nodebuf);
+	free(fs->exts);
+	free(fs->runs);
+	free(fs->dirents);
+	free(fs->names);
+	free(fs->hostexts);
+	free(fs->texts);
+	free(fs->added);
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_ext4_read_fs(struct fm_ext4_fs *const restrict fs, char *const restrict path, const size_t pathlen)
+{
+	if ((fs->nodebuf = calloc(FM_EXT4_EXTENT_MAX_DEPTH, fs->blksz)) == NULL)
+	{
+		(void) fm_print_message("%s: while reading image: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	(void) posix_fadvise(fs->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (! fm_ext4_read_inodes(fs) || ! fm_ext4_read_dirs(fs))
+		// These functions print messages on error
+		return false;
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: naming %" PRIu64 " inodes in %s ...", argvzero, fm_inode_count, fs->path);
+
+	if (! fm_ext4_name_dir(fs, FM_EXT4_ROOT_INO, path, pathlen))
+		// This function records the failure
+		return false;
+
+	// Inodes that are in use but could not be found by name (orphans, or below a corrupted directory)
+	(void) fm_forget_unnamed();
+
+	return true;
+}
+
+bool FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_ext4_scan(const int fd, const struct stat *const restrict sb, const char *const restrict abspath)
+{
+	struct fm_ext4_fs fs;
+	char path[PATH_MAX];
+	bool result = false;
+
+	(void) memset(&fs, 0x00, sizeof fs);
+	(void) memset(path, 0x00, sizeof path);
+
+	fs.fd = fd;
+	fs.path = abspath;
+
+	if (! ((sb->st_mode & S_IFMT) == S_IFREG || (sb->st_mode & S_IFMT) == S_IFBLK))
+	{
+		(void) fm_print_message("%s: while reading image '%s': not a file or block device\n", argvzero, abspath);
+		goto done;
+	}
+	if (! fm_ext4_read_super(&fs, sb))
+		// This function prints messages on error
+		goto done;
+
+	// Offsets and lengths are in the image, whose blocks are those of the filesystem in it
+	fm_blksz = fs.blksz;
+	fm_max_extent_len = (FM_EXT4_EXTENT_INIT_MAX_LEN * fs.blksz);
+
+	result = fm_ext4_read_fs(&fs, path, 0U);
+
+done:
+
+	(void) fm_ext4_free(&fs);
+	(void) close(fd);
+
+	return result;
+}
+
+static int FM_NONNULL(1, 2)
+fm_ext4_sortby_off_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_map_extent *const ext1 = ptr1;
+	const struct fm_map_extent *const ext2 = ptr2;
+
+	if (ext1->off < ext2->off)
+		return -1;
+
+	if (ext1->off > ext2->off)
+		return 1;
+
+	return 0;
+}
+
+static bool FM_NONNULL(1, 2, 3) FM_WARN_UNUSED
+fm_ext4_host_remainder(struct fm_ext4_fs *const restrict fs, struct fm_inode *const restrict host,
+                       const char *const restrict abspath)
+{
+	struct fm_map_extent *used = NULL;
+	uint64_t usedcount = 0U;
+	uint64_t usedalloc = 0U;
+	uint64_t count = 0U;
+	bool result = false;
+
+	// Everything the files in the image that ended up in the model occupy, in the order it is on the host
+	for (uint64_t i = 0U; i < fs->addedcount; i++)
+	{
+		const struct fm_extent *extent;
+		const struct fm_inode *const fi = fm_find_inode(fs->added[i], fs->host);
+
+		if (fi == NULL)
+			// It could not be found by name
+			continue;
+
+		DL_FOREACH(fi->extents, extent)
+		{
+			if (! fm_ext4_grow((void **) &used, &usedalloc, usedcount + 1U, sizeof *used))
+				// This function prints messages on error
+				goto done;
+
+			used[usedcount].off = extent->off;
+			used[usedcount].len = extent->len;
+			usedcount++;
+		}
+	}
+
+	qsort(used, usedcount, sizeof *used, &fm_ext4_sortby_off_cb);
+
+	// What is left of the image file's own extents is its filesystem's metadata and unused space
+	for (uint64_t i = 0U; i < fs->hostcount; i++)
+	{
+		const struct fm_map_extent *const hext = &fs->hostexts[i];
+		const uint64_t hend = (hext->off + hext->len);
+		uint64_t cur = hext->off;
+		uint64_t lo = 0U;
+		uint64_t hi = usedcount;
+
+		while (lo < hi)
+		{
+			const uint64_t mid = (lo + ((hi - lo) / 2U));
+
+			if ((used[mid].off + used[mid].len) <= hext->off)
+				lo = (mid + 1U);
+			else
+				hi = mid;
+		}
+		for (uint64_t j = lo; cur < hend && (j <= usedcount); j++)
+		{
+			const uint64_t ustart = ((j < usedcount && used[j].off < hend) ? used[j].off : hend);
+			const uint64_t uend = ((j < usedcount && used[j].off < hend) ? (used[j].off + used[j].len) : hend);
+
+			if (cur < ustart)
+			{
+				struct fm_map_extent *text;
+
+				if (! fm_ext4_grow((void **) &fs->texts, &fs->textalloc, count + 1U, sizeof *fs->texts))
+					// This function prints messages on error
+					goto done;
+
+				text = &fs->texts[count++];
+
+				(void) memset(text, 0x00, sizeof *text);
+
+				text->off   = cur;
+				text->len   = (ustart - cur);
+				text->loff  = (hext->loff + (cur - hext->off));
+				text->pos   = count;
+				text->flags = (hext->flags & ~FIEMAP_EXTENT_LAST);
+			}
+			if (uend > cur)
+				cur = uend;
+		}
+	}
+
+	if (count)
+		fs->texts[count - 1U].flags |= FIEMAP_EXTENT_LAST;
+
+	result = fm_replace_extents(host, fs->texts, count, abspath);
+
+done:
+
+	free(used);
+
+	return result;
+}
+
+bool FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_ext4_scan_nested(const int fd, struct fm_inode *const restrict host, const char *const restrict abspath)
+{
+	unsigned char magic[2];
+	const struct fm_extent *extent;
+	struct fm_ext4_fs fs;
+	char path[PATH_MAX];
+	bool result = false;
+	uint64_t i = 0U;
+
+	if ((host->sb.st_mode & S_IFMT) != S_IFREG || host->sb.st_size < (off_t) (FM_EXT4_SUPERBLOCK_OFFSET * 2U) ||
+	    ! host->extcount)
+		return true;
+
+	if (pread(fd, magic, sizeof magic, FM_EXT4_SUPERBLOCK_OFFSET + 0x38) != (ssize_t) sizeof magic ||
+	    fm_ext4_le16(magic) != FM_EXT4_MAGIC)
+		// Not a filesystem image (or not one that can be read)
+		return true;
+
+	(void) memset(&fs, 0x00, sizeof fs);
+	(void) memset(path, 0x00, sizeof path);
+
+	fs.fd = fd;
+	fs.path = abspath;
+	fs.host = host->inum;
+	fs.hostcount = host->extcount;
+
+	if (! fm_ext4_read_super(&fs, &host->sb))
+	{
+		// This function prints messages on error; map it as an ordinary file instead
+		result = true;
+		goto done;
+	}
+	if ((fs.hostexts = calloc(host->extcount, sizeof *fs.hostexts)) == NULL)
+	{
+		(void) fm_print_message("%s: while reading image: calloc(3): %s\n", argvzero, strerror(errno));
+		goto done;
+	}
+	DL_FOREACH(host->extents, extent)
+	{
+		fs.hostexts[i].off   = extent->off;
+		fs.hostexts[i].len   = extent->len;
+		fs.hostexts[i].loff  = extent->loff;
+		fs.hostexts[i].flags = extent->flags;
+		i++;
+	}
+
+	// The file's extents are given to the files in it; what remains of them afterwards is put back below
+	if (! fm_replace_extents(host, NULL, 0U, abspath))
+		goto done;
+
+	(void) snprintf(path, sizeof path, "%s:", abspath);
+
+	// Whatever was read of it, the image file gets back what its files don't use
+	const bool fsread = fm_ext4_read_fs(&fs, path, strlen(path));
+
+	result = (fm_ext4_host_remainder(&fs, host, abspath) && fsread);
+
+done:
+
+	(void) fm_ext4_free(&fs);
+
+	return result;
+}
@@ -7,6 +7,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -31,162 +32,561 @@ static uint32_t fmh_extent_count = 0U;
 static size_t fmh_extent_size = 0U;
 static struct fiemap *fm = NULL;
 
-bool FM_NONNULL(2, 3) FM_WARN_UNUSED
-fm_scan_extents(const int fd, const struct stat *const restrict sb, const char *const restrict abspath)
+static bool FM_NONNULL(1, 7) FM_WARN_UNUSED
+fm_add_extent(struct fm_inode *const restrict fi, const uint64_t this_extoff, const uint64_t this_extlen,
+              const uint64_t this_extlog, const uint64_t this_extpos, const uint32_t this_extflg,
+              const char *const restrict abspath)
 {
-	const uint64_t inum = (uint64_t) sb->st_ino;
-	struct fm_inode *fi = NULL;
+	struct fm_extent *fe;
 
-	if (! fm_run_quietly)
-		(void) fm_print_message("%s: mapping %s ...", argvzero, abspath);
+	HASH_FIND(hh, fm_extents, &this_extoff, sizeof this_extoff, fe);
 
-	HASH_FIND(hh, fm_inodes, &inum, sizeof inum, fi);
+	if (fe != NULL)
+	{
+		(void) fm_scan_failed(abspath, "cannot handle files with shared extents", EOPNOTSUPP);
+		return false;
+	}
+	if ((fe = calloc(1U, sizeof *fe)) == NULL)
+	{
+		(void) fm_scan_failed(abspath, "calloc(3)", errno);
+		return false;
+	}
 
-	if (fi == NULL)
+	fe->off   = this_extoff;
+	fe->flags = this_extflg;
+	fe->pos   = this_extpos;
+	fe->len   = this_extlen;
+	fe->loff  = this_extlog;
+	fe->inode = fi;
+
+	if (fi->extents != NULL)
+	{
+		// The previous extent in the inode's data is the tail of its list
+		const uint64_t prev_extoff = fi->extents->prev->off;
+		const uint64_t prev_extlen = fi->extents->prev->len;
+
+		if (this_extoff != (prev_extoff + prev_extlen))
+			fi->seeks++;
+
+		if (this_extoff < prev_extoff)
+			fi->flags |= FM_IFLAGS_UNORDERED;
+	}
+	else
+		fi->seeks = 1U;
+
+	fi->bytes += this_extlen;
+
+	// Whether it is fragmented depends on how many extents its data needs, which grows with it (see score.c)
+	if ((fi->flags & FM_IFLAGS_UNORDERED) || fi->seeks > fm_score_ideal(fi))
+		fi->flags |= FM_IFLAGS_FRAGMENTED;
+	else
+		fi->flags &= ~FM_IFLAGS_FRAGMENTED;
+
+	if ((this_extoff % fm_blksz) != 0U || (this_extlen % fm_blksz) != 0U)
+	{
+		fi->flags |= FM_IFLAGS_UNALIGNED;
+		fm_integral_blksz = false;
+	}
+
+	// Against the stripes and erase blocks of the storage underneath, if given (see align.c)
+	fi->flags |= fm_align_flags(fe);
+
+	HASH_ADD(hh, fm_extents, off, sizeof fe->off, fe);
+	DL_APPEND(fi->extents, fe);
+
+	fi->extcount++;
+
+	return true;
+}
+
+static void FM_NONNULL(1, 2)
+fm_add_inode(struct fm_inode *const restrict fi, const struct stat *const restrict sb)
+{
+	(void) memcpy(&fi->sb, sb, sizeof fi->sb);
+
+	fi->inum = (uint64_t) sb->st_ino;
+
+	// The key is the inode number and the host together (see fm_find_inode())
+	HASH_ADD(hh, fm_inodes, inum, (sizeof fi->inum + sizeof fi->host), fi);
+
+	fm_extent_count += fi->extcount;
+	fm_inode_count++;
+}
+
+static bool FM_NONNULL(1, 2, 3) FM_WARN_UNUSED
+fm_add_name(struct fm_inode *const restrict fi, const struct stat *const restrict sb, const char *const restrict abspath)
+{
+	struct fm_name *const fn = calloc(1U, sizeof *fn);
+	struct fm_name *prev = NULL;
+
+	if (fn == NULL)
+	{
+		(void) fm_scan_failed(abspath, "calloc(3)", errno);
+		return false;
+	}
+
+	// Append a slash to the end of directory names, but only if the directory is not /
+	(void) snprintf(fn->name, sizeof fn->name, "%s%s", abspath,
+	                (((sb->st_mode & S_IFMT) == S_IFDIR && strcmp(abspath, "/") != 0) ? "/" : ""));
+
+	HASH_FIND_STR(fm_names, fn->name, prev);
+
+	if (prev != NULL && prev->inode == fi)
+	{
+		// Already known by this name (the directory was scanned again)
+		free(fn);
+		return true;
+	}
+	if (prev != NULL)
+		// This name now refers to a different inode
+		(void) fm_forget_name(prev);
+
+	if ((sb->st_mode & S_IFMT) == S_IFDIR)
+		fm_dir_count++;
+	else
+		fm_file_count++;
+
+	fi->namecount++;
+	fn->inode = fi;
+
+	HASH_ADD_STR(fm_names, name, fn);
+	DL_APPEND(fi->names, fn);
+	DL_SORT(fi->names, fm_sortby_filename_cb);
+
+	return true;
+}
+
+static void FM_NONNULL(1)
+fm_forget_extents(struct fm_inode *const restrict fi)
+{
+	struct fm_extent *fe;
+	struct fm_extent *etmp;
+
+	DL_FOREACH_SAFE(fi->extents, fe, etmp)
 	{
-		struct fiemap fmh = {
-			.fm_start          = 0U,
-			.fm_length         = FIEMAP_MAX_OFFSET,
-			.fm_flags          = ((fm_sync_files) ? FIEMAP_FLAG_SYNC : 0U),
-			.fm_mapped_extents = 0U,
-			.fm_extent_count   = 0U,
-		};
+		HASH_DEL(fm_extents, fe);
+		DL_DELETE(fi->extents, fe);
+		free(fe);
+	}
 
-		if (ioctl(fd, FS_IOC_FIEMAP, &fmh) < 0)
+	fi->extcount = 0U;
+	fi->bytes = 0U;
+	fi->seeks = 0U;
+	fi->flags = ((fi->host) ? FM_IFLAGS_NESTED : FM_IFLAGS_NONE);
+}
+
+static bool FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_map_fiemap(const int fd, struct fm_inode *const restrict fi, const char *const restrict abspath)
+{
+	struct fiemap fmh = {
+		.fm_start          = 0U,
+		.fm_length         = FIEMAP_MAX_OFFSET,
+		.fm_flags          = ((fm_sync_files) ? FIEMAP_FLAG_SYNC : 0U),
+		.fm_mapped_extents = 0U,
+		.fm_extent_count   = 0U,
+	};
+
+	if (ioctl(fd, FS_IOC_FIEMAP, &fmh) < 0)
+	{
+		(void) fm_scan_failed(abspath, "ioctl(2) FS_IOC_FIEMAP", errno);
+		return false;
+	}
+	if (fmh_extent_count <= fmh.fm_mapped_extents)
+	{
+		fmh_extent_count = (fmh.fm_mapped_extents + ((fmh.fm_mapped_extents + 256U) % 256U));
+		fmh_extent_size = ((sizeof *fm) + (fmh_extent_count * sizeof(struct fiemap_extent)));
+
+		if (! (fm = realloc(fm, fmh_extent_size)))
 		{
-			(void) fm_print_message("%s: while scanning '%s': ioctl(2) FS_IOC_FIEMAP: %s\n",
-			                        argvzero, abspath, strerror(errno));
+			(void) fm_scan_failed(abspath, "realloc(3)", errno);
 			return false;
 		}
-		if (fmh_extent_count <= fmh.fm_mapped_extents)
-		{
-			fmh_extent_count = (fmh.fm_mapped_extents + ((fmh.fm_mapped_extents + 256U) % 256U));
-			fmh_extent_size = ((sizeof *fm) + (fmh_extent_count * sizeof(struct fiemap_extent)));
-
-			if (! (fm = realloc(fm, fmh_extent_size)))
-			{
-				(void) fm_print_message("%s: while scanning '%s': realloc(3): %s\n",
-				                        argvzero, abspath, strerror(errno));
-				return false;
-			}
-		}
+	}
 
-		(void) memset(fm, 0x00, fmh_extent_size);
-		(void) memcpy(fm, &fmh, sizeof fmh);
+	(void) memset(fm, 0x00, fmh_extent_size);
+	(void) memcpy(fm, &fmh, sizeof fmh);
 
-		fm->fm_extent_count = fmh_extent_count;
+	fm->fm_extent_count = fmh_extent_count;
 
-		if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+	if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+	{
+		(void) fm_scan_failed(abspath, "ioctl(2) FS_IOC_FIEMAP", errno);
+		return false;
+	}
+	if (fm->fm_mapped_extents == fmh_extent_count)
+	{
+		(void) fm_scan_failed(abspath, "truncated extents returned (file being written to?)", EAGAIN);
+		return false;
+	}
+	for (uint64_t i = 0U; i < fm->fm_mapped_extents; i++)
+	{
+		const uint64_t this_extoff = fm->fm_extents[i].fe_physical;
+		const uint64_t this_extlen = fm->fm_extents[i].fe_length;
+		const uint64_t this_extlog = fm->fm_extents[i].fe_logical;
+		const uint32_t this_extflg = fm->fm_extents[i].fe_flags;
+		const uint64_t this_extpos = (i + 1U);
+
+		if (this_extpos == fm->fm_mapped_extents && ! (this_extflg & FIEMAP_EXTENT_LAST))
 		{
-			(void) fm_print_message("%s: while scanning '%s': ioctl(2) FS_IOC_FIEMAP: %s\n",
-			                        argvzero, abspath, strerror(errno));
+			(void) fm_scan_failed(abspath, "truncated extents returned (file being written to?)", EAGAIN);
 			return false;
 		}
-		if (fm->fm_mapped_extents == fmh_extent_count)
-		{
-			(void) fm_print_message("%s: while scanning '%s': truncated extents returned; "
-			                        "file being written to?", argvzero, abspath);
+		if (! fm_add_extent(fi, this_extoff, this_extlen, this_extlog, this_extpos, this_extflg, abspath))
+			// This function prints messages on error
 			return false;
-		}
-		if ((fi = calloc(1U, sizeof *fi)) == NULL)
-		{
-			(void) fm_print_message("%s: while scanning '%s': calloc(3): %s\n",
-			                        argvzero, abspath, strerror(errno));
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 2, 3) FM_WARN_UNUSED
+fm_map_cached(const struct fm_cache_entry *const restrict ce, struct fm_inode *const restrict fi,
+              const char *const restrict abspath)
+{
+	for (uint64_t i = 0U; i < ce->extcount; i++)
+	{
+		const struct fm_map_extent *const mext = &ce->extents[i];
+
+		if (! fm_add_extent(fi, mext->off, mext->len, mext->loff, mext->pos, mext->flags, abspath))
+			// This function records the failure
 			return false;
-		}
-		for (uint64_t i = 0U; i < fm->fm_mapped_extents; i++)
-		{
-			const uint64_t this_extoff = fm->fm_extents[i].fe_physical;
-			const uint64_t this_extlen = fm->fm_extents[i].fe_length;
-			const uint32_t this_extflg = fm->fm_extents[i].fe_flags;
-			const uint64_t this_extpos = (i + 1U);
-			struct fm_extent *fe;
-
-			HASH_FIND(hh, fm_extents, &this_extoff, sizeof this_extoff, fe);
-
-			if (fe != NULL)
-			{
-				(void) fm_print_message("%s: while scanning '%s': cannot handle files "
-				                        "with shared extents\n", argvzero, abspath);
-				return false;
-			}
-			if ((fe = calloc(1U, sizeof *fe)) == NULL)
-			{
-				(void) fm_print_message("%s: while scanning '%s': calloc(3): %s\n",
-				                        argvzero, abspath, strerror(errno));
-				return false;
-			}
-			if (this_extpos == fm->fm_mapped_extents && ! (this_extflg & FIEMAP_EXTENT_LAST))
-			{
-				(void) fm_print_message("%s: while scanning '%s': truncated extents returned; "
-				                        "file being written to?", argvzero, abspath);
-				return false;
-			}
-
-			fe->off   = this_extoff;
-			fe->flags = this_extflg;
-			fe->pos   = this_extpos;
-			fe->len   = this_extlen;
-			fe->inode = fi;
-
-			if (i > 0U)
-			{
-				const uint64_t j = (i - 1U);
-				const uint64_t prev_extoff = fm->fm_extents[j].fe_physical;
-				const uint64_t prev_extlen = fm->fm_extents[j].fe_length;
-
-				if (this_extoff > (prev_extoff + prev_extlen))
-					fi->flags |= FM_IFLAGS_FRAGMENTED;
-
-				if (this_extoff < prev_extoff)
-					fi->flags |= FM_IFLAGS_FRAGMENTED | FM_IFLAGS_UNORDERED;
-			}
-			if ((this_extoff % fm_blksz) != 0U || (this_extlen % fm_blksz) != 0U)
-			{
-				fi->flags |= FM_IFLAGS_UNALIGNED;
-				fm_integral_blksz = false;
-			}
-
-			HASH_ADD(hh, fm_extents, off, sizeof fe->off, fe);
-
-			fi->extcount++;
-		}
+	}
+
+	return true;
+}
+
+static struct fm_inode * FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_map_inode(const int fd, const struct stat *const restrict sb, const char *const restrict abspath)
+{
+	const struct fm_cache_entry *const ce = fm_cache_find(sb);
+	struct fm_inode *const fi = calloc(1U, sizeof *fi);
+
+	if (fi == NULL)
+	{
+		(void) fm_scan_failed(abspath, "calloc(3)", errno);
+		return NULL;
+	}
+	if (! ((ce != NULL) ? fm_map_cached(ce, fi, abspath) : fm_map_fiemap(fd, fi, abspath)))
+	{
+		// These functions record the failure; whatever was mapped of this inode is incomplete
+		(void) fm_forget_extents(fi);
+		free(fi);
+		return NULL;
+	}
+
+	(void) fm_add_inode(fi, sb);
+
+	return fi;
+}
 
+static bool FM_NONNULL(1, 2, 3) FM_WARN_UNUSED
+fm_name_inode(struct fm_inode *const restrict fi, const struct stat *const restrict sb,
+              const char *const restrict abspath)
+{
+	if (! fi->sb.st_nlink)
+		// Found through the reverse mapping (see fsmap.c); it had no inode information until now
 		(void) memcpy(&fi->sb, sb, sizeof fi->sb);
 
-		fi->inum = inum;
+	if (fm_add_name(fi, sb, abspath))
+		return true;
 
-		HASH_ADD(hh, fm_inodes, inum, sizeof fi->inum, fi);
+	if (! fi->namecount)
+		// This function records the failure; don't leave an inode without a name in the results
+		(void) fm_forget_inode(fi);
 
-		fm_extent_count += fi->extcount;
-		fm_inode_count++;
+	return false;
+}
+
+struct fm_inode * FM_WARN_UNUSED
+fm_find_inode(const uint64_t inum, const uint64_t host)
+{
+	// The same layout as the inum and host members of struct fm_inode, which are adjacent
+	const uint64_t key[2] = { inum, host };
+	struct fm_inode *fi = NULL;
+
+	HASH_FIND(hh, fm_inodes, key, sizeof key, fi);
+
+	return fi;
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_extent_in_volume(const struct fm_extent *const restrict fe)
+{
+	// Not allocated yet, or stored with the inode itself; where these say they are in the volume means nothing
+	return ! (fe->flags & (FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE));
+}
+
+enum fm_cache_result FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_scan_cached(const struct stat *const restrict sb, const uint64_t host, const char *const restrict abspath)
+{
+	const struct fm_cache_entry *ce;
+	struct fm_inode *fi = fm_find_inode((uint64_t) sb->st_ino, host);
+
+	if (fi == NULL)
+	{
+		if (fm_fsmap_owners_known())
+			// Everything that has any space allocated to it was found through the reverse mapping
+			return FM_CACHE_HIT;
+
+		if ((ce = fm_cache_find(sb)) == NULL)
+			return FM_CACHE_MISS;
+
+		if (! fm_run_quietly)
+			(void) fm_print_message("%s: mapping %s (cached) ...", argvzero, abspath);
+
+		if ((fi = fm_map_inode(-1, sb, abspath)) == NULL)
+			// This function records the failure
+			return FM_CACHE_ERROR;
 	}
 
-	struct fm_name *const fn = calloc(1U, sizeof *fn);
+	if (! fm_name_inode(fi, sb, abspath))
+		// This function records the failure
+		return FM_CACHE_ERROR;
 
-	if (fn == NULL)
+	if (fm_rollup_top)
+		(void) fm_rollup_add(fi);
+
+	return FM_CACHE_HIT;
+}
+
+bool FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_scan_extents(const int fd, const struct stat *const restrict sb, const char *const restrict abspath)
+{
+	struct fm_inode *fi;
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: mapping %s ...", argvzero, abspath);
+
+	fi = fm_find_inode((uint64_t) sb->st_ino, 0U);
+
+	const bool mapped = (fi == NULL);
+
+	if (fi == NULL && (fi = fm_map_inode(fd, sb, abspath)) == NULL)
+	{
+		// This function records the failure
+		(void) close(fd);
+		return fm_keep_going;
+	}
+	if (! fm_name_inode(fi, sb, abspath))
+	{
+		// This function records the failure
+		(void) close(fd);
+		return fm_keep_going;
+	}
+	if (fm_nested_mode && mapped && ! fm_ext4_scan_nested(fd, fi, abspath))
+	{
+		// This function records the failure; with --keep-going, what it cannot read stays with the image file
+		(void) close(fd);
+		return false;
+	}
+	if (fm_qcow2_mode && mapped && ! fm_qcow2_scan(fd, fi, abspath))
 	{
-		(void) fm_print_message("%s: while scanning '%s': calloc(3): %s\n",
-		                        argvzero, abspath, strerror(errno));
+		// This function records the failure
+		(void) close(fd);
 		return false;
 	}
+	if (fm_rollup_top)
+		(void) fm_rollup_add(fi);
 
-	if ((sb->st_mode & S_IFMT) == S_IFDIR)
-		fm_dir_count++;
-	else
-		fm_file_count++;
+	(void) close(fd);
 
-	// Append a slash to the end of directory names, but only if the directory is not /
-	(void) snprintf(fn->name, sizeof fn->name, "%s%s", abspath,
-	                (((sb->st_mode & S_IFMT) == S_IFDIR && strcmp(abspath, "/") != 0) ? "/" : ""));
+	return true;
+}
 
-	fi->namecount++;
-	fn->inode = fi;
+bool FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_rescan_extents(const int fd, const struct stat *const restrict sb, const char *const restrict abspath)
+{
+	struct fm_inode *const fi = fm_find_inode((uint64_t) sb->st_ino, 0U);
 
-	DL_APPEND(fi->names, fn);
-	DL_SORT(fi->names, fm_sortby_filename_cb);
+	if (fi == NULL)
+		// Never seen before; nothing to replace
+		return fm_scan_extents(fd, sb, abspath);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: remapping %s ...", argvzero, abspath);
+
+	// Replace the extents of the inode in place; its other names (hardlinks) remain attached to it
+	fm_extent_count -= fi->extcount;
+
+	(void) fm_forget_extents(fi);
+	(void) memcpy(&fi->sb, sb, sizeof fi->sb);
+
+	if (! fm_map_fiemap(fd, fi, abspath))
+	{
+		// This function records the failure; drop the inode, whatever was mapped of it is incomplete
+		fm_extent_count += fi->extcount;
+		(void) fm_forget_inode(fi);
+		(void) close(fd);
+		return fm_keep_going;
+	}
+
+	fm_extent_count += fi->extcount;
+
+	if (! fm_name_inode(fi, sb, abspath))
+	{
+		// This function records the failure
+		(void) close(fd);
+		return fm_keep_going;
+	}
 
 	(void) close(fd);
 
 	return true;
 }
+
+bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_restore_inode(const struct fm_map_record *const restrict rec, const struct fm_map_extent *const restrict mexts,
+                 const char *const restrict names)
+{
+	const char *fname = names;
+	struct fm_inode *fi = NULL;
+
+	if ((fi = fm_find_inode(rec->inum, rec->host)) != NULL)
+	{
+		(void) fm_print_message("%s: while restoring inode %" PRIu64 ": duplicate inode\n", argvzero, rec->inum);
+		return false;
+	}
+	if ((fi = calloc(1U, sizeof *fi)) == NULL)
+	{
+		(void) fm_print_message("%s: while restoring inode %" PRIu64 ": calloc(3): %s\n",
+		                        argvzero, rec->inum, strerror(errno));
+		return false;
+	}
+	for (uint64_t i = 0U; i < rec->extcount; i++)
+	{
+		const struct fm_map_extent *const mext = &mexts[i];
+
+		if (! fm_add_extent(fi, mext->off, mext->len, mext->loff, mext->pos, mext->flags, names))
+		{
+			// This function prints messages on error
+			(void) fm_forget_extents(fi);
+			free(fi);
+			return false;
+		}
+	}
+
+	fi->host = rec->host;
+
+	if (fi->host)
+		// A file in a filesystem image (see ext4.c)
+		fi->flags |= FM_IFLAGS_NESTED;
+
+	(void) fm_add_inode(fi, &rec->sb);
+
+	for (uint64_t i = 0U; i < rec->namecount; i++)
+	{
+		char abspath[PATH_MAX];
+		size_t len;
+
+		(void) memset(abspath, 0x00, sizeof abspath);
+		(void) snprintf(abspath, sizeof abspath, "%s", fname);
+
+		fname += (strlen(fname) + 1U);
+		len = strlen(abspath);
+
+		// Directory names were saved with the slash that fm_add_name() appends to them
+		if ((rec->sb.st_mode & S_IFMT) == S_IFDIR && len > 1U && abspath[len - 1U] == '/')
+			abspath[len - 1U] = 0x00;
+
+		if (! fm_add_name(fi, &rec->sb, abspath))
+			// This function prints messages on error
+			return false;
+	}
+
+	return true;
+}
+
+bool FM_NONNULL(1, 4) FM_WARN_UNUSED
+fm_replace_extents(struct fm_inode *const restrict fi, const struct fm_map_extent *const restrict mexts,
+                   const uint64_t count, const char *const restrict abspath)
+{
+	fm_extent_count -= fi->extcount;
+
+	(void) fm_forget_extents(fi);
+
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		const struct fm_map_extent *const mext = &mexts[i];
+
+		if (! fm_add_extent(fi, mext->off, mext->len, mext->loff, mext->pos, mext->flags, abspath))
+		{
+			// This function records the failure
+			fm_extent_count += fi->extcount;
+			return false;
+		}
+	}
+
+	fm_extent_count += fi->extcount;
+
+	return true;
+}
+
+uint64_t
+fm_forget_unnamed(void)
+{
+	struct fm_inode *inode;
+	struct fm_inode *itmp;
+	uint64_t unnamed = 0U;
+
+	HASH_ITER(hh, fm_inodes, inode, itmp)
+	{
+		if (inode->namecount)
+			continue;
+
+		(void) fm_forget_inode(inode);
+		unnamed++;
+	}
+
+	return unnamed;
+}
+
+void FM_NONNULL(1)
+fm_forget_inode(struct fm_inode *const restrict fi)
+{
+	struct fm_name *fn;
+	struct fm_name *ntmp;
+
+	DL_FOREACH_SAFE(fi->names, fn, ntmp)
+	{
+		if ((fi->sb.st_mode & S_IFMT) == S_IFDIR)
+			fm_dir_count--;
+		else
+			fm_file_count--;
+
+		HASH_DEL(fm_names, fn);
+		DL_DELETE(fi->names, fn);
+		free(fn);
+	}
+
+	fm_extent_count -= fi->extcount;
+	fm_inode_count--;
+
+	(void) fm_forget_extents(fi);
+
+	HASH_DEL(fm_inodes, fi);
+	free(fi);
+}
+
+void FM_NONNULL(1)
+fm_forget_name(struct fm_name *const restrict fn)
+{
+	struct fm_inode *const fi = fn->inode;
+
+	if (fi->namecount == 1U)
+	{
+		// This is the last name referring to the inode
+		(void) fm_forget_inode(fi);
+		return;
+	}
+
+	if ((fi->sb.st_mode & S_IFMT) == S_IFDIR)
+		fm_dir_count--;
+	else
+		fm_file_count--;
+
+	HASH_DEL(fm_names, fn);
+	DL_DELETE(fi->names, fn);
+	free(fn);
+
+	fi->namecount--;
+}
@@ -30,6 +30,9 @@
 #define FM_IFLAGS_UNORDERED             0x02U
 #define FM_IFLAGS_UNALIGNED             0x04U
 #define FM_IFLAGS_PRINTED               0x08U
+#define FM_IFLAGS_NESTED                0x10U
+#define FM_IFLAGS_STRIPE_UNALIGNED      0x20U
+#define FM_IFLAGS_ERASE_UNALIGNED       0x40U
 
 enum fm_sort_direction
 {
@@ -46,8 +49,35 @@ enum fm_sort_method
 	FM_SORTMETH_INODE_NUMBER        = 5,
 	FM_SORTMETH_FILESIZE            = 6,
 	FM_SORTMETH_FILENAME            = 7,
+	FM_SORTMETH_FRAG_SCORE          = 8,
+	FM_SORTMETH_READ_COST           = 9,
 };
 
+enum fm_heatmap_format
+{
+	FM_HEATMAP_FORMAT_CSV           = 1,
+	FM_HEATMAP_FORMAT_PGM           = 2,
+	FM_HEATMAP_FORMAT_PPM           = 3,
+};
+
+enum fm_cost_model
+{
+	FM_COST_MODEL_HDD               = 1,
+	FM_COST_MODEL_SSD               = 2,
+};
+
+// The longest interval that --watch will wait between summaries (one week)
+#define FM_WATCH_MAX_INTERVAL           604800U
+
+// The most readers that --warm will start
+#define FM_WARM_MAX_THREADS             64U
+
+// The most bins that --heatmap will divide the volume into
+#define FM_HEATMAP_MAX_BINS             (UINT64_C(1) << 24)
+
+// Exit status when --keep-going was given and some entries could not be scanned
+#define FM_EXIT_PARTIAL                 2
+
 enum fm_optparse_result
 {
 	FM_OPTPARSE_EXIT_SUCCESS        = 1,
@@ -55,6 +85,13 @@ enum fm_optparse_result
 	FM_OPTPARSE_CONTINUE            = 3,
 };
 
+enum fm_cache_result
+{
+	FM_CACHE_HIT                    = 1,
+	FM_CACHE_MISS                   = 2,
+	FM_CACHE_ERROR                  = 3,
+};
+
 enum fm_readable_which
 {
 	FM_READABLE_OFFSET              = 1,
@@ -63,17 +100,36 @@ enum fm_readable_which
 	FM_READABLE_GAP                 = 4,
 };
 
+#define FM_MAPFILE_MAGIC                "FILEMAP"
+#define FM_MAPFILE_VERSION              2U
+
+#define FM_MAPFILE_FLAGS_NONE           0x00U
+#define FM_MAPFILE_FLAGS_INTEGRAL_BLKSZ 0x01U
+#define FM_MAPFILE_FLAGS_DIRECTORIES    0x02U
+#define FM_MAPFILE_FLAGS_CHECKPOINT     0x04U
+
 struct fm_extent;
 struct fm_inode;
 struct fm_name;
+struct fm_cache_entry;
+struct fm_checkpoint_dir;
+struct fm_checkpoint;
+struct fm_map_header;
+struct fm_map_record;
+struct fm_map_extent;
+struct fm_freespace_range;
 
 struct fm_extent
 {
 	UT_hash_handle      hh;             // For entry into global struct fm_extent *fm_extents
 	uint64_t            off;            // Physical offset of extent in volume (in bytes) (hash key)
 
+	struct fm_extent *  prev;           // For entry into this->inode->extents
+	struct fm_extent *  next;           // For entry into this->inode->extents
+
 	struct fm_inode *   inode;          // Which inode this extent belongs to; points to struct below
 	uint64_t            len;            // Length of extent (in bytes)
+	uint64_t            loff;           // Logical offset of extent in the inode's data (in bytes)
 	uint64_t            pos;            // The position of this extent in the inode's data
 	uint32_t            flags;          // Extent flags (from the kernel)
 };
@@ -81,17 +137,23 @@ struct fm_extent
 struct fm_inode
 {
 	UT_hash_handle      hh;             // For entry into global struct fm_inode *fm_inodes
-	uint64_t            inum;           // Inode number (hash key)
+	uint64_t            inum;           // Inode number (hash key, with host below)
+	uint64_t            host;           // Inode number of the image file it is in (see ext4.c); 0 if in the volume
 
 	struct stat         sb;             // Inode information (owner, mode, size, etc)
+	struct fm_extent *  extents;        // Linked list of structs above (in logical order)
 	struct fm_name *    names;          // Linked list of structs below
 	uint64_t            extcount;       // Number of data extents in this inode
 	uint64_t            namecount;      // Number of filenames that refer to this inode (hardlinks)
+	uint64_t            bytes;          // Number of bytes in those extents
+	uint64_t            seeks;          // Number of discontiguous runs those extents form (see score.c)
+	long double         readtime;       // Estimated time to read its data, in seconds (see cost.c)
 	uint32_t            flags;          // Bitfield of FI_FLAGS_*
 };
 
 struct fm_name
 {
+	UT_hash_handle      hh;             // For entry into global struct fm_name *fm_names (hash key is name)
 	struct fm_name *    prev;           // For entry into this->inode->names
 	struct fm_name *    next;           // For entry into this->inode->names
 
@@ -99,6 +161,78 @@ struct fm_name
 	char                name[PATH_MAX]; // The file name
 };
 
+struct fm_cache_entry
+{
+	UT_hash_handle          hh;         // For entry into the scan cache (see cache.c)
+	uint64_t                inum;       // Inode number (hash key)
+
+	struct stat             sb;         // Inode information at the time its extents were cached
+	struct fm_map_extent *  extents;    // Array of the inode's extents (in logical order)
+	uint64_t                extcount;   // Number of entries in the array above
+};
+
+struct fm_checkpoint_dir
+{
+	UT_hash_handle          hh;         // For entry into this->checkpoint->dirs (hash key is path)
+	char                    path[];     // The path of a directory that has been completely scanned
+};
+
+struct fm_checkpoint
+{
+	struct fm_checkpoint_dir *  dirs;       // Hash of structs above
+	time_t                      saved;      // When this checkpoint was last written out
+	char                        rootpath[PATH_MAX];
+};
+
+/* The on-disk format of a saved map (see mapfile.c)
+ *
+ * A header, followed by one record per inode. Each record is followed by its extents (in logical order)
+ * and then its file names (NUL-terminated, back to back). All values are in host byte order and the
+ * file is not intended to be portable between machines of differing architectures.
+ *
+ * A checkpoint (FM_MAPFILE_FLAGS_CHECKPOINT) is a map that is followed by the path that was being
+ * scanned, a uint64_t count, and then that many paths of directories that had been completely scanned.
+ */
+struct fm_map_header
+{
+	char                magic[8];       // FM_MAPFILE_MAGIC (NUL-padded)
+	uint32_t            version;        // FM_MAPFILE_VERSION
+	uint32_t            flags;          // Bitfield of FM_MAPFILE_FLAGS_*
+	uint64_t            blksz;          // Filesystem block size at the time of the scan
+	uint64_t            inode_count;    // Number of records that follow
+	uint64_t            extent_count;   // Total number of extents in all records
+	uint64_t            file_count;     // Number of files mapped
+	uint64_t            dir_count;      // Number of directories mapped
+};
+
+struct fm_map_record
+{
+	uint64_t            inum;           // Inode number
+	uint64_t            host;           // Inode number of the image file it is in; 0 if in the volume
+	uint64_t            extcount;       // Number of struct fm_map_extent that follow this record
+	uint64_t            namecount;      // Number of file names that follow the extents
+	uint64_t            namelen;        // Total length of those file names (including their NULs)
+	uint32_t            flags;          // Bitfield of FM_IFLAGS_*
+	uint32_t            reserved;       // Padding; always zero
+	struct stat         sb;             // Inode information (owner, mode, size, etc)
+};
+
+struct fm_map_extent
+{
+	uint64_t            off;            // Physical offset of extent in volume (in bytes)
+	uint64_t            len;            // Length of extent (in bytes)
+	uint64_t            loff;           // Logical offset of extent in the inode's data (in bytes)
+	uint64_t            pos;            // The position of this extent in the inode's data
+	uint32_t            flags;          // Extent flags (from the kernel)
+	uint32_t            reserved;       // Padding; always zero
+};
+
+struct fm_freespace_range
+{
+	uint64_t            off;            // Physical offset of the free range in the volume (in bytes)
+	uint64_t            len;            // Length of the free range (in bytes)
+};
+
 // Global variables (initialised to defaults, overridden by command-line options)
 // Located in main.c
 extern enum fm_sort_direction fm_sort_direction;
@@ -115,11 +249,55 @@ extern bool fm_readable_offsets;
 extern bool fm_readable_lengths;
 extern bool fm_readable_sizes;
 extern bool fm_readable_gaps;
+extern bool fm_diff_maps;
+extern const char *fm_save_map_path;
+extern const char *fm_cache_path;
+extern bool fm_watch_mode;
+extern uint64_t fm_watch_interval;
+extern const char *fm_checkpoint_path;
+extern uint64_t fm_checkpoint_interval;
+extern bool fm_resume_scan;
+extern bool fm_keep_going;
+extern bool fm_fsmap_mode;
+extern bool fm_ext4_image;
+extern bool fm_nested_mode;
+extern bool fm_qcow2_mode;
+extern const char *fm_trace_path;
+extern const char *fm_badblocks_path;
+extern bool fm_free_space_mode;
+extern uint64_t fm_freespace_top;
+extern uint64_t fm_heatmap_bins;
+extern enum fm_heatmap_format fm_heatmap_format;
+extern uint64_t fm_rollup_top;
+extern bool fm_physorder_mode;
+extern bool fm_physorder_weighted;
+extern bool fm_warm_mode;
+extern uint64_t fm_warm_threads;
+extern uint64_t fm_warm_rate;
+extern const char *fm_defrag_plan_path;
+extern uint64_t fm_defrag_count;
+extern bool fm_defrag_dry_run;
+extern uint64_t fm_defrag_rate;
+extern uint64_t fm_cost_top;
+extern enum fm_cost_model fm_cost_model;
+extern uint64_t fm_cost_seek;
+extern uint64_t fm_cost_rate;
+extern uint64_t fm_interleave_top;
+extern uint64_t fm_interleave_window;
+extern uint64_t fm_waste_top;
+extern uint64_t fm_stripe_unit;
+extern uint64_t fm_stripe_width;
+extern uint64_t fm_erase_block;
+extern uint64_t fm_alignment_top;
+extern const char *fm_dm_table_path;
+extern bool fm_dm_live;
+extern const char *fm_dm_device;
 
 // Global data structures
 // Located in main.c
 extern struct fm_extent *fm_extents;
 extern struct fm_inode *fm_inodes;
+extern struct fm_name *fm_names;
 
 // For statistics
 // Located in main.c
@@ -133,22 +311,159 @@ extern uint64_t fm_dir_count;
 // Located in main.c
 extern const char *argvzero;
 extern uint64_t fm_blksz;
+extern uint64_t fm_max_extent_len;
+
+// Located in align.c
+extern uint32_t fm_align_flags(const struct fm_extent *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern bool fm_align_report(void) FM_WARN_UNUSED;
+
+// Located in badblocks.c
+extern bool fm_badblocks_report(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+
+// Located in cache.c
+extern bool fm_cache_load(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern const struct fm_cache_entry *fm_cache_find(const struct stat *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern void fm_cache_free(void);
+
+// Located in checkpoint.c
+extern bool fm_checkpoint_add_dir(struct fm_checkpoint *restrict, const char *restrict) FM_NONNULL(1, 2) FM_WARN_UNUSED;
+extern bool fm_checkpoint_begin(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern bool fm_checkpoint_skip_dir(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern bool fm_checkpoint_done_dir(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern bool fm_checkpoint_save(void);
+extern void fm_checkpoint_finish(void);
+
+// Located in diff.c
+extern bool fm_diff_snapshots(const char *, const char *) FM_NONNULL(1, 2) FM_WARN_UNUSED;
+
+// Located in cost.c
+extern void fm_cost_prepare(void);
+extern bool fm_cost_report(void) FM_WARN_UNUSED;
+
+// Located in defrag.c
+extern bool fm_defrag_report(void) FM_WARN_UNUSED;
+
+// Located in defragplan.c
+extern bool fm_plan_defrag(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
 
 // Located in dirents.c
 extern bool fm_scan_directory(int, const struct stat *restrict, const char *restrict) FM_NONNULL(2, 3) FM_WARN_UNUSED;
 
+// Located in dm.c
+extern bool fm_dm_requested(void) FM_WARN_UNUSED;
+extern const char *fm_dm_describe(void) FM_RETURNS_NONNULL FM_WARN_UNUSED;
+extern uint64_t fm_dm_disk_size(void) FM_WARN_UNUSED;
+extern bool fm_dm_load(const struct stat *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern bool fm_dm_translate(void) FM_WARN_UNUSED;
+
+// Located in errors.c
+extern void fm_scan_failed(const char *, const char *, int) FM_NONNULL(1, 2);
+extern void fm_retry_failures(const struct stat *) FM_NONNULL(1);
+extern uint64_t fm_report_failures(void);
+
+// Located in ext4.c
+extern bool fm_ext4_scan(int, const struct stat *restrict, const char *restrict) FM_NONNULL(2, 3) FM_WARN_UNUSED;
+extern bool fm_ext4_scan_nested(int, struct fm_inode *restrict, const char *restrict) FM_NONNULL(2, 3) FM_WARN_UNUSED;
+
 // Located in extents.c
+extern struct fm_inode *fm_find_inode(uint64_t, uint64_t) FM_WARN_UNUSED;
+extern bool fm_extent_in_volume(const struct fm_extent *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern enum fm_cache_result fm_scan_cached(const struct stat *restrict, uint64_t, const char *restrict)
+                                          FM_NONNULL(1, 3) FM_WARN_UNUSED;
 extern bool fm_scan_extents(int, const struct stat *restrict, const char *restrict) FM_NONNULL(2, 3) FM_WARN_UNUSED;
+extern bool fm_rescan_extents(int, const struct stat *restrict, const char *restrict) FM_NONNULL(2, 3) FM_WARN_UNUSED;
+extern bool fm_replace_extents(struct fm_inode *restrict, const struct fm_map_extent *restrict, uint64_t,
+                               const char *restrict) FM_NONNULL(1, 4) FM_WARN_UNUSED;
+extern uint64_t fm_forget_unnamed(void);
+extern void fm_forget_inode(struct fm_inode *) FM_NONNULL(1);
+extern void fm_forget_name(struct fm_name *) FM_NONNULL(1);
+extern bool fm_restore_inode(const struct fm_map_record *restrict, const struct fm_map_extent *restrict,
+                             const char *restrict) FM_NONNULL(1, 3) FM_WARN_UNUSED;
+
+// Located in freespace.c
+extern bool fm_freespace_add(uint64_t, uint64_t) FM_WARN_UNUSED;
+extern void fm_freespace_complete(void);
+extern void fm_freespace_collect(const struct fm_freespace_range **restrict, uint64_t *restrict) FM_NONNULL(1, 2);
+extern void fm_freespace_free(void);
+extern bool fm_freespace_report(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+
+// Located in fsmap.c
+extern bool fm_fsmap_scan(int, const struct stat *restrict, const char *restrict) FM_NONNULL(2, 3) FM_WARN_UNUSED;
+extern void fm_fsmap_finish(void);
+extern bool fm_fsmap_owners_known(void) FM_WARN_UNUSED;
+
+// Located in qcow2.c
+extern bool fm_qcow2_scan(int, const struct fm_inode *restrict, const char *restrict) FM_NONNULL(2, 3) FM_WARN_UNUSED;
+extern void fm_qcow2_report(void);
+
+// Located in heatmap.c
+extern uint64_t fm_heatmap_volume_size(const char *restrict, struct fm_extent *const *restrict,
+                                       uint64_t) FM_NONNULL(1) FM_WARN_UNUSED;
+extern bool fm_heatmap_report(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+
+// Located in interleave.c
+extern bool fm_interleave_report(void) FM_WARN_UNUSED;
+
+// Located in lookup.c
+extern bool fm_lookup_add(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern bool fm_lookup_requested(void) FM_WARN_UNUSED;
+extern struct fm_extent **fm_lookup_index(uint64_t *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern uint64_t fm_lookup_search(struct fm_extent *const *restrict, uint64_t, uint64_t) FM_NONNULL(1);
+extern bool fm_lookup_report(void) FM_WARN_UNUSED;
+
+// Located in mapfile.c
+extern bool fm_save_map(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern bool fm_load_map(const char *, struct fm_map_header *,
+                        bool (*)(const struct fm_map_record *, const struct fm_map_extent *, const char *, void *),
+                        void *) FM_NONNULL(1, 2, 3) FM_WARN_UNUSED;
+extern bool fm_load_checkpoint(const char *, struct fm_map_header *,
+                               bool (*)(const struct fm_map_record *, const struct fm_map_extent *, const char *,
+                                        void *),
+                               void *, struct fm_checkpoint *) FM_NONNULL(1, 2, 3) FM_WARN_UNUSED;
+extern bool fm_save_checkpoint(const char *restrict, const struct fm_checkpoint *restrict) FM_NONNULL(1, 2) FM_WARN_UNUSED;
 
 // Located in options.c
 extern enum fm_optparse_result fm_parse_options(int, char *[]) FM_NONNULL(2) FM_WARN_UNUSED;
 
+// Located in physorder.c
+extern bool fm_physorder_report(void) FM_WARN_UNUSED;
+
 // Located in print.c
 extern void fm_print_message(const char *, ...) FM_NONNULL(1) FM_PRINTF(1, 2);
 extern void fm_print_results(void);
+extern const char *fm_readable_size(enum fm_readable_which, uint64_t) FM_RETURNS_NONNULL;
+extern const char *fm_inode_number(uint64_t, uint64_t) FM_RETURNS_NONNULL;
+
+// Located in rollup.c
+extern bool fm_rollup_enter(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern void fm_rollup_add(const struct fm_inode *) FM_NONNULL(1);
+extern bool fm_rollup_leave(void) FM_WARN_UNUSED;
+extern void fm_rollup_report(void);
+
+// Located in score.c
+extern uint64_t fm_score_max_extent(int) FM_WARN_UNUSED;
+extern uint64_t fm_score_ideal(const struct fm_inode *) FM_NONNULL(1) FM_WARN_UNUSED;
+extern long double fm_score_inode(const struct fm_inode *) FM_NONNULL(1) FM_WARN_UNUSED;
 
 // Located in sort.c
 extern int fm_sortby_extent_cb(const void *restrict, const void *restrict) FM_NONNULL(1, 2);
 extern int fm_sortby_filename_cb(const struct fm_name *restrict, const struct fm_name *restrict) FM_NONNULL(1, 2);
 
+// Located in throttle.c
+extern void fm_throttle(const struct timespec *, uint64_t, uint64_t) FM_NONNULL(1);
+
+// Located in trace.c
+extern bool fm_trace_report(const char *) FM_NONNULL(1) FM_WARN_UNUSED;
+
+// Located in warm.c
+extern bool fm_warm_report(void) FM_WARN_UNUSED;
+
+// Located in waste.c
+extern bool fm_waste_report(void) FM_WARN_UNUSED;
+
+// Located in watch.c
+extern bool fm_watch_init(void) FM_WARN_UNUSED;
+extern void fm_watch_directory(const char *) FM_NONNULL(1);
+extern bool fm_watch_run(const char *restrict, const struct stat *restrict) FM_NONNULL(1, 2) FM_WARN_UNUSED;
+
 #endif /* !INC_FILEMAP_H */
@@ -0,0 +1,269 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filemap.h"
+
+/* Reporting on the free space of the volume (see --free-space)
+ *
+ * With --fsmap, the filesystem says which ranges are free, and those are used as they are. Otherwise the free
+ * space is taken to be the gaps between the extents that were mapped, in order of their physical offset, and
+ * before the first and after the last of them up to the end of the volume; these also contain whatever was not
+ * mapped (filesystem metadata, and anything outside of the path scanned).
+ *
+ * The fragmentation index is 1 - (largest free range / total free space): 0 when all of the free space is in
+ * one place, approaching 1 as it is split up into ever more, smaller pieces.
+ */
+
+#define FM_FREESPACE_BUCKETS            64U
+
+static struct fm_freespace_range *fm_freespace_ranges = NULL;
+static uint64_t fm_freespace_count = 0U;
+static uint64_t fm_freespace_alloc = 0U;
+static bool fm_freespace_exact = false;
+
+bool FM_WARN_UNUSED
+fm_freespace_add(const uint64_t off, const uint64_t len)
+{
+	if (fm_freespace_count == fm_freespace_alloc)
+	{
+		const uint64_t alloc = ((fm_freespace_alloc) ? (fm_freespace_alloc * 2U) : 65536U);
+		void *const ptr = realloc(fm_freespace_ranges, alloc * sizeof *fm_freespace_ranges);
+
+		if (ptr == NULL)
+		{
+			(void) fm_print_message("%s: while recording free space: realloc(3): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+
+		fm_freespace_ranges = ptr;
+		fm_freespace_alloc = alloc;
+	}
+
+	fm_freespace_ranges[fm_freespace_count].off = off;
+	fm_freespace_ranges[fm_freespace_count].len = len;
+	fm_freespace_count++;
+
+	return true;
+}
+
+void
+fm_freespace_complete(void)
+{
+	// The whole of the reverse mapping has been read, so the ranges added are all of the free space, if any
+	fm_freespace_exact = true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_freespace_from_gaps(const char *const restrict rootpath)
+{
+	struct fm_extent **index;
+	uint64_t count = 0U;
+	uint64_t size;
+	uint64_t end = 0U;
+	bool result = true;
+
+	if ((index = fm_lookup_index(&count)) == NULL)
+		// This function prints messages on error
+		return false;
+
+	// Up to the end of the volume, as for --heatmap
+	size = fm_heatmap_volume_size(rootpath, index, count);
+
+	for (uint64_t i = 0U; i < count && result; i++)
+	{
+		// Including the space before the first extent
+		if (end < index[i]->off)
+			result = fm_freespace_add(end, (index[i]->off - end));
+
+		if ((index[i]->off + index[i]->len) > end)
+			end = (index[i]->off + index[i]->len);
+	}
+
+	// And after the last
+	if (result && end < size)
+		result = fm_freespace_add(end, (size - end));
+
+	free(index);
+
+	return result;
+}
+
+void FM_NONNULL(1, 2)
+fm_freespace_collect(const struct fm_freespace_range **const restrict ranges, uint64_t *const restrict count)
+{
+	// Only ever called after an --fsmap scan (see fm_plan_defrag()), so these are the filesystem's own
+	*ranges = fm_freespace_ranges;
+	*count = fm_freespace_count;
+}
+
+void
+fm_freespace_free(void)
+{
+	free(fm_freespace_ranges);
+
+	fm_freespace_ranges = NULL;
+	fm_freespace_count = 0U;
+	fm_freespace_alloc = 0U;
+}
+
+static int FM_NONNULL(1, 2)
+fm_freespace_sortby_len_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_freespace_range *const range1 = ptr1;
+	const struct fm_freespace_range *const range2 = ptr2;
+
+	if (range1->len > range2->len)
+		return -1;
+
+	if (range1->len < range2->len)
+		return 1;
+
+	if (range1->off < range2->off)
+		return -1;
+
+	if (range1->off > range2->off)
+		return 1;
+
+	return 0;
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_freespace_report(const char *const restrict rootpath)
+{
+	uint64_t buckets[FM_FREESPACE_BUCKETS];
+	uint64_t bucketbytes[FM_FREESPACE_BUCKETS];
+	uint64_t total = 0U;
+	uint64_t top;
+
+	if (! fm_freespace_exact && ! fm_freespace_from_gaps(rootpath))
+		// This function prints messages on error
+		return false;
+
+	(void) memset(buckets, 0x00, sizeof buckets);
+	(void) memset(bucketbytes, 0x00, sizeof bucketbytes);
+
+	for (uint64_t i = 0U; i < fm_freespace_count; i++)
+	{
+		const uint64_t len = fm_freespace_ranges[i].len;
+		unsigned int bucket = 0U;
+
+		while (bucket < (FM_FREESPACE_BUCKETS - 1U) && (len >> (bucket + 1U)))
+			bucket++;
+
+		buckets[bucket]++;
+		bucketbytes[bucket] += len;
+		total += len;
+	}
+
+	qsort(fm_freespace_ranges, fm_freespace_count, sizeof *fm_freespace_ranges, &fm_freespace_sortby_len_cb);
+
+	top = ((fm_freespace_top < fm_freespace_count) ? fm_freespace_top : fm_freespace_count);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble)
+	{
+		const long double largest = ((fm_freespace_count) ? (long double) fm_freespace_ranges[0].len : 0.0L);
+		const long double fragindex = ((total) ? (1.0L - (largest / (long double) total)) : 0.0L);
+
+		(void) printf("Free space is from .......... : %s\n", ((fm_freespace_exact) ?
+		              "the filesystem's reverse mapping" : "the gaps between the extents mapped"));
+		(void) printf("Free space .................. : %s in %" PRIu64 " ranges\n",
+		              fm_readable_size(FM_READABLE_SIZE, total), fm_freespace_count);
+
+		if (fm_freespace_count)
+		{
+			(void) printf("Largest free range .......... : %s\n",
+			              fm_readable_size(FM_READABLE_SIZE, fm_freespace_ranges[0].len));
+			(void) printf("Average free range .......... : %s\n",
+			              fm_readable_size(FM_READABLE_SIZE, (total / fm_freespace_count)));
+		}
+
+		(void) printf("Fragmentation index ......... : %.4Lf\n", fragindex);
+
+		if (fm_readable_sizes)
+			(void) printf("Sizes are in ................ : human-readable units\n");
+		else
+			(void) printf("Sizes are in ................ : bytes\n");
+
+		if (top && fm_readable_offsets)
+			(void) printf("Free offsets are in ......... : human-readable units\n");
+		else if (top && fm_integral_blksz)
+			(void) printf("Free offsets are in ......... : multiples of filesystem blocks "
+			              "(%" PRIu64 " bytes)\n", fm_blksz);
+		else if (top)
+			(void) printf("Free offsets are in ......... : bytes\n");
+
+		if (top && fm_readable_lengths)
+			(void) printf("Free lengths are in ......... : human-readable units\n");
+		else if (top && fm_integral_blksz)
+			(void) printf("Free lengths are in ......... : multiples of filesystem blocks "
+			              "(%" PRIu64 " bytes)\n", fm_blksz);
+		else if (top)
+			(void) printf("Free lengths are in ......... : bytes\n");
+
+		(void) printf("\n");
+	}
+
+	(void) printf("%20s %20s %12s %20s %8s\n", "From Size", "Below Size", "Ranges", "Free Space", "Share");
+	(void) printf("-------------------- -------------------- ------------ -------------------- --------\n\n");
+
+	for (unsigned int i = 0U; i < FM_FREESPACE_BUCKETS; i++)
+	{
+		const long double share = ((total) ? (100.0L * ((long double) bucketbytes[i] / (long double) total)) : 0.0L);
+		const uint64_t upto = ((i < (FM_FREESPACE_BUCKETS - 1U)) ? (UINT64_C(1) << (i + 1U)) : UINT64_MAX);
+		char from[128U];
+		char below[128U];
+		char pcnt[128U];
+
+		if (! buckets[i])
+			continue;
+
+		(void) memset(from, 0x00, sizeof from);
+		(void) snprintf(from, sizeof from, "%s", fm_readable_size(FM_READABLE_SIZE, (UINT64_C(1) << i)));
+
+		(void) memset(below, 0x00, sizeof below);
+		(void) snprintf(below, sizeof below, "%s", fm_readable_size(FM_READABLE_SIZE, upto));
+
+		(void) memset(pcnt, 0x00, sizeof pcnt);
+		(void) snprintf(pcnt, sizeof pcnt, "%.2Lf%%", share);
+
+		(void) printf("%20s %20s %12" PRIu64 " %20s %8s\n", from, below,
+		              buckets[i], fm_readable_size(FM_READABLE_SIZE, bucketbytes[i]), pcnt);
+	}
+
+	if (top)
+	{
+		(void) printf("\n");
+		(void) printf("%20s %20s    %s\n", "Free Offset", "Free Length", "(largest first)");
+		(void) printf("-------------------- --------------------\n\n");
+	}
+
+	for (uint64_t i = 0U; i < top; i++)
+	{
+		const struct fm_freespace_range *const range = &fm_freespace_ranges[i];
+		const uint64_t off = ((fm_integral_blksz && ! fm_readable_offsets) ? (range->off / fm_blksz) : range->off);
+		const uint64_t len = ((fm_integral_blksz && ! fm_readable_lengths) ? (range->len / fm_blksz) : range->len);
+
+		(void) printf("%20s ", fm_readable_size(FM_READABLE_OFFSET, off));
+		(void) printf("%20s\n", fm_readable_size(FM_READABLE_LENGTH, len));
+	}
+
+	(void) fm_freespace_free();
+
+	return true;
+}
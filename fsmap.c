@@ -0,0 +1,361 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/fiemap.h>
+#include <linux/fsmap.h>
+
+#include "filemap.h"
+
+/* Instead of opening every file and asking for its extents, ask the filesystem for its reverse mapping
+ * (every allocated range of the volume and who owns it) in one sweep. The owners are then named by
+ * walking the directory tree without opening any files; see fm_scan_cached() in extents.c.
+ */
+
+#define FM_FSMAP_BATCH                  8192U
+
+// Not owners as far as the filesystem is concerned; these are used to keep such records apart from file data
+#define FM_FSMAP_OWN_EXTENT_MAP         FMR_OWNER('m', 1)
+#define FM_FSMAP_OWN_ATTR_FORK          FMR_OWNER('m', 2)
+
+struct fm_fsmap_owner
+{
+	uint64_t            owner;          // Special owner code
+	const char *        name;           // Name to give the owner in the results
+};
+
+struct fm_fsmap_rec
+{
+	uint64_t            owner;          // Inode number or special owner code (sort key)
+	uint64_t            loff;           // Logical offset in the owner (sort key)
+	uint64_t            off;            // Physical offset of the range in the volume (in bytes)
+	uint64_t            len;            // Length of the range (in bytes)
+	uint32_t            flags;          // Extent flags (FIEMAP_EXTENT_*)
+	uint32_t            special;        // Whether owner is a special owner code
+};
+
+// The codes used by ext4 and XFS; they agree on the meaning of those that they both use
+static const struct fm_fsmap_owner fm_fsmap_owners[] = {
+	{ FMR_OWN_METADATA,         "[filesystem metadata]"         },
+	{ FM_FSMAP_OWN_EXTENT_MAP,  "[extent map blocks]"           },
+	{ FM_FSMAP_OWN_ATTR_FORK,   "[extended attributes]"         },
+	{ FMR_OWNER('X', 1),        "[static fs metadata]"          },
+	{ FMR_OWNER('X', 2),        "[journal]"                     },
+	{ FMR_OWNER('X', 3),        "[allocation group metadata]"   },
+	{ FMR_OWNER('X', 4),        "[inode btrees]"                },
+	{ FMR_OWNER('X', 5),        "[inode tables]"                },
+	{ FMR_OWNER('X', 6),        "[refcount btrees]"             },
+	{ FMR_OWNER('X', 7),        "[copy-on-write staging]"       },
+	{ FMR_OWNER('X', 8),        "[bad blocks]"                  },
+	{ FMR_OWNER('f', 1),        "[group descriptors]"           },
+	{ FMR_OWNER('f', 2),        "[reserved gdt blocks]"         },
+	{ FMR_OWNER('f', 3),        "[block bitmaps]"               },
+	{ FMR_OWNER('f', 4),        "[inode bitmaps]"               },
+};
+
+static struct fm_fsmap_rec *fm_fsmap_recs = NULL;
+static uint64_t fm_fsmap_count = 0U;
+static uint64_t fm_fsmap_alloc = 0U;
+static uint64_t fm_fsmap_unowned = 0U;
+
+static int FM_NONNULL(1, 2)
+fm_fsmap_sortby_owner_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_fsmap_rec *const rec1 = ptr1;
+	const struct fm_fsmap_rec *const rec2 = ptr2;
+
+	if (rec1->owner != rec2->owner)
+		return ((rec1->owner < rec2->owner) ? -1 : 1);
+
+	if (rec1->loff != rec2->loff)
+		return ((rec1->loff < rec2->loff) ? -1 : 1);
+
+	if (rec1->off != rec2->off)
+		return ((rec1->off < rec2->off) ? -1 : 1);
+
+	return 0;
+}
+
+static void FM_NONNULL(1, 2)
+fm_fsmap_owner_name(const struct fm_fsmap_rec *const restrict rec, char *const restrict buf, const size_t buflen)
+{
+	for (size_t i = 0U; i < (sizeof fm_fsmap_owners / sizeof fm_fsmap_owners[0]); i++)
+	{
+		if (fm_fsmap_owners[i].owner != rec->owner)
+			continue;
+
+		(void) snprintf(buf, buflen, "%s", fm_fsmap_owners[i].name);
+		return;
+	}
+
+	(void) snprintf(buf, buflen, "[metadata owner %c:%" PRIu32 "]",
+	                (char) FMR_OWNER_TYPE(rec->owner), FMR_OWNER_CODE(rec->owner));
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_fsmap_add(const struct fsmap *const restrict fmr)
+{
+	struct fm_fsmap_rec *rec;
+
+	if (fmr->fmr_flags & FMR_OF_SPECIAL_OWNER && fmr->fmr_owner == FMR_OWN_FREE)
+		// Not allocated to anything; the free space report can use these as they are
+		return ((! fm_free_space_mode && fm_defrag_plan_path == NULL) || fm_freespace_add(fmr->fmr_physical, fmr->fmr_length));
+
+	if (fmr->fmr_flags & FMR_OF_SPECIAL_OWNER && fmr->fmr_owner == FMR_OWN_UNKNOWN)
+	{
+		/* In use, but the filesystem does not keep track of by what (ext4 does not record the owners of
+		 * file data); these ranges will be found by mapping the files that own them instead
+		 */
+		fm_fsmap_unowned += fmr->fmr_length;
+		return true;
+	}
+
+	if (fm_fsmap_count && (fmr->fmr_flags & FMR_OF_SHARED) &&
+	    fm_fsmap_recs[fm_fsmap_count - 1U].off == fmr->fmr_physical)
+		/* Another owner of the range we just recorded (reflinks or deduplicated data); the model can only
+		 * have one owner for each extent, so the first one reported keeps it
+		 */
+		return true;
+
+	if (fm_fsmap_count == fm_fsmap_alloc)
+	{
+		const uint64_t alloc = ((fm_fsmap_alloc) ? (fm_fsmap_alloc * 2U) : 65536U);
+		void *const ptr = realloc(fm_fsmap_recs, alloc * sizeof *fm_fsmap_recs);
+
+		if (ptr == NULL)
+		{
+			(void) fm_print_message("%s: while reading the reverse mapping: realloc(3): %s\n",
+			                        argvzero, strerror(errno));
+			return false;
+		}
+
+		fm_fsmap_recs = ptr;
+		fm_fsmap_alloc = alloc;
+	}
+
+	rec = &fm_fsmap_recs[fm_fsmap_count++];
+
+	(void) memset(rec, 0x00, sizeof *rec);
+
+	rec->owner   = fmr->fmr_owner;
+	rec->loff    = fmr->fmr_offset;
+	rec->off     = fmr->fmr_physical;
+	rec->len     = fmr->fmr_length;
+	rec->special = ((fmr->fmr_flags & FMR_OF_SPECIAL_OWNER) ? 1U : 0U);
+
+	if (fmr->fmr_flags & FMR_OF_PREALLOC)
+		rec->flags |= FIEMAP_EXTENT_UNWRITTEN;
+
+	if (fmr->fmr_flags & FMR_OF_SHARED)
+		rec->flags |= FIEMAP_EXTENT_SHARED;
+
+	if (fmr->fmr_flags & (FMR_OF_EXTENT_MAP | FMR_OF_ATTR_FORK))
+	{
+		// These belong to an inode but are not its data; keep them out of the layout of its data
+		rec->owner   = ((fmr->fmr_flags & FMR_OF_EXTENT_MAP) ? FM_FSMAP_OWN_EXTENT_MAP : FM_FSMAP_OWN_ATTR_FORK);
+		rec->special = 1U;
+	}
+	if (rec->special)
+		// Logical offsets are meaningless for these; they are laid out in physical order
+		rec->loff = 0U;
+
+	return true;
+}
+
+static bool FM_WARN_UNUSED
+fm_fsmap_build(void)
+{
+	struct fm_map_extent *mexts = NULL;
+	uint64_t mextalloc = 0U;
+	uint64_t i = 0U;
+	bool result = false;
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: sorting %" PRIu64 " reverse mapping records ...", argvzero, fm_fsmap_count);
+
+	qsort(fm_fsmap_recs, fm_fsmap_count, sizeof *fm_fsmap_recs, &fm_fsmap_sortby_owner_cb);
+
+	while (i < fm_fsmap_count)
+	{
+		const struct fm_fsmap_rec *const first = &fm_fsmap_recs[i];
+		struct fm_map_record mrec;
+		char name[PATH_MAX];
+		uint64_t count = 0U;
+
+		while ((i + count) < fm_fsmap_count && fm_fsmap_recs[i + count].owner == first->owner)
+			count++;
+
+		if (count > mextalloc)
+		{
+			void *const ptr = realloc(mexts, count * sizeof *mexts);
+
+			if (ptr == NULL)
+			{
+				(void) fm_print_message("%s: while reading the reverse mapping: realloc(3): %s\n",
+				                        argvzero, strerror(errno));
+				goto done;
+			}
+
+			mexts = ptr;
+			mextalloc = count;
+		}
+
+		(void) memset(&mrec, 0x00, sizeof mrec);
+		(void) memset(name, 0x00, sizeof name);
+
+		for (uint64_t j = 0U; j < count; j++)
+		{
+			const struct fm_fsmap_rec *const rec = &fm_fsmap_recs[i + j];
+
+			(void) memset(&mexts[j], 0x00, sizeof mexts[j]);
+
+			mexts[j].off   = rec->off;
+			mexts[j].len   = rec->len;
+			mexts[j].loff  = rec->loff;
+			mexts[j].pos   = (j + 1U);
+			mexts[j].flags = rec->flags;
+		}
+
+		mexts[count - 1U].flags |= FIEMAP_EXTENT_LAST;
+
+		mrec.inum       = first->owner;
+		mrec.extcount   = count;
+		mrec.sb.st_ino  = (ino_t) first->owner;
+
+		if (first->special)
+		{
+			// Owners that are not files are named here; everything else is named by the directory walk
+			(void) fm_fsmap_owner_name(first, name, sizeof name);
+
+			mrec.namecount = 1U;
+			mrec.sb.st_size = 0;
+
+			for (uint64_t j = 0U; j < count; j++)
+				mrec.sb.st_size += (off_t) mexts[j].len;
+		}
+
+		if (! fm_restore_inode(&mrec, mexts, name))
+			// This function prints messages on error
+			goto done;
+
+		i += count;
+	}
+
+	result = true;
+
+done:
+
+	free(mexts);
+	free(fm_fsmap_recs);
+
+	fm_fsmap_recs = NULL;
+	fm_fsmap_count = 0U;
+	fm_fsmap_alloc = 0U;
+
+	return result;
+}
+
+bool FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_fsmap_scan(const int fd, const struct stat *const restrict sb, const char *const restrict abspath)
+{
+	struct fsmap_head *head;
+
+	if ((head = calloc(1U, fsmap_sizeof(FM_FSMAP_BATCH))) == NULL)
+	{
+		(void) fm_print_message("%s: while scanning '%s': calloc(3): %s\n", argvzero, abspath, strerror(errno));
+		return false;
+	}
+
+	head->fmh_count = FM_FSMAP_BATCH;
+
+	// Everything from the start of the volume to the end of the volume
+	head->fmh_keys[1].fmr_device   = UINT32_MAX;
+	head->fmh_keys[1].fmr_flags    = UINT32_MAX;
+	head->fmh_keys[1].fmr_physical = UINT64_MAX;
+	head->fmh_keys[1].fmr_owner    = UINT64_MAX;
+	head->fmh_keys[1].fmr_offset   = UINT64_MAX;
+
+	for (;;)
+	{
+		if (! fm_run_quietly)
+			(void) fm_print_message("%s: reading the reverse mapping of %s (%" PRIu64 " records) ...",
+			                        argvzero, abspath, fm_fsmap_count);
+
+		if (ioctl(fd, FS_IOC_GETFSMAP, head) < 0)
+		{
+			(void) fm_print_message("%s: while scanning '%s': ioctl(2) FS_IOC_GETFSMAP: %s\n",
+			                        argvzero, abspath, strerror(errno));
+			free(head);
+			return false;
+		}
+		if (! head->fmh_entries)
+			break;
+
+		for (uint32_t i = 0U; i < head->fmh_entries; i++)
+		{
+			const struct fsmap *const fmr = &head->fmh_recs[i];
+
+			if ((head->fmh_oflags & FMH_OF_DEV_T) && fmr->fmr_device != (uint32_t) sb->st_dev)
+				// An external journal or realtime device; its offsets are not offsets in this volume
+				continue;
+
+			if (! fm_fsmap_add(fmr))
+			{
+				// This function prints messages on error
+				free(head);
+				return false;
+			}
+		}
+		if (head->fmh_recs[head->fmh_entries - 1U].fmr_flags & FMR_OF_LAST)
+			break;
+
+		(void) fsmap_advance(head);
+	}
+
+	free(head);
+
+	if (fm_free_space_mode || fm_defrag_plan_path != NULL)
+		// All of the free ranges have been recorded, even if there were none
+		(void) fm_freespace_complete();
+
+	if (fm_fsmap_unowned && ! fm_run_quietly)
+		(void) fm_print_message("%s: reverse mapping: the owners of %" PRIu64 " bytes are not recorded by the "
+		                        "filesystem; mapping files individually\n", argvzero, fm_fsmap_unowned);
+
+	return fm_fsmap_build();
+}
+
+bool FM_WARN_UNUSED
+fm_fsmap_owners_known(void)
+{
+	return (fm_fsmap_mode && ! fm_fsmap_unowned);
+}
+
+void
+fm_fsmap_finish(void)
+{
+	/* Inodes that the directory walk did not find a name for are outside of the path that was walked,
+	 * were not asked for (directories without -d, symbolic links), or are open but no longer linked
+	 */
+	const uint64_t unnamed = fm_forget_unnamed();
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: reverse mapping: left out %" PRIu64 " inodes that were not found by name\n",
+		                        argvzero, unnamed);
+}
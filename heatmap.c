@@ -0,0 +1,261 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+
+#include "filemap.h"
+
+/* Summarising the layout of the volume in a fixed number of bins (see --heatmap)
+ *
+ * The volume (from offset 0 to the end of the filesystem, or of the last extent if that is further) is divided
+ * into bins of equal size. Each extent is added to every bin it spans. Shared (reflinked) extents overlap, and are
+ * counted once for each inode they belong to, so a bin can hold more bytes than it is long.
+ *
+ * The extents are visited in order of their physical offset, so the bins are too, and an inode can be counted
+ * once in each bin by remembering the last bin it was counted in.
+ */
+
+#define FM_HEATMAP_MAXVAL               255U
+
+struct fm_heatmap_bin
+{
+	uint64_t                    bytes;      // Bytes allocated to the extents mapped
+	uint64_t                    fragbytes;  // Of which, bytes allocated to fragmented inodes
+	uint32_t                    extents;    // Number of extents that begin in it
+	uint32_t                    fraginodes; // Number of fragmented inodes with data in it
+};
+
+struct fm_heatmap_seen
+{
+	UT_hash_handle              hh;         // For entry into the hash of fragmented inodes below
+	const struct fm_inode *     inode;      // Hash key
+	uint64_t                    lastbin;    // The last bin this inode was counted in
+};
+
+uint64_t FM_NONNULL(1) FM_WARN_UNUSED
+fm_heatmap_volume_size(const char *const restrict rootpath, struct fm_extent *const *const restrict index,
+                       const uint64_t count)
+{
+	struct statvfs svb;
+	uint64_t size = 0U;
+
+	// Shared extents overlap, so the last one to start is not necessarily the last one to end
+	for (uint64_t i = 0U; i < count; i++)
+		if ((index[i]->off + index[i]->len) > size)
+			size = (index[i]->off + index[i]->len);
+
+	(void) memset(&svb, 0x00, sizeof svb);
+
+	if (fm_dm_requested())
+	{
+		// Offsets are on the disk underneath the volume (see dm.c), so it is the disk that is divided up
+		if (fm_dm_disk_size() > size)
+			size = fm_dm_disk_size();
+	}
+	else if (! fm_ext4_image && statvfs(rootpath, &svb) == 0 && (((uint64_t) svb.f_blocks) * svb.f_frsize) > size)
+	{
+		// For --ext4-image, the filesystem that <path> is on is not the one being mapped
+		size = (((uint64_t) svb.f_blocks) * svb.f_frsize);
+	}
+
+	return size;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_heatmap_fill(struct fm_heatmap_bin *const restrict bins, struct fm_extent *const *const restrict index,
+                const uint64_t count, const uint64_t binsz)
+{
+	struct fm_heatmap_seen *seenhash = NULL;
+	struct fm_heatmap_seen *seen;
+	struct fm_heatmap_seen *stmp;
+	bool result = false;
+
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		const struct fm_extent *const extent = index[i];
+		const bool fragmented = (extent->inode->flags & FM_IFLAGS_FRAGMENTED);
+		const uint64_t end = (extent->off + extent->len);
+		uint64_t off = extent->off;
+		uint64_t bin = (off / binsz);
+
+		seen = NULL;
+
+		if (fragmented)
+		{
+			HASH_FIND(hh, seenhash, &extent->inode, sizeof extent->inode, seen);
+
+			if (seen == NULL)
+			{
+				if ((seen = calloc(1U, sizeof *seen)) == NULL)
+				{
+					(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+					goto done;
+				}
+
+				seen->inode = extent->inode;
+				seen->lastbin = UINT64_MAX;
+
+				HASH_ADD(hh, seenhash, inode, sizeof seen->inode, seen);
+			}
+		}
+
+		bins[bin].extents++;
+
+		while (off < end)
+		{
+			const uint64_t binend = ((bin + 1U) * binsz);
+			const uint64_t len = (((end < binend) ? end : binend) - off);
+
+			bins[bin].bytes += len;
+
+			if (seen != NULL)
+			{
+				bins[bin].fragbytes += len;
+
+				if (seen->lastbin != bin)
+					bins[bin].fraginodes++;
+
+				seen->lastbin = bin;
+			}
+
+			off += len;
+			bin++;
+		}
+	}
+
+	result = true;
+
+done:
+
+	HASH_ITER(hh, seenhash, seen, stmp)
+	{
+		HASH_DEL(seenhash, seen);
+		free(seen);
+	}
+
+	return result;
+}
+
+static void FM_NONNULL(1)
+fm_heatmap_write_csv(const struct fm_heatmap_bin *const restrict bins, const uint64_t nbins, const uint64_t binsz)
+{
+	(void) printf("bin,start,end,allocated_bytes,fragmented_bytes,extents,fragmented_inodes\n");
+
+	for (uint64_t i = 0U; i < nbins; i++)
+		(void) printf("%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu32 ",%" PRIu32 "\n",
+		              i, (i * binsz), ((i + 1U) * binsz), bins[i].bytes, bins[i].fragbytes, bins[i].extents,
+		              bins[i].fraginodes);
+}
+
+static void FM_NONNULL(1)
+fm_heatmap_write_image(const struct fm_heatmap_bin *const restrict bins, const uint64_t nbins, const uint64_t binsz,
+                       const bool colour)
+{
+	// As close to square as possible, filled in row by row from the top left (the start of the volume)
+	uint64_t width = 1U;
+
+	while ((width * width) < nbins)
+		width++;
+
+	const uint64_t height = ((nbins + width - 1U) / width);
+
+	(void) printf("%s\n# filemap heatmap: %" PRIu64 " bins of %" PRIu64 " bytes\n%" PRIu64 " %" PRIu64 "\n%u\n",
+	              ((colour) ? "P6" : "P5"), nbins, binsz, width, height, FM_HEATMAP_MAXVAL);
+
+	for (uint64_t i = 0U; i < (width * height); i++)
+	{
+		// Brightness is how full the bin is; in colour, from green (not fragmented) to red (fragmented)
+		const long double used = ((i < nbins) ? (((long double) bins[i].bytes) / binsz) : 0.0L);
+		// Overlapping (shared) extents can put more in a bin than it holds; it is shown as full, not as wrapped around
+		const long double fill = ((used < 1.0L) ? used : 1.0L);
+		const long double frag = ((i < nbins && bins[i].bytes) ?
+		                          (((long double) bins[i].fragbytes) / bins[i].bytes) : 0.0L);
+		const unsigned int level = (unsigned int) ((fill * FM_HEATMAP_MAXVAL) + 0.5L);
+
+		if (! colour)
+		{
+			(void) putchar((int) level);
+			continue;
+		}
+
+		(void) putchar((int) ((level * frag) + 0.5L));
+		(void) putchar((int) ((level * (1.0L - frag)) + 0.5L));
+		(void) putchar(0x00);
+	}
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_heatmap_report(const char *const restrict rootpath)
+{
+	struct fm_heatmap_bin *bins = NULL;
+	struct fm_extent **index;
+	uint64_t count = 0U;
+	uint64_t size;
+	uint64_t binsz;
+	uint64_t nbins;
+	bool result = false;
+
+	if ((index = fm_lookup_index(&count)) == NULL)
+		// This function prints messages on error
+		return false;
+
+	size = fm_heatmap_volume_size(rootpath, index, count);
+
+	// Round the bins up to whole blocks, so that the last bin ends at or just after the end of the volume
+	binsz = ((size + fm_heatmap_bins - 1U) / fm_heatmap_bins);
+	binsz = ((((binsz) ? binsz : 1U) + fm_blksz - 1U) / fm_blksz * fm_blksz);
+	nbins = ((size + binsz - 1U) / binsz);
+
+	if (! nbins)
+		nbins = 1U;
+
+	if ((bins = calloc(nbins, sizeof *bins)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		goto done;
+	}
+	if (! fm_heatmap_fill(bins, index, count, binsz))
+		// This function prints messages on error
+		goto done;
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	switch (fm_heatmap_format)
+	{
+		case FM_HEATMAP_FORMAT_CSV:
+			(void) fm_heatmap_write_csv(bins, nbins, binsz);
+			break;
+
+		case FM_HEATMAP_FORMAT_PGM:
+			(void) fm_heatmap_write_image(bins, nbins, binsz, false);
+			break;
+
+		case FM_HEATMAP_FORMAT_PPM:
+			(void) fm_heatmap_write_image(bins, nbins, binsz, true);
+			break;
+	}
+
+	(void) fflush(stdout);
+
+	result = true;
+
+done:
+
+	free(bins);
+	free(index);
+
+	return result;
+}
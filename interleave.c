@@ -0,0 +1,349 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filemap.h"
+
+/* Finding files whose data is interleaved with each other's in the volume (see --interleave)
+ *
+ * Files that are appended to at the same time, by different writers, tend to be given blocks from the same
+ * area of the volume in turn, so that their extents alternate: A B A C B A C ... Walking the extents sorted by
+ * physical offset, an extent of a file whose previous extent was not the one just before it, and ended no more
+ * than the window before it, means that everything in between was allocated while that file was being written.
+ * The extents from that file's previous one up to this one are interleaved; overlapping stretches of them are
+ * merged into one group.
+ *
+ * A group can only grow to take in extents up to the window past the end of its data, so once the walk goes
+ * beyond that, the group is complete; every extent is therefore looked at once to find the groups and at most
+ * once more to total them up. The degree of a group is the number of different files in it.
+ */
+
+struct fm_interleave_file
+{
+	UT_hash_handle              hh;         // For entry into the hash of files seen so far
+	const struct fm_inode *     inode;      // The file (hash key)
+	uint64_t                    last;       // The index of its most recent extent
+	uint64_t                    group;      // The last group it was counted in (1-based; 0 for none)
+	uint64_t                    listed;     // The last group it was listed in (1-based; 0 for none)
+};
+
+struct fm_interleave_group
+{
+	uint64_t                    first;      // Index of the first extent in the group
+	uint64_t                    last;       // Index of the last extent in the group
+	uint64_t                    end;        // Where the data of the group ends in the volume
+	uint64_t                    files;      // Number of different files in the group (its degree)
+	uint64_t                    switches;   // Number of times an extent is of another file than the previous
+	uint64_t                    bytes;      // Number of bytes in the group's extents
+};
+
+struct fm_interleave_state
+{
+	struct fm_extent **             index;      // Extents sorted by physical offset
+	uint64_t                        count;      // Number of extents in the index
+	struct fm_interleave_file *     files;      // Hash of files seen so far
+	struct fm_interleave_group *    groups;     // Groups found so far
+	uint64_t                        groupcount; // Number of groups found so far
+	uint64_t                        groupalloc; // Number of groups allocated
+	uint64_t                        filecount;  // Number of different files in any group
+};
+
+static struct fm_interleave_file * FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_interleave_file(struct fm_interleave_state *const restrict state, const struct fm_inode *const inode)
+{
+	struct fm_interleave_file *file;
+
+	HASH_FIND_PTR(state->files, &inode, file);
+
+	if (file != NULL)
+		return file;
+
+	if ((file = calloc(1U, sizeof *file)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return NULL;
+	}
+
+	file->inode = inode;
+	file->last = UINT64_MAX;
+
+	HASH_ADD_PTR(state->files, inode, file);
+
+	return file;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_interleave_close(struct fm_interleave_state *const restrict state, struct fm_interleave_group *const restrict group)
+{
+	const uint64_t groupid = (state->groupcount + 1U);
+
+	for (uint64_t i = group->first; i <= group->last; i++)
+	{
+		const struct fm_extent *const extent = state->index[i];
+		struct fm_interleave_file *const file = fm_interleave_file(state, extent->inode);
+
+		if (file == NULL)
+			// This function prints messages on error
+			return false;
+
+		if (file->group != groupid)
+		{
+			if (! file->group)
+				state->filecount++;
+
+			file->group = groupid;
+			group->files++;
+		}
+		if (i > group->first && state->index[i - 1U]->inode != extent->inode)
+			group->switches++;
+
+		group->bytes += extent->len;
+	}
+
+	if (state->groupcount == state->groupalloc)
+	{
+		const uint64_t alloc = ((state->groupalloc) ? (state->groupalloc * 2U) : 256U);
+		void *const ptr = realloc(state->groups, alloc * sizeof *state->groups);
+
+		if (ptr == NULL)
+		{
+			(void) fm_print_message("%s: realloc(3): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+
+		state->groups = ptr;
+		state->groupalloc = alloc;
+	}
+
+	(void) memcpy(&state->groups[state->groupcount++], group, sizeof *group);
+	return true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_interleave_find(struct fm_interleave_state *const restrict state)
+{
+	const uint64_t window = (fm_interleave_window * UINT64_C(1024));
+	struct fm_interleave_group group;
+	bool open = false;
+
+	(void) memset(&group, 0x00, sizeof group);
+
+	for (uint64_t i = 0U; i < state->count; i++)
+	{
+		const struct fm_extent *const extent = state->index[i];
+		struct fm_interleave_file *const file = fm_interleave_file(state, extent->inode);
+		const struct fm_extent *prev;
+
+		if (file == NULL)
+			// This function prints messages on error
+			return false;
+
+		if (open && extent->off > (group.end + window))
+		{
+			// Nothing from here on can reach back into the group
+			if (! fm_interleave_close(state, &group))
+				// This function prints messages on error
+				return false;
+
+			(void) memset(&group, 0x00, sizeof group);
+			open = false;
+		}
+
+		prev = ((file->last != UINT64_MAX) ? state->index[file->last] : NULL);
+
+		if (prev != NULL && (file->last + 1U) != i && extent->off <= (prev->off + prev->len + window))
+		{
+			// Everything since this file's previous extent was allocated in between its own
+			if (! open || file->last < group.first)
+				group.first = file->last;
+
+			// Extents do not overlap, so the last one in the group is also the one that ends last
+			group.last = i;
+			group.end = (extent->off + extent->len);
+			open = true;
+		}
+
+		file->last = i;
+	}
+
+	if (open && ! fm_interleave_close(state, &group))
+		// This function prints messages on error
+		return false;
+
+	return true;
+}
+
+static int FM_NONNULL(1, 2)
+fm_interleave_sortby_degree_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_interleave_group *const group1 = ptr1;
+	const struct fm_interleave_group *const group2 = ptr2;
+
+	if (group1->files > group2->files)
+		return -1;
+
+	if (group1->files < group2->files)
+		return 1;
+
+	if (group1->switches > group2->switches)
+		return -1;
+
+	if (group1->switches < group2->switches)
+		return 1;
+
+	if (group1->first < group2->first)
+		return -1;
+
+	if (group1->first > group2->first)
+		return 1;
+
+	return 0;
+}
+
+static const char * FM_NONNULL(1) FM_RETURNS_NONNULL
+fm_interleave_name(const struct fm_inode *const restrict inode)
+{
+	return ((inode->names != NULL) ? inode->names->name : "(unnamed)");
+}
+
+static void FM_NONNULL(1, 2)
+fm_interleave_print(struct fm_interleave_state *const restrict state, const struct fm_interleave_group *const restrict group,
+                    const uint64_t groupid)
+{
+	const struct fm_extent *const head = state->index[group->first];
+	const uint64_t off = ((fm_integral_blksz && ! fm_readable_offsets) ? (head->off / fm_blksz) : head->off);
+	const uint64_t len = ((fm_integral_blksz && ! fm_readable_lengths) ? ((group->end - head->off) / fm_blksz) :
+	                      (group->end - head->off));
+	const char *const common = fm_interleave_name(head->inode);
+	size_t commonlen = strlen(common);
+
+	// The directory that the files have in common, where a preallocation or extent size hint would help
+	for (uint64_t i = group->first; i <= group->last; i++)
+	{
+		const char *const name = fm_interleave_name(state->index[i]->inode);
+		size_t n = 0U;
+
+		while (n < commonlen && name[n] == common[n])
+			n++;
+
+		commonlen = n;
+	}
+	while (commonlen && common[commonlen - 1U] != '/')
+		commonlen--;
+
+	(void) printf("%20s %20s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "    %.*s\n",
+	              fm_readable_size(FM_READABLE_OFFSET, off), fm_readable_size(FM_READABLE_LENGTH, len),
+	              (group->last - group->first + 1U), group->files, group->switches,
+	              (int) ((commonlen) ? commonlen : 1U), ((commonlen) ? common : "?"));
+
+	// List each file once, in the order that they first appear in the group
+	for (uint64_t i = group->first; i <= group->last; i++)
+	{
+		struct fm_interleave_file *file;
+
+		HASH_FIND_PTR(state->files, &state->index[i]->inode, file);
+
+		if (file == NULL || file->listed == groupid)
+			continue;
+
+		file->listed = groupid;
+
+		(void) printf("%20s %20s %12s %12s %12s        %s\n", " ", " ", " ", " ", " ",
+		              fm_interleave_name(state->index[i]->inode));
+	}
+}
+
+bool FM_WARN_UNUSED
+fm_interleave_report(void)
+{
+	struct fm_interleave_state state;
+	struct fm_interleave_file *file;
+	struct fm_interleave_file *ftmp;
+	uint64_t top;
+	uint64_t highest = 0U;
+	bool result = false;
+
+	(void) memset(&state, 0x00, sizeof state);
+
+	if ((state.index = fm_lookup_index(&state.count)) == NULL)
+		// This function prints messages on error
+		return false;
+
+	if (! fm_interleave_find(&state))
+		// This function prints messages on error
+		goto done;
+
+	qsort(state.groups, state.groupcount, sizeof *state.groups, &fm_interleave_sortby_degree_cb);
+
+	if (state.groupcount)
+		highest = state.groups[0].files;
+
+	top = ((fm_interleave_top < state.groupcount) ? fm_interleave_top : state.groupcount);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble)
+	{
+		(void) printf("Window ...................... : %" PRIu64 " KiB\n", fm_interleave_window);
+		(void) printf("Interleaved groups .......... : %" PRIu64 "\n", state.groupcount);
+		(void) printf("Interleaved files ........... : %" PRIu64 "\n", state.filecount);
+		(void) printf("Highest degree .............. : %" PRIu64 " files\n", highest);
+		(void) printf("Groups listed ............... : %" PRIu64 " (highest degree first)\n", top);
+
+		if (fm_readable_offsets)
+			(void) printf("Group offsets are in ........ : human-readable units\n");
+		else if (fm_integral_blksz)
+			(void) printf("Group offsets are in ........ : multiples of filesystem blocks "
+			              "(%" PRIu64 " bytes)\n", fm_blksz);
+		else
+			(void) printf("Group offsets are in ........ : bytes\n");
+
+		if (fm_readable_lengths)
+			(void) printf("Group lengths are in ........ : human-readable units\n");
+		else if (fm_integral_blksz)
+			(void) printf("Group lengths are in ........ : multiples of filesystem blocks "
+			              "(%" PRIu64 " bytes)\n", fm_blksz);
+		else
+			(void) printf("Group lengths are in ........ : bytes\n");
+
+		(void) printf("\n");
+	}
+
+	(void) printf("%20s %20s %12s %12s %12s    %s\n", "Group Offset", "Group Length", "Extents", "Degree",
+	              "Switches", "Directory / File Names");
+	(void) printf("-------------------- -------------------- ------------ ------------ ------------    "
+	              "----------------------\n\n");
+
+	for (uint64_t i = 0U; i < top; i++)
+		(void) fm_interleave_print(&state, &state.groups[i], (i + 1U));
+
+	(void) fflush(stdout);
+
+	result = true;
+
+done:
+
+	HASH_ITER(hh, state.files, file, ftmp)
+	{
+		HASH_DEL(state.files, file);
+		free(file);
+	}
+
+	free(state.groups);
+	free(state.index);
+
+	return result;
+}
@@ -0,0 +1,444 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filemap.h"
+
+/* Finding the files that own ranges of the volume (see --lookup)
+ *
+ * The extents are put in an array in order of their physical offset; since no two of them overlap, their ends
+ * are in the same order, and that array is the index. A few ranges are each answered by a binary search of it.
+ * Many ranges are sorted themselves and merged against it in one pass instead, as a search for each would then
+ * cost more than reading the whole array once. Either way, the ranges are listed in the order they were given.
+ */
+
+struct fm_lookup_range
+{
+	struct fm_lookup_range *    prev;       // For entry into fm_lookup_ranges below
+	struct fm_lookup_range *    next;       // For entry into fm_lookup_ranges below
+
+	uint64_t                    start;      // First byte of the range
+	uint64_t                    end;        // First byte after the range
+	uint64_t                    first;      // Index of the first extent that ends after its start (see below)
+	bool                        inblocks;   // The numbers were in filesystem blocks (see fm_lookup_report())
+	char                        label[];    // The range as it was given
+};
+
+static struct fm_lookup_range *fm_lookup_ranges = NULL;
+static uint64_t fm_lookup_count = 0U;
+
+static bool FM_NONNULL(1, 2, 3, 4, 5) FM_WARN_UNUSED
+fm_lookup_parse_number(const char *const restrict arg, const char **const restrict endp, uint64_t *const restrict value,
+                       uint64_t *const restrict unit, bool *const restrict inblocks)
+{
+	char *end = NULL;
+
+	if (! isdigit((unsigned char) *arg))
+		return false;
+
+	errno = 0;
+
+	*value = (uint64_t) strtoull(arg, &end, 10);
+	*unit = 1U;
+	*inblocks = false;
+
+	if (errno != 0 || end == arg)
+		return false;
+
+	switch (*end)
+	{
+		case 's':
+			// 512-byte sectors (as in kernel messages and blktrace output)
+			*unit = 512U;
+			end++;
+			break;
+
+		case 'b':
+			// Filesystem blocks (as in the listing); their size is only known after the scan
+			*inblocks = true;
+			end++;
+			break;
+
+		case 'K':
+			*unit = (UINT64_C(1) << 10);
+			end++;
+			break;
+
+		case 'M':
+			*unit = (UINT64_C(1) << 20);
+			end++;
+			break;
+
+		case 'G':
+			*unit = (UINT64_C(1) << 30);
+			end++;
+			break;
+
+		case 'T':
+			*unit = (UINT64_C(1) << 40);
+			end++;
+			break;
+	}
+
+	*endp = end;
+	return true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_lookup_add_range(const char *const restrict arg, const size_t len)
+{
+	struct fm_lookup_range *range;
+	const char *end = arg;
+	bool sinblocks = false;
+	bool einblocks = false;
+	uint64_t start = 0U;
+	uint64_t sunit = 0U;
+	uint64_t last = 0U;
+	uint64_t eunit = 0U;
+
+	if (! fm_lookup_parse_number(arg, &end, &start, &sunit, &sinblocks))
+		return false;
+
+	if (*end == '-')
+	{
+		if (! fm_lookup_parse_number(end + 1, &end, &last, &eunit, &einblocks))
+			return false;
+	}
+	else
+	{
+		// A single number is a range of one unit
+		last = start;
+		eunit = sunit;
+		einblocks = sinblocks;
+	}
+
+	if (end != (arg + len) || sinblocks != einblocks)
+		return false;
+
+	// The range includes the whole of its last unit
+	if (start > (UINT64_MAX / sunit) || last >= (UINT64_MAX / eunit) || (start * sunit) > (last * eunit))
+		return false;
+
+	if ((range = calloc(1U, sizeof *range + len + 1U)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	(void) memcpy(range->label, arg, len);
+
+	range->start = (start * sunit);
+	range->end = ((last + 1U) * eunit);
+	range->inblocks = sinblocks;
+
+	DL_APPEND(fm_lookup_ranges, range);
+	fm_lookup_count++;
+
+	return true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_lookup_add_file(const char *const restrict path)
+{
+	char line[BUFSIZ];
+	uint64_t lineno = 0U;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+	{
+		(void) fm_print_message("%s: while reading ranges from '%s': fopen(3): %s\n",
+		                        argvzero, path, strerror(errno));
+		return false;
+	}
+	while (fgets(line, sizeof line, fp) != NULL)
+	{
+		size_t len = strlen(line);
+		size_t skip = 0U;
+
+		lineno++;
+
+		while (len && isspace((unsigned char) line[len - 1U]))
+			line[--len] = 0x00;
+
+		while (skip < len && isspace((unsigned char) line[skip]))
+			skip++;
+
+		if (skip == len || line[skip] == '#')
+			// Blank line or comment
+			continue;
+
+		if (! fm_lookup_add_range(line + skip, len - skip))
+		{
+			(void) fm_print_message("%s: while reading ranges from '%s': line %" PRIu64 ": invalid range '%s'\n",
+			                        argvzero, path, lineno, line + skip);
+			(void) fclose(fp);
+			return false;
+		}
+	}
+	if (ferror(fp))
+	{
+		(void) fm_print_message("%s: while reading ranges from '%s': fgets(3): %s\n",
+		                        argvzero, path, strerror(errno));
+		(void) fclose(fp);
+		return false;
+	}
+
+	(void) fclose(fp);
+	return true;
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_lookup_add(const char *const restrict arg)
+{
+	const char *ptr = arg;
+
+	if (*arg == '@')
+		return fm_lookup_add_file(arg + 1);
+
+	// A comma-separated list of ranges
+	for (;;)
+	{
+		const char *const comma = strchr(ptr, ',');
+		const size_t len = ((comma != NULL) ? (size_t) (comma - ptr) : strlen(ptr));
+
+		if (! fm_lookup_add_range(ptr, len))
+		{
+			(void) fm_print_message("%s: invalid range '%.*s'\n", argvzero, (int) len, ptr);
+			return false;
+		}
+		if (comma == NULL)
+			break;
+
+		ptr = (comma + 1);
+	}
+
+	return true;
+}
+
+bool
+fm_lookup_requested(void)
+{
+	return (fm_lookup_ranges != NULL);
+}
+
+static int FM_NONNULL(1, 2)
+fm_lookup_sortby_off_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_extent *const ext1 = *(const struct fm_extent *const *) ptr1;
+	const struct fm_extent *const ext2 = *(const struct fm_extent *const *) ptr2;
+
+	if (ext1->off < ext2->off)
+		return -1;
+
+	if (ext1->off > ext2->off)
+		return 1;
+
+	return 0;
+}
+
+static int FM_NONNULL(1, 2)
+fm_lookup_sortby_start_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_lookup_range *const range1 = *(const struct fm_lookup_range *const *) ptr1;
+	const struct fm_lookup_range *const range2 = *(const struct fm_lookup_range *const *) ptr2;
+
+	if (range1->start < range2->start)
+		return -1;
+
+	if (range1->start > range2->start)
+		return 1;
+
+	return 0;
+}
+
+struct fm_extent ** FM_NONNULL(1) FM_WARN_UNUSED
+fm_lookup_index(uint64_t *const restrict count)
+{
+	struct fm_extent **index;
+	struct fm_extent *extent;
+	struct fm_extent *etmp;
+	uint64_t i = 0U;
+
+	*count = HASH_COUNT(fm_extents);
+
+	if ((index = calloc(*count + 1U, sizeof *index)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return NULL;
+	}
+
+	HASH_ITER(hh, fm_extents, extent, etmp)
+	{
+		if (! fm_extent_in_volume(extent))
+			// Its offset is not where anything is in the volume (it is often 0); nothing there belongs to it
+			continue;
+
+		index[i++] = extent;
+	}
+
+	*count = i;
+
+	qsort(index, *count, sizeof *index, &fm_lookup_sortby_off_cb);
+
+	return index;
+}
+
+uint64_t FM_NONNULL(1)
+fm_lookup_search(struct fm_extent *const *const restrict index, const uint64_t count, const uint64_t off)
+{
+	uint64_t lo = 0U;
+	uint64_t hi = count;
+
+	// The first extent that ends after the offset
+	while (lo < hi)
+	{
+		const uint64_t mid = (lo + ((hi - lo) / 2U));
+
+		if ((index[mid]->off + index[mid]->len) <= off)
+			lo = (mid + 1U);
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void FM_NONNULL(1, 2)
+fm_lookup_print(const struct fm_lookup_range *const restrict range, struct fm_extent *const *const restrict index,
+                const uint64_t count, const uint64_t first)
+{
+	bool found = false;
+
+	(void) printf("%s:\n", range->label);
+
+	for (uint64_t i = first; i < count && index[i]->off < range->end; i++)
+	{
+		const struct fm_extent *const extent = index[i];
+		const uint64_t extoff = ((fm_integral_blksz && ! fm_readable_offsets) ? \
+		                        (extent->off / fm_blksz) : extent->off);
+		const uint64_t extlen = ((fm_integral_blksz && ! fm_readable_lengths) ? \
+		                        (extent->len / fm_blksz) : extent->len);
+		const struct fm_name *fname;
+		char extpos[128U];
+
+		(void) memset(extpos, 0x00, sizeof extpos);
+		(void) snprintf(extpos, sizeof extpos, "%" PRIu64 "/%" PRIu64, extent->pos, extent->inode->extcount);
+
+		(void) printf("%20s ", fm_readable_size(FM_READABLE_OFFSET, extoff));
+		(void) printf("%20s %12s %12s   ", fm_readable_size(FM_READABLE_LENGTH, extlen), extpos,
+		              fm_inode_number(extent->inode->inum, extent->inode->host));
+
+		DL_FOREACH(extent->inode->names, fname)
+			(void) printf(" %s", fname->name);
+
+		(void) printf("\n");
+
+		found = true;
+	}
+
+	if (! found)
+		(void) printf("%20s (no files; free space or filesystem metadata)\n", " ");
+}
+
+bool
+fm_lookup_report(void)
+{
+	struct fm_extent **index = NULL;
+	struct fm_lookup_range **ranges = NULL;
+	struct fm_lookup_range *range;
+	struct fm_lookup_range *rtmp;
+	uint64_t searchcost = 0U;
+	uint64_t count = 0U;
+	uint64_t i = 0U;
+	bool result = false;
+
+	if ((index = fm_lookup_index(&count)) == NULL)
+		// This function prints messages on error
+		goto done;
+
+	if ((ranges = calloc(fm_lookup_count, sizeof *ranges)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		goto done;
+	}
+
+	DL_FOREACH(fm_lookup_ranges, range)
+	{
+		if (range->inblocks)
+		{
+			// As for the other units (see fm_lookup_add_range()), now that the size of a block is known
+			if (range->end > (UINT64_MAX / fm_blksz))
+			{
+				(void) fm_print_message("%s: invalid range '%s' (too large for %" PRIu64 "-byte blocks)\n",
+				                        argvzero, range->label, fm_blksz);
+				goto done;
+			}
+
+			range->start *= fm_blksz;
+			range->end *= fm_blksz;
+			range->inblocks = false;
+		}
+
+		ranges[i++] = range;
+	}
+
+	for (uint64_t n = count; n; n >>= 1U)
+		searchcost++;
+
+	if ((fm_lookup_count * searchcost) < count)
+	{
+		// Few enough ranges to search for each of them
+		for (i = 0U; i < fm_lookup_count; i++)
+			ranges[i]->first = fm_lookup_search(index, count, ranges[i]->start);
+	}
+	else
+	{
+		/* Sort the ranges too, and walk both arrays together; the first extent that ends after the start of
+		 * each range only ever moves forward, because the ends of the extents are in order
+		 */
+		uint64_t first = 0U;
+
+		qsort(ranges, fm_lookup_count, sizeof *ranges, &fm_lookup_sortby_start_cb);
+
+		for (i = 0U; i < fm_lookup_count; i++)
+		{
+			while (first < count && (index[first]->off + index[first]->len) <= ranges[i]->start)
+				first++;
+
+			ranges[i]->first = first;
+		}
+	}
+
+	DL_FOREACH(fm_lookup_ranges, range)
+		(void) fm_lookup_print(range, index, count, range->first);
+
+	result = true;
+
+done:
+
+	DL_FOREACH_SAFE(fm_lookup_ranges, range, rtmp)
+	{
+		DL_DELETE(fm_lookup_ranges, range);
+		free(range);
+	}
+
+	fm_lookup_count = 0U;
+
+	free(ranges);
+	free(index);
+
+	return result;
+}
@@ -34,10 +34,54 @@ bool fm_readable_offsets = false;
 bool fm_readable_lengths = false;
 bool fm_readable_sizes = false;
 bool fm_readable_gaps = false;
+bool fm_diff_maps = false;
+const char *fm_save_map_path = NULL;
+const char *fm_cache_path = NULL;
+bool fm_watch_mode = false;
+uint64_t fm_watch_interval = 10U;
+const char *fm_checkpoint_path = NULL;
+uint64_t fm_checkpoint_interval = 300U;
+bool fm_resume_scan = false;
+bool fm_keep_going = false;
+bool fm_fsmap_mode = false;
+bool fm_ext4_image = false;
+bool fm_nested_mode = false;
+bool fm_qcow2_mode = false;
+const char *fm_trace_path = NULL;
+const char *fm_badblocks_path = NULL;
+bool fm_free_space_mode = false;
+uint64_t fm_freespace_top = 10U;
+uint64_t fm_heatmap_bins = 0U;
+enum fm_heatmap_format fm_heatmap_format = FM_HEATMAP_FORMAT_CSV;
+uint64_t fm_rollup_top = 0U;
+bool fm_physorder_mode = false;
+bool fm_physorder_weighted = false;
+bool fm_warm_mode = false;
+uint64_t fm_warm_threads = 4U;
+uint64_t fm_warm_rate = 0U;
+const char *fm_defrag_plan_path = NULL;
+uint64_t fm_defrag_count = 0U;
+bool fm_defrag_dry_run = false;
+uint64_t fm_defrag_rate = 0U;
+uint64_t fm_cost_top = 0U;
+enum fm_cost_model fm_cost_model = FM_COST_MODEL_HDD;
+uint64_t fm_cost_seek = 0U;
+uint64_t fm_cost_rate = 0U;
+uint64_t fm_interleave_top = 0U;
+uint64_t fm_interleave_window = 1024U;
+uint64_t fm_waste_top = 0U;
+uint64_t fm_stripe_unit = 0U;
+uint64_t fm_stripe_width = 1U;
+uint64_t fm_erase_block = 0U;
+uint64_t fm_alignment_top = 0U;
+const char *fm_dm_table_path = NULL;
+bool fm_dm_live = false;
+const char *fm_dm_device = NULL;
 
 // Global data structures
 struct fm_extent *fm_extents = NULL;
 struct fm_inode *fm_inodes = NULL;
+struct fm_name *fm_names = NULL;
 
 // For statistics
 bool fm_integral_blksz = true;
@@ -49,11 +93,13 @@ uint64_t fm_dir_count = 0U;
 // Miscellaneous (initialised in main())
 const char *argvzero;
 uint64_t fm_blksz;
+uint64_t fm_max_extent_len;
 
 int FM_NONNULL(2)
 main(int argc, char *argv[])
 {
 	struct stat sb;
+	int status = EXIT_SUCCESS;
 	int fd;
 
 	(void) memset(&sb, 0x00, sizeof sb);
@@ -69,6 +115,14 @@ main(int argc, char *argv[])
 		case FM_OPTPARSE_CONTINUE:
 			break;
 	}
+	if (fm_diff_maps)
+	{
+		if (! fm_diff_snapshots(argv[optind], argv[optind + 1]))
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return EXIT_SUCCESS;
+	}
 	if ((fd = open(argv[optind], O_NOCTTY | O_RDONLY | O_NOFOLLOW, 0)) < 0)
 	{
 		(void) fprintf(stderr, "%s: while scanning '%s': open(2): %s\n",
@@ -85,13 +139,54 @@ main(int argc, char *argv[])
 	}
 
 	fm_blksz = (uint64_t) sb.st_blksize;
+	fm_max_extent_len = fm_score_max_extent(fd);
+
+	if (fm_dm_requested() && ! fm_dm_load(&sb))
+		// This function prints messages on error
+		return EXIT_FAILURE;
 
-	if ((sb.st_mode & S_IFMT) == S_IFDIR)
+	if (fm_cache_path != NULL && ! fm_cache_load(fm_cache_path))
+		// This function prints messages on error
+		return EXIT_FAILURE;
+
+	if (fm_watch_mode && (sb.st_mode & S_IFMT) != S_IFDIR)
 	{
-		if (! fm_scan_directory(fd, &sb, argv[optind]))
+		(void) fprintf(stderr, "%s: while scanning '%s': --watch requires a directory\n",
+		                       argvzero, argv[optind]);
+		(void) fflush(stderr);
+		return EXIT_FAILURE;
+	}
+	if (fm_watch_mode && ! fm_watch_init())
+		// This function prints messages on error
+		return EXIT_FAILURE;
+
+	if (fm_checkpoint_path != NULL && ! fm_checkpoint_begin(argv[optind]))
+		// This function prints messages on error
+		return EXIT_FAILURE;
+
+	if (fm_fsmap_mode && ! fm_fsmap_scan(fd, &sb, argv[optind]))
+		// This function prints messages on error
+		return EXIT_FAILURE;
+
+	if (fm_ext4_image)
+	{
+		if (! fm_ext4_scan(fd, &sb, argv[optind]))
 			// This function prints messages on error
 			return EXIT_FAILURE;
 	}
+	else if ((sb.st_mode & S_IFMT) == S_IFDIR)
+	{
+		if (! fm_scan_directory(fd, &sb, argv[optind]))
+		{
+			// This function prints messages on error; keep what has been scanned so far for --resume
+			(void) fm_checkpoint_save();
+			return EXIT_FAILURE;
+		}
+
+		// Give anything that vanished or was busy while it was being scanned (with --keep-going) another chance
+		(void) fm_retry_failures(&sb);
+		(void) fm_checkpoint_finish();
+	}
 	else if ((sb.st_mode & S_IFMT) == S_IFREG)
 	{
 		if (! fm_scan_extents(fd, &sb, argv[optind]))
@@ -106,12 +201,176 @@ main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (fm_fsmap_mode)
+		(void) fm_fsmap_finish();
+
+	if (fm_dm_requested() && ! fm_dm_translate())
+		// This function prints messages on error
+		return EXIT_FAILURE;
+
+	if (fm_report_failures())
+		status = FM_EXIT_PARTIAL;
+
+	if (fm_cache_path != NULL)
+	{
+		// Entries for inodes that no longer exist are discarded here, by only saving what was just mapped
+		(void) fm_cache_free();
+
+		if (! fm_save_map(fm_cache_path))
+			// This function prints messages on error
+			return EXIT_FAILURE;
+	}
+	if (fm_save_map_path != NULL && ! fm_save_map(fm_save_map_path))
+		// This function prints messages on error
+		return EXIT_FAILURE;
+
+	if (fm_lookup_requested())
+	{
+		// The files found replace the list of extents
+		if (! fm_lookup_report())
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_alignment_top)
+	{
+		// The alignment of the extents to the storage's geometry replaces the list of extents
+		if (! fm_align_report())
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_waste_top)
+	{
+		// The files with space allocated to them that holds no data replace the list of extents
+		if (! fm_waste_report())
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_interleave_top)
+	{
+		// The interleaved groups of files replace the list of extents
+		if (! fm_interleave_report())
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_cost_top)
+	{
+		// The estimated read times replace the list of extents
+		if (! fm_cost_report())
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_defrag_count)
+	{
+		// What was done to each file replaces the list of extents
+		if (! fm_defrag_report())
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_defrag_plan_path != NULL)
+	{
+		// A summary of the plan replaces the list of extents
+		if (! fm_plan_defrag(fm_defrag_plan_path))
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_warm_mode)
+	{
+		// What was read replaces the list of extents
+		if (! fm_warm_report())
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_physorder_mode)
+	{
+		// The files in the order of their data replace the list of extents
+		if (! fm_physorder_report())
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_rollup_top)
+	{
+		// The worst subtrees replace the list of extents
+		(void) fm_rollup_report();
+		return status;
+	}
+	if (fm_heatmap_bins)
+	{
+		// The heatmap replaces the list of extents
+		if (! fm_heatmap_report(argv[optind]))
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_free_space_mode)
+	{
+		// The free space replaces the list of extents
+		if (! fm_freespace_report(argv[optind]))
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_badblocks_path != NULL)
+	{
+		// The damaged files replace the list of extents
+		if (! fm_badblocks_report(fm_badblocks_path))
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_trace_path != NULL)
+	{
+		// The I/O per file replaces the list of extents
+		if (! fm_trace_report(fm_trace_path))
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+	if (fm_qcow2_mode)
+	{
+		// The report replaces the list of extents
+		(void) fm_qcow2_report();
+		return status;
+	}
+	if (fm_watch_mode)
+	{
+		if (! fm_watch_run(argv[optind], &sb))
+			// This function prints messages on error
+			return EXIT_FAILURE;
+
+		return status;
+	}
+
 	if (! fm_run_quietly)
 		(void) fm_print_message("%s: sorting results ...", argvzero);
 
+	if (fm_sort_method == FM_SORTMETH_READ_COST)
+		(void) fm_cost_prepare();
+
 	HASH_SORT(fm_extents, fm_sortby_extent_cb);
 
 	(void) fm_print_results();
 
-	return EXIT_SUCCESS;
+	return status;
 }
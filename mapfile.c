@@ -0,0 +1,366 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filemap.h"
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_write_records(FILE *const restrict fp, const uint32_t flags)
+{
+	struct fm_map_header hdr;
+	struct fm_inode *inode;
+	struct fm_inode *itmp;
+
+	(void) memset(&hdr, 0x00, sizeof hdr);
+	(void) memcpy(hdr.magic, FM_MAPFILE_MAGIC, sizeof FM_MAPFILE_MAGIC);
+
+	hdr.version      = FM_MAPFILE_VERSION;
+	hdr.flags        = flags;
+	hdr.blksz        = fm_blksz;
+	hdr.inode_count  = fm_inode_count;
+	hdr.extent_count = fm_extent_count;
+	hdr.file_count   = fm_file_count;
+	hdr.dir_count    = fm_dir_count;
+
+	if (fm_integral_blksz)
+		hdr.flags |= FM_MAPFILE_FLAGS_INTEGRAL_BLKSZ;
+
+	if (fm_scan_directories)
+		hdr.flags |= FM_MAPFILE_FLAGS_DIRECTORIES;
+
+	if (fwrite(&hdr, sizeof hdr, 1U, fp) != 1U)
+		return false;
+
+	HASH_ITER(hh, fm_inodes, inode, itmp)
+	{
+		const struct fm_extent *extent;
+		const struct fm_name *fname;
+		struct fm_map_record rec;
+
+		(void) memset(&rec, 0x00, sizeof rec);
+		(void) memcpy(&rec.sb, &inode->sb, sizeof rec.sb);
+
+		rec.inum      = inode->inum;
+		rec.host      = inode->host;
+		rec.extcount  = inode->extcount;
+		rec.namecount = inode->namecount;
+		rec.flags     = (inode->flags & ~FM_IFLAGS_PRINTED);
+
+		DL_FOREACH(inode->names, fname)
+			rec.namelen += (strlen(fname->name) + 1U);
+
+		if (fwrite(&rec, sizeof rec, 1U, fp) != 1U)
+			return false;
+
+		DL_FOREACH(inode->extents, extent)
+		{
+			struct fm_map_extent mext;
+
+			(void) memset(&mext, 0x00, sizeof mext);
+
+			mext.off   = extent->off;
+			mext.len   = extent->len;
+			mext.loff  = extent->loff;
+			mext.pos   = extent->pos;
+			mext.flags = extent->flags;
+
+			if (fwrite(&mext, sizeof mext, 1U, fp) != 1U)
+				return false;
+		}
+
+		DL_FOREACH(inode->names, fname)
+		{
+			if (fwrite(fname->name, strlen(fname->name) + 1U, 1U, fp) != 1U)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_write_map(const char *const restrict path, const uint32_t flags,
+             bool (*const trailer)(FILE *, void *), void *const restrict trailerarg)
+{
+	char tmppath[PATH_MAX];
+	FILE *fp;
+
+	(void) memset(tmppath, 0x00, sizeof tmppath);
+
+	// Write to a temporary file and rename it into place, so that an existing map is never left half-written
+	(void) snprintf(tmppath, sizeof tmppath, "%s.tmp", path);
+
+	if ((fp = fopen(tmppath, "wb")) == NULL)
+	{
+		(void) fm_print_message("%s: while saving '%s': fopen(3): %s\n", argvzero, tmppath, strerror(errno));
+		return false;
+	}
+	if (! fm_write_records(fp, flags))
+		goto write_error;
+
+	if (trailer != NULL && ! trailer(fp, trailerarg))
+		goto write_error;
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+		goto write_error;
+
+	if (fclose(fp) != 0)
+	{
+		(void) fm_print_message("%s: while saving '%s': fclose(3): %s\n", argvzero, tmppath, strerror(errno));
+		(void) unlink(tmppath);
+		return false;
+	}
+	if (rename(tmppath, path) < 0)
+	{
+		(void) fm_print_message("%s: while saving '%s': rename(2): %s\n", argvzero, path, strerror(errno));
+		(void) unlink(tmppath);
+		return false;
+	}
+
+	return true;
+
+write_error:
+
+	(void) fm_print_message("%s: while saving '%s': write: %s\n", argvzero, tmppath, strerror(errno));
+	(void) fclose(fp);
+	(void) unlink(tmppath);
+	return false;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_write_checkpoint_trailer(FILE *const restrict fp, void *const restrict trailerarg)
+{
+	const struct fm_checkpoint *const ckpt = trailerarg;
+	const struct fm_checkpoint_dir *cdir;
+	const struct fm_checkpoint_dir *ctmp;
+	const uint64_t count = HASH_COUNT(ckpt->dirs);
+
+	if (fwrite(ckpt->rootpath, strlen(ckpt->rootpath) + 1U, 1U, fp) != 1U)
+		return false;
+
+	if (fwrite(&count, sizeof count, 1U, fp) != 1U)
+		return false;
+
+	HASH_ITER(hh, ckpt->dirs, cdir, ctmp)
+	{
+		if (fwrite(cdir->path, strlen(cdir->path) + 1U, 1U, fp) != 1U)
+			return false;
+	}
+
+	return true;
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_save_map(const char *const restrict path)
+{
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: saving map to %s ...", argvzero, path);
+
+	return fm_write_map(path, FM_MAPFILE_FLAGS_NONE, NULL, NULL);
+}
+
+bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_save_checkpoint(const char *const restrict path, const struct fm_checkpoint *const restrict ckpt)
+{
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: saving checkpoint to %s ...", argvzero, path);
+
+	return fm_write_map(path, FM_MAPFILE_FLAGS_CHECKPOINT, &fm_write_checkpoint_trailer, (void *) ckpt);
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_read_string(FILE *const restrict fp, char *const restrict buf)
+{
+	for (size_t i = 0U; i < PATH_MAX; i++)
+	{
+		const int chr = fgetc(fp);
+
+		if (chr == EOF)
+			return false;
+
+		buf[i] = (char) chr;
+
+		if (chr == 0x00)
+			return true;
+	}
+
+	// Too long to be a path; the file is corrupt
+	errno = ENAMETOOLONG;
+	return false;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_read_checkpoint_trailer(FILE *const restrict fp, struct fm_checkpoint *const restrict ckpt)
+{
+	char path[PATH_MAX];
+	uint64_t count;
+
+	if (! fm_read_string(fp, ckpt->rootpath))
+		return false;
+
+	if (fread(&count, sizeof count, 1U, fp) != 1U)
+		return false;
+
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		if (! fm_read_string(fp, path))
+			return false;
+
+		if (! fm_checkpoint_add_dir(ckpt, path))
+			return false;
+	}
+
+	return true;
+}
+
+bool FM_NONNULL(1, 2, 3) FM_WARN_UNUSED
+fm_load_map(const char *const restrict path, struct fm_map_header *const restrict hdr,
+            bool (*const callback)(const struct fm_map_record *, const struct fm_map_extent *, const char *, void *),
+            void *const restrict cbarg)
+{
+	return fm_load_checkpoint(path, hdr, callback, cbarg, NULL);
+}
+
+bool FM_NONNULL(1, 2, 3) FM_WARN_UNUSED
+fm_load_checkpoint(const char *const restrict path, struct fm_map_header *const restrict hdr,
+                   bool (*const callback)(const struct fm_map_record *, const struct fm_map_extent *, const char *,
+                                          void *),
+                   void *const restrict cbarg, struct fm_checkpoint *const restrict ckpt)
+{
+	struct fm_map_extent *mexts = NULL;
+	uint64_t mexts_alloc = 0U;
+	char *names = NULL;
+	uint64_t names_alloc = 0U;
+	bool result = false;
+	FILE *fp;
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: loading map from %s ...", argvzero, path);
+
+	(void) memset(hdr, 0x00, sizeof *hdr);
+
+	if ((fp = fopen(path, "rb")) == NULL)
+	{
+		(void) fm_print_message("%s: while loading '%s': fopen(3): %s\n", argvzero, path, strerror(errno));
+		return false;
+	}
+	if (fread(hdr, sizeof *hdr, 1U, fp) != 1U)
+		goto read_error;
+
+	if (memcmp(hdr->magic, FM_MAPFILE_MAGIC, sizeof FM_MAPFILE_MAGIC) != 0 || hdr->version != FM_MAPFILE_VERSION)
+	{
+		(void) fm_print_message("%s: while loading '%s': not a map saved by this version of filemap\n",
+		                        argvzero, path);
+		goto done;
+	}
+	if (ckpt != NULL && ! (hdr->flags & FM_MAPFILE_FLAGS_CHECKPOINT))
+	{
+		(void) fm_print_message("%s: while loading '%s': not a checkpoint\n", argvzero, path);
+		goto done;
+	}
+
+	for (uint64_t i = 0U; i < hdr->inode_count; i++)
+	{
+		struct fm_map_record rec;
+		uint64_t nuls = 0U;
+
+		if (fread(&rec, sizeof rec, 1U, fp) != 1U)
+			goto read_error;
+
+		if (rec.namecount > (UINT64_MAX / PATH_MAX) || rec.namelen > (rec.namecount * PATH_MAX) ||
+		    rec.namelen >= SIZE_MAX || rec.extcount > (SIZE_MAX / sizeof *mexts))
+		{
+			(void) fm_print_message("%s: while loading '%s': corrupt record for inode %" PRIu64 "\n",
+			                        argvzero, path, rec.inum);
+			goto done;
+		}
+		if (rec.extcount > mexts_alloc)
+		{
+			void *const ptr = realloc(mexts, rec.extcount * sizeof *mexts);
+
+			if (ptr == NULL)
+			{
+				(void) fm_print_message("%s: while loading '%s': realloc(3): %s\n",
+				                        argvzero, path, strerror(errno));
+				goto done;
+			}
+
+			mexts = ptr;
+			mexts_alloc = rec.extcount;
+		}
+		if ((rec.namelen + 1U) > names_alloc)
+		{
+			void *const ptr = realloc(names, rec.namelen + 1U);
+
+			if (ptr == NULL)
+			{
+				(void) fm_print_message("%s: while loading '%s': realloc(3): %s\n",
+				                        argvzero, path, strerror(errno));
+				goto done;
+			}
+
+			names = ptr;
+			names_alloc = (rec.namelen + 1U);
+		}
+		if (rec.extcount && fread(mexts, sizeof *mexts, rec.extcount, fp) != rec.extcount)
+			goto read_error;
+
+		if (rec.namelen && fread(names, rec.namelen, 1U, fp) != 1U)
+			goto read_error;
+
+		// Guarantee termination of the last name even if the file is corrupt
+		names[rec.namelen] = 0x00;
+
+		for (uint64_t j = 0U; j < rec.namelen; j++)
+			if (! names[j])
+				nuls++;
+
+		// Every name is followed by its NUL, so that walking them never goes past the end of the buffer
+		if (nuls != rec.namecount || (rec.namelen && names[rec.namelen - 1U]))
+		{
+			(void) fm_print_message("%s: while loading '%s': corrupt record for inode %" PRIu64 "\n",
+			                        argvzero, path, rec.inum);
+			goto done;
+		}
+		if (! callback(&rec, mexts, names, cbarg))
+			// The callback prints messages on error
+			goto done;
+	}
+
+	if (ckpt != NULL && (hdr->flags & FM_MAPFILE_FLAGS_CHECKPOINT) && ! fm_read_checkpoint_trailer(fp, ckpt))
+		goto read_error;
+
+	result = true;
+	goto done;
+
+read_error:
+
+	if (ferror(fp))
+		(void) fm_print_message("%s: while loading '%s': fread(3): %s\n", argvzero, path, strerror(errno));
+	else
+		(void) fm_print_message("%s: while loading '%s': unexpected end of file\n", argvzero, path);
+
+done:
+
+	(void) fclose(fp);
+	free(mexts);
+	free(names);
+
+	return result;
+}
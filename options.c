@@ -5,23 +5,101 @@
  * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
  */
 
+#include <errno.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "filemap.h"
 
+enum fm_longopt_only
+{
+	FM_LONGOPT_SAVE_MAP             = 0x100,
+	FM_LONGOPT_DIFF                 = 0x101,
+	FM_LONGOPT_CACHE                = 0x102,
+	FM_LONGOPT_WATCH                = 0x103,
+	FM_LONGOPT_WATCH_INTERVAL       = 0x104,
+	FM_LONGOPT_CHECKPOINT           = 0x105,
+	FM_LONGOPT_CHECKPOINT_INTERVAL  = 0x106,
+	FM_LONGOPT_RESUME               = 0x107,
+	FM_LONGOPT_KEEP_GOING           = 0x108,
+	FM_LONGOPT_FSMAP                = 0x109,
+	FM_LONGOPT_EXT4_IMAGE           = 0x10A,
+	FM_LONGOPT_NESTED               = 0x10B,
+	FM_LONGOPT_QCOW2                = 0x10C,
+	FM_LONGOPT_LOOKUP               = 0x10D,
+	FM_LONGOPT_TRACE                = 0x10E,
+	FM_LONGOPT_BADBLOCKS            = 0x10F,
+	FM_LONGOPT_FREE_SPACE           = 0x110,
+	FM_LONGOPT_FREE_SPACE_TOP       = 0x111,
+	FM_LONGOPT_HEATMAP              = 0x112,
+	FM_LONGOPT_HEATMAP_FORMAT       = 0x113,
+	FM_LONGOPT_ROLLUP               = 0x114,
+	FM_LONGOPT_PHYSORDER            = 0x115,
+	FM_LONGOPT_PHYSORDER_WEIGHTED   = 0x116,
+	FM_LONGOPT_WARM                 = 0x117,
+	FM_LONGOPT_WARM_THREADS         = 0x118,
+	FM_LONGOPT_WARM_RATE            = 0x119,
+	FM_LONGOPT_PLAN_DEFRAG          = 0x11A,
+	FM_LONGOPT_DEFRAG               = 0x11B,
+	FM_LONGOPT_DEFRAG_DRY_RUN       = 0x11C,
+	FM_LONGOPT_DEFRAG_RATE          = 0x11D,
+	FM_LONGOPT_READ_COST            = 0x11E,
+	FM_LONGOPT_COST_MODEL           = 0x11F,
+	FM_LONGOPT_COST_SEEK            = 0x120,
+	FM_LONGOPT_COST_RATE            = 0x121,
+	FM_LONGOPT_INTERLEAVE           = 0x122,
+	FM_LONGOPT_INTERLEAVE_WINDOW    = 0x123,
+	FM_LONGOPT_SPACE_WASTE          = 0x124,
+	FM_LONGOPT_STRIPE_UNIT          = 0x125,
+	FM_LONGOPT_STRIPE_WIDTH         = 0x126,
+	FM_LONGOPT_ERASE_BLOCK          = 0x127,
+	FM_LONGOPT_ALIGNMENT            = 0x128,
+	FM_LONGOPT_DM_TABLE             = 0x129,
+	FM_LONGOPT_DM_LIVE              = 0x12A,
+	FM_LONGOPT_DM_DEVICE            = 0x12B,
+};
+
 static void
 fm_print_usage(void)
 {
 	(void) fprintf(stderr, "\n"
 	    "  Usage: filemap -h\n"
-	    "  Usage: filemap [-A | -D] [-O | -L | -C | -H | -N | -S | -F]\n"
+	    "  Usage: filemap [-A | -D] [-O | -L | -C | -H | -N | -S | -F | -R | -E]\n"
 	    "                 [-d [[-f -n] | -g] -q -x -y -z] [[-o -l -s -t] | -r]\n"
+	    "                 [--save-map <file>] [--cache <file>]\n"
+	    "                 [--watch [--watch-interval <seconds>]]\n"
+	    "                 [[--checkpoint <file> | --resume <file>]\n"
+	    "                  [--checkpoint-interval <seconds>]]\n"
+	    "                 [--keep-going] [--fsmap | --nested]\n"
+	    "                 [[--dm-table <file> | --dm-live] [--dm-device <device>]]\n"
+	    "                 [--qcow2 | --lookup <ranges> | --trace <file> |\n"
+	    "                  --badblocks <file> |\n"
+	    "                  --free-space [--free-space-top <count>] |\n"
+	    "                  --heatmap <bins> [--heatmap-format <format>] |\n"
+	    "                  --rollup <count> |\n"
+	    "                  --physical-order-list [--physical-order-weighted] |\n"
+	    "                  --warm [--warm-threads <count>] [--warm-rate <MiB/s>] |\n"
+	    "                  --plan-defrag <file> |\n"
+	    "                  --defrag <count> [--defrag-dry-run] [--defrag-rate <MiB/s>] |\n"
+	    "                  --read-cost <count> [--cost-model <model>]\n"
+	    "                   [--cost-seek <us>] [--cost-rate <MiB/s>] |\n"
+	    "                  --interleave <count> [--interleave-window <KiB>] |\n"
+	    "                  --space-waste <count> |\n"
+	    "                  --alignment <count>]\n"
+	    "                 [--stripe-unit <KiB> [--stripe-width <disks>]]\n"
+	    "                 [--erase-block <KiB>]\n"
 	    "                 <path>\n"
+	    "  Usage: filemap [-A | -D] [-O | -L | -C | -H | -N | -S | -F | -R | -E] [...]\n"
+	    "                 [--keep-going] --ext4-image <image>\n"
+	    "  Usage: filemap [-q -x] --diff <old map> <new map>\n"
 	    "\n"
+	);
+	(void) fprintf(stderr,
 	    "    -h / --help               Show this help message and exit.\n"
 	    "\n"
 	    "    -A / --sort-ascending     Display extents in ascending order.\n"
@@ -34,6 +112,10 @@ fm_print_usage(void)
 	    "    -N / --order-inum         Order extents by inode number.\n"
 	    "    -S / --order-filesize     Order extents by file size.\n"
 	    "    -F / --order-filename     Order extents by file name.\n"
+	    "    -R / --order-score        Order extents by fragmentation score.\n"
+	    "    -E / --order-cost         Order extents by estimated read time\n"
+	    "                              (see --read-cost), which is listed in\n"
+	    "                              a column of its own.\n"
 	    "\n"
 	    "    -d / --scan-directories   Scan the extents that belong to\n"
 	    "                              directories as well as regular files.\n"
@@ -79,6 +161,352 @@ fm_print_usage(void)
 	    "                                  --readable-sizes\n"
 	    "                                  --readable-gaps\n"
 	    "\n"
+	);
+
+	(void) fprintf(stderr,
+	    "    --save-map <file>         Save the map to <file> after scanning,\n"
+	    "                              for later use with --diff.\n"
+	    "\n"
+	    "    --diff <old> <new>        Compare two maps saved with --save-map\n"
+	    "                              and report the inodes that were added\n"
+	    "                              (+), removed (-), moved (M) or that\n"
+	    "                              gained extents or became fragmented or\n"
+	    "                              unordered (F), with per-category totals.\n"
+	    "                              Does not scan anything.\n"
+	    "\n"
+	    "    --cache <file>            Reuse the extents of inodes that have\n"
+	    "                              not changed (same device, inode number,\n"
+	    "                              size, mtime and ctime) since <file> was\n"
+	    "                              written, instead of querying them again.\n"
+	    "                              <file> is (re)written after scanning,\n"
+	    "                              and is created if it does not exist.\n"
+	    "\n"
+	    "    --watch                   After scanning <path> (a directory), keep\n"
+	    "                              running, using inotify(7) to remap only\n"
+	    "                              the files that are created, modified,\n"
+	    "                              moved or deleted, and print a summary of\n"
+	    "                              what changed every interval instead of\n"
+	    "                              the list of extents. Directories that\n"
+	    "                              cannot be watched (fs.inotify.max_user_-\n"
+	    "                              watches) are rescanned every interval.\n"
+	    "\n"
+	    "    --watch-interval <secs>   How often to remap and print a summary\n"
+	    "                              in --watch mode. The default is 10;\n"
+	    "                              at most 604800 (one week).\n"
+	    "\n"
+	    "    --checkpoint <file>       While scanning a directory, periodically\n"
+	    "                              save everything mapped so far and which\n"
+	    "                              directories have been completely scanned\n"
+	    "                              to <file>, and also when the scan fails.\n"
+	    "                              <file> is removed when the scan\n"
+	    "                              completes. Incompatible with --watch.\n"
+	    "\n"
+	    "    --resume <file>           Continue an interrupted scan from the\n"
+	    "                              checkpoint <file>, without reading the\n"
+	    "                              directories that were completed again.\n"
+	    "                              Give the same <path> and options as the\n"
+	    "                              interrupted scan. Implies --checkpoint.\n"
+	    "\n"
+	    "    --checkpoint-interval <secs>\n"
+	    "                              How often to save the checkpoint. The\n"
+	    "                              default is 300.\n"
+	    "\n"
+	);
+
+	(void) fprintf(stderr,
+	    "    --keep-going              Don't stop at entries that cannot be\n"
+	    "                              opened or mapped; skip them, retry the\n"
+	    "                              ones that vanished or were busy once\n"
+	    "                              the scan is done, and list the rest.\n"
+	    "\n"
+	    "    --fsmap                   Read the extents of everything in the\n"
+	    "                              filesystem, including its metadata, in\n"
+	    "                              one sweep of its reverse mapping (ext4,\n"
+	    "                              XFS) instead of opening every file.\n"
+	    "                              <path> is only walked to find names.\n"
+	    "                              Incompatible with --watch and\n"
+	    "                              --checkpoint.\n"
+	    "\n"
+	    "    --ext4-image              Read the ext2/ext3/ext4 filesystem in\n"
+	    "                              the image file or block device <image>\n"
+	    "                              directly, without mounting it. Offsets\n"
+	    "                              are in the image and names are in the\n"
+	    "                              filesystem in it. Incompatible with\n"
+	    "                              --fsmap, --watch and --checkpoint.\n"
+	    "\n"
+	    "    --nested                  Also read the ext2/ext3/ext4 filesystems\n"
+	    "                              in image files found under <path>, and\n"
+	    "                              map the files in them to where they are\n"
+	    "                              in the volume, through the extents of\n"
+	    "                              the image file. They are named\n"
+	    "                              'image:/path/in/image', and the image\n"
+	    "                              file keeps only the extents not used by\n"
+	    "                              them. Incompatible with --cache, --fsmap,\n"
+	    "                              --watch and --checkpoint.\n"
+	    "\n"
+	    "    --dm-table <file>         The volume is a device-mapper device (e.g.\n"
+	    "                              an LVM logical volume) with the table in\n"
+	    "                              <file> (the output of 'dmsetup table').\n"
+	    "                              Extents are translated through its\n"
+	    "                              linear, striped and crypt segments to\n"
+	    "                              where they are on the disk underneath,\n"
+	    "                              and all offsets (including those given\n"
+	    "                              to --lookup, --trace and --badblocks, and\n"
+	    "                              those of --heatmap) are on that disk.\n"
+	    "                              Incompatible with --cache, --save-map,\n"
+	    "                              --watch, --checkpoint, --free-space,\n"
+	    "                              --defrag and --plan-defrag.\n"
+	    "\n"
+	    "    --dm-live                 As --dm-table, but read the table of the\n"
+	    "                              device that <path> is on from the kernel\n"
+	    "                              (requires root).\n"
+	    "\n"
+	    "    --dm-device <device>      With --dm-table or --dm-live, keep only\n"
+	    "                              the extents on this underlying device\n"
+	    "                              (a path, or <major>:<minor> as in the\n"
+	    "                              table). Required if the table maps onto\n"
+	    "                              more than one device (striped, or on\n"
+	    "                              several physical volumes).\n"
+	    "\n"
+	    "    --qcow2                   Instead of listing the extents, report\n"
+	    "                              on the qcow2 images found under <path>:\n"
+	    "                              how their clusters are allocated, and\n"
+	    "                              how often reading the guest's disk from\n"
+	    "                              start to finish has to seek, both in\n"
+	    "                              the image file and in the volume (per\n"
+	    "                              MiB of guest data). Incompatible with\n"
+	    "                              --fsmap, --ext4-image, --watch and\n"
+	    "                              --checkpoint.\n"
+	    "\n"
+	);
+
+	(void) fprintf(stderr,
+	    "    --lookup <ranges>         Instead of listing the extents, list the\n"
+	    "                              files that own the given ranges of the\n"
+	    "                              volume. <ranges> is a comma-separated\n"
+	    "                              list of START[-END], or @<file> to read\n"
+	    "                              them from <file>, one per line. Both\n"
+	    "                              ends are included; they are decimal\n"
+	    "                              numbers of bytes, or of sectors,\n"
+	    "                              filesystem blocks, KiB, MiB, GiB or TiB\n"
+	    "                              with a suffix of s, b, K, M, G or T.\n"
+	    "                              Can be given more than once.\n"
+	    "                              Incompatible with --watch.\n"
+	    "\n"
+	    "    --trace <file>            Instead of listing the extents, read\n"
+	    "                              the blkparse(1) output in <file> ('-'\n"
+	    "                              for standard input) of a blktrace(8)\n"
+	    "                              of the device <path> is on, and report\n"
+	    "                              the requests, bytes, reads, writes and\n"
+	    "                              the share of sequential requests of\n"
+	    "                              each file and directory, most bytes\n"
+	    "                              first. Incompatible with --watch.\n"
+	    "\n"
+	    "    --badblocks <file>        Instead of listing the extents, list the\n"
+	    "                              file, inode and offset in the file of\n"
+	    "                              each block in <file> (the output of\n"
+	    "                              badblocks(8), run with -b set to the\n"
+	    "                              filesystem's block size), and then the\n"
+	    "                              damaged files. With -n, only the names\n"
+	    "                              of the damaged files are printed.\n"
+	    "                              Incompatible with --watch.\n"
+	    "\n"
+	    "    --free-space              Instead of listing the extents, report\n"
+	    "                              on the free space: a histogram of the\n"
+	    "                              sizes of the free ranges (in powers of\n"
+	    "                              2), the largest of them, and an index\n"
+	    "                              of how fragmented it is (from 0, all in\n"
+	    "                              one range, towards 1). Exact with\n"
+	    "                              --fsmap; otherwise it is the gaps\n"
+	    "                              between the extents mapped, which also\n"
+	    "                              contain anything that was not mapped.\n"
+	    "                              Incompatible with --watch.\n"
+	    "\n"
+	    "    --free-space-top <count>  How many of the largest free ranges to\n"
+	    "                              list. The default is 10.\n"
+	    "\n"
+	);
+	(void) fprintf(stderr,
+	    "    --heatmap <bins>          Instead of listing the extents, divide\n"
+	    "                              the volume into <bins> ranges of equal\n"
+	    "                              size (whole blocks; at most 16777216)\n"
+	    "                              and write, for each, the bytes that are\n"
+	    "                              allocated, the bytes allocated to\n"
+	    "                              fragmented inodes, how many extents\n"
+	    "                              begin in it, and how many fragmented\n"
+	    "                              inodes have data in it. Incompatible\n"
+	    "                              with --watch.\n"
+	    "\n"
+	    "    --heatmap-format <format> 'csv' (the default) for one line per\n"
+	    "                              bin; 'pgm' for a greyscale image, one\n"
+	    "                              pixel per bin, as bright as the bin is\n"
+	    "                              full; or 'ppm' for the same in colour,\n"
+	    "                              from green (not fragmented) to red\n"
+	    "                              (fragmented). Images are binary; the\n"
+	    "                              start of the volume is at the top left.\n"
+	    "\n"
+	    "    --rollup <count>          Instead of listing the extents, total\n"
+	    "                              the files, extents, fragmented files\n"
+	    "                              and bytes allocated in each directory\n"
+	    "                              and everything under it, and list the\n"
+	    "                              <count> directories with the most\n"
+	    "                              extents beyond one per file (the most\n"
+	    "                              to gain from defragmenting). Hardlinks\n"
+	    "                              count in each directory they are in.\n"
+	    "                              Incompatible with --fsmap, --nested,\n"
+	    "                              --ext4-image, --watch and --checkpoint.\n"
+	    "\n"
+	);
+	(void) fprintf(stderr,
+	    "    --physical-order-list     Instead of listing the extents, list\n"
+	    "                              the names of the regular files, each\n"
+	    "                              file once, in the order that their\n"
+	    "                              data begins in the volume; for reading\n"
+	    "                              them (tar -T, rsync --files-from) with\n"
+	    "                              as few seeks as possible. Files with\n"
+	    "                              no data are last. Give -z to separate\n"
+	    "                              them by a NUL. Incompatible with\n"
+	    "                              --watch.\n"
+	    "\n"
+	    "    --physical-order-weighted Order the files by the mean offset of\n"
+	    "                              their data (each extent counting as\n"
+	    "                              much as it is long) instead.\n"
+	    "\n"
+	    "    --warm                    Instead of listing the extents, read\n"
+	    "                              the regular files into the page cache\n"
+	    "                              in the order that their data is in the\n"
+	    "                              volume, reading extents that follow one\n"
+	    "                              another without a gap as one sequential\n"
+	    "                              run, even across files. Incompatible\n"
+	    "                              with --nested, --ext4-image and\n"
+	    "                              --watch.\n"
+	    "\n"
+	    "    --warm-threads <count>    How many runs to read at once with\n"
+	    "                              --warm. The default is 4.\n"
+	    "\n"
+	    "    --warm-rate <MiB/s>       Read no faster than this with --warm.\n"
+	    "                              The default is 0 (unlimited).\n"
+	    "\n"
+	    "    --plan-defrag <file>      Instead of listing the extents, plan\n"
+	    "                              which fragmented files to rewrite, in\n"
+	    "                              which order and into which free space\n"
+	    "                              (keeping the files of each directory\n"
+	    "                              together where it fits), write the plan\n"
+	    "                              to <file> (tab-separated, with offsets\n"
+	    "                              and lengths in bytes), and summarise\n"
+	    "                              it. Nothing is moved. Requires --fsmap,\n"
+	    "                              for the free space of the filesystem;\n"
+	    "                              the gaps between the extents mapped\n"
+	    "                              also hold its metadata, and anything\n"
+	    "                              outside of <path>. Incompatible with\n"
+	    "                              --nested and --watch.\n"
+	    "\n"
+	    "    --defrag <count>          Instead of listing the extents, rewrite\n"
+	    "                              the <count> fragmented files with the\n"
+	    "                              most extents, each into space allocated\n"
+	    "                              for it in one go, if that space is in\n"
+	    "                              fewer pieces; then map them again and\n"
+	    "                              list how many extents they had and have\n"
+	    "                              now. On ext4 the data is moved in place\n"
+	    "                              (EXT4_IOC_MOVE_EXT); elsewhere it is\n"
+	    "                              copied to a new file that is renamed\n"
+	    "                              over the old one, which is not done for\n"
+	    "                              files with hardlinks or extended\n"
+	    "                              attributes. Incompatible with --nested,\n"
+	    "                              --ext4-image and --watch.\n"
+	    "\n"
+	    "    --defrag-dry-run          Only list the files that --defrag would\n"
+	    "                              rewrite; change nothing.\n"
+	    "\n"
+	    "    --defrag-rate <MiB/s>     Move or copy no faster than this with\n"
+	    "                              --defrag. The default is 0 (unlimited).\n"
+	    "\n"
+	);
+	(void) fprintf(stderr,
+	    "    --read-cost <count>       Instead of listing the extents, estimate\n"
+	    "                              how long each regular file takes to\n"
+	    "                              read from start to finish (a seek\n"
+	    "                              before its first extent and each that\n"
+	    "                              does not follow on from the last, plus\n"
+	    "                              the time to transfer its data), give\n"
+	    "                              the total and how efficient that is\n"
+	    "                              compared to reading every file with a\n"
+	    "                              single seek, and list the <count> files\n"
+	    "                              that lose the most time to seeking.\n"
+	    "                              Incompatible with --watch.\n"
+	    "\n"
+	    "    --cost-model <model>      'hdd' (the default) for a hard disk,\n"
+	    "                              whose seeks take longer the further\n"
+	    "                              they go (up to a full-stroke seek for\n"
+	    "                              the whole volume), plus half of a\n"
+	    "                              revolution at 7200 RPM; or 'ssd' for a\n"
+	    "                              solid-state drive, whose seeks all take\n"
+	    "                              the same time. Applies to --read-cost\n"
+	    "                              and --order-cost.\n"
+	    "\n"
+	    "    --cost-seek <us>          The full-stroke seek time (hdd) or the\n"
+	    "                              time for any seek (ssd) in microseconds.\n"
+	    "                              The defaults are 16000 and 100.\n"
+	    "\n"
+	    "    --cost-rate <MiB/s>       The sequential transfer rate. The\n"
+	    "                              defaults are 150 (hdd) and 500 (ssd).\n"
+	    "\n"
+	    "    --interleave <count>      Instead of listing the extents, find the\n"
+	    "                              files whose extents alternate with each\n"
+	    "                              other's in the volume (as when several\n"
+	    "                              files are appended to at once), and\n"
+	    "                              list the <count> groups of them with\n"
+	    "                              the most files (the highest degree),\n"
+	    "                              with the directory they have in common;\n"
+	    "                              a candidate for preallocation or an\n"
+	    "                              extent size hint. Incompatible with\n"
+	    "                              --watch.\n"
+	    "\n"
+	    "    --interleave-window <KiB> How far apart two extents of a file can\n"
+	    "                              be in the volume, with other files' in\n"
+	    "                              between, to count as interleaved. The\n"
+	    "                              default is 1024.\n"
+	    "\n"
+	    "    --space-waste <count>     Instead of listing the extents, total\n"
+	    "                              the space allocated past the end of\n"
+	    "                              files (fallocate(2) with KEEP_SIZE),\n"
+	    "                              in unwritten extents within them, and\n"
+	    "                              in delayed allocations, and list the\n"
+	    "                              <count> files with the most space that\n"
+	    "                              could be given back by truncating them\n"
+	    "                              or punching holes. Incompatible with\n"
+	    "                              --watch.\n"
+	    "\n"
+	);
+	(void) fprintf(stderr,
+	    "    --stripe-unit <KiB>       The stripe unit (chunk size) of the RAID\n"
+	    "                              array underneath the volume. Files with\n"
+	    "                              extents that do not begin and end on a\n"
+	    "                              stripe boundary (the last extent of a\n"
+	    "                              file can end anywhere) are flagged 'S'.\n"
+	    "\n"
+	    "    --stripe-width <disks>    The number of data disks in the array;\n"
+	    "                              a stripe is this many stripe units. The\n"
+	    "                              default is 1.\n"
+	    "\n"
+	    "    --erase-block <KiB>       The erase block size of the SSD under-\n"
+	    "                              neath the volume. Files with extents\n"
+	    "                              that are not aligned to it are flagged\n"
+	    "                              'E'.\n"
+	    "\n"
+	    "    --alignment <count>       Instead of listing the extents, classify\n"
+	    "                              every extent, for the stripe unit, the\n"
+	    "                              stripe and the erase block given, as\n"
+	    "                              aligned or misaligned and by how many\n"
+	    "                              boundaries it crosses, and list the\n"
+	    "                              <count> files with the most misaligned\n"
+	    "                              extents. Requires --stripe-unit or\n"
+	    "                              --erase-block. Incompatible with\n"
+	    "                              --watch.\n"
+	    "\n"
+	);
+
+	(void) fprintf(stderr,
 	    "  Notes:\n"
 	    "\n"
 	    "    The default options are '--sort-ascending --order-offset', to\n"
@@ -90,6 +518,13 @@ fm_print_usage(void)
 	    "    when determining the order. The file names shown next to each\n"
 	    "    extent in the results will also be sorted alphabetically.\n"
 	    "\n"
+	    "    The fragmentation score of a file is the number of times reading\n"
+	    "    it must seek, divided by the fewest extents its size could be\n"
+	    "    stored in given the longest extent its filesystem can describe\n"
+	    "    (e.g. 128 MiB on ext4 with 4 KiB blocks); 1.00 is ideal. Files\n"
+	    "    are only flagged as fragmented ('F') if they score more than\n"
+	    "    that, or if their data is out of order in the volume.\n"
+	    "\n"
 	    "    For the most comprehensive results, ensure <path> is the root of\n"
 	    "    a filesystem that supports extents, and that you have permission\n"
 	    "    to open (read-only) every file in that filesystem. You should also\n"
@@ -97,11 +532,49 @@ fm_print_usage(void)
 	    "    directories and to ensure that everything being mapped has already\n"
 	    "    been written out to the underlying storage.\n"
 	    "\n"
+	    "    With '--keep-going', the exit status is 2 if the results are\n"
+	    "    incomplete because some entries could not be scanned.\n"
+	    "\n"
 	);
 
 	(void) fflush(stderr);
 }
 
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_parse_number(const char *const restrict arg, uint64_t *const restrict result)
+{
+	char *end = NULL;
+
+	errno = 0;
+
+	const unsigned long long value = strtoull(arg, &end, 10);
+
+	if (errno != 0 || end == arg || *end != 0x00 || *arg == '-')
+		return false;
+
+	*result = (uint64_t) value;
+	return true;
+}
+
+static unsigned int FM_WARN_UNUSED
+fm_count_report_modes(void)
+{
+	// The modes that replace the list of extents with something else; no more than one can be given
+	const bool modes[] = {
+		fm_qcow2_mode, fm_lookup_requested(), (fm_trace_path != NULL), (fm_badblocks_path != NULL),
+		fm_free_space_mode, (fm_heatmap_bins != 0U), (fm_rollup_top != 0U), fm_physorder_mode, fm_warm_mode,
+		(fm_defrag_plan_path != NULL), (fm_defrag_count != 0U), (fm_cost_top != 0U), (fm_interleave_top != 0U),
+		(fm_waste_top != 0U), (fm_alignment_top != 0U), fm_watch_mode,
+	};
+	unsigned int count = 0U;
+
+	for (size_t i = 0U; i < (sizeof modes / sizeof modes[0]); i++)
+		if (modes[i])
+			count++;
+
+	return count;
+}
+
 enum fm_optparse_result FM_NONNULL(2) FM_WARN_UNUSED
 fm_parse_options(int argc, char *argv[])
 {
@@ -116,6 +589,8 @@ fm_parse_options(int argc, char *argv[])
 		{       "order-inum", 0, NULL, 'N' },
 		{   "order-filesize", 0, NULL, 'S' },
 		{   "order-filename", 0, NULL, 'F' },
+		{      "order-score", 0, NULL, 'R' },
+		{       "order-cost", 0, NULL, 'E' },
 		{ "scan-directories", 0, NULL, 'd' },
 		{  "fragmented-only", 0, NULL, 'f' },
 		{       "print-gaps", 0, NULL, 'g' },
@@ -129,10 +604,64 @@ fm_parse_options(int argc, char *argv[])
 		{   "readable-sizes", 0, NULL, 's' },
 		{    "readable-gaps", 0, NULL, 't' },
 		{     "readable-all", 0, NULL, 'r' },
+		{         "save-map", 1, NULL, FM_LONGOPT_SAVE_MAP },
+		{             "diff", 0, NULL, FM_LONGOPT_DIFF },
+		{            "cache", 1, NULL, FM_LONGOPT_CACHE },
+		{            "watch", 0, NULL, FM_LONGOPT_WATCH },
+		{   "watch-interval", 1, NULL, FM_LONGOPT_WATCH_INTERVAL },
+		{       "checkpoint", 1, NULL, FM_LONGOPT_CHECKPOINT },
+		{ "checkpoint-interval", 1, NULL, FM_LONGOPT_CHECKPOINT_INTERVAL },
+		{           "resume", 1, NULL, FM_LONGOPT_RESUME },
+		{       "keep-going", 0, NULL, FM_LONGOPT_KEEP_GOING },
+		{            "fsmap", 0, NULL, FM_LONGOPT_FSMAP },
+		{       "ext4-image", 0, NULL, FM_LONGOPT_EXT4_IMAGE },
+		{           "nested", 0, NULL, FM_LONGOPT_NESTED },
+		{            "qcow2", 0, NULL, FM_LONGOPT_QCOW2 },
+		{           "lookup", 1, NULL, FM_LONGOPT_LOOKUP },
+		{            "trace", 1, NULL, FM_LONGOPT_TRACE },
+		{        "badblocks", 1, NULL, FM_LONGOPT_BADBLOCKS },
+		{       "free-space", 0, NULL, FM_LONGOPT_FREE_SPACE },
+		{   "free-space-top", 1, NULL, FM_LONGOPT_FREE_SPACE_TOP },
+		{          "heatmap", 1, NULL, FM_LONGOPT_HEATMAP },
+		{   "heatmap-format", 1, NULL, FM_LONGOPT_HEATMAP_FORMAT },
+		{           "rollup", 1, NULL, FM_LONGOPT_ROLLUP },
+		{ "physical-order-list", 0, NULL, FM_LONGOPT_PHYSORDER },
+		{ "physical-order-weighted", 0, NULL, FM_LONGOPT_PHYSORDER_WEIGHTED },
+		{             "warm", 0, NULL, FM_LONGOPT_WARM },
+		{     "warm-threads", 1, NULL, FM_LONGOPT_WARM_THREADS },
+		{        "warm-rate", 1, NULL, FM_LONGOPT_WARM_RATE },
+		{      "plan-defrag", 1, NULL, FM_LONGOPT_PLAN_DEFRAG },
+		{           "defrag", 1, NULL, FM_LONGOPT_DEFRAG },
+		{   "defrag-dry-run", 0, NULL, FM_LONGOPT_DEFRAG_DRY_RUN },
+		{      "defrag-rate", 1, NULL, FM_LONGOPT_DEFRAG_RATE },
+		{        "read-cost", 1, NULL, FM_LONGOPT_READ_COST },
+		{       "cost-model", 1, NULL, FM_LONGOPT_COST_MODEL },
+		{        "cost-seek", 1, NULL, FM_LONGOPT_COST_SEEK },
+		{        "cost-rate", 1, NULL, FM_LONGOPT_COST_RATE },
+		{       "interleave", 1, NULL, FM_LONGOPT_INTERLEAVE },
+		{ "interleave-window", 1, NULL, FM_LONGOPT_INTERLEAVE_WINDOW },
+		{      "space-waste", 1, NULL, FM_LONGOPT_SPACE_WASTE },
+		{      "stripe-unit", 1, NULL, FM_LONGOPT_STRIPE_UNIT },
+		{     "stripe-width", 1, NULL, FM_LONGOPT_STRIPE_WIDTH },
+		{      "erase-block", 1, NULL, FM_LONGOPT_ERASE_BLOCK },
+		{        "alignment", 1, NULL, FM_LONGOPT_ALIGNMENT },
+		{         "dm-table", 1, NULL, FM_LONGOPT_DM_TABLE },
+		{          "dm-live", 0, NULL, FM_LONGOPT_DM_LIVE },
+		{        "dm-device", 1, NULL, FM_LONGOPT_DM_DEVICE },
 		{               NULL, 0, NULL,  0  },
 	};
 
-	static const char shortopts[] = "hADOLCHNSFdfgnqxyzolstr";
+	static const char shortopts[] = "hADOLCHNSFREdfgnqxyzolstr";
+
+	// Options that only mean something with another, and are rejected without it below
+	bool freespace_top_given = false;
+	bool heatmap_format_given = false;
+	bool warm_opts_given = false;
+	bool defrag_rate_given = false;
+	bool cost_opts_given = false;
+	bool interleave_window_given = false;
+	bool watch_interval_given = false;
+	bool checkpoint_interval_given = false;
 
 	argvzero = argv[0];
 
@@ -185,6 +714,14 @@ fm_parse_options(int argc, char *argv[])
 				fm_sort_method = FM_SORTMETH_FILENAME;
 				break;
 
+			case 'R':
+				fm_sort_method = FM_SORTMETH_FRAG_SCORE;
+				break;
+
+			case 'E':
+				fm_sort_method = FM_SORTMETH_READ_COST;
+				break;
+
 			case 'd':
 				fm_scan_directories = true;
 				break;
@@ -241,6 +778,301 @@ fm_parse_options(int argc, char *argv[])
 				fm_readable_gaps = true;
 				break;
 
+			case FM_LONGOPT_SAVE_MAP:
+				fm_save_map_path = optarg;
+				break;
+
+			case FM_LONGOPT_DIFF:
+				fm_diff_maps = true;
+				break;
+
+			case FM_LONGOPT_CACHE:
+				fm_cache_path = optarg;
+				break;
+
+			case FM_LONGOPT_WATCH:
+				fm_watch_mode = true;
+				break;
+
+			case FM_LONGOPT_WATCH_INTERVAL:
+				if (! fm_parse_number(optarg, &fm_watch_interval) || ! fm_watch_interval ||
+				    fm_watch_interval > FM_WATCH_MAX_INTERVAL)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				watch_interval_given = true;
+				break;
+
+			case FM_LONGOPT_CHECKPOINT:
+				fm_checkpoint_path = optarg;
+				fm_resume_scan = false;
+				break;
+
+			case FM_LONGOPT_CHECKPOINT_INTERVAL:
+				if (! fm_parse_number(optarg, &fm_checkpoint_interval))
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				checkpoint_interval_given = true;
+				break;
+
+			case FM_LONGOPT_RESUME:
+				fm_checkpoint_path = optarg;
+				fm_resume_scan = true;
+				break;
+
+			case FM_LONGOPT_KEEP_GOING:
+				fm_keep_going = true;
+				break;
+
+			case FM_LONGOPT_FSMAP:
+				fm_fsmap_mode = true;
+				break;
+
+			case FM_LONGOPT_EXT4_IMAGE:
+				fm_ext4_image = true;
+				break;
+
+			case FM_LONGOPT_NESTED:
+				fm_nested_mode = true;
+				break;
+
+			case FM_LONGOPT_DM_TABLE:
+				fm_dm_table_path = optarg;
+				break;
+
+			case FM_LONGOPT_DM_LIVE:
+				fm_dm_live = true;
+				break;
+
+			case FM_LONGOPT_DM_DEVICE:
+				fm_dm_device = optarg;
+				break;
+
+			case FM_LONGOPT_QCOW2:
+				fm_qcow2_mode = true;
+				break;
+
+			case FM_LONGOPT_HEATMAP:
+				if (! fm_parse_number(optarg, &fm_heatmap_bins) || ! fm_heatmap_bins ||
+				    fm_heatmap_bins > FM_HEATMAP_MAX_BINS)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_HEATMAP_FORMAT:
+				if (strcmp(optarg, "csv") == 0)
+					fm_heatmap_format = FM_HEATMAP_FORMAT_CSV;
+				else if (strcmp(optarg, "pgm") == 0)
+					fm_heatmap_format = FM_HEATMAP_FORMAT_PGM;
+				else if (strcmp(optarg, "ppm") == 0)
+					fm_heatmap_format = FM_HEATMAP_FORMAT_PPM;
+				else
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				heatmap_format_given = true;
+				break;
+
+			case FM_LONGOPT_ROLLUP:
+				if (! fm_parse_number(optarg, &fm_rollup_top) || ! fm_rollup_top)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_PHYSORDER:
+				fm_physorder_mode = true;
+				break;
+
+			case FM_LONGOPT_PHYSORDER_WEIGHTED:
+				fm_physorder_weighted = true;
+				break;
+
+			case FM_LONGOPT_WARM:
+				fm_warm_mode = true;
+				break;
+
+			case FM_LONGOPT_WARM_THREADS:
+				if (! fm_parse_number(optarg, &fm_warm_threads) || ! fm_warm_threads ||
+				    fm_warm_threads > FM_WARM_MAX_THREADS)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				warm_opts_given = true;
+				break;
+
+			case FM_LONGOPT_WARM_RATE:
+				if (! fm_parse_number(optarg, &fm_warm_rate))
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				warm_opts_given = true;
+				break;
+
+			case FM_LONGOPT_PLAN_DEFRAG:
+				fm_defrag_plan_path = optarg;
+				break;
+
+			case FM_LONGOPT_DEFRAG:
+				if (! fm_parse_number(optarg, &fm_defrag_count) || ! fm_defrag_count)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_DEFRAG_DRY_RUN:
+				fm_defrag_dry_run = true;
+				break;
+
+			case FM_LONGOPT_DEFRAG_RATE:
+				if (! fm_parse_number(optarg, &fm_defrag_rate))
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				defrag_rate_given = true;
+				break;
+
+			case FM_LONGOPT_READ_COST:
+				if (! fm_parse_number(optarg, &fm_cost_top) || ! fm_cost_top)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_COST_MODEL:
+				if (strcmp(optarg, "hdd") == 0)
+					fm_cost_model = FM_COST_MODEL_HDD;
+				else if (strcmp(optarg, "ssd") == 0)
+					fm_cost_model = FM_COST_MODEL_SSD;
+				else
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				cost_opts_given = true;
+				break;
+
+			case FM_LONGOPT_COST_SEEK:
+				if (! fm_parse_number(optarg, &fm_cost_seek) || ! fm_cost_seek)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				cost_opts_given = true;
+				break;
+
+			case FM_LONGOPT_COST_RATE:
+				if (! fm_parse_number(optarg, &fm_cost_rate) || ! fm_cost_rate)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				cost_opts_given = true;
+				break;
+
+			case FM_LONGOPT_INTERLEAVE:
+				if (! fm_parse_number(optarg, &fm_interleave_top) || ! fm_interleave_top)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_SPACE_WASTE:
+				if (! fm_parse_number(optarg, &fm_waste_top) || ! fm_waste_top)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_STRIPE_UNIT:
+				if (! fm_parse_number(optarg, &fm_stripe_unit) || ! fm_stripe_unit ||
+				    fm_stripe_unit > UINT32_MAX)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_STRIPE_WIDTH:
+				if (! fm_parse_number(optarg, &fm_stripe_width) || ! fm_stripe_width ||
+				    fm_stripe_width > UINT16_MAX)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_ERASE_BLOCK:
+				if (! fm_parse_number(optarg, &fm_erase_block) || ! fm_erase_block ||
+				    fm_erase_block > UINT32_MAX)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_ALIGNMENT:
+				if (! fm_parse_number(optarg, &fm_alignment_top) || ! fm_alignment_top)
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
+			case FM_LONGOPT_INTERLEAVE_WINDOW:
+				if (! fm_parse_number(optarg, &fm_interleave_window) ||
+				    fm_interleave_window > (UINT64_MAX / UINT64_C(2048)))
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				interleave_window_given = true;
+				break;
+
+			case FM_LONGOPT_FREE_SPACE:
+				fm_free_space_mode = true;
+				break;
+
+			case FM_LONGOPT_FREE_SPACE_TOP:
+				if (! fm_parse_number(optarg, &fm_freespace_top))
+				{
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				freespace_top_given = true;
+				break;
+
+			case FM_LONGOPT_BADBLOCKS:
+				fm_badblocks_path = optarg;
+				break;
+
+			case FM_LONGOPT_TRACE:
+				fm_trace_path = optarg;
+				break;
+
+			case FM_LONGOPT_LOOKUP:
+				if (! fm_lookup_add(optarg))
+				{
+					// This function prints messages on error
+					(void) fm_print_usage();
+					return FM_OPTPARSE_EXIT_FAILURE;
+				}
+				break;
+
 			default:
 				(void) fm_print_usage();
 				return FM_OPTPARSE_EXIT_FAILURE;
@@ -264,6 +1096,139 @@ fm_parse_options(int argc, char *argv[])
 		fm_run_quietly = true;
 		fm_skip_preamble = true;
 	}
+	if (fm_fsmap_mode && (fm_watch_mode || fm_checkpoint_path != NULL))
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_ext4_image && (fm_fsmap_mode || fm_watch_mode || fm_checkpoint_path != NULL))
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_nested_mode && (fm_cache_path != NULL || fm_fsmap_mode || fm_ext4_image || fm_watch_mode ||
+	                       fm_checkpoint_path != NULL))
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_qcow2_mode && (fm_fsmap_mode || fm_ext4_image || fm_watch_mode || fm_checkpoint_path != NULL))
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_dm_table_path != NULL && fm_dm_live)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_dm_device != NULL && ! fm_dm_requested())
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_dm_requested() && (fm_cache_path != NULL || fm_save_map_path != NULL || fm_watch_mode ||
+	                          fm_checkpoint_path != NULL || fm_free_space_mode || fm_defrag_plan_path != NULL ||
+	                          fm_defrag_count))
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_defrag_plan_path != NULL && ! fm_fsmap_mode)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if ((fm_defrag_dry_run || defrag_rate_given) && ! fm_defrag_count)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_stripe_width > 1U && ! fm_stripe_unit)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_alignment_top && ! (fm_stripe_unit || fm_erase_block))
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_count_report_modes() > 1U)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (interleave_window_given && ! fm_interleave_top)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (cost_opts_given && ! fm_cost_top && fm_sort_method != FM_SORTMETH_READ_COST)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_defrag_count && (fm_nested_mode || fm_ext4_image))
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_defrag_plan_path != NULL && fm_nested_mode)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (warm_opts_given && ! fm_warm_mode)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_warm_mode && (fm_nested_mode || fm_ext4_image))
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_physorder_weighted && ! fm_physorder_mode)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_rollup_top && (fm_fsmap_mode || fm_nested_mode || fm_ext4_image || fm_checkpoint_path != NULL))
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (heatmap_format_given && ! fm_heatmap_bins)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (freespace_top_given && ! fm_free_space_mode)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (watch_interval_given && ! fm_watch_mode)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (checkpoint_interval_given && fm_checkpoint_path == NULL)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_watch_mode && fm_checkpoint_path != NULL)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
+	if (fm_diff_maps && (argc - optind) != 2)
+	{
+		(void) fm_print_usage();
+		return FM_OPTPARSE_EXIT_FAILURE;
+	}
 	if (optind >= argc)
 	{
 		(void) fm_print_usage();
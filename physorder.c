@@ -0,0 +1,128 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "filemap.h"
+
+/* Listing the files in the order that their data is in the volume (see --physical-order-list)
+ *
+ * Each file is listed once (with all of its names together, if it has more than one), by where its data begins:
+ * the physical offset of its first extent. A fragmented file can have most of its data somewhere else entirely;
+ * with --physical-order-weighted, files are ordered by the mean offset of their data, with each extent counted
+ * in proportion to its length, instead. Files without any data are listed last, as reading them costs nothing.
+ */
+
+struct fm_physorder_file
+{
+	const struct fm_inode *     inode;      // The file
+	long double                 key;        // Where it is in the volume (see above)
+};
+
+static long double FM_NONNULL(1)
+fm_physorder_key(const struct fm_inode *const restrict fi)
+{
+	const struct fm_extent *fe;
+	long double weighted = 0.0L;
+	long double bytes = 0.0L;
+
+	if (fi->extents == NULL)
+		return (long double) UINT64_MAX;
+
+	if (! fm_physorder_weighted)
+		return (long double) fi->extents->off;
+
+	DL_FOREACH(fi->extents, fe)
+	{
+		weighted += ((long double) fe->off * (long double) fe->len);
+		bytes += (long double) fe->len;
+	}
+
+	return ((bytes > 0.0L) ? (weighted / bytes) : (long double) fi->extents->off);
+}
+
+static int FM_NONNULL(1, 2)
+fm_physorder_sort_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_physorder_file *const file1 = ptr1;
+	const struct fm_physorder_file *const file2 = ptr2;
+
+	if (file1->key < file2->key)
+		return -1;
+
+	if (file1->key > file2->key)
+		return 1;
+
+	if (file1->inode->inum < file2->inode->inum)
+		return -1;
+
+	if (file1->inode->inum > file2->inode->inum)
+		return 1;
+
+	return 0;
+}
+
+bool FM_WARN_UNUSED
+fm_physorder_report(void)
+{
+	const uint64_t inodes = HASH_COUNT(fm_inodes);
+	struct fm_physorder_file *files;
+	struct fm_inode *fi;
+	struct fm_inode *itmp;
+	uint64_t count = 0U;
+
+	if ((files = calloc(inodes + 1U, sizeof *files)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	HASH_ITER(hh, fm_inodes, fi, itmp)
+	{
+		if ((fi->sb.st_mode & S_IFMT) != S_IFREG)
+			// Archivers and copiers given a directory would descend into it
+			continue;
+
+		files[count].inode = fi;
+		files[count].key = fm_physorder_key(fi);
+		count++;
+	}
+
+	qsort(files, count, sizeof *files, &fm_physorder_sort_cb);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		const struct fm_name *fname;
+
+		DL_FOREACH(files[i].inode->names, fname)
+		{
+			(void) printf("%s", fname->name);
+
+			if (fm_names_zero)
+				(void) putchar('\0');
+			else
+				(void) putchar('\n');
+		}
+	}
+
+	(void) fflush(stdout);
+
+	free(files);
+
+	return true;
+}
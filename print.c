@@ -18,7 +18,7 @@
 
 #include "filemap.h"
 
-static const char * FM_RETURNS_NONNULL
+const char * FM_RETURNS_NONNULL
 fm_readable_size(const enum fm_readable_which which, const uint64_t insize)
 {
 	static const size_t result_buflen = 128U;
@@ -74,6 +74,22 @@ fm_readable_size(const enum fm_readable_which which, const uint64_t insize)
 	return result;
 }
 
+const char * FM_RETURNS_NONNULL
+fm_inode_number(const uint64_t inum, const uint64_t host)
+{
+	static char result[128U];
+
+	(void) memset(result, 0x00, sizeof result);
+
+	// Inodes in a filesystem image are numbered by the image file's inode and theirs in it (see ext4.c)
+	if (host)
+		(void) snprintf(result, sizeof result, "%" PRIu64 ":%" PRIu64, host, inum);
+	else
+		(void) snprintf(result, sizeof result, "%" PRIu64, inum);
+
+	return result;
+}
+
 static const char * FM_NONNULL(1) FM_RETURNS_NONNULL
 fm_build_inode_flags(const struct fm_inode *const restrict inode)
 {
@@ -89,8 +105,12 @@ fm_build_inode_flags(const struct fm_inode *const restrict inode)
 		// This inode is a directory
 		(void) strcat(result, "D");
 
-	if (inode->flags & FM_IFLAGS_FRAGMENTED || inode->extcount != 1U)
-		// Data is not contiguous
+	if (inode->flags & FM_IFLAGS_ERASE_UNALIGNED)
+		// Data is not aligned to the erase blocks of the storage (see --erase-block)
+		(void) strcat(result, "E");
+
+	if (inode->flags & FM_IFLAGS_FRAGMENTED)
+		// Data is in more pieces than it needs to be, or is out of order (see score.c)
 		(void) strcat(result, "F");
 
 	if (inode->namecount > 1U)
@@ -101,6 +121,14 @@ fm_build_inode_flags(const struct fm_inode *const restrict inode)
 		// Data is made up of multiple extents
 		(void) strcat(result, "M");
 
+	if (inode->flags & FM_IFLAGS_NESTED)
+		// This inode is in a filesystem image (see --nested)
+		(void) strcat(result, "N");
+
+	if (inode->flags & FM_IFLAGS_STRIPE_UNALIGNED)
+		// Data is not aligned to the stripes of the storage (see --stripe-unit)
+		(void) strcat(result, "S");
+
 	if (inode->flags & FM_IFLAGS_UNORDERED)
 		// Data is not in order
 		(void) strcat(result, "U");
@@ -188,6 +216,9 @@ fm_print_message(const char *const restrict fmt, ...)
 void
 fm_print_results(void)
 {
+	// With --order-cost, the estimated read time (see cost.c) that the extents are ordered by is shown as well
+	const bool readtimes = (fm_sort_method == FM_SORTMETH_READ_COST);
+	const char *const rtblank = ((readtimes) ? "             " : "");
 	const struct fm_name *fname;
 	uint64_t fragged_extents = 0U;
 	uint64_t fragged_inodes = 0U;
@@ -230,6 +261,9 @@ fm_print_results(void)
 		else
 			(void) printf("Extent offsets are in ....... : bytes\n");
 
+		if (fm_dm_requested())
+			(void) printf("Extent offsets are on ....... : %s\n", fm_dm_describe());
+
 		if (fm_readable_lengths)
 			(void) printf("Extent lengths are in ....... : human-readable units\n");
 		else if (fm_integral_blksz)
@@ -242,6 +276,12 @@ fm_print_results(void)
 			(void) printf("File sizes are in ........... : human-readable units\n");
 		else
 			(void) printf("File sizes are in ........... : bytes\n");
+
+		if (fm_max_extent_len)
+			(void) printf("Fragmentation scores are .... : seeks per ideal extent (extents can be at most "
+			              "%" PRIu64 " bytes long)\n", fm_max_extent_len);
+		else
+			(void) printf("Fragmentation scores are .... : seeks per ideal extent (extents can be any length)\n");
 	}
 
 	if (fm_scan_directories)
@@ -278,12 +318,13 @@ results:
 	{
 		(void) printf("\n");
 
-		(void) printf("%20s %20s %12s %12s %12s %12s %20s    %s\n", "Extent Offset", "Extent Length",
-		              "Extent Count", "Extent Flags", "Inode Number", "Inode Flags", "File Size",
-		              "File Name(s)");
+		(void) printf("%20s %20s %12s %12s %12s %12s %12s%s %20s    %s\n", "Extent Offset", "Extent Length",
+		              "Extent Count", "Extent Flags", "Inode Number", "Inode Flags", "Frag Score",
+		              ((readtimes) ? "    Read Time" : ""), "File Size", "File Name(s)");
 
 		(void) printf("-------------------- -------------------- ------------ ------------ "
-		              "------------ ------------ --------------------    ------------\n\n");
+		              "------------ ------------ ------------%s --------------------    ------------\n\n",
+		              ((readtimes) ? " ------------" : ""));
 	}
 
 	HASH_ITER(hh, fm_extents, extent, etmp)
@@ -295,8 +336,8 @@ results:
 		{
 			const uint64_t gap = (extent->off - (prev_extoff + prev_extlen));
 
-			(void) printf("%20s %-20s %12s %12s %12s %12s %20s\n",
-			              " ", fm_readable_size(FM_READABLE_GAP, gap), " ", " ", " ", " ", " ");
+			(void) printf("%20s %-20s %12s %12s %12s %12s %12s%s %20s\n",
+			              " ", fm_readable_size(FM_READABLE_GAP, gap), " ", " ", " ", " ", " ", rtblank, " ");
 		}
 
 		DL_FOREACH(extent->inode->names, fname)
@@ -325,17 +366,28 @@ results:
 				const char *const inoflags = fm_build_inode_flags(extent->inode);
 				const char *const extflags = fm_build_extent_flags(extent);
 				const uint64_t fsize = (uint64_t) extent->inode->sb.st_size;
+				char readtime[128U];
 				char extpos[128U];
+				char score[128U];
 
 				(void) memset(extpos, 0x00, sizeof extpos);
 				(void) snprintf(extpos, sizeof extpos, "%" PRIu64 "/%" PRIu64,
 				                extent->pos, extent->inode->extcount);
 
+				(void) memset(score, 0x00, sizeof score);
+				(void) snprintf(score, sizeof score, "%.2Lf", fm_score_inode(extent->inode));
+
+				(void) memset(readtime, 0x00, sizeof readtime);
+
+				if (readtimes)
+					(void) snprintf(readtime, sizeof readtime, " %9.3Lf ms", (extent->inode->readtime * 1.0E3L));
+
 				// Print full details for the first file name pointing to this inode
-				(void) printf("%20s %20s %12s %12s %12" PRIu64 " %12s %20s    %s\n",
+				(void) printf("%20s %20s %12s %12s %12s %12s %12s%s %20s    %s\n",
 				              fm_readable_size(FM_READABLE_OFFSET, extoff),
 				              fm_readable_size(FM_READABLE_LENGTH, extlen),
-				              extpos, extflags, extent->inode->inum, inoflags,
+				              extpos, extflags, fm_inode_number(extent->inode->inum, extent->inode->host),
+				              inoflags, score, readtime,
 				              fm_readable_size(FM_READABLE_SIZE, fsize),
 				              fname->name);
 			}
@@ -344,14 +396,14 @@ results:
 				/* Print only the file name for other file names pointing to this inode,
 				 * but only if we have not yet done so for this inode already
 				 */
-				(void) printf("%20s %20s %12s %12s %12s %12s %20s    %s\n",
-				              "-----", " ", " ", " ", " ", " ", " ", fname->name);
+				(void) printf("%20s %20s %12s %12s %12s %12s %12s%s %20s    %s\n",
+				              "-----", " ", " ", " ", " ", " ", " ", rtblank, " ", fname->name);
 			}
 			else
 			{
 				// We have already printed other file names for this inode, skip doing so
-				(void) printf("%20s %20s %12s %12s %12s %12s %20s    %s\n",
-				              "+++++", " ", " ", " ", " ", " ", " ", "+++++");
+				(void) printf("%20s %20s %12s %12s %12s %12s %12s%s %20s    %s\n",
+				              "+++++", " ", " ", " ", " ", " ", " ", rtblank, " ", "+++++");
 				break;
 			}
 		}
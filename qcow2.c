@@ -0,0 +1,376 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filemap.h"
+
+/* Mapping the clusters of qcow2 images (see --qcow2)
+ *
+ * A guest reading its disk from start to finish reads the clusters in the order of its L1/L2 tables, which is
+ * not the order they are in the image file, which in turn is not the order they are in the volume. The tables
+ * are walked in guest order and each allocated cluster is translated through the image file's extents, to
+ * count how often a sequential guest read has to jump; both in the image file (the qcow2 layer) and in the
+ * volume (both layers together). Everything on disk is big-endian.
+ */
+
+#define FM_QCOW2_MAGIC                  0x514649FBU     // "QFI\xFB"
+#define FM_QCOW2_HEADER_SIZE            104U
+#define FM_QCOW2_MIN_CLUSTER_BITS       9U
+#define FM_QCOW2_MAX_CLUSTER_BITS       21U
+#define FM_QCOW2_MAX_L1_SIZE            (32U * 1024U * 1024U)
+
+#define FM_QCOW2_INCOMPAT_DATA_FILE     0x04U
+#define FM_QCOW2_INCOMPAT_EXTL2         0x10U
+
+#define FM_QCOW2_OFLAG_COMPRESSED       (UINT64_C(1) << 62)
+#define FM_QCOW2_OFLAG_ZERO             UINT64_C(1)
+#define FM_QCOW2_OFFSET_MASK            UINT64_C(0x00FFFFFFFFFFFE00)
+
+#define FM_QCOW2_MIB                    (1024.0L * 1024.0L)
+
+struct fm_qcow2_image
+{
+	struct fm_qcow2_image * prev;               // For entry into fm_qcow2_images below
+	struct fm_qcow2_image * next;               // For entry into fm_qcow2_images below
+
+	uint64_t                size;               // Size of the guest's disk (in bytes)
+	uint64_t                clustersz;          // Size of a cluster (in bytes)
+	uint64_t                allocated;          // Clusters with data in the image file
+	uint64_t                compressed;         // Clusters with compressed data in the image file
+	uint64_t                zeroed;             // Clusters that read as zeroes without being in the image file
+	uint64_t                sparse;             // Allocated clusters (or parts) in holes of the image file
+	uint64_t                fileseeks;          // Jumps in the image file when reading the guest's disk in order
+	uint64_t                seeks;              // Jumps in the volume when reading the guest's disk in order
+	uint64_t                hostexts;           // Number of extents of the image file
+	bool                    backed;             // Unallocated clusters are read from a backing file instead
+	char                    path[];             // The path of the image file
+};
+
+struct fm_qcow2_walk
+{
+	struct fm_qcow2_image * image;
+	struct fm_map_extent *  hostexts;           // Extents of the image file (in logical order)
+	uint64_t                hostcount;
+	uint64_t                fileprev;           // Where in the image file the previous cluster ended (or 0)
+	uint64_t                prev;               // Where in the volume the previous cluster ended (or 0)
+};
+
+static struct fm_qcow2_image *fm_qcow2_images = NULL;
+
+static uint32_t FM_NONNULL(1)
+fm_qcow2_be32(const unsigned char *const restrict ptr)
+{
+	return ((((uint32_t) ptr[0]) << 24) | (((uint32_t) ptr[1]) << 16) | (((uint32_t) ptr[2]) << 8) | ptr[3]);
+}
+
+static uint64_t FM_NONNULL(1)
+fm_qcow2_be64(const unsigned char *const restrict ptr)
+{
+	return ((((uint64_t) fm_qcow2_be32(ptr)) << 32) | fm_qcow2_be32(ptr + 4U));
+}
+
+static bool FM_NONNULL(2) FM_WARN_UNUSED
+fm_qcow2_read(const int fd, unsigned char *const restrict buf, const size_t len, const uint64_t off)
+{
+	size_t done = 0U;
+
+	while (done < len)
+	{
+		const ssize_t ret = pread(fd, buf + done, len - done, (off_t) (off + done));
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return false;
+
+		if (ret == 0)
+		{
+			// The image file is shorter than its tables say it is
+			errno = EUCLEAN;
+			return false;
+		}
+
+		done += (size_t) ret;
+	}
+
+	return true;
+}
+
+static void FM_NONNULL(1)
+fm_qcow2_walk_cluster(struct fm_qcow2_walk *const restrict walk, const uint64_t fileoff)
+{
+	const uint64_t fileend = (fileoff + walk->image->clustersz);
+	uint64_t lo = 0U;
+	uint64_t hi = walk->hostcount;
+	uint64_t cur = fileoff;
+
+	if (walk->fileprev && walk->fileprev != fileoff)
+		walk->image->fileseeks++;
+
+	walk->fileprev = fileend;
+	walk->image->allocated++;
+
+	// Find the first extent of the image file that ends after this cluster starts
+	while (lo < hi)
+	{
+		const uint64_t mid = (lo + ((hi - lo) / 2U));
+
+		if ((walk->hostexts[mid].loff + walk->hostexts[mid].len) <= fileoff)
+			lo = (mid + 1U);
+		else
+			hi = mid;
+	}
+
+	// A cluster can span several extents of the image file, and parts of it can be in holes (never written)
+	for (uint64_t i = lo; i < walk->hostcount && walk->hostexts[i].loff < fileend; i++)
+	{
+		const struct fm_map_extent *const hext = &walk->hostexts[i];
+		const uint64_t start = ((hext->loff > cur) ? hext->loff : cur);
+		const uint64_t end = (((hext->loff + hext->len) < fileend) ? (hext->loff + hext->len) : fileend);
+		const uint64_t off = (hext->off + (start - hext->loff));
+
+		if (start > cur)
+			walk->image->sparse++;
+
+		if (walk->prev && walk->prev != off)
+			walk->image->seeks++;
+
+		walk->prev = (off + (end - start));
+		cur = end;
+	}
+
+	if (cur < fileend)
+		walk->image->sparse++;
+}
+
+static bool FM_NONNULL(2, 3, 4) FM_WARN_UNUSED
+fm_qcow2_walk_tables(const int fd, const unsigned char *const restrict hdr, struct fm_qcow2_walk *const restrict walk,
+                     const char *const restrict abspath)
+{
+	const uint32_t version = fm_qcow2_be32(hdr + 4U);
+	const uint32_t clusterbits = fm_qcow2_be32(hdr + 20U);
+	const uint32_t l1size = fm_qcow2_be32(hdr + 36U);
+	const uint64_t l1off = fm_qcow2_be64(hdr + 40U);
+	const uint64_t incompat = ((version >= 3U) ? fm_qcow2_be64(hdr + 72U) : 0U);
+	const size_t l2entsz = ((incompat & FM_QCOW2_INCOMPAT_EXTL2) ? 16U : 8U);
+	struct fm_qcow2_image *const image = walk->image;
+	unsigned char *l1 = NULL;
+	unsigned char *l2 = NULL;
+	uint64_t l2entries;
+	uint64_t clusters;
+	uint64_t cluster = 0U;
+	bool result = false;
+
+	if ((version != 2U && version != 3U) || clusterbits < FM_QCOW2_MIN_CLUSTER_BITS ||
+	    clusterbits > FM_QCOW2_MAX_CLUSTER_BITS || l1size > (FM_QCOW2_MAX_L1_SIZE / 8U))
+	{
+		(void) fm_scan_failed(abspath, "qcow2 header", EUCLEAN);
+		return false;
+	}
+	if (incompat & FM_QCOW2_INCOMPAT_DATA_FILE)
+	{
+		// The guest's data is in another file altogether; there is nothing here to map
+		(void) fm_scan_failed(abspath, "qcow2 external data file", EOPNOTSUPP);
+		return false;
+	}
+
+	image->clustersz = (UINT64_C(1) << clusterbits);
+	image->size = fm_qcow2_be64(hdr + 24U);
+	image->backed = (fm_qcow2_be64(hdr + 8U) != 0U);
+
+	l2entries = (image->clustersz / l2entsz);
+	clusters = ((image->size + image->clustersz - 1U) / image->clustersz);
+
+	if (((clusters + l2entries - 1U) / l2entries) > l1size)
+	{
+		(void) fm_scan_failed(abspath, "qcow2 L1 table", EUCLEAN);
+		return false;
+	}
+	if ((l1 = calloc(l1size + 1U, 8U)) == NULL || (l2 = calloc(1U, image->clustersz)) == NULL)
+	{
+		(void) fm_scan_failed(abspath, "calloc(3)", errno);
+		goto done;
+	}
+	if (! fm_qcow2_read(fd, l1, l1size * 8U, l1off))
+	{
+		(void) fm_scan_failed(abspath, "qcow2 L1 table", errno);
+		goto done;
+	}
+
+	for (uint64_t i = 0U; i < l1size && cluster < clusters; i++)
+	{
+		const uint64_t l2off = (fm_qcow2_be64(l1 + (i * 8U)) & FM_QCOW2_OFFSET_MASK);
+
+		if (! l2off)
+		{
+			// None of the clusters under this entry are allocated
+			cluster += l2entries;
+			continue;
+		}
+		if (! fm_qcow2_read(fd, l2, image->clustersz, l2off))
+		{
+			(void) fm_scan_failed(abspath, "qcow2 L2 table", errno);
+			goto done;
+		}
+		for (uint64_t j = 0U; j < l2entries && cluster < clusters; j++, cluster++)
+		{
+			const uint64_t entry = fm_qcow2_be64(l2 + (j * l2entsz));
+			const uint64_t fileoff = (entry & FM_QCOW2_OFFSET_MASK);
+
+			if (entry & FM_QCOW2_OFLAG_COMPRESSED)
+			{
+				// Its length in the image file varies; reading it always costs a jump of its own
+				image->compressed++;
+				image->fileseeks++;
+				image->seeks++;
+				walk->fileprev = 0U;
+				walk->prev = 0U;
+				continue;
+			}
+			if ((entry & FM_QCOW2_OFLAG_ZERO) && version >= 3U)
+			{
+				image->zeroed++;
+				continue;
+			}
+			if (! fileoff)
+				continue;
+
+			(void) fm_qcow2_walk_cluster(walk, fileoff);
+		}
+	}
+
+	result = true;
+
+done:
+
+	free(l1);
+	free(l2);
+
+	return result;
+}
+
+bool FM_NONNULL(2, 3) FM_WARN_UNUSED
+fm_qcow2_scan(const int fd, const struct fm_inode *const restrict fi, const char *const restrict abspath)
+{
+	unsigned char hdr[FM_QCOW2_HEADER_SIZE];
+	const struct fm_extent *extent;
+	struct fm_qcow2_image *image;
+	struct fm_qcow2_walk walk;
+	const size_t len = strlen(abspath);
+	uint64_t i = 0U;
+
+	if ((fi->sb.st_mode & S_IFMT) != S_IFREG || fi->sb.st_size < (off_t) sizeof hdr)
+		return true;
+
+	(void) memset(hdr, 0x00, sizeof hdr);
+
+	if (! fm_qcow2_read(fd, hdr, sizeof hdr, 0U) || fm_qcow2_be32(hdr) != FM_QCOW2_MAGIC)
+		// Not a qcow2 image
+		return true;
+
+	(void) memset(&walk, 0x00, sizeof walk);
+
+	if ((image = calloc(1U, sizeof *image + len + 1U)) == NULL ||
+	    (fi->extcount && (walk.hostexts = calloc(fi->extcount, sizeof *walk.hostexts)) == NULL))
+	{
+		(void) fm_scan_failed(abspath, "calloc(3)", errno);
+		free(image);
+		return fm_keep_going;
+	}
+
+	(void) memcpy(image->path, abspath, len);
+
+	DL_FOREACH(fi->extents, extent)
+	{
+		walk.hostexts[i].off  = extent->off;
+		walk.hostexts[i].len  = extent->len;
+		walk.hostexts[i].loff = extent->loff;
+		i++;
+	}
+
+	image->hostexts = fi->extcount;
+	walk.hostcount = fi->extcount;
+	walk.image = image;
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: reading qcow2 tables of %s ...", argvzero, abspath);
+
+	if (! fm_qcow2_walk_tables(fd, hdr, &walk, abspath))
+	{
+		// This function records the failure; the figures for this image would be incomplete
+		free(walk.hostexts);
+		free(image);
+		return fm_keep_going;
+	}
+
+	DL_APPEND(fm_qcow2_images, image);
+
+	free(walk.hostexts);
+
+	return true;
+}
+
+void
+fm_qcow2_report(void)
+{
+	struct fm_qcow2_image *image;
+	struct fm_qcow2_image *itmp;
+
+	if (fm_qcow2_images == NULL)
+	{
+		(void) printf("No qcow2 images found\n");
+		return;
+	}
+
+	DL_FOREACH_SAFE(fm_qcow2_images, image, itmp)
+	{
+		const long double mib = ((((long double) image->allocated) * image->clustersz) / FM_QCOW2_MIB);
+		const long double fileratio = ((mib > 0.0L) ? (((long double) image->fileseeks) / mib) : 0.0L);
+		const long double ratio = ((mib > 0.0L) ? (((long double) image->seeks) / mib) : 0.0L);
+
+		(void) printf("%s\n", image->path);
+		(void) printf("  Guest disk size ............ : %" PRIu64 " bytes in %" PRIu64 "-byte clusters\n",
+		              image->size, image->clustersz);
+		(void) printf("  Allocated clusters ......... : %" PRIu64 " (%.2Lf MiB)\n", image->allocated, mib);
+
+		if (image->compressed)
+			(void) printf("  Compressed clusters ........ : %" PRIu64 "\n", image->compressed);
+
+		if (image->zeroed)
+			(void) printf("  Zeroed clusters ............ : %" PRIu64 "\n", image->zeroed);
+
+		if (image->sparse)
+			(void) printf("  Clusters in holes .......... : %" PRIu64 "\n", image->sparse);
+
+		if (image->backed)
+			(void) printf("  Unallocated clusters ....... : read from the backing file (not mapped)\n");
+
+		(void) printf("  Image file extents ......... : %" PRIu64 "\n", image->hostexts);
+		(void) printf("  Seeks in the image file .... : %" PRIu64 " (%.2Lf per guest MiB)\n",
+		              image->fileseeks, fileratio);
+		(void) printf("  Seeks in the volume ........ : %" PRIu64 " (%.2Lf per guest MiB)\n",
+		              image->seeks, ratio);
+
+		if (image->next != NULL)
+			(void) printf("\n");
+
+		DL_DELETE(fm_qcow2_images, image);
+		free(image);
+	}
+}
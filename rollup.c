@@ -0,0 +1,193 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filemap.h"
+
+/* Rolling up fragmentation statistics per directory (see --rollup)
+ *
+ * The directories being walked form a stack that follows the recursion in fm_scan_directory(). Each file is
+ * added to the directory at the top of it as the file is mapped, and when a directory has been walked, its
+ * totals (which by then include all of its subdirectories) are added to its parent's; so every subtree is
+ * complete as soon as it has been walked, without a second pass over the directories or the extents.
+ *
+ * Subtrees are ranked by their excess extents (extents beyond one per file), which is how many extents would
+ * go away if every file in them were defragmented, and so how much there is to gain by doing that.
+ */
+
+struct fm_rollup_dir
+{
+	struct fm_rollup_dir *      parent;     // The directory this one is in (NULL for the top of the stack)
+
+	uint64_t                    files;      // Number of files (names; hardlinks are counted in each directory)
+	uint64_t                    extents;    // Number of extents in those files
+	uint64_t                    excess;     // Number of those extents beyond the first of each file
+	uint64_t                    fragmented; // Number of those files that are fragmented
+	uint64_t                    bytes;      // Number of bytes allocated to those files
+	char                        name[];     // The directory
+};
+
+static struct fm_rollup_dir *fm_rollup_stack = NULL;
+static struct fm_rollup_dir **fm_rollup_done = NULL;
+static uint64_t fm_rollup_count = 0U;
+static uint64_t fm_rollup_alloc = 0U;
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_rollup_enter(const char *const restrict abspath)
+{
+	const size_t len = strlen(abspath);
+	struct fm_rollup_dir *dir;
+
+	if ((dir = calloc(1U, sizeof *dir + len + 1U)) == NULL)
+	{
+		(void) fm_scan_failed(abspath, "calloc(3)", errno);
+		return false;
+	}
+
+	(void) memcpy(dir->name, abspath, len);
+
+	dir->parent = fm_rollup_stack;
+	fm_rollup_stack = dir;
+
+	return true;
+}
+
+void FM_NONNULL(1)
+fm_rollup_add(const struct fm_inode *const restrict fi)
+{
+	struct fm_rollup_dir *const dir = fm_rollup_stack;
+	const struct fm_extent *fe;
+
+	if (dir == NULL)
+		// Not in a directory being walked (<path> is a file, or it was retried after the walk)
+		return;
+
+	dir->files++;
+	dir->extents += fi->extcount;
+
+	if (fi->extcount > 1U)
+		dir->excess += (fi->extcount - 1U);
+
+	if (fi->flags & FM_IFLAGS_FRAGMENTED)
+		dir->fragmented++;
+
+	DL_FOREACH(fi->extents, fe)
+		dir->bytes += fe->len;
+}
+
+bool FM_WARN_UNUSED
+fm_rollup_leave(void)
+{
+	struct fm_rollup_dir *const dir = fm_rollup_stack;
+	struct fm_rollup_dir *const parent = dir->parent;
+
+	if (fm_rollup_count == fm_rollup_alloc)
+	{
+		const uint64_t alloc = ((fm_rollup_alloc) ? (fm_rollup_alloc * 2U) : 4096U);
+		void *const ptr = realloc(fm_rollup_done, alloc * sizeof *fm_rollup_done);
+
+		if (ptr == NULL)
+		{
+			(void) fm_scan_failed(dir->name, "realloc(3)", errno);
+			return false;
+		}
+
+		fm_rollup_done = ptr;
+		fm_rollup_alloc = alloc;
+	}
+
+	if (parent != NULL)
+	{
+		parent->files += dir->files;
+		parent->extents += dir->extents;
+		parent->excess += dir->excess;
+		parent->fragmented += dir->fragmented;
+		parent->bytes += dir->bytes;
+	}
+
+	fm_rollup_done[fm_rollup_count++] = dir;
+	fm_rollup_stack = parent;
+
+	return true;
+}
+
+static int FM_NONNULL(1, 2)
+fm_rollup_sortby_excess_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_rollup_dir *const dir1 = *(const struct fm_rollup_dir *const *) ptr1;
+	const struct fm_rollup_dir *const dir2 = *(const struct fm_rollup_dir *const *) ptr2;
+
+	if (dir1->excess > dir2->excess)
+		return -1;
+
+	if (dir1->excess < dir2->excess)
+		return 1;
+
+	if (dir1->fragmented > dir2->fragmented)
+		return -1;
+
+	if (dir1->fragmented < dir2->fragmented)
+		return 1;
+
+	return strcmp(dir1->name, dir2->name);
+}
+
+void
+fm_rollup_report(void)
+{
+	const uint64_t top = ((fm_rollup_top < fm_rollup_count) ? fm_rollup_top : fm_rollup_count);
+
+	qsort(fm_rollup_done, fm_rollup_count, sizeof *fm_rollup_done, &fm_rollup_sortby_excess_cb);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble)
+	{
+		(void) printf("Directories walked .......... : %" PRIu64 "\n", fm_rollup_count);
+		(void) printf("Subtrees listed ............. : %" PRIu64 " (most excess extents first)\n", top);
+		(void) printf("\n");
+	}
+
+	(void) printf("%12s %12s %12s %12s %8s %20s %10s    %s\n", "Files", "Extents", "Excess", "Fragmented", "Share",
+	              "Allocated", "Ext/File", "Directory");
+	(void) printf("------------ ------------ ------------ ------------ -------- -------------------- ---------- "
+	              "   ---------\n\n");
+
+	for (uint64_t i = 0U; i < top; i++)
+	{
+		const struct fm_rollup_dir *const dir = fm_rollup_done[i];
+		const long double share = ((dir->files) ?
+		                           (100.0L * ((long double) dir->fragmented / (long double) dir->files)) : 0.0L);
+		const long double average = ((dir->files) ? ((long double) dir->extents / (long double) dir->files) : 0.0L);
+		char pcnt[128U];
+
+		(void) memset(pcnt, 0x00, sizeof pcnt);
+		(void) snprintf(pcnt, sizeof pcnt, "%.2Lf%%", share);
+
+		(void) printf("%12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %8s %20s %10.2Lf    %s\n",
+		              dir->files, dir->extents, dir->excess, dir->fragmented, pcnt,
+		              fm_readable_size(FM_READABLE_SIZE, dir->bytes), average, dir->name);
+	}
+
+	for (uint64_t i = 0U; i < fm_rollup_count; i++)
+		free(fm_rollup_done[i]);
+
+	free(fm_rollup_done);
+
+	fm_rollup_done = NULL;
+	fm_rollup_count = 0U;
+	fm_rollup_alloc = 0U;
+}
@@ -0,0 +1,82 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/vfs.h>
+
+#include <linux/magic.h>
+
+#include "filemap.h"
+
+/* Scoring how fragmented an inode is against how fragmented it has to be
+ *
+ * Every filesystem limits how long a single extent can be (ext4 cannot describe more than 32768 blocks with one
+ * extent, for example), so a large file is always going to be made up of several extents, however well it was
+ * laid out, and the filesystem is free to put something else (e.g. its own metadata) between them. The ideal
+ * number of extents for an inode is the fewest that its data could be described with, and reading it should
+ * not need to seek more than once per ideal extent.
+ *
+ * An inode's seeks are the number of times that its extents, in logical order, do not carry on from where the
+ * previous one ended in the volume (plus one for the first). Its score is its seeks divided by its ideal number
+ * of extents, so 1.00 means that it could not be laid out any better and larger numbers mean that it is that
+ * many times worse than it could be. An inode is only considered fragmented if it scores above 1.00, or if its
+ * data is out of order in the volume.
+ */
+
+#define FM_SCORE_BTRFS_MAX_EXTENT       (UINT64_C(128) << 20)
+#define FM_SCORE_EXT4_MAX_EXTENT_BLOCKS UINT64_C(32768)
+#define FM_SCORE_XFS_MAX_EXTENT_BLOCKS  ((UINT64_C(1) << 21) - 1U)
+
+uint64_t FM_WARN_UNUSED
+fm_score_max_extent(const int fd)
+{
+	struct statfs sfs;
+
+	if (fstatfs(fd, &sfs) < 0)
+		// Not knowing the limit leaves every inode with an ideal of one extent, as if there were no limit
+		return 0U;
+
+	switch ((uint64_t) sfs.f_type)
+	{
+		case EXT4_SUPER_MAGIC:
+			return (FM_SCORE_EXT4_MAX_EXTENT_BLOCKS * fm_blksz);
+
+		case BTRFS_SUPER_MAGIC:
+			return FM_SCORE_BTRFS_MAX_EXTENT;
+
+		case XFS_SUPER_MAGIC:
+			return (FM_SCORE_XFS_MAX_EXTENT_BLOCKS * fm_blksz);
+	}
+
+	return 0U;
+}
+
+uint64_t FM_NONNULL(1) FM_WARN_UNUSED
+fm_score_ideal(const struct fm_inode *const restrict fi)
+{
+	if (! fm_max_extent_len || fi->bytes <= fm_max_extent_len)
+		return 1U;
+
+	return ((fi->bytes / fm_max_extent_len) + (((fi->bytes % fm_max_extent_len) != 0U) ? 1U : 0U));
+}
+
+long double FM_NONNULL(1) FM_WARN_UNUSED
+fm_score_inode(const struct fm_inode *const restrict fi)
+{
+	const uint64_t ideal = fm_score_ideal(fi);
+
+	if (! fi->seeks)
+		// There is no data to read
+		return 0.0L;
+
+	if (fi->seeks <= ideal)
+		return 1.0L;
+
+	return ((long double) fi->seeks / (long double) ideal);
+}
@@ -61,6 +61,13 @@ fm_sortby_inofcnt_cb(const struct fm_extent *const restrict in1, const struct fm
 static int FM_NONNULL(1, 2)
 fm_sortby_inonum_cb(const struct fm_extent *const restrict in1, const struct fm_extent *const restrict in2)
 {
+	// Inodes in filesystem images after those in the volume, grouped by image file (see ext4.c)
+	if (in1->inode->host < in2->inode->host)
+		return -1;
+
+	if (in1->inode->host > in2->inode->host)
+		return 1;
+
 	if (in1->inode->inum < in2->inode->inum)
 		return -1;
 
@@ -96,6 +103,33 @@ fm_sortby_inofname_cb(const struct fm_extent *const restrict in1, const struct f
 	return 0;
 }
 
+static int FM_NONNULL(1, 2)
+fm_sortby_fragscore_cb(const struct fm_extent *const restrict in1, const struct fm_extent *const restrict in2)
+{
+	const long double score1 = fm_score_inode(in1->inode);
+	const long double score2 = fm_score_inode(in2->inode);
+
+	if (score1 < score2)
+		return -1;
+
+	if (score1 > score2)
+		return 1;
+
+	return 0;
+}
+
+static int FM_NONNULL(1, 2)
+fm_sortby_readcost_cb(const struct fm_extent *const restrict in1, const struct fm_extent *const restrict in2)
+{
+	if (in1->inode->readtime < in2->inode->readtime)
+		return -1;
+
+	if (in1->inode->readtime > in2->inode->readtime)
+		return 1;
+
+	return 0;
+}
+
 int FM_NONNULL(1, 2)
 fm_sortby_extent_cb(const void *const restrict ptr1, const void *const restrict ptr2)
 {
@@ -140,6 +174,16 @@ fm_sortby_extent_cb(const void *const restrict ptr1, const void *const restrict
 			ret = fm_sortby_inofname_cb(in1, in2);
 			break;
 		}
+		case FM_SORTMETH_FRAG_SCORE:
+		{
+			ret = fm_sortby_fragscore_cb(in1, in2);
+			break;
+		}
+		case FM_SORTMETH_READ_COST:
+		{
+			ret = fm_sortby_readcost_cb(in1, in2);
+			break;
+		}
 	}
 
 	switch (fm_sort_direction)
@@ -0,0 +1,48 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "filemap.h"
+
+/* Keeping reads and writes below a rate (see --warm-rate and --defrag-rate)
+ *
+ * The caller counts the bytes it has done since it started. If doing that many at the requested rate should have
+ * taken longer than it did, it is ahead of the rate, and pauses for the difference.
+ */
+
+void FM_NONNULL(1)
+fm_throttle(const struct timespec *const restrict started, const uint64_t bytes, const uint64_t rate)
+{
+	struct timespec now;
+	long double ahead;
+
+	if (! rate)
+		return;
+
+	(void) memset(&now, 0x00, sizeof now);
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// How long everything so far should have taken at the requested rate (in MiB/s), less how long it did take
+	ahead = ((((long double) bytes) / (((long double) rate) * (UINT64_C(1) << 20))) -
+	         (((long double) (now.tv_sec - started->tv_sec)) +
+	          ((long double) (now.tv_nsec - started->tv_nsec) / 1.0E9L)));
+
+	if (ahead > 0.0L)
+	{
+		struct timespec pause;
+
+		(void) memset(&pause, 0x00, sizeof pause);
+
+		pause.tv_sec = (time_t) ahead;
+		pause.tv_nsec = (long) ((ahead - (long double) pause.tv_sec) * 1.0E9L);
+
+		(void) nanosleep(&pause, NULL);
+	}
+}
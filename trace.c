@@ -0,0 +1,423 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filemap.h"
+
+/* Attributing the I/O in a block-layer trace to files (see --trace)
+ *
+ * The trace is the text output of blkparse(1), and is read a line at a time without keeping any of it, so its
+ * length does not matter. Only the requests issued to the device (D events) are counted, once each. The sectors
+ * of each are looked up in the extents sorted by physical offset (see lookup.c); I/O tends to be clustered, so
+ * the extent that the previous request ended in and the one after it are tried before a binary search.
+ *
+ * If the trace is of a partition, blkparse shows the requests at their sector on the whole disk, and the
+ * remapping (A) events show where the partition starts; that is subtracted to get offsets in the filesystem.
+ * With --dm-table or --dm-live, offsets are already on the whole disk (see dm.c), so it is not.
+ */
+
+#define FM_TRACE_SECTOR_SIZE            512U
+#define FM_TRACE_MAX_FIELDS             16U
+
+struct fm_trace_stat
+{
+	UT_hash_handle              hh;         // For entry into fm_trace_files or fm_trace_dirs below
+	const struct fm_inode *     inode;      // The file (hash key of fm_trace_files)
+
+	uint64_t                    ios;        // Number of requests that touched it
+	uint64_t                    bytes;      // Number of bytes of it that they touched
+	uint64_t                    reads;      // Number of those requests that were reads
+	uint64_t                    writes;     // Number of those requests that were writes
+	uint64_t                    sequential; // Number of those requests that began where the previous one ended
+	uint64_t                    lastend;    // Where the previous request that touched it ended (in the volume)
+	char                        name[];     // The directory (hash key of fm_trace_dirs)
+};
+
+struct fm_trace_totals
+{
+	uint64_t                    lines;      // Lines read from the trace
+	uint64_t                    ios;        // Requests issued to the device
+	uint64_t                    bytes;      // Bytes they read or wrote
+	uint64_t                    unowned;    // Bytes outside any of the extents mapped
+	uint64_t                    partstart;  // Sector where the partition starts (if the trace is of one)
+	bool                        remapped;   // partstart is known
+};
+
+static struct fm_trace_stat *fm_trace_files = NULL;
+static struct fm_trace_stat *fm_trace_dirs = NULL;
+
+static size_t FM_NONNULL(1, 2)
+fm_trace_split(char *restrict line, char **const restrict fields)
+{
+	size_t count = 0U;
+
+	while (count < FM_TRACE_MAX_FIELDS)
+	{
+		while (isspace((unsigned char) *line))
+			line++;
+
+		if (! *line)
+			break;
+
+		fields[count++] = line;
+
+		while (*line && ! isspace((unsigned char) *line))
+			line++;
+
+		if (*line)
+			*line++ = 0x00;
+	}
+
+	return count;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_trace_number(const char *const restrict arg, uint64_t *const restrict result)
+{
+	char *end = NULL;
+
+	errno = 0;
+
+	const unsigned long long value = strtoull(arg, &end, 10);
+
+	if (errno != 0 || end == arg || *end != 0x00 || *arg == '-')
+		return false;
+
+	*result = (uint64_t) value;
+	return true;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_trace_same_major(const char *const restrict dev1, const char *const restrict dev2)
+{
+	// "8,0" and "(8,1)"
+	const char *const comma1 = strchr(dev1, ',');
+	const char *const comma2 = strchr(dev2, ',');
+	const char *const start2 = ((*dev2 == '(') ? (dev2 + 1) : dev2);
+
+	if (comma1 == NULL || comma2 == NULL || (comma1 - dev1) != (comma2 - start2))
+		return false;
+
+	return (strncmp(dev1, start2, (size_t) (comma1 - dev1)) == 0);
+}
+
+static struct fm_trace_stat * FM_NONNULL(1) FM_WARN_UNUSED
+fm_trace_file_stat(const struct fm_inode *const inode)
+{
+	struct fm_trace_stat *stat = NULL;
+
+	HASH_FIND(hh, fm_trace_files, &inode, sizeof inode, stat);
+
+	if (stat != NULL)
+		return stat;
+
+	if ((stat = calloc(1U, sizeof *stat)) == NULL)
+	{
+		(void) fm_print_message("%s: while reading trace: calloc(3): %s\n", argvzero, strerror(errno));
+		return NULL;
+	}
+
+	stat->inode = inode;
+
+	HASH_ADD(hh, fm_trace_files, inode, sizeof stat->inode, stat);
+
+	return stat;
+}
+
+static bool FM_NONNULL(1, 3) FM_WARN_UNUSED
+fm_trace_account(struct fm_extent *const *const restrict index, const uint64_t count,
+                 uint64_t *const restrict hint, const uint64_t off, const uint64_t len, const bool write,
+                 struct fm_trace_totals *const restrict totals)
+{
+	const uint64_t end = (off + len);
+	const struct fm_inode *previnode = NULL;
+	uint64_t owned = 0U;
+	uint64_t first = *hint;
+
+	// Try where the previous request was first, and then the extent after that
+	if (! (first < count && index[first]->off <= off && off < (index[first]->off + index[first]->len)))
+	{
+		if ((first + 1U) < count && index[first + 1U]->off <= off &&
+		    off < (index[first + 1U]->off + index[first + 1U]->len))
+			first++;
+		else
+			first = fm_lookup_search(index, count, off);
+	}
+
+	*hint = first;
+
+	for (uint64_t i = first; i < count && index[i]->off < end; i++)
+	{
+		const struct fm_extent *const extent = index[i];
+		const uint64_t start = ((extent->off > off) ? extent->off : off);
+		const uint64_t stop = (((extent->off + extent->len) < end) ? (extent->off + extent->len) : end);
+		struct fm_trace_stat *stat;
+
+		if ((stat = fm_trace_file_stat(extent->inode)) == NULL)
+			// This function prints messages on error
+			return false;
+
+		// A request that spans several extents of the same file is still only one request for it
+		if (extent->inode != previnode)
+		{
+			if (stat->lastend == start)
+				stat->sequential++;
+
+			if (write)
+				stat->writes++;
+			else
+				stat->reads++;
+
+			stat->ios++;
+		}
+
+		stat->bytes += (stop - start);
+		stat->lastend = stop;
+		owned += (stop - start);
+		previnode = extent->inode;
+	}
+
+	totals->unowned += (len - owned);
+
+	return true;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_trace_read(FILE *const restrict fp, struct fm_trace_totals *const restrict totals)
+{
+	struct fm_extent **index;
+	char line[BUFSIZ];
+	uint64_t count = 0U;
+	uint64_t hint = 0U;
+	bool result = false;
+
+	if ((index = fm_lookup_index(&count)) == NULL)
+		// This function prints messages on error
+		return false;
+
+	while (fgets(line, sizeof line, fp) != NULL)
+	{
+		// dev cpu seq time pid action rwbs sector + count [process]  (or, for A: ... + count <- (dev) sector)
+		char *fields[FM_TRACE_MAX_FIELDS];
+		const size_t nfields = fm_trace_split(line, fields);
+		uint64_t sector = 0U;
+		uint64_t sectors = 0U;
+
+		totals->lines++;
+
+		if (nfields < 10U || fields[5][1] != 0x00 || strcmp(fields[8], "+") != 0)
+			// Not an event with a sector range (a message, a summary line, or a flush)
+			continue;
+
+		if (! fm_trace_number(fields[7], &sector) || ! fm_trace_number(fields[9], &sectors))
+			continue;
+
+		if (fields[5][0] == 'A' && nfields >= 13U && ! totals->remapped && ! fm_dm_requested() &&
+		    strcmp(fields[10], "<-") == 0 && fm_trace_same_major(fields[0], fields[11]))
+		{
+			uint64_t partsector = 0U;
+
+			if (fm_trace_number(fields[12], &partsector) && partsector <= sector)
+			{
+				totals->partstart = (sector - partsector);
+				totals->remapped = true;
+			}
+
+			continue;
+		}
+
+		if (fields[5][0] != 'D' || ! sectors || sector < totals->partstart)
+			continue;
+
+		const uint64_t off = ((sector - totals->partstart) * FM_TRACE_SECTOR_SIZE);
+		const uint64_t len = (sectors * FM_TRACE_SECTOR_SIZE);
+
+		totals->ios++;
+		totals->bytes += len;
+
+		if (! fm_trace_account(index, count, &hint, off, len, (strchr(fields[6], 'W') != NULL), totals))
+			// This function prints messages on error
+			goto done;
+	}
+	if (ferror(fp))
+	{
+		(void) fm_print_message("%s: while reading trace: fgets(3): %s\n", argvzero, strerror(errno));
+		goto done;
+	}
+
+	result = true;
+
+done:
+
+	free(index);
+
+	return result;
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_trace_add_dir(const struct fm_trace_stat *const restrict fstat)
+{
+	const char *const name = fstat->inode->names->name;
+	const char *const slash = strrchr(name, '/');
+	const size_t len = ((slash == NULL) ? 0U : ((slash == name) ? 1U : (size_t) (slash - name)));
+	struct fm_trace_stat *dstat = NULL;
+
+	HASH_FIND(hh, fm_trace_dirs, name, len, dstat);
+
+	if (dstat == NULL)
+	{
+		if ((dstat = calloc(1U, sizeof *dstat + len + 1U)) == NULL)
+		{
+			(void) fm_print_message("%s: while reading trace: calloc(3): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+
+		(void) memcpy(dstat->name, name, len);
+
+		HASH_ADD_KEYPTR(hh, fm_trace_dirs, dstat->name, len, dstat);
+	}
+
+	dstat->ios        += fstat->ios;
+	dstat->bytes      += fstat->bytes;
+	dstat->reads      += fstat->reads;
+	dstat->writes     += fstat->writes;
+	dstat->sequential += fstat->sequential;
+
+	return true;
+}
+
+static int FM_NONNULL(1, 2)
+fm_trace_sortby_bytes_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_trace_stat *const stat1 = ptr1;
+	const struct fm_trace_stat *const stat2 = ptr2;
+
+	if (stat1->bytes > stat2->bytes)
+		return -1;
+
+	if (stat1->bytes < stat2->bytes)
+		return 1;
+
+	if (stat1->ios > stat2->ios)
+		return -1;
+
+	if (stat1->ios < stat2->ios)
+		return 1;
+
+	return 0;
+}
+
+static void FM_NONNULL(1)
+fm_trace_free(struct fm_trace_stat **const restrict stats)
+{
+	struct fm_trace_stat *stat;
+	struct fm_trace_stat *stmp;
+
+	HASH_ITER(hh, *stats, stat, stmp)
+	{
+		HASH_DEL(*stats, stat);
+		free(stat);
+	}
+}
+
+static void FM_NONNULL(1)
+fm_trace_print(const struct fm_trace_stat *const restrict stats, const bool dirs)
+{
+	const struct fm_trace_stat *stat;
+
+	(void) printf("\n");
+	(void) printf("%12s %20s %12s %12s %12s    %s\n", "Requests", "Bytes", "Reads", "Writes", "Sequential",
+	              ((dirs) ? "Directory" : "File Name"));
+	(void) printf("------------ -------------------- ------------ ------------ ------------    ------------\n\n");
+
+	for (stat = stats; stat != NULL; stat = stat->hh.next)
+	{
+		const char *const name = ((dirs) ? stat->name : ((stat->inode->names != NULL) ?
+		                          stat->inode->names->name : "(unnamed)"));
+		const long double seqpcnt = 100.0L * (((long double) stat->sequential) / ((long double) stat->ios));
+		char sequential[128U];
+
+		(void) memset(sequential, 0x00, sizeof sequential);
+		(void) snprintf(sequential, sizeof sequential, "%.2Lf%%", seqpcnt);
+
+		(void) printf("%12" PRIu64 " %20s %12" PRIu64 " %12" PRIu64 " %12s    %s\n", stat->ios,
+		              fm_readable_size(FM_READABLE_SIZE, stat->bytes), stat->reads, stat->writes, sequential,
+		              name);
+	}
+}
+
+bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_trace_report(const char *const restrict path)
+{
+	struct fm_trace_totals totals;
+	struct fm_trace_stat *stat;
+	struct fm_trace_stat *stmp;
+	FILE *fp = stdin;
+	bool result;
+
+	(void) memset(&totals, 0x00, sizeof totals);
+
+	if (strcmp(path, "-") != 0 && (fp = fopen(path, "r")) == NULL)
+	{
+		(void) fm_print_message("%s: while reading trace '%s': fopen(3): %s\n", argvzero, path, strerror(errno));
+		return false;
+	}
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("%s: reading trace %s ...", argvzero, path);
+
+	result = fm_trace_read(fp, &totals);
+
+	if (fp != stdin)
+		(void) fclose(fp);
+
+	HASH_ITER(hh, fm_trace_files, stat, stmp)
+		if (result && stat->inode->names != NULL && ! fm_trace_add_dir(stat))
+			// This function prints messages on error
+			result = false;
+
+	if (result)
+	{
+		if (! fm_run_quietly)
+			(void) fm_print_message("");
+
+		if (! fm_skip_preamble)
+		{
+			(void) printf("Trace lines read ............ : %" PRIu64 "\n", totals.lines);
+			(void) printf("Requests issued ............. : %" PRIu64 " (%s)\n", totals.ios,
+			              fm_readable_size(FM_READABLE_SIZE, totals.bytes));
+			(void) printf("Not in any file ............. : %s\n",
+			              fm_readable_size(FM_READABLE_SIZE, totals.unowned));
+
+			if (totals.remapped)
+				(void) printf("Partition starts at sector .. : %" PRIu64 "\n", totals.partstart);
+		}
+
+		HASH_SORT(fm_trace_files, fm_trace_sortby_bytes_cb);
+		HASH_SORT(fm_trace_dirs, fm_trace_sortby_bytes_cb);
+
+		if (fm_trace_files != NULL)
+			(void) fm_trace_print(fm_trace_files, false);
+
+		if (fm_trace_dirs != NULL)
+			(void) fm_trace_print(fm_trace_dirs, true);
+	}
+
+	(void) fm_trace_free(&fm_trace_files);
+	(void) fm_trace_free(&fm_trace_dirs);
+
+	return result;
+}
@@ -0,0 +1,319 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fiemap.h>
+
+#include "filemap.h"
+
+/* Reading everything that was mapped into the page cache, in the order that it is in the volume (see --warm)
+ *
+ * The extents sorted by physical offset (see lookup.c) are grouped into runs of extents that follow each other
+ * in the volume without a gap, whichever files they belong to. A pool of reader threads takes the runs in
+ * ascending order, one at a time, and reads each run from start to finish; so although the data of a run is
+ * read through more than one file, the device sees one sequential stream for it, and with more than one
+ * reader, a handful of nearby streams that its queue can order.
+ *
+ * Each extent is first announced with posix_fadvise(POSIX_FADV_WILLNEED), so that the kernel can read ahead
+ * of the reader, and is then read with large pread(2) calls, which only return once the data is cached. With
+ * --warm-rate, the readers pause whenever they are ahead of the rate over the time since they were started.
+ */
+
+#define FM_WARM_CHUNK_SIZE              (UINT64_C(1) << 20)
+
+struct fm_warm_run
+{
+	uint64_t                    first;      // Index of the first extent in the run
+	uint64_t                    count;      // Number of extents in the run
+};
+
+struct fm_warm_state
+{
+	pthread_mutex_t             lock;       // Protects everything below
+
+	struct fm_extent **         index;      // Extents sorted by physical offset
+	const struct fm_warm_run *  runs;       // Runs of adjacent extents to read
+	uint64_t                    runcount;   // Number of runs
+	uint64_t                    nextrun;    // The next run to be taken by a reader
+	struct timespec             started;    // When the readers were started
+
+	uint64_t                    bytes;      // Bytes read so far
+	uint64_t                    extents;    // Extents read so far
+	uint64_t                    failed;     // Extents that could not be (completely) read
+	bool                        nomem;      // A reader could not allocate its buffer
+};
+
+static long double
+fm_warm_elapsed(const struct timespec *const restrict since)
+{
+	struct timespec now;
+
+	(void) memset(&now, 0x00, sizeof now);
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (((long double) (now.tv_sec - since->tv_sec)) + ((long double) (now.tv_nsec - since->tv_nsec) / 1.0E9L));
+}
+
+static void FM_NONNULL(1)
+fm_warm_throttle(struct fm_warm_state *const restrict state, const uint64_t len)
+{
+	uint64_t bytes;
+
+	(void) pthread_mutex_lock(&state->lock);
+
+	state->bytes += len;
+	bytes = state->bytes;
+
+	(void) pthread_mutex_unlock(&state->lock);
+
+	// Outside of the lock, so that the other readers can carry on counting while this one pauses
+	(void) fm_throttle(&state->started, bytes, fm_warm_rate);
+}
+
+static bool FM_NONNULL(1, 2, 3, 4)
+fm_warm_extent(struct fm_warm_state *const restrict state, const struct fm_extent *const restrict extent,
+               const struct fm_inode **const restrict openino, int *const restrict fd, unsigned char *const restrict buf)
+{
+	uint64_t done = 0U;
+
+	if (*openino != extent->inode)
+	{
+		// Adjacent extents usually belong to the same file; keep it open until an extent of another one
+		if (*fd >= 0)
+			(void) close(*fd);
+
+		*openino = extent->inode;
+		*fd = -1;
+
+		if (! fm_run_quietly)
+		{
+			(void) pthread_mutex_lock(&state->lock);
+			(void) fm_print_message("%s: warming %s ...", argvzero, extent->inode->names->name);
+			(void) pthread_mutex_unlock(&state->lock);
+		}
+
+		*fd = open(extent->inode->names->name, O_NOCTTY | O_RDONLY | O_NOFOLLOW, 0);
+	}
+
+	if (*fd < 0)
+		// Removed or replaced since it was scanned
+		return false;
+
+	(void) posix_fadvise(*fd, (off_t) extent->loff, (off_t) extent->len, POSIX_FADV_WILLNEED);
+
+	while (done < extent->len)
+	{
+		const uint64_t want = (((extent->len - done) < FM_WARM_CHUNK_SIZE) ? (extent->len - done) : FM_WARM_CHUNK_SIZE);
+		const ssize_t ret = pread(*fd, buf, (size_t) want, (off_t) (extent->loff + done));
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret == 0 && (extent->loff + done) >= (uint64_t) extent->inode->sb.st_size)
+			// The last extent of a file is rounded up to a whole block, past the end of the file
+			break;
+
+		if (ret <= 0)
+			// Failed, or the file has been truncated since it was scanned
+			return false;
+
+		done += (uint64_t) ret;
+
+		(void) fm_warm_throttle(state, (uint64_t) ret);
+	}
+
+	return true;
+}
+
+static void * FM_NONNULL(1)
+fm_warm_reader(void *const restrict ptr)
+{
+	struct fm_warm_state *const state = ptr;
+	const struct fm_inode *openino = NULL;
+	unsigned char *const buf = malloc(FM_WARM_CHUNK_SIZE);
+	int fd = -1;
+
+	if (buf == NULL)
+	{
+		(void) pthread_mutex_lock(&state->lock);
+		state->nomem = true;
+		(void) pthread_mutex_unlock(&state->lock);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		const struct fm_warm_run *run = NULL;
+		uint64_t extents = 0U;
+		uint64_t failed = 0U;
+
+		(void) pthread_mutex_lock(&state->lock);
+
+		if (state->nextrun < state->runcount)
+			run = &state->runs[state->nextrun++];
+
+		(void) pthread_mutex_unlock(&state->lock);
+
+		if (run == NULL)
+			break;
+
+		for (uint64_t i = run->first; i < (run->first + run->count); i++)
+		{
+			if (fm_warm_extent(state, state->index[i], &openino, &fd, buf))
+				extents++;
+			else
+				failed++;
+		}
+
+		(void) pthread_mutex_lock(&state->lock);
+		state->extents += extents;
+		state->failed += failed;
+		(void) pthread_mutex_unlock(&state->lock);
+	}
+
+	if (fd >= 0)
+		(void) close(fd);
+
+	free(buf);
+	return NULL;
+}
+
+static bool FM_NONNULL(1)
+fm_warm_readable(const struct fm_extent *const restrict extent)
+{
+	if ((extent->inode->sb.st_mode & S_IFMT) != S_IFREG || extent->inode->names == NULL)
+		// Directories cannot be read with read(2), and there is nothing to open for an inode without a name
+		return false;
+
+	if (! fm_extent_in_volume(extent) || (extent->flags & FIEMAP_EXTENT_UNWRITTEN))
+		// Reading these does not read anything from where the extent says it is in the volume
+		return false;
+
+	return true;
+}
+
+bool FM_WARN_UNUSED
+fm_warm_report(void)
+{
+	struct fm_warm_state state;
+	struct fm_warm_run *runs = NULL;
+	pthread_t *threads = NULL;
+	uint64_t started = 0U;
+	uint64_t count = 0U;
+	long double elapsed;
+	bool result = false;
+
+	(void) memset(&state, 0x00, sizeof state);
+
+	if ((state.index = fm_lookup_index(&count)) == NULL)
+		// This function prints messages on error
+		return false;
+
+	if ((runs = calloc(count + 1U, sizeof *runs)) == NULL ||
+	    (threads = calloc(fm_warm_threads, sizeof *threads)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		goto done;
+	}
+
+	for (uint64_t i = 0U; i < count; i++)
+	{
+		const struct fm_extent *const extent = state.index[i];
+
+		if (! fm_warm_readable(extent))
+			continue;
+
+		if (state.runcount)
+		{
+			struct fm_warm_run *const prev = &runs[state.runcount - 1U];
+			const struct fm_extent *const last = state.index[prev->first + prev->count - 1U];
+
+			if ((prev->first + prev->count) == i && (last->off + last->len) == extent->off)
+			{
+				// Follows on from the end of the previous run in the volume
+				prev->count++;
+				continue;
+			}
+		}
+
+		runs[state.runcount].first = i;
+		runs[state.runcount].count = 1U;
+		state.runcount++;
+	}
+
+	state.runs = runs;
+
+	(void) pthread_mutex_init(&state.lock, NULL);
+	(void) clock_gettime(CLOCK_MONOTONIC, &state.started);
+
+	for (started = 0U; started < fm_warm_threads; started++)
+	{
+		const int ret = pthread_create(&threads[started], NULL, &fm_warm_reader, &state);
+
+		if (ret != 0)
+		{
+			(void) fm_print_message("%s: pthread_create(3): %s\n", argvzero, strerror(ret));
+			break;
+		}
+	}
+
+	for (uint64_t i = 0U; i < started; i++)
+		(void) pthread_join(threads[i], NULL);
+
+	elapsed = fm_warm_elapsed(&state.started);
+
+	(void) pthread_mutex_destroy(&state.lock);
+
+	if (! started || state.nomem)
+	{
+		if (state.nomem)
+			(void) fm_print_message("%s: malloc(3): %s\n", argvzero, strerror(ENOMEM));
+
+		goto done;
+	}
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble)
+	{
+		(void) printf("Readers ..................... : %" PRIu64 "\n", started);
+		(void) printf("Sequential runs ............. : %" PRIu64 "\n", state.runcount);
+		(void) printf("Extents read ................ : %" PRIu64 " (%" PRIu64 " could not be read)\n",
+		              state.extents, state.failed);
+		(void) printf("Data read ................... : %s\n", fm_readable_size(FM_READABLE_SIZE, state.bytes));
+		(void) printf("Time taken .................. : %.2Lf seconds\n", elapsed);
+
+		if (elapsed > 0.0L)
+			(void) printf("Throughput .................. : %s/s\n",
+			              fm_readable_size(FM_READABLE_SIZE, (uint64_t) (((long double) state.bytes) / elapsed)));
+	}
+
+	result = true;
+
+done:
+
+	free(threads);
+	free(runs);
+	free(state.index);
+
+	return result;
+}
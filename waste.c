@@ -0,0 +1,206 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <linux/fiemap.h>
+
+#include "filemap.h"
+
+/* Finding space that is allocated but not holding any data (see --space-waste)
+ *
+ * Space can be allocated to a file beyond its end (fallocate(2) with FALLOC_FL_KEEP_SIZE, or a filesystem's
+ * speculative preallocation), where nothing can be read from it until the file grows into it; or within its
+ * size but unwritten (fallocate(2) without it), where reading returns zeroes that are not stored anywhere.
+ * Either way, the space is taken from the volume (and from a thin-provisioned device underneath it, once it
+ * has been written to or zeroed there) without holding any data, and can be given back by truncating or
+ * punching holes in the file. Space past the end of a file is counted whether or not it is unwritten, and
+ * unwritten space only within it, so that nothing is counted twice.
+ *
+ * Delayed allocations are counted separately: they are data that has not been written out yet, and will take
+ * up space once it has been.
+ */
+
+struct fm_waste_file
+{
+	const struct fm_inode *     inode;      // The file
+	uint64_t                    allocated;  // Bytes allocated to it (excluding delayed allocations)
+	uint64_t                    pasteof;    // Bytes allocated to it past its end
+	uint64_t                    unwritten;  // Bytes in its unwritten extents, within its end
+	uint64_t                    delalloc;   // Bytes in its delayed allocations
+};
+
+static void FM_NONNULL(1)
+fm_waste_measure(struct fm_waste_file *const restrict file)
+{
+	const uint64_t size = (uint64_t) file->inode->sb.st_size;
+	const struct fm_extent *fe;
+
+	// The last block of the data is allocated in full, so only whole blocks past it are beyond the end
+	const uint64_t eof = (((size + fm_blksz - 1U) / fm_blksz) * fm_blksz);
+
+	DL_FOREACH(file->inode->extents, fe)
+	{
+		const uint64_t start = fe->loff;
+		const uint64_t end = (fe->loff + fe->len);
+		uint64_t within = fe->len;
+
+		if (fe->flags & (FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_UNKNOWN))
+		{
+			// Not allocated yet; where the extent says it is in the volume means nothing
+			file->delalloc += fe->len;
+			continue;
+		}
+
+		file->allocated += fe->len;
+
+		if (end > eof)
+		{
+			const uint64_t past = ((start >= eof) ? fe->len : (end - eof));
+
+			file->pasteof += past;
+			within -= past;
+		}
+		if (fe->flags & FIEMAP_EXTENT_UNWRITTEN)
+			file->unwritten += within;
+	}
+}
+
+static int FM_NONNULL(1, 2)
+fm_waste_sortby_reclaimable_cb(const void *const restrict ptr1, const void *const restrict ptr2)
+{
+	const struct fm_waste_file *const file1 = ptr1;
+	const struct fm_waste_file *const file2 = ptr2;
+	const uint64_t waste1 = (file1->pasteof + file1->unwritten);
+	const uint64_t waste2 = (file2->pasteof + file2->unwritten);
+
+	if (waste1 > waste2)
+		return -1;
+
+	if (waste1 < waste2)
+		return 1;
+
+	if (file1->delalloc > file2->delalloc)
+		return -1;
+
+	if (file1->delalloc < file2->delalloc)
+		return 1;
+
+	if (file1->inode->inum < file2->inode->inum)
+		return -1;
+
+	if (file1->inode->inum > file2->inode->inum)
+		return 1;
+
+	return 0;
+}
+
+bool FM_WARN_UNUSED
+fm_waste_report(void)
+{
+	const uint64_t inodes = HASH_COUNT(fm_inodes);
+	struct fm_waste_file *files;
+	struct fm_inode *fi;
+	struct fm_inode *itmp;
+	uint64_t allocated = 0U;
+	uint64_t pasteof = 0U;
+	uint64_t unwritten = 0U;
+	uint64_t delalloc = 0U;
+	uint64_t count = 0U;
+	uint64_t top;
+
+	if ((files = calloc(inodes + 1U, sizeof *files)) == NULL)
+	{
+		(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	HASH_ITER(hh, fm_inodes, fi, itmp)
+	{
+		struct fm_waste_file *const file = &files[count];
+
+		file->inode = fi;
+
+		(void) fm_waste_measure(file);
+
+		allocated += file->allocated;
+		pasteof += file->pasteof;
+		unwritten += file->unwritten;
+		delalloc += file->delalloc;
+
+		if (file->pasteof || file->unwritten || file->delalloc)
+			// Only the files with something to report are kept
+			count++;
+		else
+			(void) memset(file, 0x00, sizeof *file);
+	}
+
+	qsort(files, count, sizeof *files, &fm_waste_sortby_reclaimable_cb);
+
+	top = ((fm_waste_top < count) ? fm_waste_top : count);
+
+	if (! fm_run_quietly)
+		(void) fm_print_message("");
+
+	if (! fm_skip_preamble)
+	{
+		const uint64_t reclaimable = (pasteof + unwritten);
+		const long double share = ((allocated) ? (100.0L * ((long double) reclaimable / (long double) allocated)) :
+		                           0.0L);
+
+		(void) printf("Allocated ................... : %s\n", fm_readable_size(FM_READABLE_SIZE, allocated));
+		(void) printf("Allocated past end of file .. : %s\n", fm_readable_size(FM_READABLE_SIZE, pasteof));
+		(void) printf("Unwritten within file ....... : %s\n", fm_readable_size(FM_READABLE_SIZE, unwritten));
+		(void) printf("Reclaimable ................. : %s (%.2Lf%% of allocated)\n",
+		              fm_readable_size(FM_READABLE_SIZE, reclaimable), share);
+		(void) printf("Delayed allocations ......... : %s (not yet written out)\n",
+		              fm_readable_size(FM_READABLE_SIZE, delalloc));
+		(void) printf("Files with any of these ..... : %" PRIu64 "\n", count);
+		(void) printf("Files listed ................ : %" PRIu64 " (most reclaimable first)\n", top);
+		(void) printf("\n");
+	}
+
+	(void) printf("%20s %20s %20s %20s %20s %20s    %s\n", "Allocated", "File Size", "Past EOF", "Unwritten",
+	              "Reclaimable", "Delayed", "File Name");
+	(void) printf("-------------------- -------------------- -------------------- -------------------- "
+	              "-------------------- --------------------    ---------\n\n");
+
+	for (uint64_t i = 0U; i < top; i++)
+	{
+		const struct fm_waste_file *const file = &files[i];
+		const uint64_t columns[] = {
+			file->allocated, (uint64_t) file->inode->sb.st_size, file->pasteof, file->unwritten,
+			(file->pasteof + file->unwritten), file->delalloc,
+		};
+		char sizes[6U][128U];
+
+		// fm_readable_size() returns the same buffer every time it is called
+		for (size_t j = 0U; j < 6U; j++)
+		{
+			(void) memset(sizes[j], 0x00, sizeof sizes[j]);
+			(void) snprintf(sizes[j], sizeof sizes[j], "%s", fm_readable_size(FM_READABLE_SIZE, columns[j]));
+		}
+
+		(void) printf("%20s %20s %20s %20s %20s %20s    %s\n", sizes[0], sizes[1], sizes[2], sizes[3], sizes[4],
+		              sizes[5], ((file->inode->names != NULL) ? file->inode->names->name : "(unnamed)"));
+	}
+
+	(void) fflush(stdout);
+
+	free(files);
+
+	return true;
+}
@@ -0,0 +1,593 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2023-2024 Aaron M. D. Jones <me@aaronmdjones.net>
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filemap.h"
+
+#define FM_WATCH_MASK   (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                         IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct fm_watch_dir
+{
+	UT_hash_handle          hh_wd;      // For entry into fm_watch_wds below (watched directories only)
+	UT_hash_handle          hh_path;    // For entry into fm_watch_paths below (all scanned directories)
+	struct fm_watch_dir *   prev;       // For entry into fm_watch_unwatched below
+	struct fm_watch_dir *   next;       // For entry into fm_watch_unwatched below
+
+	int                     wd;         // inotify(7) watch descriptor, or -1 if it could not be watched
+	char                    path[PATH_MAX];
+};
+
+struct fm_watch_path
+{
+	UT_hash_handle          hh;         // For entry into a set of paths
+	char                    path[PATH_MAX];
+};
+
+struct fm_watch_summary
+{
+	uint64_t                files;
+	uint64_t                dirs;
+	uint64_t                inodes;
+	uint64_t                extents;
+	uint64_t                fragged;
+};
+
+static struct fm_watch_dir *fm_watch_wds = NULL;
+static struct fm_watch_dir *fm_watch_paths = NULL;
+static struct fm_watch_dir *fm_watch_unwatched = NULL;
+static struct fm_watch_path *fm_watch_pending = NULL;
+static uint64_t fm_watch_remapped = 0U;
+static uint64_t fm_watch_removed = 0U;
+static dev_t fm_watch_dev;
+static int fm_watch_fd = -1;
+
+static void FM_NONNULL(1)
+fm_watch_forget_dir(struct fm_watch_dir *const restrict wdir)
+{
+	if (wdir->wd >= 0)
+		HASH_DELETE(hh_wd, fm_watch_wds, wdir);
+	else
+		DL_DELETE(fm_watch_unwatched, wdir);
+
+	HASH_DELETE(hh_path, fm_watch_paths, wdir);
+	free(wdir);
+}
+
+static void FM_NONNULL(1)
+fm_watch_forget(const char *const restrict path)
+{
+	struct fm_watch_dir *wdir = NULL;
+	struct fm_name *fn = NULL;
+
+	HASH_FIND_STR(fm_names, path, fn);
+
+	if (fn != NULL)
+	{
+		(void) fm_forget_name(fn);
+		fm_watch_removed++;
+	}
+
+	HASH_FIND(hh_path, fm_watch_paths, path, strlen(path), wdir);
+
+	if (wdir == NULL)
+		// Not a directory that we scanned; nothing can be below it
+		return;
+
+	char prefix[PATH_MAX];
+	size_t prefixlen;
+	struct fm_watch_dir *wtmp;
+	struct fm_name *ntmp;
+
+	(void) memset(prefix, 0x00, sizeof prefix);
+	(void) snprintf(prefix, sizeof prefix, "%s/", path);
+
+	prefixlen = strlen(prefix);
+
+	// This also catches the directory's own name (which ends with a slash) when scanning directories
+	HASH_ITER(hh, fm_names, fn, ntmp)
+	{
+		if (strncmp(fn->name, prefix, prefixlen) != 0)
+			continue;
+
+		(void) fm_forget_name(fn);
+		fm_watch_removed++;
+	}
+	HASH_ITER(hh_path, fm_watch_paths, wdir, wtmp)
+	{
+		if (strcmp(wdir->path, path) != 0 && strncmp(wdir->path, prefix, prefixlen) != 0)
+			continue;
+
+		if (wdir->wd >= 0)
+			(void) inotify_rm_watch(fm_watch_fd, wdir->wd);
+
+		(void) fm_watch_forget_dir(wdir);
+	}
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_watch_remap(const char *const restrict path)
+{
+	struct fm_watch_dir *wdir = NULL;
+	struct stat sb;
+	int fd;
+
+	(void) memset(&sb, 0x00, sizeof sb);
+
+	if (fstatat(AT_FDCWD, path, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+	{
+		// Most likely deleted again since the event was queued
+		(void) fm_watch_forget(path);
+		return true;
+	}
+	if (sb.st_dev != fm_watch_dev || ! ((sb.st_mode & S_IFMT) == S_IFDIR || (sb.st_mode & S_IFMT) == S_IFREG))
+	{
+		// Not a file or directory (anymore), or not on the same filesystem
+		(void) fm_watch_forget(path);
+		return true;
+	}
+	if ((sb.st_mode & S_IFMT) == S_IFDIR)
+	{
+		HASH_FIND(hh_path, fm_watch_paths, path, strlen(path), wdir);
+
+		if (wdir != NULL)
+			// Already scanned; changes inside it will arrive as events of its own
+			return true;
+	}
+	if ((fd = open(path, O_NOCTTY | O_RDONLY | O_NOFOLLOW, 0)) < 0)
+	{
+		(void) fm_print_message("%s: while remapping '%s': open(2): %s\n", argvzero, path, strerror(errno));
+		(void) fm_watch_forget(path);
+		return true;
+	}
+	if (fstat(fd, &sb) < 0)
+	{
+		(void) fm_print_message("%s: while remapping '%s': fstat(2): %s\n", argvzero, path, strerror(errno));
+		(void) close(fd);
+		return true;
+	}
+
+	fm_watch_remapped++;
+
+	if ((sb.st_mode & S_IFMT) == S_IFDIR)
+		// A new directory (created or moved in); scan everything in it and start watching it
+		return fm_scan_directory(fd, &sb, path);
+
+	if ((sb.st_mode & S_IFMT) == S_IFREG)
+		return fm_rescan_extents(fd, &sb, path);
+
+	(void) close(fd);
+	return true;
+}
+
+static void FM_NONNULL(1)
+fm_watch_queue(const char *const restrict path)
+{
+	struct fm_watch_path *wp = NULL;
+
+	HASH_FIND_STR(fm_watch_pending, path, wp);
+
+	if (wp != NULL)
+		// Already pending; repeated writes to the same file are only remapped once per interval
+		return;
+
+	if ((wp = calloc(1U, sizeof *wp)) == NULL)
+	{
+		(void) fm_print_message("%s: while queueing '%s': calloc(3): %s\n", argvzero, path, strerror(errno));
+		return;
+	}
+
+	(void) snprintf(wp->path, sizeof wp->path, "%s", path);
+
+	HASH_ADD_STR(fm_watch_pending, path, wp);
+}
+
+static void FM_NONNULL(1)
+fm_watch_dequeue(const char *const restrict path)
+{
+	struct fm_watch_path *wp = NULL;
+
+	HASH_FIND_STR(fm_watch_pending, path, wp);
+
+	if (wp == NULL)
+		return;
+
+	HASH_DEL(fm_watch_pending, wp);
+	free(wp);
+}
+
+static bool FM_NONNULL(1) FM_WARN_UNUSED
+fm_watch_rescan_dir(const char *const restrict dirpath)
+{
+	struct fm_watch_path *seen = NULL;
+	struct fm_watch_path *wp;
+	struct fm_watch_path *wtmp;
+	struct fm_name *fn;
+	struct fm_name *ntmp;
+	char prefix[PATH_MAX];
+	size_t prefixlen;
+	bool result = true;
+	DIR *dp;
+
+	(void) memset(prefix, 0x00, sizeof prefix);
+	(void) snprintf(prefix, sizeof prefix, "%s%s", dirpath, ((strcmp(dirpath, "/") != 0) ? "/" : ""));
+
+	prefixlen = strlen(prefix);
+
+	if ((dp = opendir(dirpath)) == NULL)
+	{
+		// Gone; forget it and everything below it
+		(void) fm_watch_forget(dirpath);
+		return true;
+	}
+
+	for (;;)
+	{
+		struct dirent *ede;
+		struct stat esb;
+
+		if ((ede = readdir(dp)) == NULL)
+			break;
+
+		if (strcmp(ede->d_name, ".") == 0 || strcmp(ede->d_name, "..") == 0)
+			continue;
+
+		if ((wp = calloc(1U, sizeof *wp)) == NULL)
+		{
+			(void) fm_print_message("%s: while rescanning '%s': calloc(3): %s\n",
+			                        argvzero, dirpath, strerror(errno));
+			result = false;
+			break;
+		}
+
+		(void) snprintf(wp->path, sizeof wp->path, "%s%s", prefix, ede->d_name);
+
+		HASH_ADD_STR(seen, path, wp);
+		HASH_FIND_STR(fm_names, wp->path, fn);
+
+		if (fn != NULL && fstatat(dirfd(dp), ede->d_name, &esb, AT_SYMLINK_NOFOLLOW) == 0 &&
+		    fn->inode->inum == (uint64_t) esb.st_ino && fn->inode->sb.st_size == esb.st_size &&
+		    fn->inode->sb.st_mtim.tv_sec == esb.st_mtim.tv_sec &&
+		    fn->inode->sb.st_mtim.tv_nsec == esb.st_mtim.tv_nsec &&
+		    fn->inode->sb.st_ctim.tv_sec == esb.st_ctim.tv_sec &&
+		    fn->inode->sb.st_ctim.tv_nsec == esb.st_ctim.tv_nsec)
+			// Unchanged since it was last mapped
+			continue;
+
+		if (! fm_watch_remap(wp->path))
+		{
+			result = false;
+			break;
+		}
+	}
+
+	(void) closedir(dp);
+
+	// Forget the files that used to be directly inside this directory but are not anymore
+	HASH_ITER(hh, fm_names, fn, ntmp)
+	{
+		const char *const name = fn->name;
+
+		if (strncmp(name, prefix, prefixlen) != 0 || ! name[prefixlen] || strchr(name + prefixlen, '/') != NULL)
+			// Not directly inside this directory (or the directory itself)
+			continue;
+
+		HASH_FIND_STR(seen, name, wp);
+
+		if (wp == NULL)
+		{
+			(void) fm_forget_name(fn);
+			fm_watch_removed++;
+		}
+	}
+	HASH_ITER(hh, seen, wp, wtmp)
+	{
+		HASH_DEL(seen, wp);
+		free(wp);
+	}
+
+	return result;
+}
+
+static bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_watch_rescan_all(const char *const restrict rootpath, const struct stat *const restrict rootsb)
+{
+	struct fm_watch_dir *wdir;
+	struct fm_watch_dir *wtmp;
+	struct fm_inode *inode;
+	struct fm_inode *itmp;
+	struct stat sb;
+	int fd;
+
+	(void) memcpy(&sb, rootsb, sizeof sb);
+
+	HASH_ITER(hh_path, fm_watch_paths, wdir, wtmp)
+	{
+		if (wdir->wd >= 0)
+			(void) inotify_rm_watch(fm_watch_fd, wdir->wd);
+
+		(void) fm_watch_forget_dir(wdir);
+	}
+	HASH_ITER(hh, fm_inodes, inode, itmp)
+	{
+		(void) fm_forget_inode(inode);
+		fm_watch_removed++;
+	}
+
+	if ((fd = open(rootpath, O_NOCTTY | O_RDONLY | O_NOFOLLOW, 0)) < 0 || fstat(fd, &sb) < 0)
+	{
+		(void) fm_print_message("%s: while rescanning '%s': open(2): %s\n", argvzero, rootpath, strerror(errno));
+		return false;
+	}
+
+	return fm_scan_directory(fd, &sb, rootpath);
+}
+
+static void FM_NONNULL(1)
+fm_watch_summarise(struct fm_watch_summary *const restrict sum)
+{
+	const struct fm_inode *inode;
+	const struct fm_inode *itmp;
+
+	(void) memset(sum, 0x00, sizeof *sum);
+
+	sum->files = fm_file_count;
+	sum->dirs = fm_dir_count;
+	sum->inodes = fm_inode_count;
+	sum->extents = fm_extent_count;
+
+	HASH_ITER(hh, fm_inodes, inode, itmp)
+	{
+		if (inode->flags & FM_IFLAGS_FRAGMENTED)
+			sum->fragged++;
+	}
+}
+
+static void FM_NONNULL(1, 2)
+fm_watch_print_summary(const struct fm_watch_summary *const restrict prev, const struct fm_watch_summary *const restrict cur)
+{
+	const time_t now = time(NULL);
+	struct tm tm;
+	char stamp[64U];
+
+	(void) memset(stamp, 0x00, sizeof stamp);
+	(void) strftime(stamp, sizeof stamp, "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+	(void) fm_print_message("");
+
+	(void) printf("[%s] %" PRIu64 " files & %" PRIu64 " dirs (%" PRIu64 " inodes), %" PRIu64 " extents, "
+	              "%" PRIu64 " fragmented inodes (%+" PRId64 " files, %+" PRId64 " dirs, %+" PRId64 " inodes, "
+	              "%+" PRId64 " extents, %+" PRId64 " fragmented); %" PRIu64 " remapped, %" PRIu64 " removed, "
+	              "%u unwatched dirs\n", stamp, cur->files, cur->dirs, cur->inodes, cur->extents, cur->fragged,
+	              (int64_t) (cur->files - prev->files), (int64_t) (cur->dirs - prev->dirs),
+	              (int64_t) (cur->inodes - prev->inodes), (int64_t) (cur->extents - prev->extents),
+	              (int64_t) (cur->fragged - prev->fragged), fm_watch_remapped, fm_watch_removed,
+	              (unsigned int) HASH_CNT(hh_path, fm_watch_paths) - (unsigned int) HASH_CNT(hh_wd, fm_watch_wds));
+
+	(void) fflush(stdout);
+
+	fm_watch_remapped = 0U;
+	fm_watch_removed = 0U;
+}
+
+bool FM_WARN_UNUSED
+fm_watch_init(void)
+{
+	if ((fm_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+	{
+		(void) fm_print_message("%s: inotify_init1(2): %s\n", argvzero, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+void FM_NONNULL(1)
+fm_watch_directory(const char *const restrict abspath)
+{
+	struct fm_watch_dir *wdir = NULL;
+
+	HASH_FIND(hh_path, fm_watch_paths, abspath, strlen(abspath), wdir);
+
+	if (wdir != NULL)
+		return;
+
+	if ((wdir = calloc(1U, sizeof *wdir)) == NULL)
+	{
+		(void) fm_print_message("%s: while watching '%s': calloc(3): %s\n", argvzero, abspath, strerror(errno));
+		return;
+	}
+
+	(void) snprintf(wdir->path, sizeof wdir->path, "%s", abspath);
+
+	HASH_ADD_KEYPTR(hh_path, fm_watch_paths, wdir->path, strlen(wdir->path), wdir);
+
+	if ((wdir->wd = inotify_add_watch(fm_watch_fd, abspath, FM_WATCH_MASK)) < 0)
+	{
+		/* Most likely ENOSPC (fs.inotify.max_user_watches has been reached); this directory
+		 * will be rescanned every interval instead (only its changed entries are remapped)
+		 */
+		if (HASH_CNT(hh_path, fm_watch_paths) == (HASH_CNT(hh_wd, fm_watch_wds) + 1U))
+			(void) fm_print_message("%s: while watching '%s': inotify_add_watch(2): %s; falling back to "
+			                        "periodic rescans for this and further directories\n",
+			                        argvzero, abspath, strerror(errno));
+		wdir->wd = -1;
+		DL_APPEND(fm_watch_unwatched, wdir);
+		return;
+	}
+
+	HASH_ADD(hh_wd, fm_watch_wds, wd, sizeof wdir->wd, wdir);
+}
+
+bool FM_NONNULL(1, 2) FM_WARN_UNUSED
+fm_watch_run(const char *const restrict rootpath, const struct stat *const restrict rootsb)
+{
+	static char evbuf[65536U] __attribute__((__aligned__(__alignof__(struct inotify_event))));
+	struct fm_watch_summary prev;
+	struct fm_watch_summary cur;
+	time_t next_tick = (time(NULL) + (time_t) fm_watch_interval);
+	bool rescan_all = false;
+
+	fm_watch_dev = rootsb->st_dev;
+
+	(void) fm_watch_summarise(&cur);
+	(void) memcpy(&prev, &cur, sizeof prev);
+	(void) fm_watch_print_summary(&prev, &cur);
+
+	for (;;)
+	{
+		const time_t now = time(NULL);
+		struct pollfd pfd = { .fd = fm_watch_fd, .events = POLLIN, .revents = 0 };
+		const time_t left = ((next_tick > now) ? (next_tick - now) : 0);
+		const int timeout = ((left > (INT_MAX / 1000)) ? INT_MAX : (int) (left * 1000));
+		ssize_t evlen;
+
+		if (poll(&pfd, 1U, timeout) < 0 && errno != EINTR)
+		{
+			(void) fm_print_message("%s: poll(2): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+
+		while ((evlen = read(fm_watch_fd, evbuf, sizeof evbuf)) > 0)
+		{
+			for (const char *ptr = evbuf; ptr < (evbuf + evlen); )
+			{
+				const struct inotify_event *const ev = (const struct inotify_event *) ptr;
+				struct fm_watch_dir *wdir = NULL;
+				char path[PATH_MAX];
+
+				ptr += (sizeof *ev + ev->len);
+
+				if (ev->mask & IN_Q_OVERFLOW)
+				{
+					// Events were lost; nothing short of scanning everything again can be trusted
+					rescan_all = true;
+					continue;
+				}
+
+				HASH_FIND(hh_wd, fm_watch_wds, &ev->wd, sizeof ev->wd, wdir);
+
+				if (wdir == NULL)
+					// A directory that we have already forgotten about
+					continue;
+
+				if (ev->mask & IN_IGNORED)
+				{
+					// The kernel removed the watch (directory deleted or unmounted)
+					(void) fm_watch_forget_dir(wdir);
+					continue;
+				}
+				if (! ev->len)
+					continue;
+
+				(void) memset(path, 0x00, sizeof path);
+
+				if (snprintf(path, sizeof path, "%s%s%s", wdir->path,
+				             ((strcmp(wdir->path, "/") != 0) ? "/" : ""), ev->name) >= (int) sizeof path)
+					// Too long to ever have been scanned
+					continue;
+
+				if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				{
+					(void) fm_watch_dequeue(path);
+					(void) fm_watch_forget(path);
+				}
+				if (ev->mask & (IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE))
+					(void) fm_watch_queue(path);
+			}
+		}
+		if (evlen < 0 && errno != EAGAIN && errno != EINTR)
+		{
+			(void) fm_print_message("%s: read(2) from inotify(7): %s\n", argvzero, strerror(errno));
+			return false;
+		}
+		if (time(NULL) < next_tick)
+			continue;
+
+		if (rescan_all)
+		{
+			struct fm_watch_path *wp;
+			struct fm_watch_path *wtmp;
+
+			HASH_ITER(hh, fm_watch_pending, wp, wtmp)
+				(void) fm_watch_dequeue(wp->path);
+
+			if (! fm_watch_rescan_all(rootpath, rootsb))
+				// This function prints messages on error
+				return false;
+
+			rescan_all = false;
+		}
+		else
+		{
+			struct fm_watch_path *rescans = NULL;
+			struct fm_watch_path *wp;
+			struct fm_watch_path *wtmp;
+			struct fm_watch_dir *wdir;
+
+			HASH_ITER(hh, fm_watch_pending, wp, wtmp)
+			{
+				if (! fm_watch_remap(wp->path))
+					(void) fm_print_message("%s: failed to remap '%s'; it will be retried on its next "
+					                        "change\n", argvzero, wp->path);
+
+				(void) fm_watch_dequeue(wp->path);
+			}
+
+			/* Rescanning one unwatched directory can forget others (if it was removed) or add more
+			 * (new subdirectories that could not be watched either), so work from a copy of the list
+			 */
+			DL_FOREACH(fm_watch_unwatched, wdir)
+			{
+				if ((wp = calloc(1U, sizeof *wp)) == NULL)
+				{
+					(void) fm_print_message("%s: calloc(3): %s\n", argvzero, strerror(errno));
+					return false;
+				}
+
+				(void) snprintf(wp->path, sizeof wp->path, "%s", wdir->path);
+
+				HASH_ADD_STR(rescans, path, wp);
+			}
+			HASH_ITER(hh, rescans, wp, wtmp)
+			{
+				wdir = NULL;
+
+				HASH_FIND(hh_path, fm_watch_paths, wp->path, strlen(wp->path), wdir);
+
+				if (wdir != NULL && wdir->wd < 0 && ! fm_watch_rescan_dir(wp->path))
+					// This function prints messages on error
+					return false;
+
+				HASH_DEL(rescans, wp);
+				free(wp);
+			}
+		}
+
+		(void) fm_watch_summarise(&cur);
+		(void) fm_watch_print_summary(&prev, &cur);
+		(void) memcpy(&prev, &cur, sizeof prev);
+
+		next_tick = (time(NULL) + (time_t) fm_watch_interval);
+	}
+}